@@ -44,4 +44,38 @@ g++ \
     \
     src/Magic.cpp
 
+# Pack served-files
+#-------------------
+g++ \
+    -g \
+    -pthread \
+    -Wno-unused-result \
+    -o ../build/linux-x86_64/pack-served-files \
+    \
+        -I../build/linux-x86_64/openssl-1.1.1t/include \
+        -I../build/linux-x86_64/libwebsockets-4.3.2/include \
+        -I../build/linux-x86_64/sqlite-amalgamation-3420000/include \
+    \
+        -L../build/linux-x86_64/openssl-1.1.1t/lib \
+        -L../build/linux-x86_64/libwebsockets-4.3.2/lib \
+        -L../build/linux-x86_64/sqlite-amalgamation-3420000/lib \
+        -L../build/linux-x86_64/icu-release-78.1/lib \
+    \
+    src/PackServedFiles.cpp \
+    \
+    -l:libwebsockets.a \
+    -l:libssl.a \
+    -l:libcrypto.a \
+    -Wl,--start-group \
+        -l:libSqliteIcu.a \
+        -l:libicui18n.a \
+        -l:libicuuc.a \
+        -l:libicudata.a \
+        -l:libicuio.a \
+        -l:libsqlite3.a \
+    -Wl,--end-group \
+    -ldl
+
+../build/linux-x86_64/pack-served-files ../served-files ../build/linux-x86_64/artifacts-linux-x86_64/served-files.pack
+
 popd
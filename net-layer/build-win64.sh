@@ -42,4 +42,10 @@ x86_64-w64-mingw32-gcc \
     -Wl,-Bstatic -lstdc++ -lwinpthread \
     -Wl,-Bdynamic -lcrypt32 -lws2_32
 
+# The served-files archive doesn't depend on the platform, so the one packed by
+# the Linux build is shipped as well.
+if [ -f ../build/linux-x86_64/artifacts-linux-x86_64/served-files.pack ]; then
+    cp ../build/linux-x86_64/artifacts-linux-x86_64/served-files.pack ../build/win64/artifacts-win64/
+fi
+
 popd
@@ -0,0 +1,43 @@
+#!/bin/bash
+
+# Builds and runs every net-layer test (tests/*.cpp), against the same
+# dependencies as build-linux-x86_64.sh. Set TEST_DEPS to the compiler flags
+# of other builds of them (include paths and libraries), and TEST_FLAGS to
+# extra compiler flags, e.g. -fsanitize=address.
+
+set -e
+
+THIS_DIR="$( cd "$( dirname "${BASH_SOURCE[0]}" )" >/dev/null 2>&1 && pwd )"
+pushd $THIS_DIR > /dev/null
+
+DEPS=../build/linux-x86_64
+TEST_DEPS=${TEST_DEPS:-" \
+    -I$DEPS/openssl-1.1.1t/include \
+    -I$DEPS/libwebsockets-4.3.2/include \
+    -I$DEPS/sqlite-amalgamation-3420000/include \
+    -L$DEPS/openssl-1.1.1t/lib \
+    -L$DEPS/libwebsockets-4.3.2/lib \
+    -L$DEPS/sqlite-amalgamation-3420000/lib \
+    -L$DEPS/icu-release-78.1/lib \
+    -l:libwebsockets.a -l:libssl.a -l:libcrypto.a \
+    -Wl,--start-group -l:libSqliteIcu.a -l:libicui18n.a -l:libicuuc.a -l:libicudata.a -l:libicuio.a -l:libsqlite3.a -Wl,--end-group \
+    -ldl"}
+
+OUT_DIR=${TMPDIR:-/tmp}/net-layer-tests
+mkdir -p $OUT_DIR
+
+failed=0
+for test in tests/*.cpp; do
+    name=$(basename $test .cpp)
+    if [ -n "$1" ] && [ "$1" != "$name" ]; then continue; fi
+    
+    g++ -g -pthread -Wno-unused-result $TEST_FLAGS -o $OUT_DIR/$name $test $TEST_DEPS
+    $OUT_DIR/$name || failed=$((failed+1))
+done
+
+popd > /dev/null
+
+if [ $failed -ne 0 ]; then
+    echo "$failed test(s) failed"
+    exit 1
+fi
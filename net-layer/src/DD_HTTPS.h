@@ -4,19 +4,51 @@
 #include <sys/stat.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <pthread.h>
 
 #include "libwebsockets.h"
+#include <openssl/hmac.h>
+#include <openssl/crypto.h>
+#include <openssl/ssl.h>
+#include <openssl/rand.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#endif
 #include "DD_SQLite.h"
 #include "DD_JSON.h"
 
 #ifdef _WIN32
 #include <windows.h>
 #include <direct.h>
+#include <ws2tcpip.h>
 #else
 #include <sys/types.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <limits.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#endif
+
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/inotify.h>
+#endif
+
+#ifndef _WIN32
+#include <dirent.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#endif
+
+// Servers can run in several threads (see listener groups): no static state
+#ifdef _WIN32
+#define HS__strtok_r strtok_s
+#else
+#define HS__strtok_r strtok_r
 #endif
 
 #define HS_KILO_BYTES(x) (1024*x)
@@ -52,22 +84,35 @@
 #define HS__VHostsArrayCap 10
 #define HS__ProtocolsArrayCap 8
 #define HS__HostNameCap 64
-#define HS__URIMapCap 32
-#define HS__CacheBustCap 48
-#define HS__CacheControlMapCap 32
-#define HS__NeedsSSIParsingCap 32
-#define HS__RedirectMapCap 16
-#define HS__RootDirMapCap 16
 #define HS__FileMapCap 256
+#define HS__WatchedDirsCap 4096
+#define HS__PathCacheCap 4096 // power of 2
+#define HS__LangCacheCap 1024 // power of 2
+#define HS__GKSessionsCap 4096 // power of 2
+#define HS__GKSessionIdleTimeout 3600 // seconds
+#define HS__GKSyncPeriod 5000 // ms
+#define HS__GKLookupsPerSyncCap 1024 // database lookups of unknown cookies between syncs
+#define HS__GKTokenKeysCap 4
+#define HS__FileMappingsCap 512
+#define HS__FileMappingMinSize HS_KILO_BYTES(64) // smaller files are copied, which also keeps them safe from truncation
 #define HS__URICap 2000
 #define HS__FilePathCap 2048
+#define HS__UnixSocketPathCap 108 // sockaddr_un.sun_path
 #define HS__PostEndpointsCap 8
 #define HS__AllowedOriginsArrayCap 8
 #define HS__PostBufferSize HS_KILO_BYTES(8)
+#define HS__ArenaBlockSize HS_KILO_BYTES(8)
+#define HS__HeaderBufferSize 2048
+#define HS__DefaultCacheControl "no-cache, no-store, must-revalidate" // files no cache-control rule matches
 #define HS__ResponseHandlersArrayCap 8
+#define HS__RequestHostsCap 16
+#define HS__RequestKeepWarmSecs 30
+#define HS__RequestBodyChunkSize HS_KILO_BYTES(16)
+#define HS__ResponseSizeCap HS_MEGA_BYTES(64)
 #define HS__PluginNameCap 64
 #define HS__PluginArrayCap 4
 #define HS__CertTrustStoreCap 8
+#define HS__ByteRangesCap 8
 
 // Base64 Helpers
 //-----------------
@@ -140,6 +185,114 @@ struct HS_CallbackArgs {
 
 typedef int (*HS_CallbackFunc)(HS_CallbackArgs* args);
 
+// A read-only mapping of a served file. Mappings are owned by the server and
+// shared by the cache entries of every vhost that resolves to the same path,
+// so the kernel page cache holds a single copy of the file. Their pages are
+// never touched by the server: a file rewritten in place would make that
+// fault (SIGBUS). Bodies are sent from fd, with sendfile(2) or pread(2) on
+// the I/O pool, and data only gives their offsets.
+struct HS_FileMapping {
+    char   path[HS__FilePathCap];
+    int    fd;
+    char*  data;
+    int    size;
+    time_t modifiedTime;
+    int    refCount;
+    bool   truncated; // a read came up short: the file shrank since it was mapped
+};
+
+// A served archive packs a directory of static files into a single file, which
+// is mapped (or, on Windows, read) into memory once and served from directly.
+// Layout: the header, the entries sorted by path, the NUL-terminated path and
+// MIME type strings, then the content of each file, aligned to
+// HS__ArchiveAlignment. Offsets are from the start of the archive.
+#define HS__ArchiveMagic "HSPACK01"
+#define HS__ArchiveAlignment 64
+#define HS__ServedArchivesCap 8
+
+struct HS_ArchiveHeader {
+    char     magic[8];
+    uint32_t entriesCount;
+    uint32_t reserved;
+};
+
+struct HS_ArchiveEntry {
+    uint64_t contentOffset;
+    uint64_t contentSize;
+    uint64_t contentHash;    // FNV-1a of the content, used as the ETag
+    int64_t  modifiedTime;
+    uint32_t pathOffset;     // e.g. "/third/lib.js", relative to the packed dir
+    uint32_t mimeTypeOffset;
+};
+
+struct HS_ServedArchive {
+    char uriPrefix[HS__URICap]; // without the trailing '/'
+    int  uriPrefixSize;
+    
+    char*           data;
+    long long       size;
+    HS_FileMapping* mapping; // 0 if data was read into memory
+    char*           index;   // the header, entries and strings: data, or read from the mapping
+    long long       indexSize;
+    
+    HS_ArchiveEntry* entries;
+    int              entriesCount;
+};
+
+enum HS_PathType {
+    HS_PathType_Missing,
+    HS_PathType_File,
+    HS_PathType_Directory,
+};
+
+// A resolved (root dir, URI) pair, cached so that repeated requests (including
+// ones for missing files) don't need realpath(3) and stat(2) again.
+struct HS_PathCacheEntry {
+    uint32_t    hash;
+    int         generation; // stale when it differs from the vhost's
+    time_t      expires;
+    const char* rootDir;
+    char*       uri;
+    char*       realPath;
+    HS_PathType type;
+    bool        hasIndexFile; // directory containing an index.html
+};
+
+// Language picked for an (Accept-Language, /$lang/ URI) pair
+struct HS_LangCacheEntry {
+    uint32_t    hash;
+    int         generation;
+    time_t      expires;
+    const char* rootDir;
+    char*       key;      // normalized Accept-Language, '\n', URI
+    char        lang[16]; // empty when no listed language has the file
+};
+
+struct HS_GKSession {
+    uint32_t  hash;
+    char      cookie[96];    // "userId.sessionId", empty when the slot is free
+    char      gatedArea[64];
+    char      sessionId[64];
+    long long expirationDate;
+    long long lastUseDate;
+    bool      dirty;         // lastUseDate not written back yet
+    bool      deleting;      // to be deleted from gkdb by the next sync
+};
+
+struct HS_GatedArea {
+    char*    id;
+    JS_JSON* jArea;
+    char*    loginPage; // rendered gatekeepr.html, 0 until the first hit
+    int      loginPageSize;
+    int      loginPageGeneration;     // gkTemplateGeneration it was rendered from
+    char     loginPageCacheBust[32];  // and cacheBustVersion
+};
+
+struct HS_GKTokenKey {
+    char id[32];
+    char secret[128];
+};
+
 struct HS_FileMapEntry {
     char uri[HS__URICap];
     char filePath[HS__FilePathCap];
@@ -152,28 +305,73 @@ struct HS_FileMapEntry {
     char* cacheControl;
     int cacheControlSize;
     int clientsReading;
+    
+    time_t modifiedTime;
+    HS_FileMapping* mapping; // set when the content is mmapped instead of heap allocated
+    
+    char sourcePath[HS__FilePathCap]; // file the content was read or derived from
+    char* includes;   // files included by SSI, each NUL terminated, then an empty one (or 0)
+    bool cacheBusted; // depends on the vhost's cache bust version
+    bool stale; // invalidated while clients were still reading it
+    
+    // Built by the first response that serves the entry (see HS__WriteFileResponse)
+    char  etag[48];
+    char  lastModified[48];
+    char* headerBlocks[2]; // headers of a full 200 response, encoded for h1 and h2
+    int   headerBlockSizes[2];
 };
 
-struct HS_URIMapEntry {
-    char uri[HS__URICap];
-    int  uriSize;
-    char resource[HS__FilePathCap];
+// URI rules
+//-----------
+// Rule patterns are either an exact URI, a prefix ("/docs/*") or a suffix
+// ("*.html"). Rules are kept in the order they were added and compiled into a
+// hash of the exact URIs and tries of the prefixes and reversed suffixes: when
+// the vhost starts (HS_CompileVHostRules) and after each batch of URI mapping
+// updates (HS_CompileURIMapping). A lookup returns the first rule added that
+// matches (or the last one, for lastMatchWins lists), and costs the same no
+// matter how many rules there are. Lookups never compile: lists changed since
+// they were compiled are scanned in order until they are compiled again.
+enum HS_RuleKind {
+    HS_RuleKind_Exact,
+    HS_RuleKind_Prefix,
+    HS_RuleKind_Suffix,
 };
 
-struct HS_RedirectMapEntry {
-    char uri[HS__URICap];
-    char destination[HS__URICap];
+struct HS_Rule {
+    HS_RuleKind kind;
+    char* pattern; // without the '*'
+    int   patternSize;
+    char* value;
+    int   valueSize;
 };
 
-struct HS_RootDirMapEntry {
-    char uriPrefix[HS__URICap];
-    char path[HS__URICap];
+struct HS_RuleTrieNode {
+    char c;
+    int  firstChild;  // node index, 0 if none (the root is never a child)
+    int  nextSibling;
+    int  rule;        // rule index + 1, 0 if no rule ends here
 };
 
-struct HS_CacheControlMapEntry {
-    char uri[HS__URICap];
-    int  uriSize;
-    char cacheString[128];
+struct HS_RuleTrie {
+    HS_RuleTrieNode* nodes;
+    int nodesCount;
+    int nodesCap;
+};
+
+struct HS_RuleList {
+    HS_Rule* rules;
+    int rulesCount;
+    int rulesCap;
+    
+    bool exactOnly;     // '*' has no special meaning
+    bool lastMatchWins;
+    
+    // compiled
+    bool compiled;
+    int* exactSlots;    // open addressing, rule index + 1
+    int  exactSlotsCap;
+    HS_RuleTrie prefixes;
+    HS_RuleTrie suffixes;
 };
 
 struct HS_AllowedOrigin {
@@ -188,6 +386,16 @@ struct HS_ResponseHandler {
     HS_CallbackFunc handler;
 };
 
+// Outgoing requests share connections per endpoint (lws pipelining: kept-alive
+// HTTP/1.1 connections, h2 streams). A request is reused when it didn't have
+// to open a connection of its own.
+struct HS_RequestHostMetrics {
+    char hostName[256];
+    int  port;
+    long long requests;
+    long long reused;
+};
+
 struct HS_HTTPClient;
 
 struct HS_Plugin {
@@ -199,24 +407,153 @@ struct HS_Plugin {
 };
 
 struct HS_Server;
+struct HS_VHost;
+struct HS_Template;
+
+struct HS_VHostMetrics {
+    long long bodyBytesSent;
+    long long bodyBytesCopied;   // copied through the vhost frame buffer
+    long long bodyBytesSendFile; // handed to the kernel with sendfile(2)
+    long long tlsHandshakes;     // completed
+    long long tlsResumed;        // from the session cache or a ticket
+    long long ipRefusedConnections;
+    long long ipLimitedRequests; // answered with a 429
+    long long ipLimitedUpgrades;
+};
+
+// Per-IP limits
+//---------------
+// Concurrent connections, requests per second and WebSocket upgrades per
+// minute are limited per client address. Rates are token buckets that start
+// full. Requests over a limit get a 429, and the connection is closed.
+// Connections are counted when they're accepted, idle or not, so one over the
+// limit is closed right away, before anything is read or sent. The table is
+// rebuilt without its idle entries on a timer.
+// Behind a reverse proxy every connection comes from the proxy. Its requests
+// are limited by the address it forwards instead: the last address in
+// X-Forwarded-For that isn't a trusted proxy's, or X-Real-IP. Peers on a
+// vhost's Unix socket are always trusted proxies, others when listed with
+// HS_AddIPTrustedProxy. Their connections aren't counted.
+#define HS__IPLimitsCap 8192
+#define HS__IPLimitsExpirePeriod 10000 // ms
+#define HS__IPLimitsIdleTimeout 60     // seconds
+#define HS__IPTrustedProxiesCap 8
+
+struct HS_IPLimit {
+    uint32_t      hash;        // 0 when the slot is free
+    unsigned char address[16]; // IPv4 addresses are mapped to IPv6
+    int           connections;
+    float         requestTokens;
+    float         upgradeTokens;
+    lws_usec_t    lastRefill;
+    time_t        lastSeen;
+};
+
+// A network connection counted against its address, by socket descriptor
+struct HS_IPConnection {
+    HS_VHost* vhost; // 0 when the descriptor isn't counted
+    char      ipAddress[48];
+};
+
+// TLS
+//-----
+// Sessions are resumed from a session cache (by id, or by TLS 1.3 stateful
+// ticket) or from session tickets. Both are kept in a session store, outside
+// of the SSL_CTX of each server: the servers of a listener group share one, so
+// that a client reconnecting to another of the group's threads still resumes.
+// Ticket keys are either set in the config, which lets separate instances
+// share them too, or generated in memory and rotated: the newest key encrypts
+// new tickets, the older ones still decrypt tickets issued before a rotation,
+// which are then renewed.
+#define HS__TLSSessionCacheSizeDefault 20480
+#define HS__TLSSessionTimeoutDefault 3600
+#define HS__TLSTicketKeyRotationDefault 3600
+#define HS__TLSTicketKeysCap 3
+
+struct HS_TLSTicketKey {
+    unsigned char name[16];
+    unsigned char aesKey[32];
+    unsigned char hmacKey[32];
+};
+
+struct HS_TLSCachedSession {
+    unsigned char  id[SSL_MAX_SSL_SESSION_ID_LENGTH];
+    unsigned int   idSize; // 0 when the slot is free
+    time_t         expirationDate;
+    unsigned char* der; // the session, serialized
+    int            derSize;
+};
+
+struct HS_TLSSessionStore {
+    pthread_mutex_t mutex;
+    
+    HS_TLSTicketKey ticketKeys[HS__TLSTicketKeysCap]; // [0] encrypts new tickets
+    int             ticketKeysCount;
+    bool            ticketKeysFromConfig; // not rotated
+    int             ticketKeyRotation;    // seconds
+    time_t          ticketKeysRotationDate;
+    
+    HS_TLSCachedSession* sessions; // indexed by a hash of the id; a new session replaces the one in its slot
+    int                  sessionsCap;
+};
 
 struct HS_VHost {
     JS_JSON* jConfig;
     JS_JSON* gkConfig;
+    HS_Template* gkTemplate; // gatekeepr.html, compiled on first use
+    int gkTemplateGeneration; // bumped whenever gkTemplate is loaded
+    time_t gkTemplateCheckTime; // when to stat it again, on vhosts that aren't watched
+    HS_GatedArea* gkAreas;
+    int gkAreasCount;
+    HS_RuleList gkAreaPrefixes;
+    HS_RuleList gkAreaIds;
     
     char gkDatabasePath[PATH_MAX];
     sqlite3* gkdb;
+    pthread_mutex_t gkdbMutex; // gkdb is used by one I/O job at a time
+    HS_GKSession* gkSessions;  // live sessions, synced with gkdb periodically
+    int gkSessionsCount;
+    int gkLookupsLeft;         // until the next sync
+    bool gkSyncPending;
+    
+    HS_GKTokenKey gkTokenKeys[HS__GKTokenKeysCap]; // signed tokens instead of sessions when set
+    int gkTokenKeysCount;
+    char gkDenyListPath[PATH_MAX];
+    time_t gkDenyListModifiedTime;
+    char* gkDenyList;
+    char** gkDenied; // sorted, pointing into gkDenyList
+    int gkDeniedCount;
     
     char hostName[HS__HostNameCap];
     int port;
     char host[HS__HostNameCap+16];
     
+    char unixSocketPath[HS__UnixSocketPathCap]; // listened on instead of the port when set
+    char unixSocketOwner[HS__HostNameCap];      // "user:group"
+    int  unixSocketMode;                        // 0 leaves lws' default
+    
     char name[HS__HostNameCap];
     HS_UserCallback callback;
     
     char sslPublicKeyPath[PATH_MAX];
     char sslPrivateKeyPath[PATH_MAX];
     char sslCABundlePath[PATH_MAX];
+    char sslECDSAPublicKeyPath[PATH_MAX];  // served to clients that support ECDSA, next to the RSA certificate
+    char sslECDSAPrivateKeyPath[PATH_MAX];
+    
+    int  tlsSessionCacheSize;  // 0 means the default, negative disables the cache
+    int  tlsSessionTimeout;    // seconds; 0 means the default
+    int  tlsTicketKeyRotation; // seconds; 0 means the default
+    bool tlsDisableTickets;
+    int  tlsMinVersion;        // TLS1_2_VERSION...; 0 lets OpenSSL decide
+    
+    int  ipMaxConnections;       // 0 means unlimited
+    int  ipMaxRequestsPerSecond;
+    int  ipMaxUpgradesPerMinute;
+    bool ipLimitsExemptLoopback; // e.g. a reverse proxy on the same machine
+    unsigned char ipTrustedProxies[HS__IPTrustedProxiesCap][16];
+    int  ipTrustedProxiesCount;
+    bool ipForwardedMissingWarned;
     
     // internal
     int verbosity;
@@ -252,6 +589,8 @@ struct HS_VHost {
     char* frameBuffer;
     char* frameStart;
     
+    char* freeArenaBlocks; // each free block starts with a pointer to the next
+    
     int sessionDataSize;
     
     const char* certTrustStore[HS__CertTrustStoreCap];
@@ -264,54 +603,209 @@ struct HS_VHost {
     HS_FileMapEntry* loadedFiles;
     int              loadedFilesCount;
     bool disableFileCache;
+    bool disableCacheControl;
+    bool mappedFileCache;
+    bool persistTransformedFiles; // also write cache busted and SSI parsed files under the served dir
+    bool warmFileCache;           // load the served files when the vhost starts
+    
+    HS_PathCacheEntry* pathCache;
+    HS_LangCacheEntry* langCache; // shares the path cache's invalidation
+    int  pathCacheGeneration;
+    int  pathCacheTTL;      // seconds; 0 means the default, negative disables the cache
+    bool pathCacheWatched;  // entries are invalidated by the file watcher and don't expire
+    bool fileCacheNeedsWatcher; // files aren't cached when the watcher can't cover the served dirs
+    bool watcherFailed;         // (reported) some served dirs aren't watched
     int  memCacheMaxSizeMB;
     
-    HS_URIMapEntry uriMap[HS__URIMapCap];
-    int         uriMapSize;
+    HS_RuleList uriMap;          // value: resource URI
+    HS_RuleList cacheControlMap; // value: Cache-Control header
+    HS_RuleList cacheBust;
+    HS_RuleList needsSSIParsing;
+    HS_RuleList redirectMap;     // value: destination URL
+    HS_RuleList rootDirMap;      // value: directory path
     
-    HS_CacheControlMapEntry cacheControlMap[HS__CacheControlMapCap];
-    int                     cacheControlMapSize;
-    
-    char cacheBust[HS__CacheBustCap][HS__FilePathCap];
-    int  cacheBustSize;
+    HS_ServedArchive servedArchives[HS__ServedArchivesCap];
+    int              servedArchivesCount;
     
     char cacheBustVersion[32];
     char defaultContentLanguage[32];
     
-    char needsSSIParsing[HS__NeedsSSIParsingCap][HS__FilePathCap];
-    int  needsSSIParsingSize;
-    
-    HS_RedirectMapEntry redirectMap[HS__RedirectMapCap];
-    int                 redirectMapSize;
-
-    HS_RootDirMapEntry  rootDirMap[HS__RootDirMapCap];
-    int                 rootDirMapSize;
-    
     HS_AllowedOrigin allowedOrigins[HS__AllowedOriginsArrayCap];
     int  allowedOriginsCount;
     
     // requester
     HS_ResponseHandler responseHandlers[HS__ResponseHandlersArrayCap];
     int responseHandlersCount;
+    int requestKeepWarmSecs; // how long an idle pooled connection is kept
+    HS_RequestHostMetrics requestHosts[HS__RequestHostsCap];
+    int requestHostsCount;
     
     // plugin
     HS_Plugin plugins[HS__PluginArrayCap];
     int pluginCount;
+    
+    HS_VHostMetrics metrics;
+    
+    HS_IPLimit* ipLimits; // allocated when a limit is set
+    int         ipLimitsCount;
+    
+    SSL_CTX*            sslContext;
+    HS_TLSSessionStore* tlsStore;
+    bool                tlsOwnsStore;
+    HS_TLSTicketKey     tlsTicketKeys[HS__TLSTicketKeysCap]; // set in the config ("tls/ticket-keys"), [0] encrypts new tickets
+    int                 tlsTicketKeysCount;
 };
 
 typedef void (*HS_PeriodicTask)(HS_Server* server);
 typedef void (*HS_Task)(lws_sorted_usec_list_t* _server);
 typedef lws_sorted_usec_list_t HS_ScheduledTask;
 
-struct HS_SchedulerPeriodicEntry {
-    lws_sorted_usec_list_t entry;
-    uint32_t nanoSeconds;
-    HS_Server* server;
-    HS_PeriodicTask task;
+struct HS_WatchedDir {
+    int  wd; // -1 when the slot is free
+    char path[HS__FilePathCap];
+};
+
+// I/O pool
+//----------
+// Blocking work (file reads) runs on a pool of threads, so that the service
+// thread never waits on the disk. A job's work function runs on a pool thread;
+// its done function then runs on the service thread, woken up with
+// lws_cancel_service.
+#define HS__IOThreadsCap 32
+#define HS__IOThreadsDefault 4
+
+struct HS_IOJob;
+typedef void (*HS_IOJobFunc)(HS_IOJob* job);
+
+struct HS_IOJob {
+    HS_IOJob*    next;
+    HS_IOJobFunc work;
+    HS_IOJobFunc done;
+};
+
+// Timers
+//--------
+// One-shot and periodic timers live on a hierarchical timer wheel: 5 levels of
+// 64 slots, with 1 ms ticks on the first level, so that adding and cancelling
+// a timer is O(1) however many there are. A slot of a higher level is spread
+// over the level below when the wheel turns to it; timers beyond the span of
+// the wheel (~12 days) wait in the last slot of the top level. A single
+// lws_sorted_usec_list_t wakes the service thread at the next tick that has
+// work. Timers can be added and cancelled from any thread, their functions run
+// on the service thread.
+#define HS__TimerLevels 5
+#define HS__TimerLevelBits 6
+#define HS__TimerSlots (1 << HS__TimerLevelBits)
+#define HS__TimerBlockSize 1024
+#define HS__TimerBlocksCap 1024
+
+typedef uint64_t HS_TimerId; // 0 is never a valid timer
+typedef void (*HS_TimerFunc)(HS_Server* server, void* userData);
+
+enum HS_TimerState : uint8_t {
+    HS_TimerState_Free,
+    HS_TimerState_Scheduled,
+    HS_TimerState_Firing,    // taken off the wheel, its function is about to run
+    HS_TimerState_Cancelled, // cancelled while firing
+};
+
+struct HS_Timer {
+    uint64_t     expires; // tick
+    uint64_t     period;  // ticks, 0 for one-shot timers
+    HS_TimerFunc func;
+    void*        userData;
+    int          prev;    // slot list
+    int          next;    // slot list, free list or fired list
+    uint32_t     generation;
+    uint8_t      state;
+    uint8_t      level;
+    uint8_t      slot;
+};
+
+struct HS_TimerWheel {
+    lws_sorted_usec_list_t sul; // first, the lws callback casts it back
+    HS_Server*       server;
+    pthread_mutex_t  mutex;
+    pthread_t        serviceThread;
+    bool             serviceStarted;
+    uint64_t         tick;     // next tick to process
+    uint64_t         wakeTick; // tick the sul is scheduled for, UINT64_MAX when idle
+    
+    // Blocks never move, so the service thread can read a firing timer without the lock
+    HS_Timer*        blocks[HS__TimerBlocksCap];
+    int              timersAllocated;
+    int              timersCount; // on the wheel
+    int              freeTimer;   // -1 when empty
+    
+    int              slots[HS__TimerLevels][HS__TimerSlots]; // list heads, -1 when empty
+    uint64_t         occupied[HS__TimerLevels];              // one bit per non-empty slot
+};
+
+// Access log
+//------------
+// Service threads log requests without locks or syscalls: each server appends
+// records to its own ring, and one thread per log drains the rings into the
+// file in batched writes. Records are dropped (and counted) when a ring is full.
+#define HS__AccessLogRingCap 4096 // records, a power of 2
+#define HS__AccessLogRingsCap 64
+#define HS__AccessLogURICap 256
+#define HS__AccessLogLineCap 2048 // a formatted record, with the URI escaped
+#define HS__AccessLogBatchSize HS_KILO_BYTES(64)
+#define HS__AccessLogFlushPeriod 50 // ms
+
+enum HS_AccessLogFormat {
+    HS_AccessLogFormat_Text,
+    HS_AccessLogFormat_JSON, // JSON lines
+};
+
+struct HS_AccessLogRecord {
+    lws_usec_t time;        // when the request was received
+    int        serviceTime; // us, until the last write of the response
+    int        status;
+    long long  bytes;       // of the body
+    bool       cacheHit;    // served from the file cache or an archive
+    bool       h2;
+    char       method[16];  // as HS_HTTPClient::httpMethod
+    char       vhost[HS__HostNameCap];
+    char       ipAddress[48];
+    char       uri[HS__AccessLogURICap];
+};
+
+// Single producer (the server's service thread moves head), single consumer
+// (the log's thread moves tail).
+struct HS_AccessLogRing {
+    HS_AccessLogRecord records[HS__AccessLogRingCap];
+    unsigned           head;
+    unsigned           tail;
+    long long          logged;
+    long long          dropped;
+};
+
+struct HS_AccessLog {
+    char               path[PATH_MAX];
+    FILE*              file;
+    HS_AccessLogFormat format;
+    int                sampleRate; // 1 in sampleRate successful requests is logged
+    
+    pthread_t       thread;
+    pthread_mutex_t mutex; // guards the rings list and the file
+    pthread_cond_t  cond;
+    bool            stopping;
+    int             reopenRequested; // atomic, may be set by a signal handler
+    
+    HS_AccessLogRing* rings[HS__AccessLogRingsCap];
+    int               ringsCount;
+    
+    char*  batch;
+    int    batchSize;
+    lws_usec_t clockOffset;     // from lws_now_usecs to the wall clock
+    time_t     formattedSecond; // the timestamp prefix is only formatted once a second
+    char       formattedTime[32];
 };
 
 struct HS_Server {
     bool isRunning;
+    bool stopRequested; // by HS_Stop, possibly before HS_RunForever started
     int verbosity;
     
     HS_VHost vhosts[HS__VHostsArrayCap];
@@ -325,55 +819,240 @@ struct HS_Server {
     
     int defaultConnectionFlags;
     
-    HS_SchedulerPeriodicEntry schedulerPeriodicEntries[8];
-    int schedulerPeriodicEntriesCount;
+    HS_TimerWheel timerWheel;
+    bool          gatekeeprTaskScheduled;
+    
+    HS_AccessLog*     accessLog;
+    HS_AccessLogRing* accessLogRing;
+    unsigned          accessLogSampled; // successful requests, for sampling
+    
+    HS_FileMapping* fileMappings;
+    int             fileMappingsCount;
     
-    // FIXME: we need a proper way to schedule multiple single time tasks.
-    // With a single lws_sorted_usec_list_t on HS_Server, that's not possible.
-    // It is necessary that we have one lws_sorted_usec_list_t for each task.
-    lws_sorted_usec_list_t schedulerEntry;
+    HS_IPConnection* ipConnections; // indexed by socket descriptor
+    int              ipConnectionsCap;
+    
+    int            fileWatcherFd; // inotify instance watching the served files
+    HS_WatchedDir* watchedDirs;
+    int            watchedDirsCount;
+    
+    pthread_t       ioThreads[HS__IOThreadsCap];
+    int             ioThreadsCount;  // started
+    int             ioThreadsWanted; // 0 means the default, negative runs jobs inline
+    pthread_mutex_t ioMutex;
+    pthread_cond_t  ioCond;
+    HS_IOJob*       ioQueue;     // FIFO: ioQueue is the oldest job
+    HS_IOJob*       ioQueueLast;
+    HS_IOJob*       ioDone;      // LIFO
+    bool            ioStopping;
 };
 
-struct HS_Replacement {
-    const char* replaced;
-    const char* replacement;
-    int replacedSize;
-    int replacementSize;
-};
+void HS_AddRule(HS_RuleList* list, const char* pattern, const char* value=0) {
+    if (list->rulesCount == list->rulesCap) {
+        list->rulesCap = list->rulesCap ? 2*list->rulesCap : 16;
+        list->rules = (HS_Rule*) realloc(list->rules, list->rulesCap*sizeof(HS_Rule));
+    }
+    
+    HS_Rule& rule = list->rules[list->rulesCount++];
+    rule = {};
+    
+    int patternSize = strlen(pattern);
+    
+    if (!list->exactOnly && patternSize && pattern[patternSize-1] == '*') {
+        rule.kind = HS_RuleKind_Prefix;
+        --patternSize;
+    } else if (!list->exactOnly && pattern[0] == '*') {
+        rule.kind = HS_RuleKind_Suffix;
+        ++pattern;
+        --patternSize;
+    }
+    
+    rule.pattern = (char*) calloc(1, patternSize+1);
+    memcpy(rule.pattern, pattern, patternSize);
+    rule.patternSize = patternSize;
+    
+    if (value) {
+        rule.valueSize = strlen(value);
+        rule.value = (char*) calloc(1, rule.valueSize+1);
+        memcpy(rule.value, value, rule.valueSize);
+    }
+    
+    list->compiled = false;
+}
+
+void HS_ClearRules(HS_RuleList* list) {
+    for (int i = 0; i < list->rulesCount; ++i) {
+        free(list->rules[i].pattern);
+        if (list->rules[i].value) free(list->rules[i].value);
+    }
+    
+    list->rulesCount = 0;
+    list->compiled = false;
+}
+
+uint32_t HS__HashRulePattern(const char* s, int size) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < size; ++i) {
+        hash = (hash ^ (uint8_t) s[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Keeps the rule that takes precedence when both match. Rules are index + 1.
+int HS__PickRule(HS_RuleList* list, int current, int candidate) {
+    if (!current) return candidate;
+    if (!candidate) return current;
+    if (list->lastMatchWins) return current > candidate ? current : candidate;
+    return current < candidate ? current : candidate;
+}
+
+void HS__AddToRuleTrie(HS_RuleList* list, HS_RuleTrie* trie, HS_Rule* rule, int ruleIndex, bool reversed) {
+    if (!trie->nodesCount) trie->nodesCount = 1; // root
+    
+    int node = 0;
+    
+    for (int i = 0; i < rule->patternSize; ++i) {
+        char c = rule->pattern[reversed ? rule->patternSize-1-i : i];
+        
+        int child = trie->nodes[node].firstChild;
+        while (child && trie->nodes[child].c != c) child = trie->nodes[child].nextSibling;
+        
+        if (!child) {
+            child = trie->nodesCount++;
+            trie->nodes[child] = {};
+            trie->nodes[child].c = c;
+            trie->nodes[child].nextSibling = trie->nodes[node].firstChild;
+            trie->nodes[node].firstChild = child;
+        }
+        
+        node = child;
+    }
+    
+    trie->nodes[node].rule = HS__PickRule(list, trie->nodes[node].rule, ruleIndex+1);
+}
 
-int HS_Replace(char* outBuffer, char* inBuffer, int inLength, HS_Replacement* reps) {
-    int r = 0;
-    while (reps[r].replaced) {
-        reps[r].replacedSize = strlen(reps[r].replaced);
-        reps[r].replacementSize = strlen(reps[r].replacement);
-        ++r;
+void HS_CompileRules(HS_RuleList* list) {
+    // Every pattern byte needs at most one node, plus the roots
+    int nodesNeeded = 1;
+    int exactCount = 0;
+    
+    for (int i = 0; i < list->rulesCount; ++i) {
+        nodesNeeded += list->rules[i].patternSize;
+        if (list->rules[i].kind == HS_RuleKind_Exact) ++exactCount;
+    }
+    
+    HS_RuleTrie* tries[2] = {&list->prefixes, &list->suffixes};
+    for (int t = 0; t < 2; ++t) {
+        if (tries[t]->nodesCap < nodesNeeded) {
+            tries[t]->nodesCap = nodesNeeded;
+            tries[t]->nodes = (HS_RuleTrieNode*) realloc(tries[t]->nodes, nodesNeeded*sizeof(HS_RuleTrieNode));
+        }
+        tries[t]->nodesCount = 1;
+        tries[t]->nodes[0] = {};
+    }
+    
+    int slotsCap = 16;
+    while (slotsCap < 2*exactCount) slotsCap *= 2;
+    
+    if (list->exactSlotsCap != slotsCap) {
+        if (list->exactSlots) free(list->exactSlots);
+        list->exactSlots = (int*) calloc(slotsCap, sizeof(int));
+        list->exactSlotsCap = slotsCap;
+    } else {
+        memset(list->exactSlots, 0, slotsCap*sizeof(int));
     }
+    
+    for (int i = 0; i < list->rulesCount; ++i) {
+        HS_Rule* rule = &list->rules[i];
+        
+        if (rule->kind == HS_RuleKind_Prefix) {
+            HS__AddToRuleTrie(list, &list->prefixes, rule, i, false);
+        } else if (rule->kind == HS_RuleKind_Suffix) {
+            HS__AddToRuleTrie(list, &list->suffixes, rule, i, true);
+        } else {
+            uint32_t slot = HS__HashRulePattern(rule->pattern, rule->patternSize) & (slotsCap-1);
             
-    int i = 0;
-    int j = 0;
-    while (i < inLength) {
-        r = 0;
-        int replaced = false;
-        while (reps[r].replaced) {
-            if (i <= inLength - reps[r].replacedSize && memcmp(inBuffer+i, reps[r].replaced, reps[r].replacedSize) == 0) {
-                memcpy(outBuffer+j, reps[r].replacement, reps[r].replacementSize);
-                i += reps[r].replacedSize;
-                j += reps[r].replacementSize;
-                replaced = true;
-                break;
+            while (list->exactSlots[slot]) {
+                HS_Rule* other = &list->rules[list->exactSlots[slot]-1];
+                if (other->patternSize == rule->patternSize && memcmp(other->pattern, rule->pattern, rule->patternSize)==0) break;
+                slot = (slot+1) & (slotsCap-1);
             }
-            ++r;
+            
+            list->exactSlots[slot] = HS__PickRule(list, list->exactSlots[slot], i+1);
         }
+    }
+    
+    list->compiled = true;
+}
+
+void HS_CompileVHostRules(HS_VHost* vhost) {
+    HS_RuleList* lists[] = {&vhost->uriMap, &vhost->cacheControlMap, &vhost->cacheBust, &vhost->needsSSIParsing,
+                            &vhost->redirectMap, &vhost->rootDirMap, &vhost->gkAreaPrefixes, &vhost->gkAreaIds};
+    
+    for (int i = 0; i < (int) (sizeof(lists)/sizeof(lists[0])); ++i) {
+        if (!lists[i]->compiled) HS_CompileRules(lists[i]);
+    }
+}
+
+HS_Rule* HS__MatchRuleInOrder(HS_RuleList* list, const char* uri, int uriSize) {
+    int match = 0;
+    
+    for (int i = 0; i < list->rulesCount; ++i) {
+        HS_Rule* rule = &list->rules[i];
+        bool matches = rule->kind == HS_RuleKind_Exact  ? rule->patternSize == uriSize && memcmp(rule->pattern, uri, uriSize)==0
+                     : rule->kind == HS_RuleKind_Prefix ? rule->patternSize <= uriSize && memcmp(rule->pattern, uri, rule->patternSize)==0
+                     : rule->patternSize <= uriSize && memcmp(rule->pattern, uri + uriSize - rule->patternSize, rule->patternSize)==0;
         
-        if (!replaced) {
-            outBuffer[j] = inBuffer[i];
-            ++j;
-            ++i;
+        if (matches) {
+            match = i+1;
+            if (!list->lastMatchWins) break;
         }
     }
     
-    outBuffer[j] = 0;
-    return j;
+    return match ? &list->rules[match-1] : 0;
+}
+
+// Returns the rule that applies to `uri`, or 0 if none does.
+HS_Rule* HS_MatchRule(HS_RuleList* list, const char* uri) {
+    if (!list->rulesCount) return 0;
+    
+    int uriSize = strlen(uri);
+    if (!list->compiled) return HS__MatchRuleInOrder(list, uri, uriSize);
+    
+    int match = 0;
+    
+    // Exact
+    uint32_t slot = HS__HashRulePattern(uri, uriSize) & (list->exactSlotsCap-1);
+    while (list->exactSlots[slot]) {
+        HS_Rule* rule = &list->rules[list->exactSlots[slot]-1];
+        if (rule->patternSize == uriSize && memcmp(rule->pattern, uri, uriSize)==0) {
+            match = list->exactSlots[slot];
+            break;
+        }
+        slot = (slot+1) & (list->exactSlotsCap-1);
+    }
+    
+    // Prefixes and suffixes
+    HS_RuleTrie* tries[2] = {&list->prefixes, &list->suffixes};
+    for (int t = 0; t < 2; ++t) {
+        HS_RuleTrieNode* nodes = tries[t]->nodes;
+        int node = 0;
+        match = HS__PickRule(list, match, nodes[0].rule);
+        
+        for (int i = 0; i < uriSize; ++i) {
+            char c = uri[t == 0 ? i : uriSize-1-i];
+            
+            int child = nodes[node].firstChild;
+            while (child && nodes[child].c != c) child = nodes[child].nextSibling;
+            if (!child) break;
+            
+            node = child;
+            match = HS__PickRule(list, match, nodes[node].rule);
+        }
+    }
+    
+    return match ? &list->rules[match-1] : 0;
 }
 
 void HS_AddPlugin(HS_VHost* vhost, HS_Plugin plugin) {
@@ -442,82 +1121,757 @@ HS_Server* HS_GetServer(HS_CallbackArgs* args) {
     return (HS_Server*) lws_context_user(lws_get_context(args->socket));
 }
 
-void HS_PeriodicSchedulerCallback(lws_sorted_usec_list_t* entry) {
-    HS_SchedulerPeriodicEntry* schedulerEntry = (HS_SchedulerPeriodicEntry*) entry;
-    HS_Server* server = schedulerEntry->server;
+// Number of I/O pool threads, set before the server runs. 0 runs the jobs on
+// the service thread.
+void HS_SetIOThreadsCount(HS_Server* server, int count) {
+    server->ioThreadsWanted = count > 0 ? HS_Min(count, HS__IOThreadsCap) : -1;
+}
+
+void* HS__IOWorker(void* data) {
+    HS_Server* server = (HS_Server*) data;
+    
+    pthread_mutex_lock(&server->ioMutex);
     
-    schedulerEntry->task(server);
+    while (true) {
+        while (!server->ioQueue && !server->ioStopping) {
+            pthread_cond_wait(&server->ioCond, &server->ioMutex);
+        }
+        if (!server->ioQueue) break;
+        
+        HS_IOJob* job = server->ioQueue;
+        server->ioQueue = job->next;
+        if (!server->ioQueue) server->ioQueueLast = 0;
+        pthread_mutex_unlock(&server->ioMutex);
+        
+        job->work(job);
+        
+        pthread_mutex_lock(&server->ioMutex);
+        job->next = server->ioDone;
+        server->ioDone = job;
+        lws_cancel_service(server->lwsContext);
+    }
     
-    lws_sul_schedule(server->lwsContext, 0, &schedulerEntry->entry, HS_PeriodicSchedulerCallback, schedulerEntry->nanoSeconds);
+    pthread_mutex_unlock(&server->ioMutex);
+    return 0;
 }
 
-void HS_SchedulePeriodicTask(HS_Server* server, HS_PeriodicTask task, uint64_t ms) {
-    HS_SchedulerPeriodicEntry& schedulerEntry = server->schedulerPeriodicEntries[server->schedulerPeriodicEntriesCount++];
-    schedulerEntry.server = server;
-    schedulerEntry.task = task;
-    schedulerEntry.nanoSeconds = ms*1000;
+void HS__StartIOPool(HS_Server* server) {
+    pthread_mutex_init(&server->ioMutex, 0);
+    pthread_cond_init(&server->ioCond, 0);
+    
+    int count = server->ioThreadsWanted ? server->ioThreadsWanted : HS__IOThreadsDefault;
+    
+    for (int i = 0; i < count; ++i) {
+        if (pthread_create(&server->ioThreads[server->ioThreadsCount], 0, HS__IOWorker, server) == 0) {
+            ++server->ioThreadsCount;
+        }
+    }
 }
 
-void HS_InitPeriodicTasks(HS_Server* server) {
-    for (int i = 0; i < server->schedulerPeriodicEntriesCount; ++i) {
-        HS_SchedulerPeriodicEntry& schedulerEntry = server->schedulerPeriodicEntries[i];
-        lws_sul_schedule(server->lwsContext, 0, &schedulerEntry.entry, HS_PeriodicSchedulerCallback, schedulerEntry.nanoSeconds);
+// Lets the threads finish the queued jobs; their done functions run on the
+// next HS__FinishIOJobs.
+void HS__StopIOPool(HS_Server* server) {
+    if (!server->ioThreadsCount) return;
+    
+    pthread_mutex_lock(&server->ioMutex);
+    server->ioStopping = true;
+    pthread_cond_broadcast(&server->ioCond);
+    pthread_mutex_unlock(&server->ioMutex);
+    
+    for (int i = 0; i < server->ioThreadsCount; ++i) {
+        pthread_join(server->ioThreads[i], 0);
     }
+    server->ioThreadsCount = 0;
 }
 
-#define HS_GetClientData(clientType, args) ((clientType*) (args)->userData)
-#define HS_GetServerData(serverType, args) ((serverType*) HS_GetServer(args)->userData)
+void HS_SubmitIOJob(HS_Server* server, HS_IOJob* job) {
+    job->next = 0;
+    
+    if (!server->ioThreadsCount) {
+        job->work(job);
+        job->done(job);
+        return;
+    }
+    
+    pthread_mutex_lock(&server->ioMutex);
+    if (server->ioQueueLast) server->ioQueueLast->next = job;
+    else server->ioQueue = job;
+    server->ioQueueLast = job;
+    pthread_cond_signal(&server->ioCond);
+    pthread_mutex_unlock(&server->ioMutex);
+}
+
+// Runs the done functions of the finished jobs, in the order they finished.
+void HS__FinishIOJobs(HS_Server* server) {
+    pthread_mutex_lock(&server->ioMutex);
+    HS_IOJob* finished = server->ioDone;
+    server->ioDone = 0;
+    pthread_mutex_unlock(&server->ioMutex);
+    
+    HS_IOJob* ordered = 0;
+    while (finished) {
+        HS_IOJob* next = finished->next;
+        finished->next = ordered;
+        ordered = finished;
+        finished = next;
+    }
+    
+    while (ordered) {
+        HS_IOJob* next = ordered->next;
+        ordered->done(ordered);
+        ordered = next;
+    }
+}
 
-void HS_GetIpv4(HS_CallbackArgs* args, char* result) {
-    lws_get_peer_simple(args->socket, result, 16);
+// Timers
+//--------
+uint64_t HS__TimerNowTick() {
+    return lws_now_usecs()/1000;
 }
 
-HS_VHost* HS_GetVHost(HS_Server* server, const char* name) {
-    for (int i = 0; i < server->vhostsCount; ++i) {
-        if (strcmp(server->vhosts[i].name, name) == 0) {
-            return &server->vhosts[i];
-        }
+int HS__LowestBit(uint64_t bits) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward64(&index, bits);
+    return index;
+#else
+    return __builtin_ctzll(bits);
+#endif
+}
+
+HS_Timer* HS__GetTimer(HS_TimerWheel* wheel, int index) {
+    return &wheel->blocks[index/HS__TimerBlockSize][index%HS__TimerBlockSize];
+}
+
+void HS__InitTimers(HS_Server* server) {
+    HS_TimerWheel* wheel = &server->timerWheel;
+    if (wheel->server) return;
+    
+    wheel->server = server;
+    pthread_mutex_init(&wheel->mutex, 0);
+    wheel->tick = HS__TimerNowTick();
+    wheel->wakeTick = UINT64_MAX;
+    wheel->freeTimer = -1;
+    memset(wheel->slots, -1, sizeof(wheel->slots));
+}
+
+// Puts the timer in the slot of the lowest level that reaches its expiry
+void HS__LinkTimer(HS_TimerWheel* wheel, int index) {
+    HS_Timer* timer = HS__GetTimer(wheel, index);
+    uint64_t expires = timer->expires > wheel->tick ? timer->expires : wheel->tick;
+    
+    int level = 0;
+    while (level < HS__TimerLevels - 1 && (expires >> (level*HS__TimerLevelBits)) - (wheel->tick >> (level*HS__TimerLevelBits)) >= HS__TimerSlots) {
+        ++level;
     }
-    return 0;
+    
+    uint64_t current = wheel->tick >> (level*HS__TimerLevelBits);
+    uint64_t slotNumber = expires >> (level*HS__TimerLevelBits);
+    if (slotNumber - current >= HS__TimerSlots) slotNumber = current + HS__TimerSlots - 1; // Beyond the wheel
+    
+    int slot = slotNumber & (HS__TimerSlots - 1);
+    int& head = wheel->slots[level][slot];
+    
+    timer->level = level;
+    timer->slot = slot;
+    timer->prev = -1;
+    timer->next = head;
+    if (head >= 0) HS__GetTimer(wheel, head)->prev = index;
+    head = index;
+    wheel->occupied[level] |= 1ull << slot;
 }
 
-void HS_PushPostEndpoint(HS_Server* server, const char* vhostName, const char* endpoint) {
-    HS_VHost* vhost = HS_GetVHost(server, vhostName);
-    char* entry = vhost->postEndpoints[vhost->postEndpointsSize++];
-    strcpy(entry, endpoint);
+void HS__UnlinkTimer(HS_TimerWheel* wheel, int index) {
+    HS_Timer* timer = HS__GetTimer(wheel, index);
+    int& head = wheel->slots[timer->level][timer->slot];
+    
+    if (timer->prev >= 0) HS__GetTimer(wheel, timer->prev)->next = timer->next;
+    else                  head = timer->next;
+    if (timer->next >= 0) HS__GetTimer(wheel, timer->next)->prev = timer->prev;
+    
+    if (head < 0) wheel->occupied[timer->level] &= ~(1ull << timer->slot);
 }
 
-void HS_PushCacheBust(HS_Server* server, const char* vhostName, const char* resource) {
-    HS_VHost* vhost = HS_GetVHost(server, vhostName);
-    char* entry = vhost->cacheBust[vhost->cacheBustSize++];
-    strcpy(entry, resource);
+void HS__FreeTimer(HS_TimerWheel* wheel, int index) {
+    HS_Timer* timer = HS__GetTimer(wheel, index);
+    timer->state = HS_TimerState_Free;
+    ++timer->generation;
+    timer->next = wheel->freeTimer;
+    wheel->freeTimer = index;
 }
 
-void HS_PushSSITarget(HS_Server* server, const char* vhostName, const char* resource) {
-    HS_VHost* vhost = HS_GetVHost(server, vhostName);
-    char* entry = vhost->needsSSIParsing[vhost->needsSSIParsingSize++];
-    strcpy(entry, resource);
+// First tick with work: a level 0 slot to run or a higher slot to spread out
+uint64_t HS__NextTimerTick(HS_TimerWheel* wheel) {
+    uint64_t result = UINT64_MAX;
+    
+    for (int level = 0; level < HS__TimerLevels; ++level) {
+        uint64_t bits = wheel->occupied[level];
+        if (!bits) continue;
+        
+        int shift = level*HS__TimerLevelBits;
+        uint64_t current = wheel->tick >> shift;
+        int offset = current & (HS__TimerSlots - 1);
+        if (offset) bits = (bits >> offset) | (bits << (HS__TimerSlots - offset));
+        
+        uint64_t tick = (current + HS__LowestBit(bits)) << shift;
+        if (tick < wheel->tick) tick = wheel->tick;
+        if (tick < result) result = tick;
+    }
+    
+    return result;
 }
 
-void HS_PushCacheControlMapping(HS_Server* server, const char* vhostName, const char* uri, const char* cacheString) {
-    HS_VHost* vhost = HS_GetVHost(server, vhostName);
-    HS_CacheControlMapEntry& entry = vhost->cacheControlMap[vhost->cacheControlMapSize++];
-    strcpy(entry.uri, uri);
-    entry.uriSize = strlen(uri);
-    strcpy(entry.cacheString, cacheString);
+// Takes the expired timers off the wheel, returns them as a list
+int HS__AdvanceTimers(HS_TimerWheel* wheel, uint64_t now) {
+    int fired = -1;
+    int firedLast = -1;
+    
+    while (wheel->timersCount) {
+        uint64_t tick = HS__NextTimerTick(wheel);
+        if (tick > now) break;
+        wheel->tick = tick;
+        
+        for (int level = 1; level < HS__TimerLevels; ++level) {
+            int shift = level*HS__TimerLevelBits;
+            if (tick & ((1ull << shift) - 1)) break;
+            
+            int slot = (tick >> shift) & (HS__TimerSlots - 1);
+            int index = wheel->slots[level][slot];
+            wheel->slots[level][slot] = -1;
+            wheel->occupied[level] &= ~(1ull << slot);
+            
+            while (index >= 0) {
+                int next = HS__GetTimer(wheel, index)->next;
+                HS__LinkTimer(wheel, index);
+                index = next;
+            }
+        }
+        
+        int slot = tick & (HS__TimerSlots - 1);
+        int index = wheel->slots[0][slot];
+        wheel->slots[0][slot] = -1;
+        wheel->occupied[0] &= ~(1ull << slot);
+        
+        while (index >= 0) {
+            HS_Timer* timer = HS__GetTimer(wheel, index);
+            int next = timer->next;
+            
+            timer->state = HS_TimerState_Firing;
+            timer->next = -1;
+            if (firedLast >= 0) HS__GetTimer(wheel, firedLast)->next = index;
+            else                fired = index;
+            firedLast = index;
+            --wheel->timersCount;
+            
+            index = next;
+        }
+        
+        wheel->tick = tick + 1;
+    }
+    
+    if (wheel->tick <= now) wheel->tick = now + 1; // Nothing left up to now
+    return fired;
 }
 
-void HS_PushRedirectMapping(HS_Server* server, const char* vhostName, const char* uri, const char* destination) {
-    HS_VHost* vhost = HS_GetVHost(server, vhostName);
-    HS_RedirectMapEntry& entry = vhost->redirectMap[vhost->redirectMapSize++];
-    strcpy(entry.uri, uri);
-    strcpy(entry.destination, destination);
+void HS__TimerServiceCallback(lws_sorted_usec_list_t* sul);
+
+// Service thread only: sets the sul for the next tick with work
+void HS__ScheduleTimerService(HS_Server* server) {
+    HS_TimerWheel* wheel = &server->timerWheel;
+    if (!wheel->serviceStarted) return;
+    
+    pthread_mutex_lock(&wheel->mutex);
+    uint64_t tick = HS__NextTimerTick(wheel);
+    wheel->wakeTick = tick;
+    pthread_mutex_unlock(&wheel->mutex);
+    
+    if (tick == UINT64_MAX) {
+        lws_sul_cancel(&wheel->sul);
+        return;
+    }
+    
+    lws_usec_t now = lws_now_usecs();
+    lws_usec_t at = (lws_usec_t) tick*1000;
+    lws_sul_schedule(server->lwsContext, 0, &wheel->sul, HS__TimerServiceCallback, at > now ? at - now : 0);
 }
 
-// TODO: This reasons list is outdated
-//-------------------------------------
-const char* HS_ToString(lws_callback_reasons reason) {
-    switch(reason) {
+// Runs the timers expired by tick `now`, then reschedules the periodic ones
+void HS__RunTimers(HS_Server* server, uint64_t now) {
+    HS_TimerWheel* wheel = &server->timerWheel;
+    
+    pthread_mutex_lock(&wheel->mutex);
+    int fired = HS__AdvanceTimers(wheel, now);
+    pthread_mutex_unlock(&wheel->mutex);
+    
+    // Functions run without the lock: they can add and cancel timers
+    for (int index = fired; index >= 0; index = HS__GetTimer(wheel, index)->next) {
+        HS_Timer* timer = HS__GetTimer(wheel, index);
+        
+        pthread_mutex_lock(&wheel->mutex);
+        bool run = timer->state == HS_TimerState_Firing;
+        pthread_mutex_unlock(&wheel->mutex);
+        
+        if (run) timer->func(server, timer->userData);
+    }
+    
+    pthread_mutex_lock(&wheel->mutex);
+    while (fired >= 0) {
+        HS_Timer* timer = HS__GetTimer(wheel, fired);
+        int next = timer->next;
+        
+        if (timer->state == HS_TimerState_Firing && timer->period) {
+            timer->expires += timer->period;
+            if (timer->expires <= now) timer->expires = now + 1; // Late: skip the missed runs
+            timer->state = HS_TimerState_Scheduled;
+            HS__LinkTimer(wheel, fired);
+            ++wheel->timersCount;
+        } else {
+            HS__FreeTimer(wheel, fired);
+        }
+        
+        fired = next;
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+    
+    HS__ScheduleTimerService(server);
+}
+
+void HS__TimerServiceCallback(lws_sorted_usec_list_t* sul) {
+    HS__RunTimers(((HS_TimerWheel*) sul)->server, HS__TimerNowTick());
+}
+
+// Runs func on the service thread after delayMs, then every periodMs if it is
+// not 0. Returns 0 when no more timers can be added.
+HS_TimerId HS_AddTimer(HS_Server* server, uint64_t delayMs, uint64_t periodMs, HS_TimerFunc func, void* userData=0) {
+    HS_TimerWheel* wheel = &server->timerWheel;
+    HS__InitTimers(server);
+    
+    lws_usec_t nowUsecs = lws_now_usecs();
+    uint64_t now = nowUsecs/1000;
+    
+    pthread_mutex_lock(&wheel->mutex);
+    
+    int index = wheel->freeTimer;
+    if (index >= 0) {
+        wheel->freeTimer = HS__GetTimer(wheel, index)->next;
+    } else if (wheel->timersAllocated < HS__TimerBlocksCap*HS__TimerBlockSize) {
+        index = wheel->timersAllocated++;
+        HS_Timer*& block = wheel->blocks[index/HS__TimerBlockSize];
+        if (!block) block = (HS_Timer*) calloc(HS__TimerBlockSize, sizeof(HS_Timer));
+    } else {
+        pthread_mutex_unlock(&wheel->mutex);
+        lwsl_warn("Timers | No more than %d timers\n", HS__TimerBlocksCap*HS__TimerBlockSize);
+        return 0;
+    }
+    
+    // An idle wheel can skip ahead instead of walking the ticks it missed
+    if (!wheel->timersCount && wheel->tick < now) wheel->tick = now;
+    
+    HS_Timer* timer = HS__GetTimer(wheel, index);
+    timer->expires = (nowUsecs + delayMs*1000 + 999)/1000; // Never early
+    timer->period = periodMs;
+    timer->func = func;
+    timer->userData = userData;
+    timer->state = HS_TimerState_Scheduled;
+    HS__LinkTimer(wheel, index);
+    ++wheel->timersCount;
+    
+    HS_TimerId id = ((uint64_t) timer->generation << 32) | (uint64_t) (index + 1);
+    bool earlier = timer->expires < wheel->wakeTick;
+    pthread_mutex_unlock(&wheel->mutex);
+    
+    if (earlier && wheel->serviceStarted) {
+        if (pthread_equal(pthread_self(), wheel->serviceThread)) HS__ScheduleTimerService(server);
+        else                                                     lws_cancel_service(server->lwsContext);
+    }
+    
+    return id;
+}
+
+// Returns false when the timer already ran (one-shot) or was cancelled
+bool HS_CancelTimer(HS_Server* server, HS_TimerId id) {
+    HS_TimerWheel* wheel = &server->timerWheel;
+    int index = (int) (id & 0xffffffff) - 1;
+    bool result = false;
+    
+    pthread_mutex_lock(&wheel->mutex);
+    if (index >= 0 && index < wheel->timersAllocated) {
+        HS_Timer* timer = HS__GetTimer(wheel, index);
+        
+        if (timer->generation == (uint32_t) (id >> 32)) {
+            if (timer->state == HS_TimerState_Scheduled) {
+                HS__UnlinkTimer(wheel, index);
+                HS__FreeTimer(wheel, index);
+                --wheel->timersCount;
+                result = true;
+            } else if (timer->state == HS_TimerState_Firing) {
+                timer->state = HS_TimerState_Cancelled; // Freed once the fired timers are done
+                result = true;
+            }
+        }
+    }
+    pthread_mutex_unlock(&wheel->mutex);
+    
+    return result;
+}
+
+void HS__StartTimers(HS_Server* server) {
+    HS_TimerWheel* wheel = &server->timerWheel;
+    HS__InitTimers(server);
+    wheel->serviceThread = pthread_self();
+    wheel->serviceStarted = true;
+    HS__ScheduleTimerService(server);
+}
+
+void HS__DestroyTimers(HS_Server* server) {
+    HS_TimerWheel* wheel = &server->timerWheel;
+    if (!wheel->server) return;
+    
+    for (int i = 0; i < HS__TimerBlocksCap && wheel->blocks[i]; ++i) {
+        free(wheel->blocks[i]);
+    }
+    pthread_mutex_destroy(&wheel->mutex);
+    *wheel = {};
+}
+
+void HS__RunPeriodicTask(HS_Server* server, void* task) {
+    ((HS_PeriodicTask) task)(server);
+}
+
+void HS_SchedulePeriodicTask(HS_Server* server, HS_PeriodicTask task, uint64_t ms) {
+    HS_AddTimer(server, ms, ms, HS__RunPeriodicTask, (void*) task);
+}
+
+// TLS
+//-----
+int HS__TLSVHostIndex() {
+    static int index = SSL_CTX_get_ex_new_index(0, 0, 0, 0, 0);
+    return index;
+}
+
+bool HS__NewTLSTicketKey(HS_TLSTicketKey* key) {
+    return RAND_bytes(key->name, sizeof(key->name)) == 1
+        && RAND_bytes(key->aesKey, sizeof(key->aesKey)) == 1
+        && RAND_bytes(key->hmacKey, sizeof(key->hmacKey)) == 1;
+}
+
+// Creates a store for the TLS sessions of vhosts served by several servers.
+// Each vhost gets one of its own otherwise (see HS_SetTLSSessionStore).
+HS_TLSSessionStore* HS_CreateTLSSessionStore() {
+    HS_TLSSessionStore* store = (HS_TLSSessionStore*) calloc(1, sizeof(HS_TLSSessionStore));
+    pthread_mutex_init(&store->mutex, 0);
+    return store;
+}
+
+// The servers using the store must have been destroyed
+void HS_DestroyTLSSessionStore(HS_TLSSessionStore* store) {
+    for (int i = 0; i < store->sessionsCap; ++i) {
+        free(store->sessions[i].der);
+    }
+    free(store->sessions);
+    pthread_mutex_destroy(&store->mutex);
+    OPENSSL_cleanse(store->ticketKeys, sizeof(store->ticketKeys));
+    free(store);
+}
+
+// Called with the store's mutex held. Catches up with the rotations due since
+// the last handshake, so the servers sharing the store rotate its keys once.
+void HS__RotateTLSTicketKeys(HS_TLSSessionStore* store) {
+    if (store->ticketKeysFromConfig) return;
+    
+    time_t now = time(0);
+    int rotations = store->ticketKeysCount ? (int) HS_Min((now - store->ticketKeysRotationDate)/store->ticketKeyRotation, (time_t) HS__TLSTicketKeysCap) : 1;
+    
+    for (int i = 0; i < rotations; ++i) {
+        HS_TLSTicketKey key;
+        if (!HS__NewTLSTicketKey(&key)) {
+            lwsl_warn("TLS | Failed to generate a ticket key, keeping the current one\n");
+            return;
+        }
+        
+        // The oldest key falls off: its tickets now get a full handshake
+        int count = store->ticketKeysCount < HS__TLSTicketKeysCap ? store->ticketKeysCount + 1 : HS__TLSTicketKeysCap;
+        memmove(&store->ticketKeys[1], &store->ticketKeys[0], (count - 1)*sizeof(HS_TLSTicketKey));
+        store->ticketKeys[0] = key;
+        store->ticketKeysCount = count;
+        store->ticketKeysRotationDate = now;
+        OPENSSL_cleanse(&key, sizeof(key));
+    }
+}
+
+HS_TLSCachedSession* HS__GetTLSCachedSession(HS_TLSSessionStore* store, const unsigned char* id, unsigned int idSize) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (unsigned int i = 0; i < idSize; ++i) {
+        hash = (hash ^ id[i])*1099511628211ULL;
+    }
+    return &store->sessions[hash % store->sessionsCap];
+}
+
+HS_TLSSessionStore* HS__GetTLSSessionStore(SSL* ssl) {
+    HS_VHost* vhost = (HS_VHost*) SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), HS__TLSVHostIndex());
+    return vhost ? vhost->tlsStore : 0;
+}
+
+int HS__StoreTLSSession(SSL* ssl, SSL_SESSION* session) {
+    HS_TLSSessionStore* store = HS__GetTLSSessionStore(ssl);
+    unsigned int idSize;
+    const unsigned char* id = SSL_SESSION_get_id(session, &idSize);
+    int derSize = i2d_SSL_SESSION(session, 0);
+    if (!store || !store->sessions || !idSize || derSize <= 0) return 0;
+    
+    unsigned char* der = (unsigned char*) malloc(derSize);
+    unsigned char* at = der;
+    i2d_SSL_SESSION(session, &at);
+    
+    pthread_mutex_lock(&store->mutex);
+    HS_TLSCachedSession* cached = HS__GetTLSCachedSession(store, id, idSize);
+    free(cached->der);
+    memcpy(cached->id, id, idSize);
+    cached->idSize = idSize;
+    cached->expirationDate = SSL_SESSION_get_time(session) + SSL_SESSION_get_timeout(session);
+    cached->der = der;
+    cached->derSize = derSize;
+    pthread_mutex_unlock(&store->mutex);
+    
+    return 0; // The session isn't kept
+}
+
+SSL_SESSION* HS__LoadTLSSession(SSL* ssl, const unsigned char* id, int idSize, int* copy) {
+    HS_TLSSessionStore* store = HS__GetTLSSessionStore(ssl);
+    *copy = 0;
+    if (!store || !store->sessions || idSize <= 0) return 0;
+    
+    SSL_SESSION* session = 0;
+    pthread_mutex_lock(&store->mutex);
+    HS_TLSCachedSession* cached = HS__GetTLSCachedSession(store, id, idSize);
+    
+    if (cached->idSize == (unsigned int) idSize && memcmp(cached->id, id, idSize)==0 && cached->expirationDate > time(0)) {
+        const unsigned char* at = cached->der;
+        session = d2i_SSL_SESSION(0, &at, cached->derSize);
+    }
+    pthread_mutex_unlock(&store->mutex);
+    
+    return session;
+}
+
+void HS__RemoveTLSSession(SSL_CTX* ctx, SSL_SESSION* session) {
+    HS_VHost* vhost = (HS_VHost*) SSL_CTX_get_ex_data(ctx, HS__TLSVHostIndex());
+    HS_TLSSessionStore* store = vhost ? vhost->tlsStore : 0;
+    unsigned int idSize;
+    const unsigned char* id = SSL_SESSION_get_id(session, &idSize);
+    if (!store || !store->sessions || !idSize) return;
+    
+    pthread_mutex_lock(&store->mutex);
+    HS_TLSCachedSession* cached = HS__GetTLSCachedSession(store, id, idSize);
+    if (cached->idSize == idSize && memcmp(cached->id, id, idSize)==0) {
+        free(cached->der);
+        *cached = {};
+    }
+    pthread_mutex_unlock(&store->mutex);
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+typedef EVP_MAC_CTX HS__TicketMACContext;
+
+bool HS__InitTicketMAC(EVP_MAC_CTX* mac, unsigned char* key) {
+    OSSL_PARAM params[] = {
+        OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key, 32),
+        OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char*) "SHA256", 0),
+        OSSL_PARAM_construct_end(),
+    };
+    return EVP_MAC_CTX_set_params(mac, params);
+}
+#else
+typedef HMAC_CTX HS__TicketMACContext;
+
+bool HS__InitTicketMAC(HMAC_CTX* mac, unsigned char* key) {
+    return HMAC_Init_ex(mac, key, 32, EVP_sha256(), 0);
+}
+#endif
+
+int HS__TLSTicketKeyCallback(SSL* ssl, unsigned char* keyName, unsigned char* iv, EVP_CIPHER_CTX* cipher, HS__TicketMACContext* mac, int encrypt) {
+    HS_TLSSessionStore* store = HS__GetTLSSessionStore(ssl);
+    if (!store) return 0; // No ticket, or a full handshake
+    
+    // The keys are copied out: the cipher and MAC are set up without the lock
+    HS_TLSTicketKey key;
+    int result = 0;
+    
+    pthread_mutex_lock(&store->mutex);
+    HS__RotateTLSTicketKeys(store);
+    
+    if (encrypt) {
+        key = store->ticketKeys[0];
+        result = store->ticketKeysCount ? 1 : 0;
+    } else {
+        for (int i = 0; i < store->ticketKeysCount && !result; ++i) {
+            if (memcmp(keyName, store->ticketKeys[i].name, sizeof(key.name))) continue;
+            key = store->ticketKeys[i];
+            result = i ? 2 : 1; // 2: issued before a rotation, renew it
+        }
+    }
+    pthread_mutex_unlock(&store->mutex);
+    
+    if (!result) return 0; // No key, or a retired one
+    
+    if (encrypt) {
+        if (RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1) result = -1;
+        memcpy(keyName, key.name, sizeof(key.name));
+        if (result > 0 && !EVP_EncryptInit_ex(cipher, EVP_aes_256_cbc(), 0, key.aesKey, iv)) result = -1;
+        if (result > 0 && !HS__InitTicketMAC(mac, key.hmacKey)) result = -1;
+    } else {
+        if (!HS__InitTicketMAC(mac, key.hmacKey)) result = -1;
+        if (result > 0 && !EVP_DecryptInit_ex(cipher, EVP_aes_256_cbc(), 0, key.aesKey, iv)) result = -1;
+    }
+    
+    OPENSSL_cleanse(&key, sizeof(key));
+    return result;
+}
+
+// Applies the vhost's TLS settings to the SSL_CTX lws created for it
+void HS__ConfigureTLS(HS_VHost* vhost, SSL_CTX* ctx) {
+    vhost->sslContext = ctx;
+    SSL_CTX_set_ex_data(ctx, HS__TLSVHostIndex(), vhost);
+    
+    if (vhost->tlsMinVersion) SSL_CTX_set_min_proto_version(ctx, vhost->tlsMinVersion);
+    
+    if (!vhost->tlsStore) {
+        vhost->tlsStore = HS_CreateTLSSessionStore();
+        vhost->tlsOwnsStore = true;
+    }
+    
+    // The first server to use the store sets it up; the others share its state
+    HS_TLSSessionStore* store = vhost->tlsStore;
+    pthread_mutex_lock(&store->mutex);
+    
+    if (vhost->tlsSessionCacheSize >= 0 && !store->sessions) {
+        store->sessionsCap = vhost->tlsSessionCacheSize ? vhost->tlsSessionCacheSize : HS__TLSSessionCacheSizeDefault;
+        store->sessions = (HS_TLSCachedSession*) calloc(store->sessionsCap, sizeof(HS_TLSCachedSession));
+    }
+    
+    if (!vhost->tlsDisableTickets && !store->ticketKeysCount) {
+        if (vhost->tlsTicketKeysCount) {
+            memcpy(store->ticketKeys, vhost->tlsTicketKeys, sizeof(store->ticketKeys));
+            store->ticketKeysCount = vhost->tlsTicketKeysCount;
+            store->ticketKeysFromConfig = true;
+        } else {
+            store->ticketKeyRotation = vhost->tlsTicketKeyRotation > 0 ? vhost->tlsTicketKeyRotation : HS__TLSTicketKeyRotationDefault;
+            HS__RotateTLSTicketKeys(store);
+        }
+    }
+    pthread_mutex_unlock(&store->mutex);
+    
+    if (vhost->tlsSessionCacheSize < 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    } else {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER | SSL_SESS_CACHE_NO_INTERNAL);
+        SSL_CTX_sess_set_new_cb(ctx, HS__StoreTLSSession);
+        SSL_CTX_sess_set_get_cb(ctx, HS__LoadTLSSession);
+        SSL_CTX_sess_set_remove_cb(ctx, HS__RemoveTLSSession);
+    }
+    SSL_CTX_set_timeout(ctx, vhost->tlsSessionTimeout ? vhost->tlsSessionTimeout : HS__TLSSessionTimeoutDefault);
+    
+    if (vhost->tlsDisableTickets) {
+        // TLS 1.3 then resumes with stateful tickets, from the session cache
+        SSL_CTX_set_options(ctx, SSL_OP_NO_TICKET);
+    } else {
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        SSL_CTX_set_tlsext_ticket_key_evp_cb(ctx, HS__TLSTicketKeyCallback);
+#else
+        SSL_CTX_set_tlsext_ticket_key_cb(ctx, HS__TLSTicketKeyCallback);
+#endif
+    }
+    
+    // OpenSSL keeps one certificate per key type, and picks the ECDSA one for
+    // the clients that support it
+    if (vhost->sslECDSAPublicKeyPath[0] && vhost->lwsContextInfo.ssl_cert_filepath != vhost->sslECDSAPublicKeyPath) {
+        if (SSL_CTX_use_certificate_chain_file(ctx, vhost->sslECDSAPublicKeyPath) != 1
+         || SSL_CTX_use_PrivateKey_file(ctx, vhost->sslECDSAPrivateKeyPath, SSL_FILETYPE_PEM) != 1
+         || SSL_CTX_check_private_key(ctx) != 1) {
+            lwsl_warn("TLS | VHost=%s | Failed to load the ECDSA certificate %s\n", vhost->name, vhost->sslECDSAPublicKeyPath);
+        }
+    }
+}
+
+void HS__UpdateTLSMetrics(HS_VHost* vhost) {
+    if (!vhost->sslContext) return;
+    vhost->metrics.tlsHandshakes = SSL_CTX_sess_accept_good(vhost->sslContext);
+    vhost->metrics.tlsResumed = SSL_CTX_sess_hits(vhost->sslContext);
+}
+
+void HS_PrintMetrics(HS_Server* server) {
+    for (int i = 0; i < server->vhostsCount; ++i) {
+        HS_VHost& v = server->vhosts[i];
+        HS_VHostMetrics& m = v.metrics;
+        printf("Metrics | VHost=%s | BodyBytesSent=%lld | BodyBytesCopied=%lld | BodyBytesSendFile=%lld\n", v.name, m.bodyBytesSent, m.bodyBytesCopied, m.bodyBytesSendFile);
+        
+        if (v.sslContext) {
+            HS__UpdateTLSMetrics(&v);
+            printf("Metrics | VHost=%s | TLSHandshakes=%lld | Full=%lld | Resumed=%lld\n", v.name, m.tlsHandshakes, m.tlsHandshakes - m.tlsResumed, m.tlsResumed);
+        }
+        
+        if (v.ipLimits) {
+            printf("Metrics | VHost=%s | IPRefusedConnections=%lld | IPLimitedRequests=%lld | IPLimitedUpgrades=%lld | IPsTracked=%d\n", v.name, m.ipRefusedConnections, m.ipLimitedRequests, m.ipLimitedUpgrades, v.ipLimitsCount);
+        }
+        
+        for (int j = 0; j < v.requestHostsCount; ++j) {
+            HS_RequestHostMetrics& h = v.requestHosts[j];
+            printf("Metrics | VHost=%s | RequestHost=%s:%d | Requests=%lld | Reused=%lld | HitRate=%.1f%%\n", v.name, h.hostName, h.port, h.requests, h.reused, h.requests ? 100.0*h.reused/h.requests : 0.0);
+        }
+    }
+    
+    if (server->accessLogRing) {
+        printf("Metrics | AccessLog | Logged=%lld | Dropped=%lld\n", server->accessLogRing->logged, server->accessLogRing->dropped);
+    }
+}
+
+#define HS_GetClientData(clientType, args) ((clientType*) (args)->userData)
+#define HS_GetServerData(serverType, args) ((serverType*) HS_GetServer(args)->userData)
+
+void HS_GetIpv4(HS_CallbackArgs* args, char* result) {
+    lws_get_peer_simple(args->socket, result, 16);
+}
+
+HS_VHost* HS_GetVHost(HS_Server* server, const char* name) {
+    for (int i = 0; i < server->vhostsCount; ++i) {
+        if (strcmp(server->vhosts[i].name, name) == 0) {
+            return &server->vhosts[i];
+        }
+    }
+    return 0;
+}
+
+void HS_PushPostEndpoint(HS_Server* server, const char* vhostName, const char* endpoint) {
+    HS_VHost* vhost = HS_GetVHost(server, vhostName);
+    char* entry = vhost->postEndpoints[vhost->postEndpointsSize++];
+    strcpy(entry, endpoint);
+}
+
+void HS_PushCacheBust(HS_Server* server, const char* vhostName, const char* resource) {
+    HS_VHost* vhost = HS_GetVHost(server, vhostName);
+    HS_AddRule(&vhost->cacheBust, resource);
+}
+
+void HS_PushSSITarget(HS_Server* server, const char* vhostName, const char* resource) {
+    HS_VHost* vhost = HS_GetVHost(server, vhostName);
+    HS_AddRule(&vhost->needsSSIParsing, resource);
+}
+
+void HS_PushCacheControlMapping(HS_Server* server, const char* vhostName, const char* uri, const char* cacheString) {
+    HS_VHost* vhost = HS_GetVHost(server, vhostName);
+    HS_AddRule(&vhost->cacheControlMap, uri, cacheString);
+}
+
+void HS_PushRedirectMapping(HS_Server* server, const char* vhostName, const char* uri, const char* destination) {
+    HS_VHost* vhost = HS_GetVHost(server, vhostName);
+    vhost->redirectMap.exactOnly = true;
+    HS_AddRule(&vhost->redirectMap, uri, destination);
+}
+
+// TODO: This reasons list is outdated
+//-------------------------------------
+const char* HS_ToString(lws_callback_reasons reason) {
+    switch(reason) {
       case LWS_CALLBACK_PROTOCOL_INIT                            : return "LWS_CALLBACK_PROTOCOL_INIT";
       case LWS_CALLBACK_PROTOCOL_DESTROY                         : return "LWS_CALLBACK_PROTOCOL_DESTROY";
       case LWS_CALLBACK_WSI_CREATE                               : return "LWS_CALLBACK_WSI_CREATE";
@@ -661,7 +2015,12 @@ struct HS_Date {
 HS_Date HS_GetDateNow() {
     HS_Date date = {};
     time_t t = time(0);
-    tm tt = *localtime(&t);
+    tm tt;
+#ifdef _WIN32
+    localtime_s(&tt, &t);
+#else
+    localtime_r(&t, &tt);
+#endif
     date.year = tt.tm_year + 1900;
     date.month = tt.tm_mon + 1;
     date.day = tt.tm_mday;
@@ -684,55 +2043,161 @@ struct HS_UTMParams {
     char term[256];
 };
 
+struct HS_ByteRange {
+    long long first;
+    long long last; // inclusive
+};
+
+// Strings that only live for the duration of a request are allocated from a
+// block owned by the request. Blocks are recycled through a free list of the
+// vhost, so an idle connection only holds its HS_HTTPClient. What doesn't fit
+// in the block (e.g. unusually large headers) is allocated on the heap and
+// freed with the rest of the arena.
+struct HS_Arena {
+    char* block;
+    int   size;
+    char* overflow; // list of heap chunks, each starting with the next one
+};
+
 struct HS_HTTPClient {
     int id;
     lws* socket;
     
+    // Kept across the requests of a connection
+    char ipAddress[48];
+    bool ipProxied; // the peer is a trusted proxy: ipAddress is read on every request
+    
     char httpMethod[16];
     bool requestProcessed;
     
-    char ipAddress[16];
-    char host[256];
-    char referer[1024];
-    char acceptLanguage[1024];
-    char userAgent[1024];
-    char contentType[256];
-    char origin[HS__HostNameCap];
-    
-    HS_UTMParams utm;
-    
+    // Request headers are read when needed, with HS_GetHeader or
+    // HS_GetRequestHeader.
     int  contentLength;
     
     char* receivedBuffer;
     int   receivedCap;
     int   receivedSize;
     
-    char uri[HS__URICap];
-    int  uriSize;
+    HS_Arena arena;
     
-    char  headerBuffer[LWS_PRE + 2048];
+    char* uri;      // HS__URICap bytes, in the arena
+    int   uriSize;
+    
+    char* headerBuffer; // LWS_PRE + HS__HeaderBufferSize bytes, in the arena
     char* headerAt;
     char* headerBegin;
     char* headerEnd;
     int   headerSize;
     
-    char filePath[HS__FilePathCap];
+    char* filePath; // HS__FilePathCap bytes, in the arena
     
     char* fileBuffer;
     char* fileContent;
     int   fileSize;
-    int   at; // file writing progress
     char  contentLanguage[16];
     
+    // Files that are not kept in the memory cache are streamed from disk,
+    // one frame at a time, instead of being loaded whole. Frames that aren't
+    // sent by the kernel are read on the I/O pool, one frame ahead.
+    FILE*     streamFile;
+    long long streamSize;
+    struct HS__FileReadJob* fileReadJob;
+    time_t    fileModifiedTime;
+    
+    // Byte ranges of the body being sent (Range requests). When more than
+    // one range is requested, the body is sent as multipart/byteranges.
+    HS_ByteRange ranges[HS__ByteRangesCap];
+    int          rangesCount;
+    int          rangeIndex;
+    long long    rangeAt;
+    bool         partHeaderPending;
+    char         boundary[32];
+    const char*  mimeType;
+    
     HS_FileMapEntry* fileEntry;
+    HS_ServedArchive* archive; // the body is an entry of this archive
+    HS_FileMapping* mapping;   // the body is this mapping, which isn't cached
+    
+    // A file being loaded by the I/O pool; the response is written once it's done
+    struct HS__FileLoadJob* fileLoadJob;
+    // A path being resolved by the I/O pool; the request is served again once it's done
+    struct HS__PathResolveJob* pathResolveJob;
+    // A session cookie being looked up by the I/O pool; the request is handled again once it's done
+    struct HS__GKSessionJob* gkLookupJob;
+    http_status pendingStatus;
+    char*       pendingCacheControl;
     
     bool closeConnection;
     http_status closeStatus;
     
     void* sessionData;
     bool delayBodyFree;
+    
+    // Access log
+    char*      requestURI;   // before any mapping; HS__AccessLogURICap bytes, in the arena
+    lws_usec_t requestTime;  // 0 when not logged, or already logged
+    lws_usec_t responseTime; // of the last write
+    int        responseStatus;
+    long long  responseBytes;
+    bool       cacheHit;
 };
 
+char* HS_ArenaAlloc(HS_Arena* arena, int size) {
+    size = (size + 7) & ~7;
+    
+    if (!arena->block || arena->size + size > HS__ArenaBlockSize) {
+        char* chunk = (char*) malloc(sizeof(char*) + size);
+        if (!chunk) return 0;
+        *(char**) chunk = arena->overflow;
+        arena->overflow = chunk;
+        return chunk + sizeof(char*);
+    }
+    
+    char* result = arena->block + arena->size;
+    arena->size += size;
+    return result;
+}
+
+// Frees everything allocated from the arena, keeping its block.
+void HS__ResetArena(HS_Arena* arena) {
+    while (arena->overflow) {
+        char* next = *(char**) arena->overflow;
+        free(arena->overflow);
+        arena->overflow = next;
+    }
+    arena->size = 0;
+}
+
+void HS__AcquireArena(HS_VHost* vhost, HS_Arena* arena) {
+    if (vhost->freeArenaBlocks) {
+        arena->block = vhost->freeArenaBlocks;
+        vhost->freeArenaBlocks = *(char**) arena->block;
+    } else {
+        arena->block = (char*) malloc(HS__ArenaBlockSize);
+    }
+    arena->size = 0;
+}
+
+void HS__ReleaseArena(HS_VHost* vhost, HS_Arena* arena) {
+    HS__ResetArena(arena);
+    if (!arena->block) return;
+    
+    *(char**) arena->block = vhost->freeArenaBlocks;
+    vhost->freeArenaBlocks = arena->block;
+    *arena = {};
+}
+
+// Returns the value of a request header, copied into the request's arena, or
+// 0 if the request doesn't have it.
+const char* HS_GetRequestHeader(HS_HTTPClient* client, lws_token_indexes header) {
+    int size = lws_hdr_total_length(client->socket, header);
+    if (!size) return 0;
+    
+    char* value = HS_ArenaAlloc(&client->arena, size + 1);
+    if (!value || lws_hdr_copy(client->socket, value, size + 1, header) < 0) return 0;
+    return value;
+}
+
 void HS_DelayBodyFree(HS_HTTPClient* client) {
     client->delayBodyFree = true;
 }
@@ -740,6 +2205,7 @@ void HS_DelayBodyFree(HS_HTTPClient* client) {
 void HS_CloseConnection(HS_HTTPClient* client, int closeStatus) {
     client->closeConnection = true;
     client->closeStatus = (http_status) closeStatus;
+    if (closeStatus) client->responseStatus = closeStatus;
     lws_callback_on_writable(client->socket);
 }
 
@@ -756,9 +2222,14 @@ bool HS_AddHTTPHeader(HS_HTTPClient* client, lws_token_indexes header, const cha
 }
 
 bool HS_AddHTTPHeader(HS_HTTPClient* client, const char* header, const char* value) {
-    char buf[128] = {};
-    sprintf(buf, "%s:", header);
-    return 0 == lws_add_http_header_by_name(client->socket, (uint8_t*) buf, (uint8_t*) value, strlen(value), (uint8_t**) &client->headerAt, (uint8_t*) client->headerEnd);
+    char name[128];
+    int nameSize = strlen(header);
+    if (nameSize > (int) sizeof(name)-2) return false;
+    
+    memcpy(name, header, nameSize);
+    name[nameSize] = ':';
+    name[nameSize+1] = 0;
+    return 0 == lws_add_http_header_by_name(client->socket, (uint8_t*) name, (uint8_t*) value, strlen(value), (uint8_t**) &client->headerAt, (uint8_t*) client->headerEnd);
 }
 
 bool HS_AddHTTPHeader(HS_HTTPClient* client, lws_token_indexes header, int value) {
@@ -767,8 +2238,16 @@ bool HS_AddHTTPHeader(HS_HTTPClient* client, lws_token_indexes header, int value
     return HS_AddHTTPHeader(client, header, buf);
 }
 
+bool HS_AddHTTPHeader(HS_HTTPClient* client, lws_token_indexes header, long long value) {
+    char buf[64] = {};
+    sprintf(buf, "%lld", value);
+    return HS_AddHTTPHeader(client, header, buf);
+}
+
 bool HS_AddHTTPHeaderStatus(HS_HTTPClient* client, int status) {
     client->closeStatus = (http_status) status;
+    client->responseStatus = status;
+    if (client->requestTime) client->responseTime = lws_now_usecs();
     return 0 == lws_add_http_header_status(client->socket, status, (uint8_t**) &client->headerAt, (uint8_t*) client->headerEnd);
 }
 
@@ -811,7 +2290,8 @@ bool HS_GetCookieValue(lws* socket, const char* key, char* resultBuffer, int res
     char keyWithEqual[HS__URICap] = {};
     int keyWithEqualSize = sprintf(keyWithEqual, "%s=", key);
     
-    char* at = strtok(cookie, ";");
+    char* state;
+    char* at = HS__strtok_r(cookie, ";", &state);
     while (at && *at == ' ') ++at;
     
     while (at && *at) {
@@ -822,7 +2302,7 @@ bool HS_GetCookieValue(lws* socket, const char* key, char* resultBuffer, int res
             strncpy(resultBuffer, value, resultBufferSize);
             return true;
         } else {
-            at = strtok(0, ";");
+            at = HS__strtok_r(0, ";", &state);
             while (at && *at == ' ') ++at;
         }
     }
@@ -885,7 +2365,8 @@ bool HS_GetUTMParams(lws* socket, HS_UTMParams* result) {
 }
 
 bool HS_ContainsUTM(HS_HTTPClient* client) {
-    return client->utm.source[0] || client->utm.medium[0] || client->utm.campaign[0] || client->utm.content[0] || client->utm.term[0];
+    HS_UTMParams utm;
+    return lws_hdr_total_length(client->socket, WSI_TOKEN_HTTP_URI_ARGS) && HS_GetUTMParams(client->socket, &utm);
 }
 
 void HS_GetURIQueryStringWithExceptions(lws* socket, char* resultBuffer, const char** exceptions, int exceptionsCount) {
@@ -1124,24 +2605,6 @@ void HS_SystemCall(const char* formatString, ...) {
     system(command);
 }
 
-int HS_RmDir(const char *format, ...) {
-    char path[1024];
-    char command[1200];
-    va_list args;
-
-    va_start(args, format);
-    vsnprintf(path, sizeof(path), format, args);
-    va_end(args);
-
-#ifdef _WIN32
-    snprintf(command, sizeof(command), "rmdir /s /q \"%s\" 2>nul", path);
-#else
-    snprintf(command, sizeof(command), "rm -rf \"%s\" 2>/dev/null", path);
-#endif
-
-    return system(command);
-}
-
 int HS_Mkdir(const char *path, int permissions) {
 #ifdef _WIN32
     return _mkdir(path);
@@ -1156,8 +2619,9 @@ void HS_CreateFilePath(const char* root, const char* path) {
     char dirPath[HS__FilePathCap] = {};
     strcpy(dirPath, root);
     
-    char* pathComponent = strtok(pathBuffer, "/");
-    char* nextPathComponent = strtok(0, "/");
+    char* state;
+    char* pathComponent = HS__strtok_r(pathBuffer, "/", &state);
+    char* nextPathComponent = HS__strtok_r(0, "/", &state);
     
     while (nextPathComponent) {
         strcat(dirPath, "/");
@@ -1166,7 +2630,7 @@ void HS_CreateFilePath(const char* root, const char* path) {
             HS_Mkdir(dirPath, 0777);
         }
         pathComponent = nextPathComponent;
-        nextPathComponent = strtok(0, "/");
+        nextPathComponent = HS__strtok_r(0, "/", &state);
     }
 }
 
@@ -1184,153 +2648,555 @@ int HS_GetFileSize(FILE* file) {
     return fsize;
 }
 
-void HS_SaveFile(char* content, int size, const char* formatString, ...) {
-    char path[HS__FilePathCap] = {};
-    va_list argList;
-    va_start(argList, formatString);
-    vsprintf(path, formatString, argList);
-    va_end(argList);
-    
-    FILE* file = fopen(path, "w");
-    if (file) {
-        fwrite(content, 1, size, file);
-        fclose(file);
-    } else {
-        // TODO: handle error
-    }
+long long HS_GetLargeFileSize(FILE* file) {
+#ifdef _WIN32
+    _fseeki64(file, 0, SEEK_END);
+    long long fsize = _ftelli64(file);
+    _fseeki64(file, 0, SEEK_SET);
+#else
+    fseeko(file, 0, SEEK_END);
+    long long fsize = ftello(file);
+    fseeko(file, 0, SEEK_SET);
+#endif
+    return fsize;
 }
 
-int HS_Replace(char* outBuffer, char* inBuffer, int inLength, const char* searchedString, int searchedLength, const char* replacementString, int replacementLength) {
-    int i = 0;
-    int j = 0;
-    while (i < inLength) {
-        if (i < inLength - searchedLength && memcmp(&inBuffer[i], searchedString, searchedLength) == 0) {
-            memcpy(&outBuffer[j], replacementString, replacementLength);
-            i += searchedLength;
-            j += replacementLength;
-        } else {
-            outBuffer[j] = inBuffer[i];
-            ++i;
-            ++j;
+bool HS_SeekFile(FILE* file, long long offset) {
+#ifdef _WIN32
+    return _fseeki64(file, offset, SEEK_SET) == 0;
+#else
+    return fseeko(file, offset, SEEK_SET) == 0;
+#endif
+}
+
+time_t HS_GetFileModifiedTime(FILE* file) {
+    struct stat st;
+    if (fstat(fileno(file), &st) != 0) return 0;
+    return st.st_mtime;
+}
+
+HS_FileMapping* HS__FindFileMapping(HS_Server* server, const char* path, long long size, time_t modifiedTime) {
+    for (int i = 0; server->fileMappings && i < server->fileMappingsCount; ++i) {
+        HS_FileMapping* mapping = &server->fileMappings[i];
+        if (mapping->refCount && !mapping->truncated && mapping->size == size && mapping->modifiedTime == modifiedTime && strcmp(mapping->path, path)==0) {
+            return mapping;
         }
     }
-    outBuffer[j] = 0;
-    return j;
+    return 0;
 }
 
-int HS_Replace(char* outBuffer, char* inBuffer, int inLength, const char* searchedString, const char* replacementString) {
-    int searchedLength = strlen(searchedString);
-    int replacementLength = strlen(replacementString);
-    return HS_Replace(outBuffer, inBuffer, inLength, searchedString, searchedLength, replacementString, replacementLength);
+// Maps the file at `path` into `mapping`, without registering it with a
+// server, so it can be called from any thread. Fails for the files that
+// shouldn't be mapped (small or empty, Windows).
+bool HS__MapFile(const char* path, HS_FileMapping* mapping) {
+#ifdef _WIN32
+    return false;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0 || st.st_size < HS__FileMappingMinSize || st.st_size > INT_MAX) return false;
+    if (snprintf(mapping->path, sizeof(mapping->path), "%s", path) >= (int) sizeof(mapping->path)) return false;
+    
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+    
+    void* data = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    
+    mapping->fd = fd;
+    mapping->data = (char*) data;
+    mapping->size = st.st_size;
+    mapping->modifiedTime = st.st_mtime;
+    mapping->truncated = false;
+    mapping->refCount = 0;
+    return true;
+#endif
 }
 
-void HS_PushURIMapping(HS_Server* server, const char* vhostName, const char* uri, const char* resource) {
-    HS_VHost* vhost = HS_GetVHost(server, vhostName);
-    HS_URIMapEntry& entry = vhost->uriMap[vhost->uriMapSize++];
-    strcpy(entry.uri, uri);
-    entry.uriSize = strlen(uri);
-    strcpy(entry.resource, resource);
+void HS__UnmapFile(HS_FileMapping* mapping) {
+#ifndef _WIN32
+    munmap(mapping->data, mapping->size);
+    close(mapping->fd);
+#endif
+}
 
-    if (HS_StartsWith(entry.resource, "/$lang/") && !vhost->defaultContentLanguage[0]) {
-        fprintf(stderr, "[WARN] %s: localized URI mapping is being used, but 'default-content-language' was not set\n", vhostName);
+// Takes over a mapping made by HS__MapFile. If the server already maps the
+// same version of the file, that one is shared and `mapped` is unmapped.
+// Returns 0 (and unmaps) if the table is full.
+HS_FileMapping* HS__AddFileMapping(HS_Server* server, HS_FileMapping* mapped) {
+#ifdef _WIN32
+    return 0;
+#else
+    HS_FileMapping* mapping = HS__FindFileMapping(server, mapped->path, mapped->size, mapped->modifiedTime);
+    if (mapping) {
+        HS__UnmapFile(mapped);
+        ++mapping->refCount;
+        return mapping;
     }
+    
+    if (!server->fileMappings) {
+        server->fileMappings = (HS_FileMapping*) calloc(1, HS__FileMappingsCap*sizeof(HS_FileMapping));
+    }
+    
+    HS_FileMapping* freeSlot = 0;
+    for (int i = 0; i < server->fileMappingsCount && !freeSlot; ++i) {
+        if (!server->fileMappings[i].refCount) freeSlot = &server->fileMappings[i];
+    }
+    
+    if (!freeSlot) {
+        if (server->fileMappingsCount == HS__FileMappingsCap) {
+            HS__UnmapFile(mapped);
+            return 0;
+        }
+        freeSlot = &server->fileMappings[server->fileMappingsCount++];
+    }
+    
+    *freeSlot = *mapped;
+    freeSlot->refCount = 1;
+    return freeSlot;
+#endif
 }
 
-void HS_ClearURIMapping(HS_Server* server, const char* vhostName) {
-    HS_VHost* vhost = HS_GetVHost(server, vhostName);
-    vhost->uriMapSize = 0;
+// Returns a read-only mapping of the file at `path`, shared with every other
+// cache entry (of any vhost) that maps the same version of that file. Returns
+// 0 if the file shouldn't be mapped (small or empty file, table full, Windows),
+// in which case the caller should load the file into memory instead.
+HS_FileMapping* HS_AcquireFileMapping(HS_Server* server, const char* path) {
+#ifdef _WIN32
+    return 0;
+#else
+    struct stat st;
+    if (stat(path, &st) != 0) return 0;
+    
+    HS_FileMapping* mapping = HS__FindFileMapping(server, path, st.st_size, st.st_mtime);
+    if (mapping) {
+        ++mapping->refCount;
+        return mapping;
+    }
+    
+    HS_FileMapping mapped;
+    return HS__MapFile(path, &mapped) ? HS__AddFileMapping(server, &mapped) : 0;
+#endif
 }
 
-struct HS_FileChunk {
-    char* begin;
-    int   size;
-};
+void HS_ReleaseFileMapping(HS_FileMapping* mapping) {
+#ifndef _WIN32
+    if (--mapping->refCount == 0) {
+        munmap(mapping->data, mapping->size);
+        close(mapping->fd);
+        *mapping = {};
+    }
+#endif
+}
 
-void HS_DoSSI(FILE* file, const char* rootDir, char* savePath) {
-    int   fileSize = HS_GetFileSize(file);
-    char* fileContent = (char*) calloc(1, fileSize);
-    fread(fileContent, fileSize, 1, file);
+void HS_SaveFile(char* content, int size, const char* formatString, ...) {
+    char path[HS__FilePathCap] = {};
+    va_list argList;
+    va_start(argList, formatString);
+    vsprintf(path, formatString, argList);
+    va_end(argList);
     
-    char* mainFileEnd = fileContent + fileSize;
+    FILE* file = fopen(path, "w");
+    if (file) {
+        fwrite(content, 1, size, file);
+        fclose(file);
+    } else {
+        // TODO: handle error
+    }
+}
+
+// Multi-pattern replacement
+//---------------------------
+// HS_Matcher finds any of a set of patterns in a single pass over its input.
+// It is an Aho-Corasick automaton compiled to a full transition table, with a
+// first-byte prefilter (memchr when every pattern starts with the same byte)
+// to skip the text that can't start a match. Matches are reported as soon as
+// they end and never overlap; patterns are expected not to overlap each other
+// either, like the placeholders of a template.
+
+#define HS__TemplatePlaceholdersCap 32
+
+struct HS_Matcher {
+    int* transitions;  // 256 per state, state 0 is the root
+    int* matches;      // per state: pattern ending there, or -1
+    int* patternSizes;
+    int  patternsCount;
+    int  statesCount;
+    
+    bool    firstBytes[256]; // bytes a pattern starts with
+    int     firstBytesCount;
+    uint8_t firstByte;
+};
+
+HS_Matcher* HS_CreateMatcher(const char** patterns, int patternsCount) {
+    HS_Matcher* matcher = (HS_Matcher*) calloc(1, sizeof(HS_Matcher));
+    matcher->patternsCount = patternsCount;
+    matcher->patternSizes = (int*) calloc(patternsCount, sizeof(int));
     
-    int at = 0;
+    int statesCap = 1;
+    for (int p = 0; p < patternsCount; ++p) {
+        matcher->patternSizes[p] = strlen(patterns[p]);
+        statesCap += matcher->patternSizes[p];
+    }
     
-    char* parsedContent = 0;
-    int   parsedContentSize = fileSize;
+    matcher->transitions = (int*) malloc(statesCap*256*sizeof(int));
+    matcher->matches = (int*) malloc(statesCap*sizeof(int));
+    memset(matcher->transitions, -1, statesCap*256*sizeof(int));
+    memset(matcher->matches, -1, statesCap*sizeof(int));
+    matcher->statesCount = 1;
     
-    HS_FileChunk mainFileChunks[16] = {};
-    int mainFileChunksCount = 0;
+    // Trie
+    for (int p = 0; p < patternsCount; ++p) {
+        if (!matcher->patternSizes[p]) continue;
+        int state = 0;
+        
+        for (int i = 0; i < matcher->patternSizes[p]; ++i) {
+            int* next = &matcher->transitions[state*256 + (uint8_t) patterns[p][i]];
+            if (*next < 0) *next = matcher->statesCount++;
+            state = *next;
+        }
+        
+        if (matcher->matches[state] < 0) matcher->matches[state] = p;
+        
+        uint8_t firstByte = patterns[p][0];
+        if (!matcher->firstBytes[firstByte]) ++matcher->firstBytesCount;
+        matcher->firstBytes[firstByte] = true;
+        matcher->firstByte = firstByte;
+    }
     
-    HS_FileChunk includedFiles[16] = {};
-    int includedFilesCount = 0;
+    // Failure links, breadth first, folded into the transitions. A state with
+    // no pattern of its own reports the longest one ending at its failure state.
+    int* failures = (int*) calloc(matcher->statesCount, sizeof(int));
+    int* queue = (int*) calloc(matcher->statesCount, sizeof(int));
+    int queueBegin = 0;
+    int queueEnd = 0;
+    
+    for (int c = 0; c < 256; ++c) {
+        int* next = &matcher->transitions[c];
+        if (*next < 0) {
+            *next = 0;
+        } else {
+            queue[queueEnd++] = *next;
+        }
+    }
     
-    while (at < fileSize) {
-        HS_FileChunk chunk = {fileContent + at};
-        int at0 = at;
-        const char* ssiPrefix = "<!--#include virtual=\"";
+    while (queueBegin < queueEnd) {
+        int state = queue[queueBegin++];
         
-        while (at < fileSize && !HS_Consume(fileContent, mainFileEnd, &at, ssiPrefix)) ++at;
-        
-        if (at < fileSize) {
-            char* includedFilePathBegin = fileContent + at;
-            while (at < fileSize && fileContent[at] != '\"') ++at;
-            int includedFilePathSize = (fileContent + at) - includedFilePathBegin;
-            char includedFilePath[HS__FilePathCap] = {};
-            memcpy(includedFilePath, includedFilePathBegin, includedFilePathSize);
+        for (int c = 0; c < 256; ++c) {
+            int* next = &matcher->transitions[state*256 + c];
+            int fallback = matcher->transitions[failures[state]*256 + c];
             
-            if (includedFilePathSize && at < fileSize) {
-                while (at < fileSize && !HS_Consume(fileContent, mainFileEnd, &at, "-->")) ++at;
-                
-                if (at < fileSize) {
-                    char includedFileFullPath[HS__FilePathCap] = {};
-                    sprintf(includedFileFullPath, "%s%.*s", rootDir, includedFilePathSize, includedFilePath);
-                    FILE* includedFile = fopen(includedFileFullPath, "rb");
-                    
-                    if (includedFile) {
-                        HS_FileChunk incChunk = {};
-                        incChunk.size = HS_GetFileSize(includedFile);
-                        incChunk.begin = (char*) calloc(1, incChunk.size);
-                        fread(incChunk.begin, incChunk.size, 1, includedFile);
-                        fclose(includedFile);
-                        
-                        parsedContentSize += incChunk.size;
-                        includedFiles[includedFilesCount++] = incChunk;
-                    } else {
-                        // TODO: failed to open included file
-                    }
-                } else {
-                    // TODO: Include directive termination '-->' not found
-                }
-                
+            if (*next < 0) {
+                *next = fallback;
+            } else {
+                failures[*next] = fallback;
+                if (matcher->matches[*next] < 0) matcher->matches[*next] = matcher->matches[fallback];
+                queue[queueEnd++] = *next;
+            }
+        }
+    }
+    
+    free(failures);
+    free(queue);
+    return matcher;
+}
+
+void HS_DestroyMatcher(HS_Matcher* matcher) {
+    if (!matcher) return;
+    free(matcher->transitions);
+    free(matcher->matches);
+    free(matcher->patternSizes);
+    free(matcher);
+}
+
+// Returns the offset of the first match in `input` starting the search at
+// `from`, and sets the index of the matched pattern, or returns -1.
+int HS_FindMatch(HS_Matcher* matcher, const char* input, int inputSize, int from, int* pattern) {
+    int state = 0;
+    
+    for (int i = from; i < inputSize; ++i) {
+        if (state == 0) {
+            if (matcher->firstBytesCount == 1) {
+                const char* next = (const char*) memchr(input + i, matcher->firstByte, inputSize - i);
+                if (!next) return -1;
+                i = next - input;
+            } else {
+                while (i < inputSize && !matcher->firstBytes[(uint8_t) input[i]]) ++i;
+                if (i == inputSize) return -1;
             }
         }
         
-        chunk.size = at - at0;
-        mainFileChunks[mainFileChunksCount++] = chunk;
+        state = matcher->transitions[state*256 + (uint8_t) input[i]];
+        
+        if (matcher->matches[state] >= 0) {
+            *pattern = matcher->matches[state];
+            return i + 1 - matcher->patternSizes[*pattern];
+        }
     }
     
-    parsedContent = (char*) calloc(1, parsedContentSize);
+    return -1;
+}
+
+// Templates
+//-----------
+// A template is a text split once at its placeholders, so rendering it is a
+// sequence of copies whose total size is known up front.
+
+struct HS_TemplateSegment {
+    int offset;
+    int size;
+    int placeholder; // -1 for text of the template
+};
+
+struct HS_Template {
+    char* content;
+    int   contentSize;
+    
+    HS_TemplateSegment* segments;
+    int segmentsCount;
+    int placeholdersCount;
     
-    int caret = 0;
+    char   path[HS__FilePathCap]; // for templates loaded from a file
+    time_t modifiedTime;
+};
+
+HS_Template* HS__CompileTemplate(const char* content, int contentSize, HS_Matcher* matcher) {
+    HS_Template* tmpl = (HS_Template*) calloc(1, sizeof(HS_Template));
+    tmpl->content = (char*) malloc(contentSize + 1);
+    memcpy(tmpl->content, content, contentSize);
+    tmpl->content[contentSize] = 0;
+    tmpl->contentSize = contentSize;
+    tmpl->placeholdersCount = matcher->patternsCount;
+    
+    int segmentsCap = 0;
+    int at = 0;
     
-    for (int i = 0; i < includedFilesCount; ++i) {
-        HS_FileChunk& mainChunk = mainFileChunks[i];
-        HS_FileChunk& incChunk = includedFiles[i];
+    while (at <= contentSize) {
+        int placeholder = -1;
+        int match = HS_FindMatch(matcher, content, contentSize, at, &placeholder);
+        int textEnd = match < 0 ? contentSize : match;
+        
+        if (tmpl->segmentsCount + 2 > segmentsCap) {
+            segmentsCap = segmentsCap ? 2*segmentsCap : 16;
+            tmpl->segments = (HS_TemplateSegment*) realloc(tmpl->segments, segmentsCap*sizeof(HS_TemplateSegment));
+        }
+        
+        if (textEnd > at) {
+            tmpl->segments[tmpl->segmentsCount++] = {at, textEnd - at, -1};
+        }
+        if (match < 0) break;
         
-        memcpy(parsedContent + caret, mainChunk.begin, mainChunk.size);
-        caret += mainChunk.size;
-        memcpy(parsedContent + caret, incChunk.begin, incChunk.size);
-        caret += incChunk.size;
+        tmpl->segments[tmpl->segmentsCount++] = {match, matcher->patternSizes[placeholder], placeholder};
+        at = match + matcher->patternSizes[placeholder];
+    }
+    
+    return tmpl;
+}
+
+HS_Template* HS_CompileTemplate(const char* content, int contentSize, const char** placeholders, int placeholdersCount) {
+    if (placeholdersCount > HS__TemplatePlaceholdersCap) return 0;
+    
+    HS_Matcher* matcher = HS_CreateMatcher(placeholders, placeholdersCount);
+    HS_Template* tmpl = HS__CompileTemplate(content, contentSize, matcher);
+    HS_DestroyMatcher(matcher);
+    return tmpl;
+}
+
+HS_Template* HS_LoadTemplate(const char* path, const char** placeholders, int placeholdersCount) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return 0;
+    
+    int size = HS_GetFileSize(file);
+    char* content = (char*) malloc(size + 1);
+    fread(content, size, 1, file);
+    time_t modifiedTime = HS_GetFileModifiedTime(file);
+    fclose(file);
+    
+    HS_Template* tmpl = HS_CompileTemplate(content, size, placeholders, placeholdersCount);
+    free(content);
+    
+    if (tmpl) {
+        snprintf(tmpl->path, HS__FilePathCap, "%s", path);
+        tmpl->modifiedTime = modifiedTime;
+    }
+    return tmpl;
+}
+
+void HS_DestroyTemplate(HS_Template* tmpl) {
+    if (!tmpl) return;
+    free(tmpl->content);
+    free(tmpl->segments);
+    free(tmpl);
+}
+
+// Writes the template into `output`, with the placeholders replaced by
+// `values` (in the order the placeholders were given). Returns the size of
+// the output, which is all that's computed when `output` is 0.
+int HS_RenderTemplate(HS_Template* tmpl, const char** values, char* output) {
+    int valueSizes[HS__TemplatePlaceholdersCap];
+    for (int i = 0; i < tmpl->placeholdersCount; ++i) {
+        valueSizes[i] = strlen(values[i]);
+    }
+    
+    int size = 0;
+    
+    for (int i = 0; i < tmpl->segmentsCount; ++i) {
+        HS_TemplateSegment& segment = tmpl->segments[i];
+        const char* data = segment.placeholder < 0 ? tmpl->content + segment.offset : values[segment.placeholder];
+        int dataSize = segment.placeholder < 0 ? segment.size : valueSizes[segment.placeholder];
         
-        free(incChunk.begin);
+        if (output) memcpy(output + size, data, dataSize);
+        size += dataSize;
+    }
+    
+    return size;
+}
+
+struct HS_Replacement {
+    const char* replaced;
+    const char* replacement;
+    int replacedSize;
+    int replacementSize;
+};
+
+// Matchers of the pattern sets HS_Replace was called with, built once per
+// set and kept for the life of the process. They are never modified once
+// built, so any thread can use them.
+#define HS__SharedMatchersCap 16
+
+struct HS__SharedMatcher {
+    uint32_t    hash;
+    char*       patterns; // each 0-terminated
+    int         patternsSize;
+    HS_Matcher* matcher;
+};
+
+static HS__SharedMatcher HS__SharedMatchers[HS__SharedMatchersCap];
+static int HS__SharedMatchersCount;
+static pthread_mutex_t HS__SharedMatchersMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Returns the shared matcher of patterns, or 0 when there's no room left for
+// another one.
+HS_Matcher* HS__GetSharedMatcher(const char** patterns, int patternsCount) {
+    char key[HS_KILO_BYTES(2)];
+    int keySize = 0;
+    
+    for (int p = 0; p < patternsCount; ++p) {
+        int size = strlen(patterns[p])+1;
+        if (keySize + size > (int) sizeof(key)) return 0;
+        memcpy(key + keySize, patterns[p], size);
+        keySize += size;
+    }
+    uint32_t hash = HS__HashRulePattern(key, keySize);
+    
+    pthread_mutex_lock(&HS__SharedMatchersMutex);
+    HS_Matcher* matcher = 0;
+    
+    for (int i = 0; i < HS__SharedMatchersCount && !matcher; ++i) {
+        HS__SharedMatcher& shared = HS__SharedMatchers[i];
+        if (shared.hash == hash && shared.patternsSize == keySize && memcmp(shared.patterns, key, keySize)==0) {
+            matcher = shared.matcher;
+        }
+    }
+    
+    if (!matcher && HS__SharedMatchersCount < HS__SharedMatchersCap) {
+        HS__SharedMatcher& shared = HS__SharedMatchers[HS__SharedMatchersCount++];
+        shared.hash = hash;
+        shared.patterns = (char*) malloc(keySize);
+        memcpy(shared.patterns, key, keySize);
+        shared.patternsSize = keySize;
+        shared.matcher = matcher = HS_CreateMatcher(patterns, patternsCount);
+    }
+    
+    pthread_mutex_unlock(&HS__SharedMatchersMutex);
+    return matcher;
+}
+
+// Replaces the `replaced` strings of `reps` (terminated by an empty one) in
+// inBuffer, into outBuffer of outCap bytes. Like snprintf, returns the size of
+// the result, which is only written when it fits with its terminating 0. Returns
+// -1 when there are more than HS__TemplatePlaceholdersCap strings to replace.
+int HS_Replace(char* outBuffer, int outCap, char* inBuffer, int inLength, HS_Replacement* reps) {
+    const char* placeholders[HS__TemplatePlaceholdersCap];
+    const char* values[HS__TemplatePlaceholdersCap];
+    int repsCount = 0;
+    
+    for (; reps[repsCount].replaced; ++repsCount) {
+        if (repsCount == HS__TemplatePlaceholdersCap) return -1;
+        placeholders[repsCount] = reps[repsCount].replaced;
+        values[repsCount] = reps[repsCount].replacement;
     }
     
-    memcpy(parsedContent + caret, mainFileChunks[mainFileChunksCount-1].begin, mainFileChunks[mainFileChunksCount-1].size);
+    HS_Matcher* matcher = HS__GetSharedMatcher(placeholders, repsCount);
+    HS_Matcher* ownMatcher = matcher ? 0 : HS_CreateMatcher(placeholders, repsCount);
+    
+    HS_Template* tmpl = HS__CompileTemplate(inBuffer, inLength, matcher ? matcher : ownMatcher);
+    int size = HS_RenderTemplate(tmpl, values, 0);
+    if (size < outCap) {
+        HS_RenderTemplate(tmpl, values, outBuffer);
+        outBuffer[size] = 0;
+    }
+    HS_DestroyTemplate(tmpl);
+    HS_DestroyMatcher(ownMatcher);
+    return size;
+}
+
+// Single pattern version, which can replace in place when the replacement
+// isn't longer than the searched string.
+int HS_Replace(char* outBuffer, char* inBuffer, int inLength, const char* searchedString, int searchedLength, const char* replacementString, int replacementLength) {
+    int i = 0;
+    int j = 0;
     
-    HS_SaveFile(parsedContent, parsedContentSize, savePath);
+    while (i < inLength) {
+        const char* candidate = searchedLength ? (const char*) memchr(inBuffer + i, searchedString[0], inLength - i) : 0;
+        int textEnd = candidate ? candidate - inBuffer : inLength;
+        
+        memmove(outBuffer + j, inBuffer + i, textEnd - i);
+        j += textEnd - i;
+        i = textEnd;
+        if (!candidate) break;
+        
+        if (inLength - i >= searchedLength && memcmp(inBuffer + i, searchedString, searchedLength) == 0) {
+            memmove(outBuffer + j, replacementString, replacementLength);
+            i += searchedLength;
+            j += replacementLength;
+        } else {
+            outBuffer[j++] = inBuffer[i++];
+        }
+    }
     
-    free(parsedContent);
-    free(fileContent);
+    outBuffer[j] = 0;
+    return j;
+}
+
+int HS_Replace(char* outBuffer, char* inBuffer, int inLength, const char* searchedString, const char* replacementString) {
+    int searchedLength = strlen(searchedString);
+    int replacementLength = strlen(replacementString);
+    return HS_Replace(outBuffer, inBuffer, inLength, searchedString, searchedLength, replacementString, replacementLength);
+}
+
+void HS_PushURIMapping(HS_Server* server, const char* vhostName, const char* uri, const char* resource) {
+    HS_VHost* vhost = HS_GetVHost(server, vhostName);
+    HS_AddRule(&vhost->uriMap, uri, resource);
+
+    if (strncmp(resource, "/$lang/", 7)==0 && !vhost->defaultContentLanguage[0]) {
+        fprintf(stderr, "[WARN] %s: localized URI mapping is being used, but 'default-content-language' was not set\n", vhostName);
+    }
+}
+
+void HS_ClearURIMapping(HS_Server* server, const char* vhostName) {
+    HS_VHost* vhost = HS_GetVHost(server, vhostName);
+    HS_ClearRules(&vhost->uriMap);
+}
+
+// Call after a batch of HS_PushURIMapping / HS_ClearURIMapping calls on a
+// running server.
+void HS_CompileURIMapping(HS_Server* server, const char* vhostName) {
+    HS_VHost* vhost = HS_GetVHost(server, vhostName);
+    HS_CompileRules(&vhost->uriMap);
 }
 
 HS_FileMapEntry* HS_GetFileByPath(HS_FileMapEntry* map, int mapSize, char* path) {
@@ -1427,6 +3293,60 @@ void HS_SetVHostPort(HS_Server* server, const char* vhostName, int port) {
     HS_UpdateVHostHostString(server, vhostName);
 }
 
+// Listens on a Unix domain socket instead of the TCP port, e.g. behind a
+// reverse proxy on the same machine. A path starting with '@' is an abstract
+// socket (Linux), which has no owner nor mode. The owner is "user:group".
+bool HS_SetVHostUnixSocket(HS_Server* server, const char* vhostName, const char* path, int mode=0, const char* owner=0) {
+#ifdef LWS_WITH_UNIX_SOCK
+    HS_VHost* vhost = HS_GetVHost(server, vhostName);
+    
+    if (strlen(path) >= HS__UnixSocketPathCap || (owner && strlen(owner) >= HS__HostNameCap)) {
+        lwsl_err("VHost=%s | Unix socket path or owner too long: %s\n", vhostName, path);
+        return false;
+    }
+    
+    strcpy(vhost->unixSocketPath, path);
+    vhost->unixSocketMode = mode;
+    vhost->lwsContextInfo.options |= LWS_SERVER_OPTION_UNIX_SOCK;
+    vhost->lwsContextInfo.iface = vhost->unixSocketPath;
+    
+    if (owner) {
+        strcpy(vhost->unixSocketOwner, owner);
+        vhost->lwsContextInfo.unix_socket_perms = vhost->unixSocketOwner;
+    }
+    
+    return true;
+#else
+    lwsl_err("VHost=%s | Unix sockets are not supported by this build\n", vhostName);
+    return false;
+#endif
+}
+
+// Limits each client address to maxConnections concurrent connections (HTTP/2
+// streams count as connections), maxRequestsPerSecond requests and
+// maxUpgradesPerMinute WebSocket upgrades. 0 means unlimited.
+void HS_SetIPLimits(HS_Server* server, const char* vhostName, int maxConnections, int maxRequestsPerSecond, int maxUpgradesPerMinute, bool exemptLoopback=false) {
+    HS_VHost* vhost = HS_GetVHost(server, vhostName);
+    vhost->ipMaxConnections = maxConnections;
+    vhost->ipMaxRequestsPerSecond = maxRequestsPerSecond;
+    vhost->ipMaxUpgradesPerMinute = maxUpgradesPerMinute;
+    vhost->ipLimitsExemptLoopback = exemptLoopback;
+}
+
+bool HS__ParseIPAddress(const char* text, unsigned char* address);
+
+// Takes the client addresses of the vhost's limits from the X-Forwarded-For
+// and X-Real-IP headers of the requests coming from address.
+bool HS_AddIPTrustedProxy(HS_Server* server, const char* vhostName, const char* address) {
+    HS_VHost* vhost = HS_GetVHost(server, vhostName);
+    if (vhost->ipTrustedProxiesCount >= HS__IPTrustedProxiesCap || !HS__ParseIPAddress(address, vhost->ipTrustedProxies[vhost->ipTrustedProxiesCount])) {
+        lwsl_err("VHost=%s | Can't trust proxy %s\n", vhostName, address);
+        return false;
+    }
+    ++vhost->ipTrustedProxiesCount;
+    return true;
+}
+
 void HS_SetHTTPSessionDataSize(HS_Server* server, const char* vhostName, int sessionDataSize) {
     HS_VHost* vhost = HS_GetVHost(server, vhostName);
     vhost->sessionDataSize = sessionDataSize;
@@ -1473,8 +3393,11 @@ bool HS_ShouldAddAllowOriginHeader(HS_HTTPClient* client, char* allowedOrigin) {
     HS_VHost* vhost = (HS_VHost*) lws_vhost_user(vh);
     
     char* allowedOriginTemplate = HS_GetAllowedOriginTemplate(vhost, client->uri);
+    if (!allowedOriginTemplate) return false;
+    
+    char* origin = (char*) HS_GetRequestHeader(client, WSI_TOKEN_ORIGIN);
     
-    if (allowedOriginTemplate && HS_IsOriginAllowed(allowedOriginTemplate, client->origin, allowedOrigin)) {
+    if (origin && HS_IsOriginAllowed(allowedOriginTemplate, origin, allowedOrigin)) {
         return true;
     }
     
@@ -1491,580 +3414,3720 @@ bool HS_MaybeAddAllowOriginHeader(HS_HTTPClient* client) {
     return false;
 }
 
-int HS_GetFileByURI(HS_CallbackArgs* args) {
-    HS_VHost* server = HS_GetVHost(args);
-    HS_HTTPClient* client = HS_GetHTTPClientData(args);
-    
-    int callbackResult = 0;
-    
-    http_status httpStatus = HTTP_STATUS_OK;
-    const char* mimeType = 0;
-    char defaultCacheControl[] = "no-cache, no-store, must-revalidate";
-    
-    char* cacheControl = (char*) defaultCacheControl;
-    int cacheControlSize = sizeof(defaultCacheControl)-1;
-    
-    if (HS_GetUTMParams(args->socket, &client->utm)) {
-        char redirURL[HS__URICap] = {};
-        HS_GetHTTPSURLWithoutUTMParams(args->socket, server->host, redirURL, sizeof(redirURL));
-        HS_Redirect(client, redirURL, 307);
-        
-        if (server->verbosity) {
-            printf("UTMParams | utm_source=%s | utm_medium=%s | utm_campaign=%s | utm_content=%s | utm_term=%s", client->utm.source, client->utm.medium, client->utm.campaign, client->utm.content, client->utm.term);
-        }
-        
-        return 0;
-    }
-    
-    HS_FileMapEntry* fileEntry = HS_GetFileEntryByURI(server->loadedFiles, server->loadedFilesCount, client->uri);
-    
+// Byte ranges
+//--------------
+void HS_FormatETag(char* result, long long size, time_t modifiedTime) {
+    sprintf(result, "\"%llx-%llx\"", size, (long long) modifiedTime);
+}
+
+// Parses a Range header value (e.g. "bytes=0-499, 1000-, -500") against a body
+// of `bodySize` bytes. Returns the number of satisfiable ranges written to
+// `ranges`, 0 if the header is malformed or asks for too many ranges (it should
+// then be ignored), or -1 if none of the ranges can be satisfied.
+int HS_ParseRangeHeader(const char* header, long long bodySize, HS_ByteRange* ranges, int rangesCap) {
+    if (strncmp(header, "bytes=", 6) != 0) return 0;
+
+    char* at = (char*) header + 6;
+    int count = 0;
+    bool parsedAny = false;
+
+    while (*at) {
+        while (*at == ' ' || *at == '\t') ++at;
+
+        long long first = -1;
+        long long last = -1;
+
+        if (isdigit(*at)) first = strtoll(at, &at, 10);
+        if (*at != '-') return 0;
+        ++at;
+        if (isdigit(*at)) last = strtoll(at, &at, 10);
+
+        while (*at == ' ' || *at == '\t') ++at;
+        if (*at == ',') {
+            ++at;
+        } else if (*at) {
+            return 0;
+        }
+
+        if (first < 0 && last < 0) return 0;
+        if (first >= 0 && last >= 0 && last < first) return 0;
+        parsedAny = true;
+
+        HS_ByteRange range = {};
+        if (first < 0) {
+            // Suffix range: the last `last` bytes
+            if (last == 0 || bodySize == 0) continue;
+            range.first = last >= bodySize ? 0 : bodySize - last;
+            range.last = bodySize - 1;
+        } else {
+            if (first >= bodySize) continue;
+            range.first = first;
+            range.last = (last < 0 || last >= bodySize) ? bodySize - 1 : last;
+        }
+
+        if (count == rangesCap) return 0;
+        ranges[count++] = range;
+    }
+
+    if (!parsedAny) return 0;
+    return count ? count : -1;
+}
+
+int HS__FormatPartHeader(HS_HTTPClient* client, int rangeIndex, long long bodySize, char* buffer, int bufferSize) {
+    if (rangeIndex < client->rangesCount) {
+        HS_ByteRange& range = client->ranges[rangeIndex];
+        return snprintf(buffer, bufferSize, "\r\n--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n", client->boundary, client->mimeType, range.first, range.last, bodySize);
+    } else {
+        return snprintf(buffer, bufferSize, "\r\n--%s--\r\n", client->boundary);
+    }
+}
+
+long long HS__GetBodySize(HS_HTTPClient* client) {
+    return client->streamFile ? client->streamSize : client->fileSize;
+}
+
+long long HS__GetRangedBodyLength(HS_HTTPClient* client, long long bodySize) {
+    long long result = 0;
+    for (int i = 0; i < client->rangesCount; ++i) {
+        result += client->ranges[i].last - client->ranges[i].first + 1;
+    }
+
+    if (client->rangesCount > 1) {
+        for (int i = 0; i <= client->rangesCount; ++i) {
+            result += HS__FormatPartHeader(client, i, bodySize, 0, 0);
+        }
+    }
+
+    return result;
+}
+
+// Decides between a full (200), partial (206) or unsatisfiable (416) response,
+// based on the Range and If-Range request headers.
+http_status HS__PrepareByteRanges(HS_HTTPClient* client, long long bodySize, const char* etag, const char* lastModified) {
+    char range[512] = {};
+    if (lws_hdr_copy(client->socket, range, sizeof(range), WSI_TOKEN_HTTP_RANGE) <= 0) {
+        return HTTP_STATUS_OK;
+    }
+
+    char ifRange[128] = {};
+    if (lws_hdr_copy(client->socket, ifRange, sizeof(ifRange), WSI_TOKEN_HTTP_IF_RANGE) > 0) {
+        if (strcmp(ifRange, etag) != 0 && strcmp(ifRange, lastModified) != 0) {
+            return HTTP_STATUS_OK; // Representation changed, send it whole
+        }
+    }
+
+    int count = HS_ParseRangeHeader(range, bodySize, client->ranges, HS__ByteRangesCap);
+
+    if (count == 0) {
+        return HTTP_STATUS_OK;
+    } else if (count < 0) {
+        return HTTP_STATUS_REQ_RANGE_NOT_SATISFIABLE;
+    }
+
+    client->rangesCount = count;
+    client->rangeIndex = 0;
+    client->rangeAt = 0;
+    client->partHeaderPending = count > 1;
+
+    if (count > 1) {
+        sprintf(client->boundary, "HS%08x%08x", client->id, (unsigned) time(0));
+    }
+
+    return HTTP_STATUS_PARTIAL_CONTENT;
+}
+
+void HS__FreeFileEntry(HS_FileMapEntry* entry) {
+    if (entry->mapping) {
+        HS_ReleaseFileMapping(entry->mapping);
+    } else if (entry->fileBuffer) {
+        free(entry->fileBuffer);
+    }
+    if (entry->includes) free(entry->includes);
+    if (entry->headerBlocks[0]) free(entry->headerBlocks[0]);
+    if (entry->headerBlocks[1]) free(entry->headerBlocks[1]);
+    *entry = {};
+}
+
+// Returns an unused slot of the vhost's file cache, or 0 if it is full. A slot
+// past loadedFilesCount is only claimed once the caller bumps the count.
+HS_FileMapEntry* HS__GetFreeFileEntry(HS_VHost* server) {
+    if (!server->loadedFiles) return 0;
+    
+    for (int i = 0; i < server->loadedFilesCount; ++i) {
+        HS_FileMapEntry* entry = &server->loadedFiles[i];
+        if (!entry->fileBuffer && !entry->stale) return entry;
+    }
+    
+    return server->loadedFilesCount < HS__FileMapCap ? &server->loadedFiles[server->loadedFilesCount] : 0;
+}
+
+// Removes an entry from the file cache. Clients still writing the entry's
+// content keep it alive until the last one is done with it.
+void HS_InvalidateFileEntry(HS_FileMapEntry* entry) {
+    entry->uri[0] = 0;
+    entry->filePath[0] = 0;
+    entry->sourcePath[0] = 0;
+    
+    if (entry->clientsReading) {
+        entry->stale = true;
+    } else {
+        HS__FreeFileEntry(entry);
+    }
+}
+
+// Reads a frame of a streamed or mapped body on the I/O pool (see
+// HS__WriteBodyChunk).
+struct HS__FileReadJob {
+    HS_IOJob ioJob;
+    
+    HS_HTTPClient* client; // 0 once the response is released: the job then closes file or fd
+    FILE*     file;
+    int       fd; // a duplicate of the mapping's, when reading a mapped body (-1 otherwise)
+    long long offset;
+    int       amount;
+    bool      pending;
+    bool      failed;
+    bool      truncated; // the file ended before offset + amount
+    char*     buffer; // LWS_PRE + the frame
+};
+
+void HS__ReadFileChunk(HS_IOJob* ioJob) {
+    HS__FileReadJob* job = (HS__FileReadJob*) ioJob;
+    char* buffer = job->buffer + LWS_PRE;
+    int read = 0;
+    
+    if (job->file) {
+        if (HS_SeekFile(job->file, job->offset)) read = fread(buffer, 1, job->amount, job->file);
+        job->truncated = read < job->amount && feof(job->file);
+    }
+#ifndef _WIN32
+    else {
+        ssize_t n = 0;
+        while (read < job->amount && ((n = pread(job->fd, buffer + read, job->amount - read, job->offset + read)) > 0 || (n < 0 && errno == EINTR))) {
+            if (n > 0) read += n;
+        }
+        job->truncated = n == 0;
+    }
+#endif
+    
+    job->failed = read != job->amount;
+}
+
+void HS__FreeFileReadJob(HS__FileReadJob* job) {
+    if (job->file) fclose(job->file);
+#ifndef _WIN32
+    if (job->fd >= 0) close(job->fd);
+#endif
+    free(job);
+}
+
+void HS__FinishFileChunk(HS_IOJob* ioJob) {
+    HS__FileReadJob* job = (HS__FileReadJob*) ioJob;
+    job->pending = false;
+    
+    if (!job->client) {
+        HS__FreeFileReadJob(job);
+        return;
+    }
+    lws_callback_on_writable(job->client->socket);
+}
+
+void HS__SubmitFileChunkRead(HS_VHost* vhost, HS_HTTPClient* client, HS_FileMapping* mapping, long long offset, int amount) {
+    HS__FileReadJob* job = client->fileReadJob;
+    
+    if (!job) {
+        job = (HS__FileReadJob*) calloc(1, sizeof(HS__FileReadJob) + LWS_PRE + vhost->h2MaxFrameSize);
+        job->ioJob.work = HS__ReadFileChunk;
+        job->ioJob.done = HS__FinishFileChunk;
+        job->client = client;
+        job->file = client->streamFile;
+        job->fd = -1;
+#ifndef _WIN32
+        // The mapping may be released while a read is in flight
+        if (!job->file) job->fd = dup(mapping->fd);
+#endif
+        job->buffer = (char*) (job + 1);
+        client->fileReadJob = job;
+    }
+    
+    job->offset = offset;
+    job->amount = amount;
+    job->pending = true;
+    HS_SubmitIOJob((HS_Server*) lws_context_user(lws_get_context(client->socket)), &job->ioJob);
+}
+
+void HS__ReleaseResponseBody(HS_HTTPClient* client) {
+    if (client->fileEntry) {
+        HS_FileMapEntry* entry = client->fileEntry;
+        if (--entry->clientsReading == 0 && entry->stale) HS__FreeFileEntry(entry);
+        client->fileEntry = 0;
+    } else if (client->mapping) {
+        HS_ReleaseFileMapping(client->mapping);
+        client->mapping = 0;
+    } else if (client->fileBuffer) {
+        free(client->fileBuffer);
+    }
+
+    client->archive = 0;
+    client->fileBuffer = 0;
+    client->fileContent = 0;
+    client->fileSize = 0;
+
+    if (client->fileReadJob) {
+        HS__FileReadJob* job = client->fileReadJob;
+        if (job->pending) {
+            job->client = 0;
+            client->streamFile = 0; // Closed by the job when it's done
+            client->streamSize = 0;
+        } else {
+            job->file = 0; // Closed below
+            HS__FreeFileReadJob(job);
+        }
+        client->fileReadJob = 0;
+    }
+
+    if (client->streamFile) {
+        fclose(client->streamFile);
+        client->streamFile = 0;
+        client->streamSize = 0;
+    }
+}
+
+bool HS__IsPathUnder(const char* path, const char* dir) {
+    int dirSize = strlen(dir);
+    return dirSize && strncmp(path, dir, dirSize)==0 && (path[dirSize] == 0 || path[dirSize] == '/');
+}
+
+// Server side includes
+//----------------------
+// Expands <!--#include virtual="/path"--> (relative to the root dir, or to
+// the including file when it doesn't start with '/') and
+// <!--#include file="path"--> (relative to the including file). Includes
+// nest; one that would include itself again, directly or not, is dropped.
+// The paths of every file a page was assembled from are recorded, so that a
+// change to one of them only invalidates the pages that include it.
+
+#define HS__SSIDepthCap 16
+
+struct HS__SSIParser {
+    const char* rootDir;
+    
+    char* buffer; // LWS_PRE bytes of headroom, then the output
+    int   size;
+    int   capacity;
+    
+    char* includes; // see HS_FileMapEntry::includes
+    int   includesSize;
+    int   includesCapacity;
+    
+    char chain[HS__SSIDepthCap][HS__FilePathCap]; // files being expanded, outermost first
+    int  depth;
+};
+
+void HS__SSIWrite(HS__SSIParser* parser, const char* data, int size) {
+    // Keeps a byte for a terminating 0
+    if (parser->size + size >= parser->capacity) {
+        while (parser->size + size >= parser->capacity) parser->capacity *= 2;
+        parser->buffer = (char*) realloc(parser->buffer, LWS_PRE + parser->capacity);
+    }
+    
+    memcpy(parser->buffer + LWS_PRE + parser->size, data, size);
+    parser->size += size;
+}
+
+void HS__SSIAddInclude(HS__SSIParser* parser, const char* path) {
+    for (char* at = parser->includes; *at; at += strlen(at)+1) {
+        if (strcmp(at, path)==0) return;
+    }
+    
+    int size = strlen(path)+1;
+    if (parser->includesSize + size + 1 > parser->includesCapacity) {
+        while (parser->includesSize + size + 1 > parser->includesCapacity) parser->includesCapacity *= 2;
+        parser->includes = (char*) realloc(parser->includes, parser->includesCapacity);
+    }
+    
+    memcpy(parser->includes + parser->includesSize, path, size);
+    parser->includesSize += size;
+    parser->includes[parser->includesSize] = 0;
+}
+
+// Tells whether `includes` (see HS_FileMapEntry::includes) has `path`, or a
+// file under it when it's a directory.
+bool HS__IncludesPath(const char* includes, const char* path) {
+    for (const char* at = includes; at && *at; at += strlen(at)+1) {
+        if (HS__IsPathUnder(at, path)) return true;
+    }
+    return false;
+}
+
+// Parses the attribute of an include directive (`directive` points past
+// "<!--#include ") into the path of the included file.
+bool HS__ParseSSIInclude(HS__SSIParser* parser, const char* directive, const char* directiveEnd, char* path) {
+    while (directive < directiveEnd && *directive == ' ') ++directive;
+    
+    bool isVirtual = false;
+    int at = 0;
+    
+    if (HS_Consume((char*) directive, (char*) directiveEnd, &at, "virtual=\"")) {
+        isVirtual = true;
+    } else if (!HS_Consume((char*) directive, (char*) directiveEnd, &at, "file=\"")) {
+        return false;
+    }
+    
+    const char* value = directive + at;
+    const char* valueEnd = value;
+    while (valueEnd < directiveEnd && *valueEnd != '"') ++valueEnd;
+    
+    int valueSize = valueEnd - value;
+    if (valueEnd == directiveEnd || !valueSize) return false;
+    
+    char joinedPath[HS__FilePathCap];
+    
+    if (isVirtual && value[0] == '/') {
+        snprintf(joinedPath, sizeof(joinedPath), "%s%.*s", parser->rootDir, valueSize, value);
+    } else {
+        const char* includingFile = parser->chain[parser->depth-1];
+        const char* dirEnd = strrchr(includingFile, '/');
+        int dirSize = dirEnd ? dirEnd - includingFile : 0;
+        snprintf(joinedPath, sizeof(joinedPath), "%.*s/%.*s", dirSize, includingFile, valueSize, value);
+    }
+    
+    if (!HS_RealPath(joinedPath, path)) {
+        // Missing: still a dependency, in case it's created later
+        snprintf(path, HS__FilePathCap, "%s", joinedPath);
+    }
+    
+    return HS__IsPathUnder(path, parser->rootDir);
+}
+
+void HS__SSIExpand(HS__SSIParser* parser, const char* content, int size);
+
+void HS__SSIInclude(HS__SSIParser* parser, const char* path) {
+    HS__SSIAddInclude(parser, path);
+    
+    for (int i = 0; i < parser->depth; ++i) {
+        if (strcmp(parser->chain[i], path)==0) {
+            lwsl_warn("SSI | Include cycle, skipping %s in %s\n", path, parser->chain[parser->depth-1]);
+            return;
+        }
+    }
+    
+    if (parser->depth == HS__SSIDepthCap) {
+        lwsl_warn("SSI | Includes nested too deep, skipping %s\n", path);
+        return;
+    }
+    
+    FILE* file = fopen(path, "rb");
+    if (!file) return;
+    
+    int size = HS_GetFileSize(file);
+    char* content = (char*) calloc(1, size+1);
+    fread(content, size, 1, file);
+    fclose(file);
+    
+    strcpy(parser->chain[parser->depth++], path);
+    HS__SSIExpand(parser, content, size);
+    --parser->depth;
+    
+    free(content);
+}
+
+void HS__SSIExpand(HS__SSIParser* parser, const char* content, int size) {
+    const char prefix[] = "<!--#include ";
+    int prefixSize = sizeof(prefix)-1;
+    
+    int copied = 0;
+    int at = 0;
+    
+    while (at < size) {
+        const char* directive = (const char*) memchr(content + at, '<', size - at);
+        if (!directive) break;
+        
+        at = directive - content;
+        
+        if (size - at < prefixSize || memcmp(directive, prefix, prefixSize) != 0) {
+            ++at;
+            continue;
+        }
+        
+        int end = at + prefixSize;
+        bool terminated = false;
+        while (end < size && !(terminated = HS_Consume((char*) content, (char*) content + size, &end, "-->"))) ++end;
+        
+        char path[HS__FilePathCap];
+        
+        if (!terminated || !HS__ParseSSIInclude(parser, directive + prefixSize, content + end - 3, path)) {
+            // Not a well formed include: leave it in the output
+            ++at;
+            continue;
+        }
+        
+        HS__SSIWrite(parser, content + copied, at - copied);
+        HS__SSIInclude(parser, path);
+        at = copied = end;
+    }
+    
+    HS__SSIWrite(parser, content + copied, size - copied);
+}
+
+// Expands the includes of fileContent, which was read from filePath under
+// rootDir. Returns a buffer with LWS_PRE bytes of headroom before the parsed
+// content, which is 0-terminated. When `includes` is given, it receives the paths of the included
+// files (see HS_FileMapEntry::includes), to be freed by the caller.
+char* HS_DoSSI(char* fileContent, int fileSize, const char* rootDir, int* parsedSize, const char* filePath, char** includes=0) {
+    HS__SSIParser* parser = (HS__SSIParser*) calloc(1, sizeof(HS__SSIParser));
+    parser->rootDir = rootDir;
+    parser->capacity = fileSize + HS_KILO_BYTES(4);
+    parser->buffer = (char*) calloc(1, LWS_PRE + parser->capacity);
+    parser->includesCapacity = 256;
+    parser->includes = (char*) calloc(1, parser->includesCapacity);
+    
+    if (!HS_RealPath(filePath, parser->chain[0])) snprintf(parser->chain[0], HS__FilePathCap, "%s", filePath);
+    parser->depth = 1;
+    
+    HS__SSIExpand(parser, fileContent, fileSize);
+    parser->buffer[LWS_PRE + parser->size] = 0; // HS__SSIWrite keeps room for it
+    
+    char* parsedBuffer = parser->buffer;
+    *parsedSize = parser->size;
+    
+    if (includes) *includes = parser->includes;
+    else free(parser->includes);
+    
+    free(parser);
+    return parsedBuffer;
+}
+
+// Reads sourcePath and applies the cache busting and SSI transforms to it in
+// memory. Returns a buffer with LWS_PRE bytes of headroom before the content,
+// or 0 if the file can't be read. `includes` receives the files included by
+// SSI (or 0).
+char* HS__LoadTransformedFile(const char* cacheBustVersion, const char* rootDir, const char* sourcePath, bool cacheBust, bool parseSSI, int* size, char** includes) {
+    *includes = 0;
+    
+    FILE* file = fopen(sourcePath, "rb");
+    if (!file) return 0;
+    
+    int   fileSize = HS_GetFileSize(file);
+    char* fileBuffer = (char*) calloc(1, LWS_PRE + fileSize + 1);
+    char* fileContent = fileBuffer + LWS_PRE;
+    fread(fileContent, fileSize, 1, file);
+    fclose(file);
+    
+    if (parseSSI) {
+        char* parsedBuffer = HS_DoSSI(fileContent, fileSize, rootDir, &fileSize, sourcePath, includes);
+        free(fileBuffer);
+        fileBuffer = parsedBuffer;
+        fileContent = fileBuffer + LWS_PRE;
+    }
+    
+    if (cacheBust) {
+        // The version string has the same length as the placeholder, so this can be done in place.
+        HS_Replace(fileContent, fileContent, fileSize, "-v0000.00.00.00.00.00", (char*) cacheBustVersion);
+    }
+    
+    *size = fileSize;
+    return fileBuffer;
+}
+
+bool HS__IsDerivedFilesPath(const char* path) {
+    return strstr(path, "/.cache-bust") || strstr(path, "/.ssi-parsed");
+}
+
+typedef void (*HS__FileVisitor)(void* data, const char* filePath);
+
+// Calls visit for every regular file under dirPath, skipping the directories
+// of derived files and the paths that don't fit in HS__FilePathCap.
+void HS__WalkFiles(const char* dirPath, HS__FileVisitor visit, void* data) {
+    if (HS__IsDerivedFilesPath(dirPath)) return;
+    
+#ifdef _WIN32
+    char pattern[HS__FilePathCap];
+    if (snprintf(pattern, sizeof(pattern), "%s/*", dirPath) >= (int) sizeof(pattern)) return;
+    
+    WIN32_FIND_DATAA child;
+    HANDLE dir = FindFirstFileA(pattern, &child);
+    if (dir == INVALID_HANDLE_VALUE) return;
+    
+    do {
+        if (strcmp(child.cFileName, ".")==0 || strcmp(child.cFileName, "..")==0) continue;
+        
+        char childPath[HS__FilePathCap];
+        if (snprintf(childPath, sizeof(childPath), "%s/%s", dirPath, child.cFileName) >= (int) sizeof(childPath)) {
+            lwsl_warn("HS__WalkFiles | Path too long under %s\n", dirPath);
+            continue;
+        }
+        
+        if (child.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+            HS__WalkFiles(childPath, visit, data);
+        } else {
+            visit(data, childPath);
+        }
+    } while (FindNextFileA(dir, &child));
+    
+    FindClose(dir);
+#else
+    DIR* dir = opendir(dirPath);
+    if (!dir) return;
+    
+    while (dirent* child = readdir(dir)) {
+        if (strcmp(child->d_name, ".")==0 || strcmp(child->d_name, "..")==0) continue;
+        
+        char childPath[HS__FilePathCap];
+        if (snprintf(childPath, sizeof(childPath), "%s/%s", dirPath, child->d_name) >= (int) sizeof(childPath)) {
+            lwsl_warn("HS__WalkFiles | Path too long under %s\n", dirPath);
+            continue;
+        }
+        
+        if (child->d_type == DT_DIR || (child->d_type == DT_UNKNOWN && HS_IsDirectory(childPath))) {
+            HS__WalkFiles(childPath, visit, data);
+        } else if (child->d_type == DT_REG || HS_IsRegularFile(childPath)) {
+            visit(data, childPath);
+        }
+    }
+    
+    closedir(dir);
+#endif
+}
+
+const char* HS_GetMimeType(const char* filePath) {
+    const char* mimeType = lws_get_mimetype(filePath, 0);
+    if (mimeType) return mimeType;
+    
+    char* path = (char*) filePath;
+    
+    if (HS_EndsWith(path, ".wasm")) {
+        return "application/wasm";
+    } else if (HS_EndsWith(path, ".woff2")) {
+        return "font/woff2";
+    } else if (HS_EndsWith(path, ".map")) {
+        return "application/json";
+    } else if (HS_EndsWith(path, ".zip")) {
+        return "application/zip";
+    } else if (HS_EndsWith(path, ".pdf")) {
+        return "application/pdf";
+    } else if (HS_EndsWith(path, ".txt")) {
+        return "text/plain";
+    }
+    
+    return "text/html";
+}
+
+bool HS__NeedsCacheBusting(HS_VHost* server, const char* uri, const char* mimeType) {
+    if (strcmp(mimeType, "text/html")!=0 && strcmp(mimeType, "text/javascript")!=0 && strcmp(mimeType, "text/css")!=0) return false;
+    return HS_MatchRule(&server->cacheBust, uri);
+}
+
+bool HS__NeedsSSIParsing(HS_VHost* server, const char* uri, const char* mimeType) {
+    if (strcmp(mimeType, "text/html")!=0) return false;
+    return HS_MatchRule(&server->needsSSIParsing, uri);
+}
+
+// Claims a free slot of the vhost's file cache (see HS__GetFreeFileEntry) and
+// fills in its identity; the caller sets the content. Returns 0 if the cache
+// is full.
+HS_FileMapEntry* HS__AddFileEntry(HS_VHost* server, const char* uri, const char* filePath, const char* sourcePath, const char* mimeType) {
+    HS_FileMapEntry* entry = HS__GetFreeFileEntry(server);
+    if (!entry) return 0;
+    if (entry == &server->loadedFiles[server->loadedFilesCount]) ++server->loadedFilesCount;
+    
+    snprintf(entry->uri, HS__URICap, "%s", uri);
+    snprintf(entry->filePath, HS__FilePathCap, "%s", filePath);
+    snprintf(entry->sourcePath, HS__FilePathCap, "%s", sourcePath);
+    entry->mimeType = mimeType;
+    return entry;
+}
+
+// Served archives
+//-----------------
+
+struct HS__ArchivePacker {
+    int    dirPathSize;
+    char** paths;
+    int    pathsCount;
+    int    pathsCap;
+};
+
+void HS__AddPackedFile(void* data, const char* filePath) {
+    HS__ArchivePacker* packer = (HS__ArchivePacker*) data;
+    
+    if (packer->pathsCount == packer->pathsCap) {
+        packer->pathsCap = packer->pathsCap ? 2*packer->pathsCap : 256;
+        packer->paths = (char**) realloc(packer->paths, packer->pathsCap*sizeof(char*));
+    }
+    
+    packer->paths[packer->pathsCount++] = strdup(filePath);
+}
+
+int HS__ComparePaths(const void* a, const void* b) {
+    return strcmp(*(char**) a, *(char**) b);
+}
+
+uint64_t HS__HashContent(const char* content, long long size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (long long i = 0; i < size; ++i) {
+        hash = (hash ^ (uint8_t) content[i]) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Packs every file under dirPath into a served archive at archivePath (see
+// HS_ArchiveEntry). Meant to run at build time.
+bool HS_PackServedFiles(const char* dirPath, const char* archivePath) {
+    char rootDir[HS__FilePathCap] = {};
+    HS_RealPath(dirPath, rootDir);
+    
+    HS__ArchivePacker packer = {};
+    packer.dirPathSize = strlen(rootDir);
+    HS__WalkFiles(rootDir, HS__AddPackedFile, &packer);
+    qsort(packer.paths, packer.pathsCount, sizeof(char*), HS__ComparePaths);
+    
+    HS_ArchiveHeader header = {};
+    memcpy(header.magic, HS__ArchiveMagic, sizeof(header.magic));
+    header.entriesCount = packer.pathsCount;
+    
+    HS_ArchiveEntry* entries = (HS_ArchiveEntry*) calloc(packer.pathsCount + 1, sizeof(HS_ArchiveEntry));
+    
+    // Strings
+    //---------
+    uint64_t stringsOffset = sizeof(HS_ArchiveHeader) + packer.pathsCount*sizeof(HS_ArchiveEntry);
+    int stringsSize = 0;
+    
+    for (int i = 0; i < packer.pathsCount; ++i) {
+        stringsSize += strlen(packer.paths[i] + packer.dirPathSize) + 1;
+        stringsSize += strlen(HS_GetMimeType(packer.paths[i])) + 1;
+    }
+    
+    char* strings = (char*) calloc(1, stringsSize);
+    int stringsAt = 0;
+    
+    for (int i = 0; i < packer.pathsCount; ++i) {
+        const char* path = packer.paths[i] + packer.dirPathSize;
+        const char* mimeType = HS_GetMimeType(packer.paths[i]);
+        
+        entries[i].pathOffset = stringsOffset + stringsAt;
+        stringsAt += sprintf(strings + stringsAt, "%s", path) + 1;
+        entries[i].mimeTypeOffset = stringsOffset + stringsAt;
+        stringsAt += sprintf(strings + stringsAt, "%s", mimeType) + 1;
+    }
+    
+    FILE* archive = fopen(archivePath, "wb");
+    bool result = archive != 0;
+    
+    if (archive) {
+        // Entries are written again once the content hashes are known
+        fwrite(&header, sizeof(header), 1, archive);
+        fwrite(entries, sizeof(HS_ArchiveEntry), packer.pathsCount, archive);
+        fwrite(strings, stringsSize, 1, archive);
+        
+        // Content
+        //---------
+        uint64_t at = stringsOffset + stringsSize;
+        char padding[HS__ArchiveAlignment] = {};
+        
+        for (int i = 0; result && i < packer.pathsCount; ++i) {
+            FILE* file = fopen(packer.paths[i], "rb");
+            if (!file) {
+                lwsl_err("PackServedFiles | Failed to read %s\n", packer.paths[i]);
+                result = false;
+                break;
+            }
+            
+            long long fileSize = HS_GetLargeFileSize(file);
+            char* content = (char*) malloc(fileSize + 1);
+            result = fileSize <= INT_MAX && fread(content, 1, fileSize, file) == (size_t) fileSize;
+            
+            int paddingSize = (HS__ArchiveAlignment - at % HS__ArchiveAlignment) % HS__ArchiveAlignment;
+            fwrite(padding, 1, paddingSize, archive);
+            at += paddingSize;
+            
+            entries[i].contentOffset = at;
+            entries[i].contentSize = fileSize;
+            entries[i].contentHash = HS__HashContent(content, fileSize);
+            entries[i].modifiedTime = HS_GetFileModifiedTime(file);
+            
+            result = result && fwrite(content, 1, fileSize, archive) == (size_t) fileSize;
+            at += fileSize;
+            
+            free(content);
+            fclose(file);
+        }
+        
+        fseek(archive, sizeof(header), SEEK_SET);
+        fwrite(entries, sizeof(HS_ArchiveEntry), packer.pathsCount, archive);
+        result = fclose(archive) == 0 && result;
+        
+        if (result) {
+            printf("PackServedFiles | Dir=%s | Files=%d | Size=%lld\n", rootDir, packer.pathsCount, (long long) at);
+        }
+    }
+    
+    for (int i = 0; i < packer.pathsCount; ++i) free(packer.paths[i]);
+    free(packer.paths);
+    free(strings);
+    free(entries);
+    return result;
+}
+
+void HS__FreeServedArchive(HS_ServedArchive* archive) {
+    if (archive->mapping) {
+        HS_ReleaseFileMapping(archive->mapping);
+        free(archive->index);
+    } else if (archive->data) {
+        free(archive->data);
+    }
+    *archive = {};
+}
+
+bool HS__IsValidArchiveString(HS_ServedArchive* archive, uint32_t offset) {
+    return offset < archive->indexSize && memchr(archive->index + offset, 0, archive->indexSize - offset);
+}
+
+#ifndef _WIN32
+bool HS__ReadAt(int fd, void* buffer, long long size, long long offset) {
+    return size <= 0 || pread(fd, buffer, size, offset) == size;
+}
+
+// Reads the index of a mapped archive (it ends where the first content
+// starts), so that lookups don't touch the mapping. Returns 0 if invalid.
+char* HS__ReadArchiveIndex(HS_ServedArchive* archive) {
+    int fd = archive->mapping->fd;
+    HS_ArchiveHeader header;
+    if (archive->size < (long long) sizeof(header) || !HS__ReadAt(fd, &header, sizeof(header), 0)) return 0;
+    
+    long long entriesEnd = sizeof(header) + (long long) header.entriesCount*sizeof(HS_ArchiveEntry);
+    if (entriesEnd > archive->size) return 0;
+    
+    long long indexSize = archive->size;
+    char* index = (char*) malloc(entriesEnd);
+    if (!HS__ReadAt(fd, index, entriesEnd, 0)) {
+        free(index);
+        return 0;
+    }
+    
+    HS_ArchiveEntry* entries = (HS_ArchiveEntry*) (index + sizeof(header));
+    for (uint32_t i = 0; i < header.entriesCount; ++i) {
+        indexSize = HS_Min((long long) entries[i].contentOffset, indexSize);
+    }
+    
+    if (indexSize >= entriesEnd) index = (char*) realloc(index, indexSize);
+    if (indexSize < entriesEnd || !HS__ReadAt(fd, index + entriesEnd, indexSize - entriesEnd, entriesEnd)) {
+        free(index);
+        return 0;
+    }
+    
+    archive->indexSize = indexSize;
+    return index;
+}
+#endif
+
+// Serves the files of the archive at `path` (made with HS_PackServedFiles)
+// under uriPrefix. Archived files take precedence over the served dirs, except
+// the ones that need cache busting or SSI parsing, which are always read from
+// the served dirs.
+bool HS_AddServedArchive(HS_Server* server, const char* vhostName, const char* uriPrefix, const char* path) {
+    HS_VHost* vhost = HS_GetVHost(server, vhostName);
+    if (vhost->servedArchivesCount == HS__ServedArchivesCap) return false;
+    
+    HS_ServedArchive archive = {};
+    
+    char realPath[HS__FilePathCap] = {};
+    HS_RealPath(path, realPath);
+    
+    archive.mapping = HS_AcquireFileMapping(server, realPath);
+    
+    if (archive.mapping) {
+        archive.data = archive.mapping->data;
+        archive.size = archive.mapping->size;
+#ifndef _WIN32
+        archive.index = HS__ReadArchiveIndex(&archive);
+#endif
+    } else {
+        FILE* file = fopen(realPath, "rb");
+        if (file) {
+            archive.size = HS_GetLargeFileSize(file);
+            archive.data = (char*) malloc(archive.size);
+            if (fread(archive.data, 1, archive.size, file) != (size_t) archive.size) archive.size = 0;
+            fclose(file);
+        }
+        archive.index = archive.data;
+        archive.indexSize = archive.size;
+    }
+    
+    // Validate
+    //----------
+    HS_ArchiveHeader* header = (HS_ArchiveHeader*) archive.index;
+    bool valid = archive.index && archive.indexSize >= (long long) sizeof(HS_ArchiveHeader) && memcmp(header->magic, HS__ArchiveMagic, sizeof(header->magic))==0;
+    valid = valid && sizeof(HS_ArchiveHeader) + (long long) header->entriesCount*sizeof(HS_ArchiveEntry) <= (unsigned long long) archive.indexSize;
+    
+    if (valid) {
+        archive.entries = (HS_ArchiveEntry*) (archive.index + sizeof(HS_ArchiveHeader));
+        archive.entriesCount = header->entriesCount;
+    }
+    
+    for (int i = 0; valid && i < archive.entriesCount; ++i) {
+        HS_ArchiveEntry* entry = &archive.entries[i];
+        valid = entry->contentSize <= INT_MAX && entry->contentOffset >= LWS_PRE && entry->contentOffset + entry->contentSize <= (uint64_t) archive.size
+             && HS__IsValidArchiveString(&archive, entry->pathOffset) && HS__IsValidArchiveString(&archive, entry->mimeTypeOffset);
+    }
+    
+    if (!valid) {
+        lwsl_err("HS_AddServedArchive | VHost=%s | Invalid archive %s\n", vhostName, path);
+        HS__FreeServedArchive(&archive);
+        return false;
+    }
+    
+    int uriPrefixSize = strlen(uriPrefix);
+    if (uriPrefixSize && uriPrefix[uriPrefixSize-1] == '/') --uriPrefixSize;
+    snprintf(archive.uriPrefix, sizeof(archive.uriPrefix), "%.*s", uriPrefixSize, uriPrefix);
+    archive.uriPrefixSize = uriPrefixSize;
+    
+    vhost->servedArchives[vhost->servedArchivesCount++] = archive;
+    return true;
+}
+
+HS_ArchiveEntry* HS__FindArchivedFile(HS_VHost* vhost, const char* uri, HS_ServedArchive** result) {
+    // Like served dirs, archives added later take precedence
+    for (int i = vhost->servedArchivesCount-1; i >= 0; --i) {
+        HS_ServedArchive* archive = &vhost->servedArchives[i];
+        if (strncmp(uri, archive->uriPrefix, archive->uriPrefixSize)!=0 || uri[archive->uriPrefixSize] != '/') continue;
+        
+        const char* path = uri + archive->uriPrefixSize;
+        int first = 0;
+        int last = archive->entriesCount - 1;
+        
+        while (first <= last) {
+            int middle = first + (last - first)/2;
+            HS_ArchiveEntry* entry = &archive->entries[middle];
+            int cmp = strcmp(archive->index + entry->pathOffset, path);
+            
+            if (cmp == 0) {
+                *result = archive;
+                return entry;
+            } else if (cmp < 0) {
+                first = middle + 1;
+            } else {
+                last = middle - 1;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+HS_PathCacheEntry* HS__GetPathCacheEntry(HS_VHost* vhost, const char* rootDir, const char* uri, uint32_t* hash) {
+    *hash = HS__HashRulePattern(uri, strlen(uri)) ^ (uint32_t) (uintptr_t) rootDir;
+    return vhost->pathCache ? &vhost->pathCache[*hash & (HS__PathCacheCap-1)] : 0;
+}
+
+// Looks rootDir+uri up in the vhost's path cache only. Returns false on a miss.
+bool HS__LookUpPath(HS_VHost* vhost, const char* rootDir, const char* uri, char* realPath, bool* hasIndexFile, HS_PathType* type) {
+    uint32_t hash;
+    HS_PathCacheEntry* entry = HS__GetPathCacheEntry(vhost, rootDir, uri, &hash);
+    
+    if (entry && entry->uri
+     && entry->hash == hash
+     && entry->rootDir == rootDir
+     && entry->generation == vhost->pathCacheGeneration
+     && (vhost->pathCacheWatched || time(0) < entry->expires)
+     && strcmp(entry->uri, uri)==0) {
+        snprintf(realPath, HS__FilePathCap, "%s", entry->realPath);
+        if (hasIndexFile) *hasIndexFile = entry->hasIndexFile;
+        *type = entry->type;
+        return true;
+    }
+    return false;
+}
+
+// Resolves rootDir+uri on the file system, without the cache; safe on any
+// thread. Returns false when the path doesn't fit, in which case it is
+// reported missing (a truncated one would name another file).
+bool HS__StatPath(const char* rootDir, const char* uri, char* realPath, bool* hasIndexFile, HS_PathType* type) {
+    char path[PATH_MAX] = {};
+    char resolvedPath[PATH_MAX] = {};
+    *hasIndexFile = false;
+    *type = HS_PathType_Missing;
+    
+    if (snprintf(path, sizeof(path), "%s%s", rootDir, uri) >= (int) sizeof(path)) {
+        realPath[0] = 0;
+        return false;
+    }
+    
+    if (!HS_RealPath(path, resolvedPath)) {
+        strcpy(resolvedPath, path);
+    }
+    
+    if (snprintf(realPath, HS__FilePathCap, "%s", resolvedPath) >= HS__FilePathCap) {
+        realPath[0] = 0;
+        return false;
+    }
+    
+    struct stat st;
+    
+    if (stat(resolvedPath, &st)==0) {
+        if (S_ISREG(st.st_mode)) {
+            *type = HS_PathType_File;
+        } else if (S_ISDIR(st.st_mode)) {
+            *type = HS_PathType_Directory;
+            *hasIndexFile = snprintf(path, sizeof(path), "%s/index.html", resolvedPath) < (int) sizeof(path) && HS_IsRegularFile(path);
+        }
+    }
+    return true;
+}
+
+// Caches a path resolved when the vhost's pathCacheGeneration was generation,
+// unless something changed under its roots since.
+void HS__CachePath(HS_VHost* vhost, const char* rootDir, const char* uri, const char* realPath, HS_PathType type, bool hasIndexFile, int generation) {
+    uint32_t hash;
+    HS_PathCacheEntry* entry = HS__GetPathCacheEntry(vhost, rootDir, uri, &hash);
+    if (!entry || generation != vhost->pathCacheGeneration) return;
+    
+    if (entry->uri) free(entry->uri);
+    if (entry->realPath) free(entry->realPath);
+    
+    int uriSize = strlen(uri);
+    entry->hash = hash;
+    entry->generation = generation;
+    entry->expires = (vhost->pathCacheWatched ? 0 : time(0)) + vhost->pathCacheTTL;
+    entry->rootDir = rootDir;
+    entry->uri = (char*) calloc(1, uriSize+1);
+    memcpy(entry->uri, uri, uriSize);
+    entry->realPath = (char*) calloc(1, strlen(realPath)+1);
+    strcpy(entry->realPath, realPath);
+    entry->type = type;
+    entry->hasIndexFile = hasIndexFile;
+}
+
+// Resolves rootDir+uri to a real path and tells whether it is a file, a
+// directory or missing. Results are cached per vhost until the file watcher
+// reports a change under the vhost's roots, or for pathCacheTTL seconds when
+// the vhost isn't watched. HS_GetFileByURI resolves misses on the I/O pool.
+HS_PathType HS_ResolvePath(HS_VHost* vhost, const char* rootDir, const char* uri, char* realPath, bool* hasIndexFile=0) {
+    HS_PathType type;
+    bool hasIndex;
+    
+    if (HS__LookUpPath(vhost, rootDir, uri, realPath, hasIndexFile, &type)) return type;
+    
+    if (HS__StatPath(rootDir, uri, realPath, &hasIndex, &type)) {
+        HS__CachePath(vhost, rootDir, uri, realPath, type, hasIndex, vhost->pathCacheGeneration);
+    }
+    
+    if (hasIndexFile) *hasIndexFile = hasIndex;
+    return type;
+}
+
+// Picks the first language of acceptLanguage that has a translation of uri
+// (the part following /$lang/) under rootDir. Few distinct Accept-Language
+// values reach a site, so the choice is cached like resolved paths.
+bool HS__NegotiateLanguage(HS_VHost* vhost, const char* rootDir, const char* acceptLanguage, const char* uri, char* lang) {
+    // Key: lowercase header without spaces, then the URI
+    char key[256 + HS__URICap];
+    int keySize = 0;
+    
+    for (const char* c = acceptLanguage; *c && keySize < 255; ++c) {
+        if (*c != ' ') key[keySize++] = tolower(*c);
+    }
+    int headerSize = keySize;
+    key[keySize++] = '\n';
+    keySize += snprintf(key+keySize, sizeof(key)-keySize, "%s", uri);
+    if (keySize >= (int) sizeof(key)) keySize = sizeof(key)-1;
+    
+    uint32_t hash = HS__HashRulePattern(key, keySize) ^ (uint32_t) (uintptr_t) rootDir;
+    HS_LangCacheEntry* entry = vhost->langCache ? &vhost->langCache[hash & (HS__LangCacheCap-1)] : 0;
+    time_t now = entry && !vhost->pathCacheWatched ? time(0) : 0;
+    
+    if (entry && entry->key
+     && entry->hash == hash
+     && entry->rootDir == rootDir
+     && entry->generation == vhost->pathCacheGeneration
+     && (vhost->pathCacheWatched || now < entry->expires)
+     && strcmp(entry->key, key)==0) {
+        strcpy(lang, entry->lang);
+        return lang[0];
+    }
+    
+    lang[0] = 0;
+    char locURI[HS__URICap];
+    char filePath[HS__FilePathCap];
+    
+    for (int at = 0; at < headerSize;) {
+        int size = 0;
+        char candidate[16] = {};
+        
+        while (at < headerSize && key[at] != ',' && key[at] != ';') {
+            if (size < (int) sizeof(candidate)-1) candidate[size++] = key[at];
+            ++at;
+        }
+        // Skip the quality value
+        while (at < headerSize && key[at] != ',') ++at;
+        ++at;
+        
+        if (!size || strcmp(candidate, "*")==0) continue;
+        
+        snprintf(locURI, sizeof(locURI), "/%s/%s", candidate, uri);
+        
+        if (HS_ResolvePath(vhost, rootDir, locURI, filePath) == HS_PathType_File) {
+            strcpy(lang, candidate);
+            break;
+        }
+    }
+    
+    if (entry) {
+        if (entry->key) free(entry->key);
+        
+        entry->hash = hash;
+        entry->generation = vhost->pathCacheGeneration;
+        entry->expires = now + vhost->pathCacheTTL;
+        entry->rootDir = rootDir;
+        entry->key = (char*) calloc(1, keySize+1);
+        memcpy(entry->key, key, keySize);
+        strcpy(entry->lang, lang);
+    }
+    
+    return lang[0];
+}
+
+// A file read on the I/O pool for a request that missed the cache.
+struct HS__FileLoadJob {
+    HS_IOJob ioJob;
+    
+    HS_VHost*      vhost;
+    HS_HTTPClient* client; // 0 once the client is gone
+    lws*           socket;
+    
+    char uri[HS__URICap];
+    char filePath[HS__FilePathCap];
+    char sourcePath[HS__FilePathCap];
+    char rootDir[HS__FilePathCap];
+    char cacheBustVersion[32];
+    
+    const char* mimeType;
+    char*       cacheControl;
+    int         cacheControlSize;
+    http_status httpStatus;
+    
+    bool cacheBust;
+    bool parseSSI;
+    bool persist;   // write the transformed file under the served dir
+    bool cacheable; // cleared when the file is too large to cache
+    bool mapFile;   // cache it as a mapping (mappedFileCache)
+    long long maxSize;
+    int  generation; // the vhost's pathCacheGeneration when the job was submitted
+    
+    // Result: the content, or the file to stream it from, or an error status
+    char*     fileBuffer;
+    int       fileSize;
+    char*     includes;
+    bool      mapped;
+    HS_FileMapping mapping; // made by HS__MapFile, not registered yet
+    FILE*     streamFile;
+    long long streamSize;
+    time_t    modifiedTime;
+    http_status errorStatus;
+};
+
+http_status HS__GetFileErrorStatus(int error) {
+    return error == ENOENT || error == ENOTDIR ? HTTP_STATUS_NOT_FOUND : HTTP_STATUS_INTERNAL_SERVER_ERROR;
+}
+
+// Runs on the I/O pool
+void HS__LoadFile(HS_IOJob* ioJob) {
+    HS__FileLoadJob* job = (HS__FileLoadJob*) ioJob;
+    
+    if (job->cacheBust || job->parseSSI) {
+        job->fileBuffer = HS__LoadTransformedFile(job->cacheBustVersion, job->rootDir, job->sourcePath, job->cacheBust, job->parseSSI, &job->fileSize, &job->includes);
+        job->modifiedTime = time(0);
+        
+        if (!job->fileBuffer) {
+            job->errorStatus = HS_IsRegularFile(job->sourcePath) ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_NOT_FOUND;
+        } else if (job->persist) {
+            HS_CreateFilePath(job->rootDir, job->filePath + strlen(job->rootDir));
+            HS_SaveFile(job->fileBuffer + LWS_PRE, job->fileSize, "%s", job->filePath);
+        }
+        return;
+    }
+    
+    if (job->mapFile && HS__MapFile(job->filePath, &job->mapping)) {
+        if (!job->maxSize || job->mapping.size <= job->maxSize) {
+            job->mapped = true;
+            return;
+        }
+        HS__UnmapFile(&job->mapping);
+    }
+    
+    FILE* file = fopen(job->filePath, "rb");
+    if (!file) {
+        job->errorStatus = HS__GetFileErrorStatus(errno);
+        return;
+    }
+    
+    long long fileSize = HS_GetLargeFileSize(file);
+    job->modifiedTime = HS_GetFileModifiedTime(file);
+    
+    if (fileSize > INT_MAX || (job->maxSize && fileSize > job->maxSize)) {
+        job->cacheable = false;
+    }
+    
+    if (job->cacheable) {
+        job->fileSize = fileSize;
+        job->fileBuffer = (char*) calloc(1, LWS_PRE + fileSize);
+        if (fileSize && fread(job->fileBuffer + LWS_PRE, fileSize, 1, file) != 1) {
+            // e.g. truncated while being read
+            free(job->fileBuffer);
+            job->fileBuffer = 0;
+            job->errorStatus = HTTP_STATUS_INTERNAL_SERVER_ERROR;
+        }
+        fclose(file);
+    } else {
+        // Not going to be cached: stream it from disk
+        job->streamFile = file;
+        job->streamSize = fileSize;
+    }
+}
+
+// Runs on the service thread: caches the loaded file and resumes the response,
+// whose headers are written on the next HTTP_WRITEABLE. Files loaded before a
+// change under the vhost's roots (see HS_InvalidateServedPath) are only served
+// to the client that asked for them, never cached.
+void HS__FinishFileLoad(HS_IOJob* ioJob) {
+    HS__FileLoadJob* job = (HS__FileLoadJob*) ioJob;
+    HS_HTTPClient* client = job->client;
+    
+    if (!client) {
+        if (job->fileBuffer) free(job->fileBuffer);
+        if (job->includes) free(job->includes);
+        if (job->mapped) HS__UnmapFile(&job->mapping);
+        if (job->streamFile) fclose(job->streamFile);
+        free(job);
+        return;
+    }
+    
+    HS_VHost* server = job->vhost;
+    HS_FileMapEntry* fileEntry = 0;
+    client->fileLoadJob = 0;
+    
+    if (job->errorStatus) {
+        lwsl_warn("HS_HTTPCallback | VHost=%s | Failed to load %s (%d)\n", server->name, job->filePath, job->errorStatus);
+        HS_CloseConnection(client, job->errorStatus);
+        free(job);
+        return;
+    }
+    
+    HS_Server* httpServer = (HS_Server*) lws_context_user(lws_get_context(job->socket));
+    HS_FileMapping* mapping = job->mapped ? HS__AddFileMapping(httpServer, &job->mapping) : 0;
+    if (job->mapped && !mapping) {
+        // Mapping table full: load it into memory instead
+        job->mapFile = false;
+        job->mapped = false;
+        client->fileLoadJob = job;
+        HS_SubmitIOJob(httpServer, &job->ioJob);
+        return;
+    }
+    
+    char* fileBuffer = mapping ? mapping->data : job->fileBuffer;
+    
+    if (fileBuffer && job->cacheable && job->generation == server->pathCacheGeneration) {
+        // Another request may have loaded it in the meantime
+        fileEntry = HS_GetFileByPath(server->loadedFiles, server->loadedFilesCount, job->filePath);
+        
+        if (fileEntry) {
+            if (mapping) HS_ReleaseFileMapping(mapping);
+            else free(job->fileBuffer);
+            mapping = 0;
+            job->fileBuffer = 0;
+        } else if ((fileEntry = HS__AddFileEntry(server, job->uri, job->filePath, job->sourcePath, job->mimeType))) {
+            fileEntry->fileBuffer = fileBuffer;
+            fileEntry->fileContent = mapping ? fileBuffer : fileBuffer + LWS_PRE;
+            fileEntry->fileSize = mapping ? mapping->size : job->fileSize;
+            fileEntry->cacheControl = job->cacheControl;
+            fileEntry->cacheControlSize = job->cacheControlSize;
+            fileEntry->modifiedTime = mapping ? mapping->modifiedTime : job->modifiedTime;
+            fileEntry->mapping = mapping;
+            fileEntry->includes = job->includes;
+            fileEntry->cacheBusted = job->cacheBust;
+            job->includes = 0;
+            mapping = 0;
+            job->fileBuffer = 0;
+        }
+    }
+    
+    if (job->includes) free(job->includes);
+    
+    if (fileEntry) {
+        client->fileBuffer = fileEntry->fileBuffer;
+        client->fileContent = fileEntry->fileContent;
+        client->fileSize = fileEntry->fileSize;
+        client->fileModifiedTime = fileEntry->modifiedTime;
+        ++fileEntry->clientsReading;
+        client->fileEntry = fileEntry;
+    } else if (mapping) {
+        // Not cached: the client holds the mapping until its response is sent
+        client->mapping = mapping;
+        client->fileBuffer = mapping->data;
+        client->fileContent = mapping->data;
+        client->fileSize = mapping->size;
+        client->fileModifiedTime = mapping->modifiedTime;
+    } else if (job->fileBuffer) {
+        client->fileBuffer = job->fileBuffer;
+        client->fileContent = job->fileBuffer + LWS_PRE;
+        client->fileSize = job->fileSize;
+        client->fileModifiedTime = job->modifiedTime;
+    } else {
+        client->streamFile = job->streamFile;
+        client->streamSize = job->streamSize;
+        client->fileModifiedTime = job->modifiedTime;
+    }
+    
+    client->mimeType = job->mimeType;
+    client->pendingStatus = job->httpStatus;
+    client->pendingCacheControl = job->cacheControl;
+    lws_callback_on_writable(job->socket);
+    free(job);
+}
+
+// The Cache-Control of files no rule matches. Cache entries and responses
+// share this one copy.
+static char HS__DefaultCacheControlValue[] = HS__DefaultCacheControl;
+
+// Writes the status and headers of a file response. The body (fileContent or
+// streamFile of the client) is written when the socket becomes writable. If
+// contentHash is not 0, it is used as the ETag instead of the size and the
+// modification time.
+//
+// Responses served from a file cache entry reuse its validators and, for full
+// 200 responses, the headers encoded by the entry's first response: only the
+// status and the per-request headers (CORS, Content-Language) are added.
+void HS__WriteFileResponse(HS_HTTPClient* client, http_status httpStatus, const char* mimeType, char* cacheControl, uint64_t contentHash) {
+    client->mimeType = mimeType;
+    
+    HS_FileMapEntry* entry = client->fileEntry;
+    bool cached = entry && mimeType == entry->mimeType && cacheControl && entry->cacheControl
+               && (cacheControl == entry->cacheControl || strcmp(cacheControl, entry->cacheControl)==0);
+    client->cacheHit = (entry || client->archive) && !client->streamFile;
+    
+    // Byte ranges
+    //-------------
+    long long bodySize = HS__GetBodySize(client);
+    bool servesFile = httpStatus == HTTP_STATUS_OK && (client->fileContent || client->streamFile);
+    char etagBuffer[48] = {};
+    char lastModifiedBuffer[48] = {};
+    char* etag = cached ? entry->etag : etagBuffer;
+    char* lastModified = cached ? entry->lastModified : lastModifiedBuffer;
+    
+    if (servesFile) {
+        if (!etag[0]) {
+            if (contentHash) {
+                sprintf(etag, "\"%016llx\"", (unsigned long long) contentHash);
+            } else {
+                HS_FormatETag(etag, bodySize, client->fileModifiedTime);
+            }
+            lws_http_date_render_from_unix(lastModified, sizeof(lastModifiedBuffer), &client->fileModifiedTime);
+        }
+        httpStatus = HS__PrepareByteRanges(client, bodySize, etag, lastModified);
+    }
+    
+    // Write headers
+    //-----------------
+    HS_AddHTTPHeaderStatus(client, httpStatus);
+    
+    // h2 streams are children of the network connection, and encode headers
+    // differently
+    int protocol = lws_get_network_wsi(client->socket) != client->socket;
+    bool usesHeaderBlock = cached && httpStatus == HTTP_STATUS_OK;
+    
+    if (usesHeaderBlock && entry->headerBlocks[protocol]) {
+        memcpy(client->headerAt, entry->headerBlocks[protocol], entry->headerBlockSizes[protocol]);
+        client->headerAt += entry->headerBlockSizes[protocol];
+    } else {
+        char* headerBlockBegin = client->headerAt;
+        
+        if (httpStatus == HTTP_STATUS_REQ_RANGE_NOT_SATISFIABLE) {
+            char contentRange[64] = {};
+            sprintf(contentRange, "bytes */%lld", bodySize);
+            HS__ReleaseResponseBody(client);
+            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_RANGE, contentRange);
+            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_LENGTH, 0);
+        } else if (httpStatus == HTTP_STATUS_PARTIAL_CONTENT) {
+            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_LENGTH, HS__GetRangedBodyLength(client, bodySize));
+            
+            if (client->rangesCount == 1) {
+                char contentRange[96] = {};
+                sprintf(contentRange, "bytes %lld-%lld/%lld", client->ranges[0].first, client->ranges[0].last, bodySize);
+                HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_TYPE, mimeType);
+                HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_RANGE, contentRange);
+            } else {
+                char contentType[96] = {};
+                sprintf(contentType, "multipart/byteranges; boundary=%s", client->boundary);
+                HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_TYPE, contentType);
+            }
+        } else {
+            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_LENGTH, bodySize);
+            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_TYPE, mimeType);
+        }
+        
+        HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CACHE_CONTROL, cacheControl);
+        HS_AddHTTPHeader(client, "X-Content-Type-Options", "nosniff"); // ZAP recommendation
+        
+        if (servesFile) {
+            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_ACCEPT_RANGES, "bytes");
+            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_ETAG, etag);
+            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_LAST_MODIFIED, lastModified);
+        }
+        
+        if (usesHeaderBlock) {
+            int size = client->headerAt - headerBlockBegin;
+            entry->headerBlocks[protocol] = (char*) malloc(size);
+            entry->headerBlockSizes[protocol] = size;
+            memcpy(entry->headerBlocks[protocol], headerBlockBegin, size);
+        }
+    }
+
+    // TODO: Connection: keep-alive is not allowed in http 2. I couldn't find
+    // a way to detect if the connection is using h1 or h2, so I'm removing
+    // this header from all responses.
+    // HS_AddHTTPHeader(client, WSI_TOKEN_CONNECTION, "keep-alive");
+
+    HS_MaybeAddAllowOriginHeader(client);
+
+    if (client->contentLanguage[0]) {
+        // The body depends on the negotiated language
+        HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_LANGUAGE, client->contentLanguage);
+        HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_VARY, "Accept-Language");
+    }
+
+    HS_WriteResponse(client);
+}
+
+// Path resolution misses
+//-------------------------
+// HS_GetFileByURI stats paths that aren't in the path cache on the I/O pool,
+// then serves the request again from its URI, on HTTP_WRITEABLE.
+#define HS__PathResolveReplaysCap 4
+
+struct HS__PathResolveJob {
+    HS_IOJob ioJob;
+    
+    HS_VHost*      vhost;
+    HS_HTTPClient* client; // 0 once the client is gone
+    lws*           socket;
+    bool           pending;
+    int            replays;
+    int            generation;
+    
+    const char* rootDirKey; // as passed to HS_ResolvePath
+    char rootDir[HS__FilePathCap];
+    char uri[HS__URICap];
+    char requestURI[HS__URICap]; // client->uri when HS_GetFileByURI started
+    
+    // Result
+    char        realPath[HS__FilePathCap];
+    HS_PathType type;
+    bool        hasIndexFile;
+    bool        cacheable;
+};
+
+void HS__ResolvePathOnPool(HS_IOJob* ioJob) {
+    HS__PathResolveJob* job = (HS__PathResolveJob*) ioJob;
+    job->cacheable = HS__StatPath(job->rootDir, job->uri, job->realPath, &job->hasIndexFile, &job->type);
+}
+
+void HS__FinishPathResolve(HS_IOJob* ioJob) {
+    HS__PathResolveJob* job = (HS__PathResolveJob*) ioJob;
+    
+    if (!job->client) {
+        free(job);
+        return;
+    }
+    
+    if (job->cacheable) {
+        HS__CachePath(job->vhost, job->rootDirKey, job->uri, job->realPath, job->type, job->hasIndexFile, job->generation);
+    }
+    job->pending = false;
+    lws_callback_on_writable(job->socket);
+}
+
+int HS_GetFileByURI(HS_CallbackArgs* args);
+
+// Serves the request again once its path is resolved. The job is only read
+// by HS_GetFileByURI, which may submit another one.
+void HS__ReplayGetRequest(HS_CallbackArgs* args, HS_HTTPClient* client) {
+    HS__PathResolveJob* job = client->pathResolveJob;
+    
+    client->uriSize = snprintf(client->uri, HS__URICap, "%s", job->requestURI);
+    client->contentLanguage[0] = 0;
+    HS_GetFileByURI(args);
+    
+    if (client->pathResolveJob == job) client->pathResolveJob = 0;
+    free(job);
+}
+
+void HS__ReleasePathResolve(HS_HTTPClient* client) {
+    if (!client->pathResolveJob) return;
+    
+    if (client->pathResolveJob->pending) {
+        client->pathResolveJob->client = 0; // Freed when it's done
+    } else {
+        free(client->pathResolveJob);
+    }
+    client->pathResolveJob = 0;
+}
+
+int HS_GetFileByURI(HS_CallbackArgs* args) {
+    HS_VHost* server = HS_GetVHost(args);
+    HS_HTTPClient* client = HS_GetHTTPClientData(args);
+    
+    int callbackResult = 0;
+    
+    // Kept to serve the request again if its path is resolved on the I/O pool
+    char requestURI[HS__URICap];
+    memcpy(requestURI, client->uri, client->uriSize+1);
+    
+    http_status httpStatus = HTTP_STATUS_OK;
+    const char* mimeType = 0;
+    char* cacheControl = HS__DefaultCacheControlValue;
+    int cacheControlSize = sizeof(HS__DefaultCacheControlValue)-1;
+    
+    HS_UTMParams utm;
+    
+    if (lws_hdr_total_length(args->socket, WSI_TOKEN_HTTP_URI_ARGS) && HS_GetUTMParams(args->socket, &utm)) {
+        char redirURL[HS__URICap] = {};
+        HS_GetHTTPSURLWithoutUTMParams(args->socket, server->host, redirURL, sizeof(redirURL));
+        HS_Redirect(client, redirURL, 307);
+        
+        if (server->verbosity) {
+            printf("UTMParams | utm_source=%s | utm_medium=%s | utm_campaign=%s | utm_content=%s | utm_term=%s", utm.source, utm.medium, utm.campaign, utm.content, utm.term);
+        }
+        
+        return 0;
+    }
+    
+    HS_FileMapEntry* fileEntry = HS_GetFileEntryByURI(server->loadedFiles, server->loadedFilesCount, client->uri);
+    
+    if (fileEntry && fileEntry->mapping && fileEntry->mapping->truncated) {
+        HS_InvalidateFileEntry(fileEntry);
+        fileEntry = 0;
+    }
+    
     if (!server->disableFileCache || !fileEntry) {
         // Strip version string
         if (HS_EndsWithVersionString(client->uri, client->uriSize)) {
             HS_RemoveVersionString(client->uri, &client->uriSize);
         }
 
-        // Redirect?
-        //------------
-        bool redirected = false;
-        
-        for (int i = 0; i < server->redirectMapSize; ++i) {
-            if (strcmp(server->redirectMap[i].uri, client->uri)==0) {
-                char* redirURL = server->redirectMap[i].destination;
-                lws_http_redirect(args->socket, 301, (uint8_t*) redirURL, strlen(redirURL), (uint8_t**) &client->headerAt, (uint8_t*) client->headerEnd);
-                return -1;
-            }
+        // Redirect?
+        //------------
+        bool redirected = false;
+        
+        HS_Rule* redirect = HS_MatchRule(&server->redirectMap, client->uri);
+        if (redirect) {
+            lws_http_redirect(args->socket, 301, (uint8_t*) redirect->value, redirect->valueSize, (uint8_t**) &client->headerAt, (uint8_t*) client->headerEnd);
+            return -1;
+        }
+        
+        // URI processing
+        //-----------------
+        HS_Rule* uriMapping = HS_MatchRule(&server->uriMap, client->uri);
+        if (uriMapping) {
+            strcpy(client->uri, uriMapping->value);
+        }
+
+        // Packed archives
+        //-----------------
+        HS_ServedArchive* archive = 0;
+        HS_ArchiveEntry* archived = HS__FindArchivedFile(server, client->uri, &archive);
+        
+        if (archived) {
+            const char* archivedMimeType = archive->index + archived->mimeTypeOffset;
+            
+            if (!HS__NeedsCacheBusting(server, client->uri, archivedMimeType) && !HS__NeedsSSIParsing(server, client->uri, archivedMimeType)) {
+                client->archive = archive;
+                client->fileContent = archive->data + archived->contentOffset;
+                client->fileSize = archived->contentSize;
+                client->fileModifiedTime = archived->modifiedTime;
+                
+                if (!server->disableFileCache && !server->disableCacheControl) {
+                    HS_Rule* cacheControlRule = HS_MatchRule(&server->cacheControlMap, client->uri);
+                    if (cacheControlRule) cacheControl = cacheControlRule->value;
+                }
+                
+                HS__WriteFileResponse(client, httpStatus, archivedMimeType, cacheControl, archived->contentHash);
+                return callbackResult;
+            }
+        }
+        
+        // Root directory
+        //------------------
+        const char* rootDir = server->servedFilesRootDir;
+        const char* unprefixedURI = client->uri;
+
+        HS_Rule* rootDirMapping = HS_MatchRule(&server->rootDirMap, client->uri);
+        if (rootDirMapping) {
+            rootDir = rootDirMapping->value;
+            unprefixedURI = client->uri + rootDirMapping->patternSize - 1;
+        }
+
+        if (!rootDir[0]) {
+            HS_CloseConnection(client, HTTP_STATUS_NOT_FOUND);
+            return -1;
+        }
+
+        // Localization
+        //--------------
+        if (HS_StartsWith(client->uri, "/$lang/")) {
+            const char* acceptLanguage = HS_GetRequestHeader(client, WSI_TOKEN_HTTP_ACCEPT_LANGUAGE);
+            char locURI[HS__URICap];
+            char lang[16];
+            
+            if (HS__NegotiateLanguage(server, rootDir, acceptLanguage ? acceptLanguage : "", client->uri + 7, lang)) {
+                snprintf(locURI, sizeof(locURI), "/%s/%s", lang, client->uri + 7);
+                strcpy(client->uri, locURI);
+                strcpy(client->contentLanguage, lang);
+            }
+            
+            if (!client->contentLanguage[0]) {
+                snprintf(locURI, sizeof(locURI), "/%s/%s", server->defaultContentLanguage, client->uri + 7);
+                strcpy(client->uri, locURI);
+                strcpy(client->contentLanguage, server->defaultContentLanguage);
+            }
+        }
+        
+        // Infer file path
+        //-----------------------
+        bool hasIndexFile = false;
+        HS_PathType pathType;
+        HS__PathResolveJob* resolved = client->pathResolveJob; // when served again
+        client->pathResolveJob = 0;
+        
+        if (resolved && resolved->rootDirKey == rootDir && strcmp(resolved->uri, unprefixedURI)==0) {
+            snprintf(client->filePath, HS__FilePathCap, "%s", resolved->realPath);
+            hasIndexFile = resolved->hasIndexFile;
+            pathType = resolved->type;
+        } else if (!HS__LookUpPath(server, rootDir, unprefixedURI, client->filePath, &hasIndexFile, &pathType)) {
+            HS_Server* httpServer = HS_GetServer(args);
+            
+            if (server->pathCache && httpServer->ioThreadsCount && (!resolved || resolved->replays < HS__PathResolveReplaysCap)) {
+                HS__PathResolveJob* job = (HS__PathResolveJob*) calloc(1, sizeof(HS__PathResolveJob));
+                job->ioJob.work = HS__ResolvePathOnPool;
+                job->ioJob.done = HS__FinishPathResolve;
+                job->vhost = server;
+                job->client = client;
+                job->socket = args->socket;
+                job->pending = true;
+                job->replays = resolved ? resolved->replays + 1 : 0;
+                job->generation = server->pathCacheGeneration;
+                job->rootDirKey = rootDir;
+                snprintf(job->rootDir, HS__FilePathCap, "%s", rootDir);
+                snprintf(job->uri, HS__URICap, "%s", unprefixedURI);
+                memcpy(job->requestURI, requestURI, sizeof(requestURI));
+                
+                client->pathResolveJob = job;
+                lws_set_timeout(args->socket, PENDING_TIMEOUT_HTTP_CONTENT, 20);
+                HS_SubmitIOJob(httpServer, &job->ioJob);
+                return callbackResult;
+            }
+            
+            pathType = HS_ResolvePath(server, rootDir, unprefixedURI, client->filePath, &hasIndexFile);
+        }
+        
+        if (!HS_StartsWith(client->filePath, rootDir)) {
+            HS_CloseConnection(client, HTTP_STATUS_NOT_FOUND);
+            httpStatus = (http_status) 0; // Handled
+        } else if (pathType != HS_PathType_File) {
+            if (pathType == HS_PathType_Directory) {
+                strcat(client->filePath, "/index.html");
+            }
+
+            if (!hasIndexFile) {
+                if (server->error404File[0]) {
+                    snprintf(client->filePath, PATH_MAX, "%s%s", rootDir, server->error404File);
+                    httpStatus = HTTP_STATUS_NOT_FOUND;
+                    strcpy(client->uri, server->error404File);
+                } else {
+                    HS_CloseConnection(client, HTTP_STATUS_NOT_FOUND);
+                    httpStatus = (http_status) 0; // Handled
+                }
+            }
+        }
+
+        if (httpStatus != 0) {
+            char sourcePath[HS__FilePathCap];
+            strcpy(sourcePath, client->filePath);
+            
+            // Get mimetype
+            //----------------
+            mimeType = HS_GetMimeType(client->filePath);
+
+            // Cache busting
+            //---------------
+            bool needsCacheBusting = HS__NeedsCacheBusting(server, client->uri, mimeType);
+            int derivedPathSize = 0;
+
+            if (needsCacheBusting) {
+                // The transformed content only lives in memory; this path just
+                // identifies it in the cache (and on disk if it is persisted).
+                derivedPathSize = snprintf(client->filePath, HS__FilePathCap, "%s/.cache-bust%s", rootDir, client->uri);
+            }
+
+            // Check if needs SSI Parsing
+            //-----------------------------
+            bool needsSSIParsing = HS__NeedsSSIParsing(server, client->uri, mimeType);
+
+            if (needsSSIParsing) {
+                derivedPathSize = snprintf(client->filePath, HS__FilePathCap, "%s/.ssi-parsed%s", rootDir, client->uri);
+            }
+            
+            if (derivedPathSize >= HS__FilePathCap) {
+                // A truncated path could name another file's cache entry
+                lwsl_warn("HS_GetFileByURI | VHost=%s | Path too long for %s\n", server->name, sourcePath);
+                HS_CloseConnection(client, HTTP_STATUS_REQ_URI_TOO_LONG);
+                return -1;
+            }
+
+            // Cache control
+            //---------------
+            if (!server->disableFileCache && !server->disableCacheControl) {
+                HS_Rule* cacheControlRule = HS_MatchRule(&server->cacheControlMap, client->uri);
+                if (cacheControlRule) {
+                    cacheControl = cacheControlRule->value;
+                    cacheControlSize = cacheControlRule->valueSize;
+                }
+            }
+
+            fileEntry = HS_GetFileByPath(server->loadedFiles, server->loadedFilesCount, client->filePath);
+            if (fileEntry && fileEntry->mapping && fileEntry->mapping->truncated) {
+                HS_InvalidateFileEntry(fileEntry);
+                fileEntry = 0;
+            }
+            bool cacheable = !server->disableFileCache && HS__GetFreeFileEntry(server);
+
+            if (fileEntry) {
+                client->fileBuffer = fileEntry->fileBuffer;
+                client->fileContent = fileEntry->fileContent;
+                client->fileSize = fileEntry->fileSize;
+                client->fileModifiedTime = fileEntry->modifiedTime;
+                ++fileEntry->clientsReading;
+                client->fileEntry = fileEntry;
+            } else {
+                // Load resource
+                //---------------
+                HS__FileLoadJob* job = (HS__FileLoadJob*) calloc(1, sizeof(HS__FileLoadJob));
+                job->ioJob.work = HS__LoadFile;
+                job->ioJob.done = HS__FinishFileLoad;
+                job->vhost = server;
+                job->client = client;
+                job->socket = args->socket;
+                strcpy(job->uri, client->uri);
+                strcpy(job->filePath, client->filePath);
+                strcpy(job->sourcePath, sourcePath);
+                snprintf(job->rootDir, HS__FilePathCap, "%s", rootDir);
+                snprintf(job->cacheBustVersion, sizeof(job->cacheBustVersion), "%s", server->cacheBustVersion);
+                job->mimeType = mimeType;
+                job->cacheControl = cacheControl;
+                job->cacheControlSize = cacheControlSize;
+                job->httpStatus = httpStatus;
+                job->cacheBust = needsCacheBusting;
+                job->parseSSI = needsSSIParsing;
+                job->persist = server->persistTransformedFiles;
+                job->cacheable = cacheable;
+                job->mapFile = cacheable && server->mappedFileCache && !needsCacheBusting && !needsSSIParsing;
+                job->maxSize = server->memCacheMaxSizeMB > 0 ? (long long) HS_MEGA_BYTES(server->memCacheMaxSizeMB) : 0;
+                job->generation = server->pathCacheGeneration;
+                
+                client->fileLoadJob = job;
+                lws_set_timeout(args->socket, PENDING_TIMEOUT_HTTP_CONTENT, 20);
+                HS_SubmitIOJob(HS_GetServer(args), &job->ioJob);
+                return callbackResult;
+            }
+        } else {
+            // Response Not OK.
+        }
+    } else {
+        client->fileBuffer = fileEntry->fileBuffer;
+        client->fileContent = fileEntry->fileContent;
+        client->fileSize = fileEntry->fileSize;
+        client->fileModifiedTime = fileEntry->modifiedTime;
+        
+        mimeType = fileEntry->mimeType;
+        cacheControl = fileEntry->cacheControl;
+        cacheControlSize = fileEntry->cacheControlSize;
+        ++fileEntry->clientsReading;
+        
+        client->fileEntry = fileEntry;
+    }
+
+    if (httpStatus != 0) { // httpStatus == 0 means request already handled.
+        HS__WriteFileResponse(client, httpStatus, mimeType, cacheControl, 0);
+    }
+    
+    return callbackResult;
+}
+
+bool HS_GetHeader(HS_HTTPClient* client, lws_token_indexes header, char* buffer, int bufferSize) {
+    return lws_hdr_copy(client->socket, buffer, bufferSize, header) > 0;
+}
+
+void HS_GetPathNodes(char* path, char** nodes) {
+    // TODO: This function can crash very easily!!1
+    // We don't check if the passed buffers for each
+    // path node has sufficient space to receive the data.
+    char buffer[PATH_MAX] = {};
+    strcpy(buffer, path);
+    char* state;
+    char* entry = HS__strtok_r(buffer, "/", &state);
+    
+    if (entry[0] == 0) {
+        entry = HS__strtok_r(0, "/", &state);
+    }
+    
+    int i = 0;
+    while (nodes[i]) {
+        if (!entry || !entry[0]) {
+            break;
+        }
+        
+        strcpy(nodes[i], entry);
+        entry = HS__strtok_r(0, "/", &state);
+        ++i;
+    }
+}
+
+// Gated areas are compiled from the gatekeepr config when the file server is
+// initialized: the prefixes into a rule list (first area listed wins, as in
+// the config) and the ids into an exact one. Rule i is gkAreas[i].
+void HS__FreeGatedAreas(HS_VHost* vhost) {
+    for (int i = 0; i < vhost->gkAreasCount; ++i) {
+        if (vhost->gkAreas[i].loginPage) free(vhost->gkAreas[i].loginPage);
+    }
+    if (vhost->gkAreas) free(vhost->gkAreas);
+    vhost->gkAreas = 0;
+    vhost->gkAreasCount = 0;
+    
+    HS_ClearRules(&vhost->gkAreaPrefixes);
+    HS_ClearRules(&vhost->gkAreaIds);
+}
+
+void HS__CompileGatedAreas(HS_VHost* vhost) {
+    HS__FreeGatedAreas(vhost);
+    
+    JS_JSON* jAreas = JS_Get(vhost->gkConfig, "gated-areas");
+    int areasCount = jAreas && jAreas->type == JS_Type_Array ? DDJSON_arrcount(jAreas->array) : 0;
+    vhost->gkAreas = (HS_GatedArea*) calloc(areasCount ? areasCount : 1, sizeof(HS_GatedArea));
+    vhost->gkAreaIds.exactOnly = true;
+    
+    JS_Iterator it = JS_ForEach(jAreas);
+    while (JS_Next(&it)) {
+        JS_JSON* jArea = JS_Unwrap(it);
+        char* id = JS_GetString(jArea, "id");
+        char* prefix = JS_GetString(jArea, "prefix");
+        
+        if (!id || !prefix) {
+            lwsl_err("gatekeepr: gated area %d needs an id and a prefix\n", it.index);
+            continue;
+        }
+        
+        HS_GatedArea& area = vhost->gkAreas[vhost->gkAreasCount++];
+        area.id = id;
+        area.jArea = jArea;
+        
+        char pattern[HS__URICap];
+        snprintf(pattern, sizeof(pattern), "%s*", prefix);
+        HS_AddRule(&vhost->gkAreaPrefixes, pattern);
+        HS_AddRule(&vhost->gkAreaIds, id);
+    }
+}
+
+HS_GatedArea* HS_GetGatedArea(HS_VHost* vhost, const char* areaId) {
+    HS_Rule* rule = HS_MatchRule(&vhost->gkAreaIds, areaId);
+    return rule ? &vhost->gkAreas[rule - vhost->gkAreaIds.rules] : 0;
+}
+
+HS_GatedArea* HS_GetGatedAreaFromURI(HS_VHost* vhost, const char* uri) {
+    HS_Rule* rule = HS_MatchRule(&vhost->gkAreaPrefixes, uri);
+    return rule ? &vhost->gkAreas[rule - vhost->gkAreaPrefixes.rules] : 0;
+}
+
+// Returns the vhost's compiled gatekeepr.html. It's dropped by the file watcher
+// when the file changes, or reloaded when its modification time changes on
+// vhosts that aren't watched, which check it at most every pathCacheTTL seconds.
+HS_Template* HS__GetGatekeeprTemplate(HS_VHost* vhost) {
+    HS_Template* tmpl = vhost->gkTemplate;
+    time_t now = vhost->pathCacheWatched ? 0 : time(0);
+    
+    if (tmpl && !vhost->pathCacheWatched && now >= vhost->gkTemplateCheckTime) {
+        vhost->gkTemplateCheckTime = now + (vhost->pathCacheTTL > 0 ? vhost->pathCacheTTL : 0);
+        
+        struct stat st;
+        if (stat(tmpl->path, &st) != 0 || st.st_mtime != tmpl->modifiedTime) {
+            HS_DestroyTemplate(tmpl);
+            vhost->gkTemplate = tmpl = 0;
+        }
+    }
+    
+    if (!tmpl) {
+        const char* placeholders[] = {
+            "<!--TITLE GOES HERE-->",
+            "/*GATEKEEPR CONFIG GOES HERE*/",
+            "LOGO PATH GOES HERE",
+            "AREA ID GOES HERE",
+            "HOME PATH GOES HERE",
+            "TERMS URL GOES HERE",
+            "-v0000.00.00.00.00.00",
+        };
+        
+        char tmplPath[PATH_MAX] = {};
+        snprintf(tmplPath, sizeof(tmplPath), "%s/gatekeepr/gatekeepr.html", vhost->servedFilesRootDir);
+        vhost->gkTemplate = tmpl = HS_LoadTemplate(tmplPath, placeholders, sizeof(placeholders)/sizeof(placeholders[0]));
+        vhost->gkTemplateCheckTime = now + (vhost->pathCacheTTL > 0 ? vhost->pathCacheTTL : 0);
+        ++vhost->gkTemplateGeneration;
+    }
+    
+    return tmpl;
+}
+
+// Renders the area's login page, unless the one rendered last is still current.
+bool HS__RenderLoginPage(HS_VHost* vhost, HS_GatedArea* area) {
+    HS_Template* tmpl = HS__GetGatekeeprTemplate(vhost);
+    if (!tmpl) {
+        return false;
+    }
+    
+    if (area->loginPage && area->loginPageGeneration == vhost->gkTemplateGeneration && strcmp(area->loginPageCacheBust, vhost->cacheBustVersion) == 0) {
+        return true;
+    }
+    
+    JS_JSON* jArea = area->jArea;
+    JS_JSON* jConfig = JS_Create();
+    JS_Set(jConfig, "server", vhost->host);
+    char* googleClientId = JS_GetString(vhost->gkConfig, "google-client-id");
+    JS_Set(jConfig, "googleClientId", googleClientId ? googleClientId : "");
+    JS_Set(jConfig, "gatedArea", JS_Copy(jArea));
+    
+    char config[HS_KILO_BYTES(2)] = {};
+    JS_DumpCompact(jConfig, config, sizeof(config));
+    JS_Free(jConfig);
+    
+    const char* values[] = {
+        JS_GetString(jArea, "name"),
+        config,
+        JS_Get(jArea, "image") ? JS_GetString(jArea, "image") : "",
+        area->id,
+        JS_Get(jArea, "home") ? JS_GetString(jArea, "home") : "",
+        JS_Get(jArea, "terms") ? JS_GetString(jArea, "terms") : "",
+        vhost->cacheBustVersion,
+    };
+    
+    int size = HS_RenderTemplate(tmpl, values, 0);
+    area->loginPage = (char*) realloc(area->loginPage, size ? size : 1);
+    area->loginPageSize = HS_RenderTemplate(tmpl, values, area->loginPage);
+    area->loginPageGeneration = vhost->gkTemplateGeneration;
+    strcpy(area->loginPageCacheBust, vhost->cacheBustVersion);
+    
+    return true;
+}
+
+void HS_EndGatekeeprSession(HS_Server* server, HS_VHost* vhost, const char* gatedArea, const char* cookie);
+
+int HS_GatekeeprGetRequestHandler(HS_CallbackArgs* args) {
+    HS_HTTPClient* client = HS_GetHTTPClientData(args);
+    HS_VHost* vhost = HS_GetVHost(args);
+    
+    int result = 0;
+    
+    char urlPrefix[1024] = {};
+    char gatedAreaId[256] = {};
+    char action[1024] = {};
+    char* nodes[] = {urlPrefix, gatedAreaId, action, 0};
+    
+    HS_GetPathNodes(client->uri, nodes);
+    
+    if (strcmp(urlPrefix, "gk")==0 && gatedAreaId[0]) {
+        HS_GatedArea* area = HS_GetGatedArea(vhost, gatedAreaId);
+        
+        if (area && strcmp(action, "logout")==0) {
+            // /gk/<area>/logout: ends the session and clears its cookie
+            char cookieName[256 + 16] = {};
+            char sessionCookie[512] = {};
+            snprintf(cookieName, sizeof(cookieName), "gatekeepr_%s", area->id);
+            
+            if (HS_GetCookieValue(client->socket, cookieName, sessionCookie, sizeof(sessionCookie))) {
+                HS_EndGatekeeprSession(HS_GetServer(args), vhost, area->id, sessionCookie);
+            }
+            
+            char* home = JS_GetString(area->jArea, "home");
+            snprintf(sessionCookie, sizeof(sessionCookie), "%s=; Expires=Thu, 01 Jan 1970 00:00:01 GMT; Path=/;", cookieName);
+            HS_AddHTTPHeaderStatus(client, 302);
+            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_LOCATION, home && home[0] == '/' ? home : "/");
+            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_SET_COOKIE, sessionCookie);
+            HS_WriteResponse(client);
+        } else if (area && !action[0]) {
+            if (HS__RenderLoginPage(vhost, area)) {
+                HS_InitResponseBuffer(client, area->loginPageSize);
+                memcpy(client->fileContent, area->loginPage, area->loginPageSize);
+                client->fileSize = area->loginPageSize;
+                
+                HS_AddHTTPHeaderStatus(client, 200);
+                HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_LENGTH, client->fileSize);
+                HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_TYPE, "text/html");
+                HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CACHE_CONTROL, HS__DefaultCacheControl);
+                HS_WriteResponse(client);
+            } else {
+                // TODO: gatekeepr.html not found!
+            }
+        } else {
+            HS_AddHTTPHeaderStatus(client, 404);
+            HS_WriteResponse(client);
+        }
+    } else {
+        HS_AddHTTPHeaderStatus(client, 404);
+        HS_WriteResponse(client);
+    }
+    
+    return result;
+}
+
+// Gatekeepr sessions
+//--------------------
+// Sessions are created by gatekeepr in gkdb. The vhost keeps the live ones in
+// a table, so validating a request doesn't touch the database, which is only
+// used by I/O pool jobs, one at a time (gkdbMutex):
+// - Every HS__GKSyncPeriod ms a sync job writes back the changes made in the
+//   table (last use dates, sessions to delete), purges the expired sessions
+//   and loads the others into a new table, which replaces the vhost's when
+//   the job is done. That picks up the logouts of other instances.
+// - A cookie that isn't in the table yet (a fresh login) is looked up by a
+//   job while its request waits; the request is then handled again.
+// Cookies the database doesn't know (stale or forged) are kept in the table
+// as expired entries until the next sync, and at most HS__GKLookupsPerSyncCap
+// unknown cookies are looked up between syncs; past that they are rejected,
+// so a client cycling forged cookies can't keep the database busy.
+// HS_EndGatekeeprSession expires a session in the table right away; the next
+// sync deletes it from gkdb.
+#define HS__GKSessionsQuery "SELECT users.id || '.' || sessions.id, gatedArea, sessions.id, expirationDate, lastUseDate FROM sessions JOIN users ON sessions.userId=users.id"
+
+enum HS_GKSessionState {
+    HS_GKSessionState_Invalid,
+    HS_GKSessionState_Valid,
+    HS_GKSessionState_Unknown, // not in the table: to be looked up
+};
+
+// Returns the session, or with insert a free slot filled with the keys.
+// Returns 0 when the session isn't there or the table is full.
+HS_GKSession* HS__FindGKSession(HS_GKSession* sessions, int* sessionsCount, const char* cookie, const char* gatedArea, bool insert) {
+    int cookieSize = strlen(cookie);
+    if (cookieSize >= (int) sizeof(HS_GKSession::cookie) || strlen(gatedArea) >= sizeof(HS_GKSession::gatedArea)) {
+        return 0;
+    }
+    
+    uint32_t hash = HS__HashRulePattern(cookie, cookieSize);
+    
+    for (int i = 0; i < HS__GKSessionsCap; ++i) {
+        HS_GKSession* session = &sessions[(hash + i) & (HS__GKSessionsCap-1)];
+        
+        if (!session->cookie[0]) {
+            // Keep the load factor at 3/4 so that misses end quickly
+            if (!insert || *sessionsCount >= HS__GKSessionsCap/4*3) {
+                return 0;
+            }
+            
+            session->hash = hash;
+            strcpy(session->cookie, cookie);
+            strcpy(session->gatedArea, gatedArea);
+            ++*sessionsCount;
+            return session;
+        }
+        
+        if (session->hash == hash && strcmp(session->cookie, cookie) == 0 && strcmp(session->gatedArea, gatedArea) == 0) {
+            return session;
+        }
+    }
+    
+    return 0;
+}
+
+HS_GKSession* HS__FindGKSession(HS_VHost* vhost, const char* cookie, const char* gatedArea, bool insert) {
+    return HS__FindGKSession(vhost->gkSessions, &vhost->gkSessionsCount, cookie, gatedArea, insert);
+}
+
+bool HS__ReadGKSessionRow(sqlite3_stmt* stmt, HS_GKSession* session) {
+    const char* cookie    = (const char*) sqlite3_column_text(stmt, 0);
+    const char* gatedArea = (const char*) sqlite3_column_text(stmt, 1);
+    const char* sessionId = (const char*) sqlite3_column_text(stmt, 2);
+    
+    if (!cookie || !gatedArea || !sessionId ||
+        strlen(cookie) >= sizeof(session->cookie) || strlen(gatedArea) >= sizeof(session->gatedArea) || strlen(sessionId) >= sizeof(session->sessionId)) {
+        return false;
+    }
+    
+    memset(session, 0, sizeof(HS_GKSession));
+    strcpy(session->cookie, cookie);
+    strcpy(session->gatedArea, gatedArea);
+    strcpy(session->sessionId, sessionId);
+    session->expirationDate = sqlite3_column_int64(stmt, 3);
+    session->lastUseDate = sqlite3_column_int64(stmt, 4);
+    return true;
+}
+
+HS_GKSession* HS__PutGKSession(HS_GKSession* sessions, int* sessionsCount, HS_GKSession* row) {
+    HS_GKSession* session = HS__FindGKSession(sessions, sessionsCount, row->cookie, row->gatedArea, true);
+    if (session) {
+        strcpy(session->sessionId, row->sessionId);
+        session->expirationDate = row->expirationDate;
+        session->lastUseDate = row->lastUseDate;
+        session->dirty = false;
+    }
+    return session;
+}
+
+// Writes back a session's last use date. The statement is prepared on the first call.
+bool HS__WriteGKSessionUse(HS_VHost* vhost, sqlite3_stmt** stmt, HS_GKSession* session) {
+    if (!*stmt) {
+        *stmt = SQ_PrepareStatement(vhost->gkdb, "UPDATE sessions SET lastUseDate=?1 WHERE id=?2");
+    }
+    
+    sqlite3_bind_int64(*stmt, 1, session->lastUseDate);
+    sqlite3_bind_text(*stmt, 2, session->sessionId, -1, SQLITE_STATIC);
+    bool result = sqlite3_step(*stmt) == SQLITE_DONE;
+    sqlite3_reset(*stmt);
+    return result;
+}
+
+// Deletes a session. The statement is prepared on the first call.
+bool HS__DeleteGKSessionRow(HS_VHost* vhost, sqlite3_stmt** stmt, HS_GKSession* session) {
+    if (!*stmt) {
+        *stmt = SQ_PrepareStatement(vhost->gkdb, "DELETE FROM sessions WHERE gatedArea=?1 AND userId || '.' || id = ?2");
+    }
+    
+    sqlite3_bind_text(*stmt, 1, session->gatedArea, -1, SQLITE_STATIC);
+    sqlite3_bind_text(*stmt, 2, session->cookie, -1, SQLITE_STATIC);
+    bool result = sqlite3_step(*stmt) == SQLITE_DONE;
+    if (!result) {
+        lwsl_err("gatekeepr: couldn't delete session of %s: %s\n", session->gatedArea, sqlite3_errmsg(vhost->gkdb));
+    }
+    sqlite3_reset(*stmt);
+    return result;
+}
+
+// Writes back, in one transaction, the changes of the sessions: last use
+// dates, and deletions. Sessions are clean again once written. Called with
+// gkdbMutex locked.
+void HS__WriteGKSessionChanges(HS_VHost* vhost, HS_GKSession* sessions, int sessionsCount) {
+    sqlite3_stmt* updateStmt = 0;
+    sqlite3_stmt* deleteStmt = 0;
+    bool began = false;
+    
+    for (int i = 0; i < sessionsCount; ++i) {
+        HS_GKSession* session = &sessions[i];
+        if (!session->cookie[0] || (!session->dirty && !session->deleting)) {
+            continue;
+        }
+        
+        if (!began) {
+            sqlite3_exec(vhost->gkdb, "BEGIN", 0, 0, 0);
+            began = true;
+        }
+        if (session->deleting) {
+            if (HS__DeleteGKSessionRow(vhost, &deleteStmt, session)) {
+                session->deleting = false;
+                session->dirty = false;
+            }
+        } else if (HS__WriteGKSessionUse(vhost, &updateStmt, session)) {
+            session->dirty = false;
+        }
+    }
+    
+    if (updateStmt) sqlite3_finalize(updateStmt);
+    if (deleteStmt) sqlite3_finalize(deleteStmt);
+    if (began) sqlite3_exec(vhost->gkdb, "COMMIT", 0, 0, 0);
+}
+
+// Writes back the changes of the table, when the vhost is destroyed.
+void HS__FlushGKSessions(HS_VHost* vhost) {
+    pthread_mutex_lock(&vhost->gkdbMutex);
+    HS__WriteGKSessionChanges(vhost, vhost->gkSessions, HS__GKSessionsCap);
+    pthread_mutex_unlock(&vhost->gkdbMutex);
+}
+
+// Syncs
+//-------
+struct HS__GKSyncJob {
+    HS_IOJob ioJob;
+    HS_VHost* vhost;
+    
+    HS_GKSession* changed; // sessions changed since the last sync, written back by the job
+    int changedCount;
+    
+    // Result: the new table. The changes that couldn't be written back
+    // (database busy) are still marked.
+    HS_GKSession* sessions;
+    int sessionsCount;
+};
+
+// Runs on the I/O pool
+void HS__SyncGKSessions(HS_IOJob* ioJob) {
+    HS__GKSyncJob* job = (HS__GKSyncJob*) ioJob;
+    HS_VHost* vhost = job->vhost;
+    
+    pthread_mutex_lock(&vhost->gkdbMutex);
+    HS__WriteGKSessionChanges(vhost, job->changed, job->changedCount);
+    
+    // Cleanup database
+    long long now = time(0);
+    SQ_DeleteRows(vhost->gkdb, "sessions", "%lld >= expirationDate OR (%lld-lastUseDate) >= %d", now, now, HS__GKSessionIdleTimeout);
+    
+    job->sessions = (HS_GKSession*) calloc(HS__GKSessionsCap, sizeof(HS_GKSession));
+    sqlite3_stmt* stmt = SQ_PrepareStatement(vhost->gkdb, HS__GKSessionsQuery);
+    HS_GKSession row;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        if (HS__ReadGKSessionRow(stmt, &row)) {
+            HS__PutGKSession(job->sessions, &job->sessionsCount, &row);
+        }
+    }
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&vhost->gkdbMutex);
+}
+
+// Keeps a change that isn't in the database yet: a session to delete stays
+// as it was, a last use date is kept if the session is still there.
+void HS__KeepGKSessionChange(HS_VHost* vhost, HS_GKSession* change) {
+    HS_GKSession* session = HS__FindGKSession(vhost, change->cookie, change->gatedArea, change->deleting);
+    if (!session) {
+        return;
+    }
+    
+    if (change->deleting) {
+        *session = *change;
+    } else if (session->expirationDate && session->lastUseDate < change->lastUseDate) {
+        session->lastUseDate = change->lastUseDate;
+        session->dirty = true;
+    }
+}
+
+// Runs on the service thread: the new table replaces the vhost's. The changes
+// that weren't written back, and the ones made while the job ran, are carried
+// over.
+void HS__FinishGKSync(HS_IOJob* ioJob) {
+    HS__GKSyncJob* job = (HS__GKSyncJob*) ioJob;
+    HS_VHost* vhost = job->vhost;
+    HS_GKSession* previous = vhost->gkSessions;
+    vhost->gkSyncPending = false;
+    
+    if (!previous) {
+        // The vhost is gone
+        free(job->sessions);
+        if (job->changed) free(job->changed);
+        free(job);
+        return;
+    }
+    
+    vhost->gkSessions = job->sessions;
+    vhost->gkSessionsCount = job->sessionsCount;
+    vhost->gkLookupsLeft = HS__GKLookupsPerSyncCap;
+    
+    for (int i = 0; i < job->changedCount; ++i) {
+        HS_GKSession* change = &job->changed[i];
+        if (change->dirty || change->deleting) HS__KeepGKSessionChange(vhost, change);
+    }
+    for (int i = 0; i < HS__GKSessionsCap; ++i) {
+        HS_GKSession* change = &previous[i];
+        if (change->dirty || change->deleting) HS__KeepGKSessionChange(vhost, change);
+    }
+    
+    free(previous);
+    if (job->changed) free(job->changed);
+    free(job);
+}
+
+// Takes the changes off the table, for the job to write them back.
+HS__GKSyncJob* HS__NewGKSyncJob(HS_VHost* vhost) {
+    HS__GKSyncJob* job = (HS__GKSyncJob*) calloc(1, sizeof(HS__GKSyncJob));
+    job->ioJob.work = HS__SyncGKSessions;
+    job->ioJob.done = HS__FinishGKSync;
+    job->vhost = vhost;
+    
+    int changedCount = 0;
+    for (int i = 0; i < HS__GKSessionsCap; ++i) {
+        changedCount += vhost->gkSessions[i].dirty || vhost->gkSessions[i].deleting;
+    }
+    if (changedCount) {
+        job->changed = (HS_GKSession*) malloc(changedCount*sizeof(HS_GKSession));
+    }
+    
+    for (int i = 0; i < HS__GKSessionsCap; ++i) {
+        HS_GKSession* session = &vhost->gkSessions[i];
+        if (session->dirty || session->deleting) {
+            job->changed[job->changedCount++] = *session;
+            session->dirty = false;
+            session->deleting = false;
+        }
+    }
+    
+    vhost->gkSyncPending = true;
+    return job;
+}
+
+// Syncs the table on the I/O pool, unless it's being synced already.
+void HS__SubmitGKSync(HS_Server* server, HS_VHost* vhost) {
+    if (!vhost->gkSyncPending) {
+        HS_SubmitIOJob(server, &HS__NewGKSyncJob(vhost)->ioJob);
+    }
+}
+
+// Single sessions
+//-----------------
+// A job on one session: the lookup of a cookie while its request waits, or a
+// change the table has no room to keep until the next sync.
+struct HS__GKSessionJob {
+    HS_IOJob ioJob;
+    
+    HS_VHost*      vhost;
+    HS_HTTPClient* client; // 0 once the client is gone
+    lws*           socket;
+    bool           pending;
+    
+    HS_GKSession session; // the keys, and the row once looked up
+    bool         found;
+};
+
+// Runs on the I/O pool
+void HS__LookUpGKSession(HS_IOJob* ioJob) {
+    HS__GKSessionJob* job = (HS__GKSessionJob*) ioJob;
+    HS_VHost* vhost = job->vhost;
+    
+    pthread_mutex_lock(&vhost->gkdbMutex);
+    sqlite3_stmt* stmt = SQ_PrepareStatement(vhost->gkdb, HS__GKSessionsQuery " WHERE gatedArea=?1 AND users.id || '.' || sessions.id = ?2");
+    sqlite3_bind_text(stmt, 1, job->session.gatedArea, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, job->session.cookie, -1, SQLITE_STATIC);
+    HS_GKSession row;
+    job->found = sqlite3_step(stmt) == SQLITE_ROW && HS__ReadGKSessionRow(stmt, &row);
+    if (job->found) job->session = row;
+    sqlite3_finalize(stmt);
+    pthread_mutex_unlock(&vhost->gkdbMutex);
+}
+
+// Runs on the service thread: the session is added to the table, or left in
+// it as expired when the database doesn't know it. The request is handled
+// again on HTTP_WRITEABLE.
+void HS__FinishGKLookup(HS_IOJob* ioJob) {
+    HS__GKSessionJob* job = (HS__GKSessionJob*) ioJob;
+    HS_VHost* vhost = job->vhost;
+    
+    // Unless a sync, another lookup or a logout got there first
+    if (vhost->gkSessions && !HS__FindGKSession(vhost, job->session.cookie, job->session.gatedArea, false)) {
+        if (job->found) {
+            HS__PutGKSession(vhost->gkSessions, &vhost->gkSessionsCount, &job->session);
+        } else {
+            HS__FindGKSession(vhost, job->session.cookie, job->session.gatedArea, true);
+        }
+    }
+    
+    if (!job->client) {
+        free(job);
+        return;
+    }
+    
+    job->pending = false;
+    lws_callback_on_writable(job->socket);
+}
+
+// Runs on the I/O pool
+void HS__WriteGKSessionChange(HS_IOJob* ioJob) {
+    HS__GKSessionJob* job = (HS__GKSessionJob*) ioJob;
+    
+    pthread_mutex_lock(&job->vhost->gkdbMutex);
+    HS__WriteGKSessionChanges(job->vhost, &job->session, 1);
+    pthread_mutex_unlock(&job->vhost->gkdbMutex);
+}
+
+void HS__FreeGKSessionJob(HS_IOJob* ioJob) {
+    free(ioJob);
+}
+
+HS__GKSessionJob* HS__NewGKSessionJob(HS_VHost* vhost, const char* gatedArea, const char* cookie, HS_IOJobFunc work, HS_IOJobFunc done) {
+    HS__GKSessionJob* job = (HS__GKSessionJob*) calloc(1, sizeof(HS__GKSessionJob));
+    job->ioJob.work = work;
+    job->ioJob.done = done;
+    job->vhost = vhost;
+    snprintf(job->session.cookie, sizeof(job->session.cookie), "%s", cookie);
+    snprintf(job->session.gatedArea, sizeof(job->session.gatedArea), "%s", gatedArea);
+    return job;
+}
+
+// Parks the request until its session cookie is looked up.
+void HS__SubmitGKLookup(HS_CallbackArgs* args, const char* gatedArea, const char* cookie) {
+    HS_HTTPClient* client = HS_GetHTTPClientData(args);
+    HS__GKSessionJob* job = HS__NewGKSessionJob(HS_GetVHost(args), gatedArea, cookie, HS__LookUpGKSession, HS__FinishGKLookup);
+    job->client = client;
+    job->socket = args->socket;
+    job->pending = true;
+    
+    client->gkLookupJob = job;
+    lws_set_timeout(args->socket, PENDING_TIMEOUT_HTTP_CONTENT, 20);
+    HS_SubmitIOJob(HS_GetServer(args), &job->ioJob);
+}
+
+void HS__ReleaseGKLookup(HS_HTTPClient* client) {
+    if (!client->gkLookupJob) return;
+    
+    if (client->gkLookupJob->pending) {
+        client->gkLookupJob->client = 0; // Freed when it's done
+    } else {
+        free(client->gkLookupJob);
+    }
+    client->gkLookupJob = 0;
+}
+
+// Deletes a session from gkdb with the next sync; it stays in the table as it
+// is until then. Returns it, or 0 when the table has no room for it, in which
+// case it's deleted right away on the I/O pool.
+HS_GKSession* HS__DeleteGKSession(HS_Server* server, HS_VHost* vhost, const char* gatedArea, const char* cookie) {
+    HS_GKSession* session = HS__FindGKSession(vhost, cookie, gatedArea, true);
+    if (session) {
+        session->deleting = true;
+        return session;
+    }
+    
+    HS__GKSessionJob* job = HS__NewGKSessionJob(vhost, gatedArea, cookie, HS__WriteGKSessionChange, HS__FreeGKSessionJob);
+    job->session.deleting = true;
+    HS_SubmitIOJob(server, &job->ioJob);
+    return 0;
+}
+
+// Validation
+//------------
+// expirationDate, when given, is set to the session's if it's valid. lookup,
+// when given, is the finished lookup of the cookie: a session that isn't in
+// the table then (table full) is validated from its row, which is marked dirty
+// when its use needs to be written back.
+HS_GKSessionState HS__ValidateGKSession(HS_VHost* vhost, const char* gatedArea, const char* cookie, long long* expirationDate=0, HS__GKSessionJob* lookup=0) {
+    if (!vhost->gkSessions) {
+        return HS_GKSessionState_Invalid;
+    }
+    
+    HS_GKSession* session = HS__FindGKSession(vhost, cookie, gatedArea, false);
+    
+    if (!session && lookup) {
+        if (!lookup->found || strcmp(lookup->session.cookie, cookie) || strcmp(lookup->session.gatedArea, gatedArea)) {
+            return HS_GKSessionState_Invalid;
+        }
+        session = &lookup->session;
+    } else if (!session) {
+        // Not in the table since the last sync, e.g. a fresh login
+        if (strlen(cookie) >= sizeof(HS_GKSession::cookie) || strlen(gatedArea) >= sizeof(HS_GKSession::gatedArea)) {
+            return HS_GKSessionState_Invalid;
+        }
+        if (vhost->gkLookupsLeft <= 0) {
+            if (vhost->gkLookupsLeft-- == 0) {
+                lwsl_warn("gatekeepr: too many unknown session cookies, rejecting them until the next sync\n");
+            }
+            return HS_GKSessionState_Invalid;
+        }
+        --vhost->gkLookupsLeft;
+        return HS_GKSessionState_Unknown;
+    }
+    
+    long long now = time(0);
+    if (now >= session->expirationDate || now - session->lastUseDate >= HS__GKSessionIdleTimeout) {
+        return HS_GKSessionState_Invalid;
+    }
+    
+    if (session->lastUseDate != now) {
+        session->lastUseDate = now;
+        session->dirty = true;
+    }
+    
+    if (expirationDate) *expirationDate = session->expirationDate;
+    return HS_GKSessionState_Valid;
+}
+
+bool HS__ValidateGKToken(HS_VHost* vhost, const char* gatedArea, const char* token);
+void HS__DenyGKToken(HS_VHost* vhost, const char* token);
+
+// Ends a session: expires it in the table so that it's rejected right away,
+// and deletes it from gkdb. A token is put on the deny list instead.
+void HS_EndGatekeeprSession(HS_Server* server, HS_VHost* vhost, const char* gatedArea, const char* cookie) {
+    if (vhost->gkTokenKeysCount && HS__ValidateGKToken(vhost, gatedArea, cookie)) {
+        HS__DenyGKToken(vhost, cookie);
+        return;
+    }
+    
+    if (!vhost->gkSessions) {
+        return;
+    }
+    
+    HS_GKSession* session = HS__DeleteGKSession(server, vhost, gatedArea, cookie);
+    if (session) {
+        session->expirationDate = 0;
+        session->dirty = false;
+    }
+}
+
+// Gatekeepr tokens
+//------------------
+// With "token-keys" in the gatekeepr config, the gatekeepr_<area> cookie is a
+// signed token instead of a database session:
+//     <keyId>.<userId>.<expires>.<hex HMAC-SHA256 of "<area>.<keyId>.<userId>.<expires>">
+// Validation needs only the keys, so instances sharing them can serve gated
+// areas without gatekeepr.db. Instances with gatekeepr.db still accept the
+// database sessions gatekeepr creates at login, and exchange them for a token
+// on first use: the request is redirected to its URI with the token cookie,
+// which expires with the session. New tokens are signed with the first key; the
+// others are still accepted, which lets keys rotate. The exchanged session is
+// deleted from gkdb by the next sync, and stays valid in the table until then,
+// so requests already on their way with the session cookie get the same token.
+// Tokens are revoked through the deny list, a file with a user id or a token
+// signature per line that is reloaded when it changes. Logging out denies the
+// token's signature, here right away and, appended to the file, on the other
+// instances once they reload it.
+#define HS__GKSignatureSize 32 // SHA-256
+
+int HS__HexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void HS__GKTokenSignature(HS_GKTokenKey* key, const char* gatedArea, const char* payload, int payloadSize, uint8_t* signature) {
+    char message[HS_KILO_BYTES(1)];
+    int messageSize = snprintf(message, sizeof(message), "%s.%.*s", gatedArea, payloadSize, payload);
+    if (messageSize >= (int) sizeof(message)) messageSize = sizeof(message)-1;
+    
+    unsigned int signatureSize = HS__GKSignatureSize;
+    HMAC(EVP_sha256(), key->secret, strlen(key->secret), (uint8_t*) message, messageSize, signature, &signatureSize);
+}
+
+// Writes a token for userId to output. Returns its size, or 0 when there's no
+// key or output is too small.
+int HS_CreateGatekeeprToken(HS_VHost* vhost, const char* gatedArea, const char* userId, long long expires, char* output, int outputSize) {
+    if (!vhost->gkTokenKeysCount) {
+        return 0;
+    }
+    
+    HS_GKTokenKey* key = &vhost->gkTokenKeys[0];
+    int payloadSize = snprintf(output, outputSize, "%s.%s.%lld", key->id, userId, expires);
+    if (payloadSize + 1 + 2*HS__GKSignatureSize >= outputSize) {
+        return 0;
+    }
+    
+    uint8_t signature[HS__GKSignatureSize];
+    HS__GKTokenSignature(key, gatedArea, output, payloadSize, signature);
+    
+    char* out = output + payloadSize;
+    *out++ = '.';
+    for (int i = 0; i < HS__GKSignatureSize; ++i) {
+        out += sprintf(out, "%02x", signature[i]);
+    }
+    
+    return out - output;
+}
+
+int HS__CompareDenyListEntries(const void* a, const void* b) {
+    return strcmp(*(const char**) a, *(const char**) b);
+}
+
+bool HS__IsDeniedGKToken(HS_VHost* vhost, const char* entry, int entrySize) {
+    char key[256];
+    if (!vhost->gkDeniedCount || entrySize >= (int) sizeof(key)) {
+        return false;
+    }
+    
+    memcpy(key, entry, entrySize);
+    key[entrySize] = 0;
+    const char* keyPtr = key;
+    return bsearch(&keyPtr, vhost->gkDenied, vhost->gkDeniedCount, sizeof(char*), HS__CompareDenyListEntries) != 0;
+}
+
+void HS__RefreshGKDenyList(HS_VHost* vhost) {
+    struct stat st;
+    if (!vhost->gkDenyListPath[0] || stat(vhost->gkDenyListPath, &st) || st.st_mtime == vhost->gkDenyListModifiedTime) {
+        return;
+    }
+    
+    FILE* file = fopen(vhost->gkDenyListPath, "rb");
+    if (!file) {
+        return;
+    }
+    
+    int size = HS_GetFileSize(file);
+    char* list = (char*) malloc(size + 1);
+    size = fread(list, 1, size, file);
+    list[size] = 0;
+    fclose(file);
+    
+    int count = 0;
+    for (int i = 0; i < size; ++i) {
+        count += list[i] == '\n';
+    }
+    char** denied = (char**) malloc((count + 1)*sizeof(char*));
+    count = 0;
+    
+    char* state;
+    for (char* line = HS__strtok_r(list, "\r\n", &state); line; line = HS__strtok_r(0, "\r\n", &state)) {
+        while (isspace(*line)) ++line;
+        int lineSize = strlen(line);
+        while (lineSize && isspace(line[lineSize-1])) line[--lineSize] = 0;
+        
+        if (lineSize && line[0] != '#') {
+            denied[count++] = line;
+        }
+    }
+    qsort(denied, count, sizeof(char*), HS__CompareDenyListEntries);
+    
+    if (vhost->gkDenyList) free(vhost->gkDenyList);
+    if (vhost->gkDenied) free(vhost->gkDenied);
+    vhost->gkDenyList = list;
+    vhost->gkDenied = denied;
+    vhost->gkDeniedCount = count;
+    vhost->gkDenyListModifiedTime = st.st_mtime;
+}
+
+// Adds entry to the deny list in memory, keeping it sorted.
+void HS__AddGKDenyListEntry(HS_VHost* vhost, const char* entry) {
+    int entrySize = strlen(entry);
+    if (HS__IsDeniedGKToken(vhost, entry, entrySize)) {
+        return;
+    }
+    
+    int size = entrySize + 1;
+    for (int i = 0; i < vhost->gkDeniedCount; ++i) {
+        size += strlen(vhost->gkDenied[i]) + 1;
+    }
+    
+    char* list = (char*) malloc(size);
+    char** denied = (char**) malloc((vhost->gkDeniedCount + 1)*sizeof(char*));
+    char* out = list;
+    int count = 0;
+    bool added = false;
+    
+    for (int i = 0; i <= vhost->gkDeniedCount; ++i) {
+        if (!added && (i == vhost->gkDeniedCount || strcmp(entry, vhost->gkDenied[i]) < 0)) {
+            denied[count++] = out;
+            memcpy(out, entry, entrySize + 1);
+            out += entrySize + 1;
+            added = true;
+        }
+        if (i < vhost->gkDeniedCount) {
+            int deniedSize = strlen(vhost->gkDenied[i]);
+            denied[count++] = out;
+            memcpy(out, vhost->gkDenied[i], deniedSize + 1);
+            out += deniedSize + 1;
+        }
+    }
+    
+    if (vhost->gkDenyList) free(vhost->gkDenyList);
+    if (vhost->gkDenied) free(vhost->gkDenied);
+    vhost->gkDenyList = list;
+    vhost->gkDenied = denied;
+    vhost->gkDeniedCount = count;
+}
+
+// Revokes a token: its signature is denied here, and appended to the deny
+// list file for the other instances.
+void HS__DenyGKToken(HS_VHost* vhost, const char* token) {
+    const char* signature = strrchr(token, '.');
+    if (!signature || strlen(signature+1) != 2*HS__GKSignatureSize) {
+        return;
+    }
+    ++signature;
+    HS__AddGKDenyListEntry(vhost, signature);
+    
+    if (!vhost->gkDenyListPath[0]) {
+        return;
+    }
+    
+    // One write of a short line with O_APPEND, so lines appended by several
+    // instances don't interleave
+    char line[2*HS__GKSignatureSize + 2];
+    int lineSize = snprintf(line, sizeof(line), "%s\n", signature);
+    int fd = open(vhost->gkDenyListPath, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0 || write(fd, line, lineSize) != lineSize) {
+        lwsl_err("gatekeepr: couldn't append to the deny list %s: %s\n", vhost->gkDenyListPath, strerror(errno));
+    }
+    if (fd >= 0) close(fd);
+}
+
+bool HS__ValidateGKToken(HS_VHost* vhost, const char* gatedArea, const char* token) {
+    // keyId, userId, expires, signature
+    const char* fields[4];
+    int sizes[4];
+    int fieldsCount = 0;
+    
+    for (const char* c = token; fieldsCount < 4; ++c) {
+        fields[fieldsCount] = c;
+        while (*c && *c != '.') ++c;
+        sizes[fieldsCount] = c - fields[fieldsCount];
+        ++fieldsCount;
+        if (!*c) break;
+    }
+    
+    if (fieldsCount != 4 || sizes[3] != 2*HS__GKSignatureSize || fields[3][sizes[3]]) {
+        return false;
+    }
+    
+    long long expires = strtoll(fields[2], 0, 10);
+    if (time(0) >= expires) {
+        return false;
+    }
+    
+    HS_GKTokenKey* key = 0;
+    for (int i = 0; i < vhost->gkTokenKeysCount; ++i) {
+        if ((int) strlen(vhost->gkTokenKeys[i].id) == sizes[0] && memcmp(vhost->gkTokenKeys[i].id, fields[0], sizes[0]) == 0) {
+            key = &vhost->gkTokenKeys[i];
+            break;
+        }
+    }
+    if (!key) {
+        return false;
+    }
+    
+    uint8_t signature[HS__GKSignatureSize];
+    for (int i = 0; i < HS__GKSignatureSize; ++i) {
+        int hi = HS__HexValue(fields[3][2*i]);
+        int lo = HS__HexValue(fields[3][2*i+1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        signature[i] = hi*16 + lo;
+    }
+    
+    uint8_t expected[HS__GKSignatureSize];
+    HS__GKTokenSignature(key, gatedArea, token, fields[3] - token - 1, expected);
+    
+    if (CRYPTO_memcmp(signature, expected, HS__GKSignatureSize)) {
+        return false;
+    }
+    
+    return !HS__IsDeniedGKToken(vhost, fields[1], sizes[1]) && !HS__IsDeniedGKToken(vhost, fields[3], sizes[3]);
+}
+
+void HS__GatekeeprTask(HS_Server* server) {
+    for (int i = 0; i < server->vhostsCount; ++i) {
+        HS_VHost* vhost = &server->vhosts[i];
+        if (vhost->gkSessions) {
+            HS__SubmitGKSync(server, vhost);
+        }
+        HS__RefreshGKDenyList(vhost);
+    }
+}
+
+int HS_HandleGetRequestToGatedArea(HS_CallbackArgs* args) {
+    HS_HTTPClient* client = HS_GetHTTPClientData(args);
+    HS_VHost* vhost = HS_GetVHost(args);
+    
+    int result = 0;
+    
+    HS_GatedArea* area = HS_GetGatedAreaFromURI(vhost, client->uri);
+    
+    char* gatedAreaId = area->id;
+    char sessionCookie[512] = {};
+    char cookieName[256] = {};
+    sprintf(cookieName, "gatekeepr_%s", gatedAreaId);
+    
+    if (HS_GetCookieValue(client->socket, cookieName, sessionCookie, sizeof(sessionCookie))) {
+        if (vhost->gkTokenKeysCount && HS__ValidateGKToken(vhost, gatedAreaId, sessionCookie)) {
+            // Authentication successful
+            return HS_GetFileByURI(args);
+        }
+        
+        long long expirationDate = 0;
+        HS_GKSessionState state = HS__ValidateGKSession(vhost, gatedAreaId, sessionCookie, &expirationDate, client->gkLookupJob);
+        
+        if (state == HS_GKSessionState_Unknown) {
+            HS__SubmitGKLookup(args, gatedAreaId, sessionCookie);
+            return result;
+        }
+        
+        if (state == HS_GKSessionState_Valid) {
+            if (!vhost->gkTokenKeysCount) {
+                // Authentication successful
+                return HS_GetFileByURI(args);
+            }
+            
+            // A database session, exchanged for a token. The cookie is
+            // "userId.sessionId".
+            char userId[sizeof(HS_GKSession::cookie)] = {};
+            snprintf(userId, sizeof(userId), "%.*s", (int) strcspn(sessionCookie, "."), sessionCookie);
+            
+            char token[256];
+            if (!HS_CreateGatekeeprToken(vhost, gatedAreaId, userId, expirationDate, token, sizeof(token))) {
+                return HS_GetFileByURI(args);
+            }
+            
+            HS__DeleteGKSession(HS_GetServer(args), vhost, gatedAreaId, sessionCookie);
+            
+            char tokenCookie[sizeof(cookieName) + sizeof(token) + 64];
+            snprintf(tokenCookie, sizeof(tokenCookie), "%s=%s; Max-Age=%lld; Path=/;", cookieName, token, expirationDate - (long long) time(0));
+            HS_AddHTTPHeaderStatus(client, 302);
+            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_LOCATION, client->uri);
+            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_SET_COOKIE, tokenCookie);
+            HS_WriteResponse(client);
+            return result;
+        }
+    }
+    
+    // Authentication needed. Redirect to gatekeepr
+    //-----------------------------------------------
+    sprintf(sessionCookie, "%s=; Expires=Thu, 01 Jan 1970 00:00:01 GMT; Path=/;", cookieName);
+
+    char redirParam[HS_KILO_BYTES(2)] = {};
+    if (!HS_GetQueryStringValue(client, "redirect", redirParam, sizeof(redirParam))) {
+        lws_urlencode(redirParam, client->uri, sizeof(redirParam));
+    }
+
+    char redirURL[HS_KILO_BYTES(2)] = {};
+    int redirURLSize = snprintf(redirURL, sizeof(redirURL), "https://%s/gk/%s?redirect=%s", vhost->host, gatedAreaId, redirParam);
+    if (redirURLSize < 0 || redirURLSize >= (int) sizeof(redirURL)) {
+        // A truncated redirect would send the user elsewhere after the login
+        HS_CloseConnection(client, HTTP_STATUS_REQ_URI_TOO_LONG);
+        return result;
+    }
+    
+    HS_AddHTTPHeaderStatus(client, 302);
+    HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_LOCATION, redirURL);
+    HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_SET_COOKIE, sessionCookie);
+    HS_WriteResponse(client);
+    
+    return result;
+}
+
+// Handles the request again once its session cookie was looked up. A session
+// validated from the looked up row has its use written back by the same job.
+void HS__ReplayGatedRequest(HS_CallbackArgs* args, HS_HTTPClient* client) {
+    HS__GKSessionJob* job = client->gkLookupJob;
+    HS_HandleGetRequestToGatedArea(args);
+    
+    if (client->gkLookupJob == job) client->gkLookupJob = 0;
+    
+    if (job->session.dirty) {
+        job->ioJob.work = HS__WriteGKSessionChange;
+        job->ioJob.done = HS__FreeGKSessionJob;
+        job->client = 0;
+        HS_SubmitIOJob(HS_GetServer(args), &job->ioJob);
+    } else {
+        free(job);
+    }
+}
+
+int HS_GetFileByURIOrAuthenticate(HS_CallbackArgs* args) {
+    HS_HTTPClient* client = HS_GetHTTPClientData(args);
+    HS_VHost* vhost = HS_GetVHost(args);
+    
+    if (HS_StartsWith(client->uri, "/gk/")) {
+        return HS_GatekeeprGetRequestHandler(args);
+    }
+    
+    if (HS_GetGatedAreaFromURI(vhost, client->uri)) {
+        return HS_HandleGetRequestToGatedArea(args);
+    }
+    
+    return HS_GetFileByURI(args);
+}
+  
+#ifdef __linux__
+// Plain-TCP HTTP/1 connections can have file bodies handed to the kernel with
+// sendfile(2). TLS and h2 streams need lws to frame/encrypt every byte.
+bool HS__CanSendFile(HS_HTTPClient* client) {
+    return !lws_is_ssl(client->socket) && lws_get_network_wsi(client->socket) == client->socket;
+}
+#endif
+
+void HS__SetCacheBustVersion(HS_VHost* server) {
+    HS_Date dateNow = HS_GetDateNow();
+    snprintf(server->cacheBustVersion, sizeof(server->cacheBustVersion), "-v%04d.%02d.%02d.%02d.%02d.%02d",
+             dateNow.year % 10000, dateNow.month % 100, dateNow.day % 100, dateNow.hour % 100, dateNow.minute % 100, dateNow.second % 100);
+}
+
+// Cache warm-up
+//---------------
+// Loads every cacheable file of a vhost's served directories into the file
+// cache when the vhost starts, so few clients pay for the disk reads and the
+// cache busting / SSI transforms. It runs in the background on the I/O pool:
+// the served directories are walked by one job, then the files are loaded by
+// a few jobs at a time, so that the loads of requests aren't queued behind
+// the whole warm-up. Requests for files not loaded yet fill the cache as
+// usual. Loads that finish after a change under the vhost's roots (or after
+// the file was cached by a request) are dropped.
+
+#define HS__WarmUpJobsInFlightCap 4
+
+struct HS__WarmUp;
+
+struct HS__WarmUpJob {
+    HS_IOJob ioJob;
+    HS__WarmUp* warmUp;
+    
+    char uri[HS__URICap];
+    char filePath[HS__FilePathCap];
+    char sourcePath[HS__FilePathCap];
+    const char* rootDir;
+    const char* mimeType;
+    bool cacheBust;
+    bool parseSSI;
+    char cacheBustVersion[32];
+    int  generation; // the vhost's pathCacheGeneration when the job was submitted
+    
+    // output
+    char* fileBuffer;
+    char* includes;
+    int   fileSize;
+    time_t modifiedTime;
+    bool mapped;
+    HS_FileMapping mapping;
+};
+
+struct HS__WarmUp {
+    HS_IOJob ioJob; // walks the served directories
+    HS_Server* server;
+    HS_VHost* vhost;
+    const char* rootDir;   // of the directory being walked
+    const char* uriPrefix;
+    HS__WarmUpJob* jobs;
+    int jobsCount;
+    int nextJob;
+    int jobsInFlight;
+    bool continuing; // jobs run inline when there are no I/O threads
+    int filesCount;
+    long long bytesCount;
+    lws_usec_t startTime;
+};
+
+void HS__AddWarmUpJob(void* data, const char* filePath) {
+    HS__WarmUp* warmUp = (HS__WarmUp*) data;
+    HS_VHost* vhost = warmUp->vhost;
+    const char* rootDir = warmUp->rootDir;
+    if (warmUp->jobsCount == HS__FileMapCap) return;
+    
+    HS__WarmUpJob* job = &warmUp->jobs[warmUp->jobsCount];
+    *job = {};
+    if (snprintf(job->uri, HS__URICap, "%s%s", warmUp->uriPrefix, filePath + strlen(rootDir)) >= HS__URICap) return;
+    
+    // Only the root the request would be resolved against is warmed
+    HS_Rule* rootDirMapping = HS_MatchRule(&vhost->rootDirMap, job->uri);
+    if (strcmp(rootDirMapping ? rootDirMapping->value : vhost->servedFilesRootDir, rootDir)!=0) return;
+    
+    HS_RealPath(filePath, job->sourcePath);
+    if (!HS__IsPathUnder(job->sourcePath, rootDir)) return;
+    
+    job->rootDir = rootDir;
+    job->mimeType = HS_GetMimeType(job->sourcePath);
+    job->cacheBust = HS__NeedsCacheBusting(vhost, job->uri, job->mimeType);
+    job->parseSSI = HS__NeedsSSIParsing(vhost, job->uri, job->mimeType);
+    
+    int filePathSize = 0;
+    if (job->parseSSI) {
+        filePathSize = snprintf(job->filePath, HS__FilePathCap, "%s/.ssi-parsed%s", rootDir, job->uri);
+    } else if (job->cacheBust) {
+        filePathSize = snprintf(job->filePath, HS__FilePathCap, "%s/.cache-bust%s", rootDir, job->uri);
+    } else {
+        strcpy(job->filePath, job->sourcePath);
+    }
+    if (filePathSize >= HS__FilePathCap) return;
+    
+    // Already in memory
+    HS_ServedArchive* archive = 0;
+    if (!job->cacheBust && !job->parseSSI && HS__FindArchivedFile(vhost, job->uri, &archive)) return;
+    
+    ++warmUp->jobsCount;
+}
+
+// Runs on a pool thread
+void HS__WalkWarmUpFiles(HS_IOJob* ioJob) {
+    HS__WarmUp* warmUp = (HS__WarmUp*) ioJob;
+    HS_VHost* vhost = warmUp->vhost;
+    
+    if (vhost->servedFilesRootDir[0]) {
+        warmUp->rootDir = vhost->servedFilesRootDir;
+        warmUp->uriPrefix = "";
+        HS__WalkFiles(warmUp->rootDir, HS__AddWarmUpJob, warmUp);
+    }
+    
+    for (int i = 0; i < vhost->rootDirMap.rulesCount; ++i) {
+        HS_Rule* rule = &vhost->rootDirMap.rules[i];
+        char uriPrefix[HS__URICap] = {};
+        snprintf(uriPrefix, sizeof(uriPrefix), "%.*s", rule->patternSize - 1, rule->pattern); // without the trailing '/'
+        warmUp->rootDir = rule->value;
+        warmUp->uriPrefix = uriPrefix;
+        HS__WalkFiles(warmUp->rootDir, HS__AddWarmUpJob, warmUp);
+    }
+}
+
+// Runs on a pool thread
+void HS__LoadWarmUpFile(HS_IOJob* ioJob) {
+    HS__WarmUpJob* job = (HS__WarmUpJob*) ioJob;
+    HS_VHost* vhost = job->warmUp->vhost;
+    long long maxSize = vhost->memCacheMaxSizeMB > 0 ? (long long) HS_MEGA_BYTES(vhost->memCacheMaxSizeMB) : INT_MAX;
+    
+    if (job->cacheBust || job->parseSSI) {
+        job->fileBuffer = HS__LoadTransformedFile(job->cacheBustVersion, job->rootDir, job->sourcePath, job->cacheBust, job->parseSSI, &job->fileSize, &job->includes);
+        job->modifiedTime = time(0);
+        return;
+    }
+    
+    if (vhost->mappedFileCache && HS__MapFile(job->sourcePath, &job->mapping)) {
+        if (job->mapping.size <= maxSize) {
+            job->mapped = true;
+#ifndef _WIN32
+            // Fault the pages in now rather than on the first request
+            madvise(job->mapping.data, job->mapping.size, MADV_WILLNEED);
+#endif
+            return;
         }
-        
-        // URI processing
-        //-----------------
-        for (int i = 0; i < server->uriMapSize; ++i) {
-            if (HS_EndsWith(server->uriMap[i].uri, "*")) {
-                if (HS_StartsWith(client->uri, server->uriMap[i].uri, server->uriMap[i].uriSize-1)) {
-                    strcpy(client->uri, server->uriMap[i].resource);
-                    break;
-                }
-            } else if (HS_StartsWith(server->uriMap[i].uri, "*")) {
-                char* ending = server->uriMap[i].uri+1;
-                if (HS_EndsWith(client->uri, ending)) {
-                    strcpy(client->uri, server->uriMap[i].resource);
-                    break;
-                }
-            } else if (strcmp(server->uriMap[i].uri, client->uri)==0) {
-                strcpy(client->uri, server->uriMap[i].resource);
-                break;
-            }
+        HS__UnmapFile(&job->mapping);
+    }
+    
+    FILE* file = fopen(job->sourcePath, "rb");
+    if (!file) return;
+    
+    long long fileSize = HS_GetLargeFileSize(file);
+    if (fileSize <= maxSize) {
+        job->modifiedTime = HS_GetFileModifiedTime(file);
+        job->fileSize = fileSize;
+        job->fileBuffer = (char*) calloc(1, LWS_PRE + fileSize);
+        if (fread(job->fileBuffer + LWS_PRE, fileSize, 1, file) != 1 && fileSize) {
+            free(job->fileBuffer);
+            job->fileBuffer = 0;
         }
+    }
+    fclose(file);
+}
 
-        // Root directory
-        //------------------
-        const char* rootDir = server->servedFilesRootDir;
-        const char* unprefixedURI = client->uri;
+void HS__FinishWarmUpFile(HS_IOJob* ioJob);
 
-        for (int i = 0; i < server->rootDirMapSize; ++i) {
-            const char* uriPrefix = server->rootDirMap[i].uriPrefix;
-            if (HS_StartsWith(client->uri, uriPrefix)) {
-                rootDir = server->rootDirMap[i].path;
-                unprefixedURI = client->uri + strlen(uriPrefix) - 1;
-            }
+// Keeps up to HS__WarmUpJobsInFlightCap loads queued, and ends the warm-up
+// once they are all done.
+void HS__ContinueWarmUp(HS__WarmUp* warmUp) {
+    HS_Server* server = warmUp->server;
+    HS_VHost* vhost = warmUp->vhost;
+    
+    if (warmUp->continuing) return;
+    warmUp->continuing = true;
+    
+    while (!server->ioStopping && warmUp->jobsInFlight < HS__WarmUpJobsInFlightCap && warmUp->nextJob < warmUp->jobsCount) {
+        HS__WarmUpJob* job = &warmUp->jobs[warmUp->nextJob++];
+        if (HS_GetFileByPath(vhost->loadedFiles, vhost->loadedFilesCount, job->filePath)) continue;
+        
+        job->ioJob.work = HS__LoadWarmUpFile;
+        job->ioJob.done = HS__FinishWarmUpFile;
+        job->warmUp = warmUp;
+        job->generation = vhost->pathCacheGeneration;
+        snprintf(job->cacheBustVersion, sizeof(job->cacheBustVersion), "%s", vhost->cacheBustVersion);
+        ++warmUp->jobsInFlight;
+        HS_SubmitIOJob(server, &job->ioJob);
+    }
+    
+    warmUp->continuing = false;
+    if (warmUp->jobsInFlight) return;
+    
+    if (vhost->verbosity) {
+        printf("WarmUp | VHost=%s | Files=%d | Bytes=%lld | Time=%.1fms\n", vhost->name, warmUp->filesCount, warmUp->bytesCount, (lws_now_usecs() - warmUp->startTime)/1000.0);
+    }
+    free(warmUp->jobs);
+    free(warmUp);
+}
+
+void HS__FinishWarmUpFile(HS_IOJob* ioJob) {
+    HS__WarmUpJob* job = (HS__WarmUpJob*) ioJob;
+    HS__WarmUp* warmUp = job->warmUp;
+    HS_Server* server = warmUp->server;
+    HS_VHost* vhost = warmUp->vhost;
+    --warmUp->jobsInFlight;
+    
+    // Stale, or already loaded by a request
+    bool keep = !server->ioStopping && vhost->loadedFiles && (job->mapped || job->fileBuffer)
+             && job->generation == vhost->pathCacheGeneration
+             && !HS_GetFileByPath(vhost->loadedFiles, vhost->loadedFilesCount, job->filePath)
+             && HS__GetFreeFileEntry(vhost);
+    
+    HS_FileMapping* mapping = 0;
+    if (keep && job->mapped) {
+        mapping = HS__AddFileMapping(server, &job->mapping);
+        keep = mapping != 0;
+    } else if (job->mapped) {
+        HS__UnmapFile(&job->mapping);
+    }
+    
+    if (!keep) {
+        if (job->fileBuffer) free(job->fileBuffer);
+        if (job->includes) free(job->includes);
+        HS__ContinueWarmUp(warmUp);
+        return;
+    }
+    
+    HS_FileMapEntry* entry = HS__AddFileEntry(vhost, job->uri, job->filePath, job->sourcePath, job->mimeType);
+    entry->fileBuffer = mapping ? mapping->data : job->fileBuffer;
+    entry->fileContent = mapping ? mapping->data : job->fileBuffer + LWS_PRE;
+    entry->fileSize = mapping ? mapping->size : job->fileSize;
+    entry->modifiedTime = mapping ? mapping->modifiedTime : job->modifiedTime;
+    entry->mapping = mapping;
+    entry->includes = job->includes;
+    entry->cacheBusted = job->cacheBust;
+    
+    entry->cacheControl = HS__DefaultCacheControlValue;
+    entry->cacheControlSize = sizeof(HS__DefaultCacheControlValue)-1;
+    
+    if (!vhost->disableCacheControl) {
+        HS_Rule* cacheControlRule = HS_MatchRule(&vhost->cacheControlMap, job->uri);
+        if (cacheControlRule) {
+            entry->cacheControl = cacheControlRule->value;
+            entry->cacheControlSize = cacheControlRule->valueSize;
         }
+    }
+    
+    ++warmUp->filesCount;
+    warmUp->bytesCount += entry->fileSize;
+    HS__ContinueWarmUp(warmUp);
+}
 
-        if (!rootDir[0]) {
-            HS_CloseConnection(client, HTTP_STATUS_NOT_FOUND);
+void HS__FinishWarmUpWalk(HS_IOJob* ioJob) {
+    HS__WarmUp* warmUp = (HS__WarmUp*) ioJob;
+    HS__ContinueWarmUp(warmUp);
+}
+
+// Timer function: the I/O pool is running by the time it fires
+void HS__WarmFileCache(HS_Server* server, void* data) {
+    HS_VHost* vhost = (HS_VHost*) data;
+    
+    HS__WarmUp* warmUp = (HS__WarmUp*) calloc(1, sizeof(HS__WarmUp));
+    warmUp->ioJob.work = HS__WalkWarmUpFiles;
+    warmUp->ioJob.done = HS__FinishWarmUpWalk;
+    warmUp->server = server;
+    warmUp->vhost = vhost;
+    warmUp->jobs = (HS__WarmUpJob*) calloc(HS__FileMapCap, sizeof(HS__WarmUpJob));
+    warmUp->startTime = lws_now_usecs();
+    HS_SubmitIOJob(server, &warmUp->ioJob);
+}
+
+// Writes the next frame of the response body. The body is either the whole
+// file or the byte ranges asked for in a Range header, and it comes either from
+// memory (fileContent) or from a file: a shared file mapping's, or streamFile.
+// Files are read on the I/O pool, unless the kernel sends them.
+int HS__WriteBodyChunk(HS_VHost* server, HS_HTTPClient* client) {
+    lws* socket = client->socket;
+    long long bodySize = HS__GetBodySize(client);
+    
+    if (!client->rangesCount) {
+        lwsl_debug("HS_HTTPCallback | VHost=%s | Reason=LWS_CALLBACK_HTTP_WRITEABLE | Size=%lld | WSI=%p\n", server->name, bodySize, socket);
+        
+        if (!bodySize) {
+            lws_write(socket, (uint8_t*) server->frameStart, 0, LWS_WRITE_HTTP_FINAL);
+            client->closeStatus = (http_status) 0;
             return -1;
         }
-
-        // Localization
-        //--------------
-        char tempBuffer[4096] = {};
         
-        if (HS_StartsWith(client->uri, "/$lang/")) {
-            char acceptLanguage[256] = {};
-            strcpy(acceptLanguage, client->acceptLanguage);
-            
-            char* cell = strtok(acceptLanguage, ",");
+        client->ranges[0].first = 0;
+        client->ranges[0].last = bodySize - 1;
+        client->rangesCount = 1;
+    }
+    
+    bool multipart = client->rangesCount > 1;
+    bool finalWrite = false;
+    
+    if (multipart && client->partHeaderPending) {
+        // Part header, or closing delimiter after the last part
+        int amount = HS__FormatPartHeader(client, client->rangeIndex, bodySize, server->frameStart, server->h2MaxFrameSize);
+        finalWrite = client->rangeIndex == client->rangesCount;
+        lws_write(socket, (uint8_t*) server->frameStart, amount, finalWrite ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP);
+        client->partHeaderPending = false;
+    } else {
+        HS_ByteRange& range = client->ranges[client->rangeIndex];
+        long long offset = range.first + client->rangeAt;
+        long long remaining = range.last + 1 - offset;
+        int amount = (int) HS_Min(remaining, (long long) server->h2MaxFrameSize);
+        bool sentByKernel = false;
+        HS_FileMapping* mapping = client->streamFile ? 0 : client->fileEntry ? client->fileEntry->mapping : client->archive ? client->archive->mapping : client->mapping;
+        long long bodyOffset = mapping ? client->fileContent - mapping->data : 0; // in the file
+        
+#ifdef __linux__
+        int sourceFd = client->streamFile ? fileno(client->streamFile) : mapping ? mapping->fd : -1;
+        
+        if (sourceFd >= 0 && HS__CanSendFile(client)) {
+            if (lws_partial_buffered(socket)) {
+                // lws still has queued bytes for this socket; they must go out first.
+                lws_callback_on_writable(socket);
+                return 0;
+            }
             
-            char locURI[2048] = {};
-            char filePath[4096] = {};
+            off_t fileOffset = bodyOffset + offset;
+            ssize_t sent = sendfile(lws_get_socket_fd(socket), sourceFd, &fileOffset, amount);
             
-            while (cell) {
-                char lang[32] = {};
-                char* langStart = cell;
-                
-                // Trim spaces
-                while (*langStart && *langStart == ' ') ++langStart;
-                
-                int at = 0;
-                
-                while (langStart[at] && langStart[at] != ';' && langStart[at] != ' ') {
-                    lang[at] = langStart[at];
-                    ++at;
-                }
-                
-                HS_ToLower(lang);
-                
-                sprintf(locURI, "/%s/%s", lang, client->uri + 7);
-                
-                sprintf(tempBuffer, "%s%s", rootDir, locURI);
-                HS_RealPath(tempBuffer, filePath);
-                
-                if (HS_IsRegularFile(filePath)) {
-                    strcpy(client->uri, locURI);
-                    strcpy(client->contentLanguage, lang);
-                    break;
-                }
-                
-                cell = strtok(0, ",");
+            if (sent < 0) {
+                if (errno != EAGAIN && errno != EINTR) return -1;
+                sent = 0;
+            } else if (sent == 0) {
+                // End of file before the end of the body: it was truncated
+                lwsl_err("HS_HTTPCallback | VHost=%s | %s was truncated while being sent\n", server->name, client->filePath);
+                if (mapping) mapping->truncated = true;
+                return -1;
             }
             
-            if (!client->contentLanguage[0]) {
-                sprintf(locURI, "/%s/%s", server->defaultContentLanguage, client->uri + 7);
-                strcpy(client->uri, locURI);
-                strcpy(client->contentLanguage, server->defaultContentLanguage);
-            }
+            amount = (int) sent;
+            sentByKernel = true;
+            server->metrics.bodyBytesSendFile += amount;
         }
+#endif
         
-        // Infer file path
-        //-----------------------
-        sprintf(tempBuffer, "%s%s", rootDir, unprefixedURI);
-        HS_RealPath(tempBuffer, client->filePath);
+        bool readFromFile = client->streamFile || mapping;
         
-        if (!HS_StartsWith(client->filePath, rootDir)) {
-            HS_CloseConnection(client, HTTP_STATUS_NOT_FOUND);
-            httpStatus = (http_status) 0; // Handled
-        } else if (!HS_IsRegularFile(client->filePath)) {
-            if (HS_IsDirectory(client->filePath)) {
-                strcat(client->filePath, "/index.html");
+        if (!sentByKernel && readFromFile) {
+            HS__FileReadJob* job = client->fileReadJob;
+            
+            if (!job || (!job->pending && (job->offset != bodyOffset + offset || job->amount != amount))) {
+                HS__SubmitFileChunkRead(server, client, mapping, bodyOffset + offset, amount);
+                job = client->fileReadJob;
             }
-
-            if (!HS_IsRegularFile(client->filePath)) {
-                if (server->error404File[0]) {
-                    snprintf(client->filePath, PATH_MAX, "%s%s", rootDir, server->error404File);
-                    httpStatus = HTTP_STATUS_NOT_FOUND;
-                    strcpy(client->uri, server->error404File);
-                } else {
-                    HS_CloseConnection(client, HTTP_STATUS_NOT_FOUND);
-                    httpStatus = (http_status) 0; // Handled
-                }
+            
+            if (job->pending) return 0; // Written when the read is done
+            
+            if (job->truncated) {
+                // Ended early: the rest of the body can't be sent
+                lwsl_err("HS_HTTPCallback | VHost=%s | %s was truncated while being sent\n", server->name, client->filePath);
+                if (mapping) mapping->truncated = true;
+                return -1;
+            } else if (job->failed) {
+                lwsl_err("HS_HTTPCallback | VHost=%s | Failed to read %s\n", server->name, client->filePath);
+                return -1;
             }
+            
+            server->metrics.bodyBytesCopied += amount;
         }
-
-        if (httpStatus != 0) {
-            // Get mimetype
-            //----------------
-            mimeType = lws_get_mimetype(client->filePath, 0);
-
-            if (!mimeType) {
-                if (HS_EndsWith(client->filePath, ".wasm")) {
-                    mimeType = "application/wasm";
-                } else if (HS_EndsWith(client->filePath, ".woff2")) {
-                    mimeType = "font/woff2";
-                } else if (HS_EndsWith(client->filePath, ".map")) {
-                    mimeType = "application/json";
-                } else if (HS_EndsWith(client->filePath, ".zip")) {
-                    mimeType = "application/zip";
-                } else if (HS_EndsWith(client->filePath, ".pdf")) {
-                    mimeType = "application/pdf";
-                } else if (HS_EndsWith(client->filePath, ".txt")) {
-                    mimeType = "text/plain";
-                } else {
-                    mimeType = "text/html";
-                }
-            }
-
-            // Cache busting
-            //---------------
-            bool needsCacheBusting = false;
-            if (strcmp(mimeType, "text/html")==0 || strcmp(mimeType, "text/javascript")==0 || strcmp(mimeType, "text/css")==0) {
-                for (int i = 0; i < server->cacheBustSize; ++i) {
-                    if (HS_EndsWith(server->cacheBust[i], "*")) {
-                        if (HS_StartsWith(client->uri, server->cacheBust[i], strlen(server->cacheBust[i])-1)) {
-                            needsCacheBusting = true;
-                            break;
-                        }
-                    } else if (HS_StartsWith(server->cacheBust[i], "*")) {
-                        char* ending = server->cacheBust[i]+1;
-                        if (HS_EndsWith(client->uri, ending)) {
-                            needsCacheBusting = true;
-                            break;
-                        }
-                    } else if (strcmp(client->uri, server->cacheBust[i])==0) {
-                        needsCacheBusting = true;
-                        break;
-                    }
-                }
-            }
-
-            if (needsCacheBusting) {
-                char transformedPath[HS__FilePathCap] = {};
-                char transformedFullPath[HS__FilePathCap*2] = {};
-                sprintf(transformedPath, "/.cache-bust%s", client->uri);
-                sprintf(transformedFullPath, "%s%s", rootDir, transformedPath);
-
-                if (!HS_IsRegularFile(transformedFullPath)) {
-                    HS_CreateFilePath(rootDir, transformedPath);
-
-                    FILE* file = fopen(client->filePath, "rb");
-                    char* fileContent = 0;
-                    int   fileSize = 0;
-
-                    if (file) {
-                        fileSize = HS_GetFileSize(file);
-                        fileContent = (char*) calloc(1, fileSize+1);
-                        fread(fileContent, fileSize, 1, file);
-                        fclose(file);
-
-                        HS_Replace(fileContent, fileContent, fileSize, "-v0000.00.00.00.00.00", server->cacheBustVersion);
-                        HS_SaveFile(fileContent, fileSize, transformedFullPath);
-                        free(fileContent);
-                    } else {
-                        //TODO error
-                    }
-                }
-
-                strcpy(client->filePath, transformedFullPath);
-            }
-
-            // Check if needs SSI Parsing
-            //-----------------------------
-            bool needsSSIParsing = false;
-            if (strcmp(mimeType, "text/html")==0) {
-                for (int i = 0; i < server->needsSSIParsingSize; ++i) {
-                    if (HS_EndsWith(server->needsSSIParsing[i], "*")) {
-                        if (HS_StartsWith(client->uri, server->needsSSIParsing[i], strlen(server->needsSSIParsing[i])-1)) {
-                            needsSSIParsing = true;
-                            break;
-                        }
-                    } else if (strcmp(server->needsSSIParsing[i], client->uri)==0) {
-                        needsSSIParsing = true;
-                        break;
-                    }
-                }
-            }
-
-            if (needsSSIParsing) {
-                char transformedPath[HS__FilePathCap] = {};
-                char transformedFullPath[HS__FilePathCap*2] = {};
-                sprintf(transformedPath, "/.ssi-parsed%s", client->uri);
-                sprintf(transformedFullPath, "%s%s", rootDir, transformedPath);
-
-                if (!HS_IsRegularFile(transformedFullPath)) {
-                    HS_CreateFilePath(rootDir, transformedPath);
-                    FILE* file = fopen(client->filePath, "rb");
-
-                    if (file) {
-                        HS_DoSSI(file, rootDir, transformedFullPath);
-                        fclose(file);
-                    } else {
-                        // TODO: handle error
-                    }
-                }
-
-                strcpy(client->filePath, transformedFullPath);
+        
+        client->rangeAt += amount;
+        server->metrics.bodyBytesSent += amount;
+        client->responseBytes += amount;
+        
+        if (amount == remaining) {
+            ++client->rangeIndex;
+            client->rangeAt = 0;
+            client->partHeaderPending = multipart;
+            finalWrite = !multipart && client->rangeIndex == client->rangesCount;
+        }
+        
+        lws_write_protocol writeProtocol = finalWrite ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP;
+        
+        if (sentByKernel) {
+            if (finalWrite) lws_write(socket, (uint8_t*) server->frameStart, 0, writeProtocol);
+        } else if (readFromFile) {
+            lws_write(socket, (uint8_t*) client->fileReadJob->buffer + LWS_PRE, amount, writeProtocol);
+            
+            if (!finalWrite && client->rangeIndex < client->rangesCount) {
+                // Read ahead while this frame goes out
+                HS_ByteRange& next = client->ranges[client->rangeIndex];
+                long long nextOffset = next.first + client->rangeAt;
+                HS__SubmitFileChunkRead(server, client, mapping, bodyOffset + nextOffset, (int) HS_Min(next.last + 1 - nextOffset, (long long) server->h2MaxFrameSize));
             }
+        } else {
+            // Zero-copy: write straight from the body buffer. lws only needs the
+            // LWS_PRE bytes before the data as scratch space for framing (h2 frame
+            // headers). Those bytes belong to the previous chunk (or the headroom
+            // of fileBuffer), so they are saved and restored around the write.
+            uint8_t* data = (uint8_t*) client->fileContent + offset;
+            uint8_t saved[LWS_PRE];
+            memcpy(saved, data - LWS_PRE, LWS_PRE);
+            lws_write(socket, data, amount, writeProtocol);
+            memcpy(data - LWS_PRE, saved, LWS_PRE);
+        }
+    }
+    
+    if (finalWrite) {
+        lwsl_debug("WriteFinished | VHost=%s | WSI=%p\n", server->name, socket);
+        if (client->requestTime) client->responseTime = lws_now_usecs();
+        client->closeStatus = (http_status) 0;
+        return -1;
+    }
+    
+    lws_set_timeout(socket, PENDING_TIMEOUT_HTTP_CONTENT, 20);
+    lws_callback_on_writable(socket);
+    return 0;
+}
 
-            // Cache control
-            //---------------
-            if (!server->disableFileCache) {
-                for (int i = 0; i < server->cacheControlMapSize; ++i) {
-                    if (HS_EndsWith(server->cacheControlMap[i].uri, "*")) {
-                        if (HS_StartsWith(client->uri, server->cacheControlMap[i].uri, server->cacheControlMap[i].uriSize-1)) {
-                            cacheControl = server->cacheControlMap[i].cacheString;
-                            cacheControlSize = strlen(server->cacheControlMap[i].cacheString);
-                            break;
-                        }
-                    } else if (server->cacheControlMap[i].uri[0] == '*') {
-                        char* ending = server->cacheControlMap[i].uri+1;
-                        if (HS_EndsWith(client->uri, ending)) {
-                            cacheControl = server->cacheControlMap[i].cacheString;
-                            cacheControlSize = strlen(server->cacheControlMap[i].cacheString);
-                            break;
-                        }
-                    } else if (strcmp(server->cacheControlMap[i].uri, client->uri)==0) {
-                        cacheControl = server->cacheControlMap[i].cacheString;
-                        cacheControlSize = strlen(server->cacheControlMap[i].cacheString);
-                        break;
-                    }
-                }
-            }
+// Access log
+//------------
+FILE* HS__OpenAccessLogFile(const char* path) {
+    FILE* file = fopen(path, "a");
+    if (!file) {
+        lwsl_err("HS_AccessLog | Can't open %s: %s\n", path, strerror(errno));
+        return 0;
+    }
+    
+    // Batches are written whole, with a single write
+    setvbuf(file, 0, _IONBF, 0);
+    return file;
+}
+
+// Writes the URI with the bytes that would break a line (or the JSON string)
+// escaped. Returns the size written.
+int HS__EscapeAccessLogURI(char* out, const char* uri, bool json) {
+    static const char hexDigits[] = "0123456789ABCDEF";
+    char* at = out;
+    
+    for (const unsigned char* c = (const unsigned char*) uri; *c; ++c) {
+        if (json && (*c == '"' || *c == '\\')) {
+            *at++ = '\\';
+            *at++ = *c;
+        } else if (*c <= ' ' || *c == 0x7f || (!json && *c == '"')) {
+            *at++ = '%';
+            *at++ = hexDigits[*c >> 4];
+            *at++ = hexDigits[*c & 15];
+        } else {
+            *at++ = *c;
+        }
+    }
+    
+    *at = 0;
+    return at - out;
+}
 
-            fileEntry = HS_GetFileByPath(server->loadedFiles, server->loadedFilesCount, client->filePath);
+int HS__FormatAccessLogRecord(HS_AccessLog* log, HS_AccessLogRecord* record, char* out) {
+    lws_usec_t time = record->time + log->clockOffset;
+    time_t second = time/1000000;
+    if (second != log->formattedSecond) {
+        tm date;
+#ifdef _WIN32
+        gmtime_s(&date, &second);
+#else
+        gmtime_r(&second, &date);
+#endif
+        strftime(log->formattedTime, sizeof(log->formattedTime), "%Y-%m-%dT%H:%M:%S", &date);
+        log->formattedSecond = second;
+    }
+    
+    char uri[3*HS__AccessLogURICap];
+    bool json = log->format == HS_AccessLogFormat_JSON;
+    HS__EscapeAccessLogURI(uri, record->uri, json);
+    
+    int milliseconds = (int) (time/1000 % 1000);
+    const char* ipAddress = record->ipAddress[0] ? record->ipAddress : "-";
+    
+    if (json) {
+        return snprintf(out, HS__AccessLogLineCap, "{\"time\":\"%s.%03dZ\",\"ip\":\"%s\",\"vhost\":\"%s\",\"method\":\"%s\",\"uri\":\"%s\",\"status\":%d,\"bytes\":%lld,\"cache\":\"%s\",\"protocol\":\"%s\",\"service_us\":%d}\n",
+                        log->formattedTime, milliseconds, ipAddress, record->vhost, record->method, uri, record->status, record->bytes,
+                        record->cacheHit ? "hit" : "miss", record->h2 ? "h2" : "h1", record->serviceTime);
+    }
+    
+    return snprintf(out, HS__AccessLogLineCap, "%s.%03dZ %s %s \"%s %s\" %d %lld %s %s %dus\n",
+                    log->formattedTime, milliseconds, ipAddress, record->vhost, record->method, uri, record->status, record->bytes,
+                    record->cacheHit ? "hit" : "miss", record->h2 ? "h2" : "h1", record->serviceTime);
+}
 
-            if (fileEntry) {
-                client->fileBuffer = fileEntry->fileBuffer;
-                client->fileContent = fileEntry->fileContent;
-                client->fileSize = fileEntry->fileSize;
-                ++fileEntry->clientsReading;
-                client->fileEntry = fileEntry;
-            } else {
-                // Load resource
-                //---------------
-                FILE* file = fopen(client->filePath, "rb");
-                if (file) {
-                    client->fileSize = HS_GetFileSize(file);
-                    client->fileBuffer = (char*) calloc(1, LWS_PRE + client->fileSize);
-                    client->fileContent = client->fileBuffer + LWS_PRE;
-                    fread(client->fileContent, client->fileSize, 1, file);
-                    fclose(file);
-                } else {
-                    // TODO: ERROR
-                }
-            }
+// Called with the log's mutex held
+void HS__FlushAccessLog(HS_AccessLog* log) {
+    if (log->batchSize && log->file) {
+        fwrite(log->batch, 1, log->batchSize, log->file);
+    }
+    log->batchSize = 0;
+}
 
-            if (server->disableFileCache || (server->memCacheMaxSizeMB > 0 && (int)client->fileSize > HS_MEGA_BYTES(server->memCacheMaxSizeMB))) {
-                // Don't cache
-                // TODO: Make this work on windows
-                HS_RmDir("%s/.cache-bust", rootDir);
-                HS_RmDir("%s/.ssi-parsed", rootDir);
-            } else if (!fileEntry) {
-                fileEntry = &server->loadedFiles[server->loadedFilesCount++];
-                strcpy(fileEntry->uri, client->uri);
-                strcpy(fileEntry->filePath, client->filePath);
-                fileEntry->fileBuffer = client->fileBuffer;
-                fileEntry->fileContent = client->fileContent;
-                fileEntry->fileSize = client->fileSize;
-                fileEntry->mimeType = mimeType;
-                fileEntry->cacheControl = cacheControl;
-                fileEntry->cacheControlSize = cacheControlSize;
-                fileEntry->clientsReading = 1;
+// Called with the log's mutex held
+void HS__DrainAccessLogRing(HS_AccessLog* log, HS_AccessLogRing* ring) {
+    unsigned head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    unsigned tail = ring->tail;
+    
+    while (tail != head) {
+        if (log->batchSize + HS__AccessLogLineCap > HS__AccessLogBatchSize) {
+            HS__FlushAccessLog(log);
+        }
+        
+        HS_AccessLogRecord* record = &ring->records[tail & (HS__AccessLogRingCap-1)];
+        log->batchSize += HS__FormatAccessLogRecord(log, record, log->batch + log->batchSize);
+        ++tail;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+}
 
-                client->fileEntry = fileEntry;
-            }
-        } else {
-            // Response Not OK.
+void* HS__AccessLogWorker(void* data) {
+    HS_AccessLog* log = (HS_AccessLog*) data;
+    pthread_mutex_lock(&log->mutex);
+    
+    while (true) {
+        if (__atomic_exchange_n(&log->reopenRequested, 0, __ATOMIC_ACQ_REL)) {
+            if (log->file) fclose(log->file);
+            log->file = HS__OpenAccessLogFile(log->path);
         }
-    } else {
-        client->fileBuffer = fileEntry->fileBuffer;
-        client->fileContent = fileEntry->fileContent;
-        client->fileSize = fileEntry->fileSize;
         
-        mimeType = fileEntry->mimeType;
-        cacheControl = fileEntry->cacheControl;
-        cacheControlSize = fileEntry->cacheControlSize;
-        ++fileEntry->clientsReading;
+        // Records are timed with the monotonic clock
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        log->clockOffset = (lws_usec_t) now.tv_sec*1000000 + now.tv_nsec/1000 - lws_now_usecs();
         
-        client->fileEntry = fileEntry;
+        for (int i = 0; i < log->ringsCount; ++i) {
+            HS__DrainAccessLogRing(log, log->rings[i]);
+        }
+        HS__FlushAccessLog(log);
+        
+        if (log->stopping) break;
+        
+        timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += HS__AccessLogFlushPeriod*1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_nsec -= 1000000000L;
+            ++deadline.tv_sec;
+        }
+        pthread_cond_timedwait(&log->cond, &log->mutex, &deadline);
     }
+    
+    pthread_mutex_unlock(&log->mutex);
+    return 0;
+}
 
-    if (httpStatus != 0) { // httpStatus == 0 means request already handled.
-        // Write headers
-        //-----------------
-        HS_AddHTTPHeaderStatus(client, httpStatus);
-        HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_LENGTH, client->fileSize);
-        HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_TYPE, mimeType);
-        HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CACHE_CONTROL, cacheControl);
-        HS_AddHTTPHeader(client, "X-Content-Type-Options", "nosniff"); // ZAP recommendation
+// Opens (appends to) an access log and starts its thread. Successful requests
+// are sampled: only 1 in sampleRate is logged. Failed ones are always logged.
+HS_AccessLog* HS_OpenAccessLog(const char* path, HS_AccessLogFormat format=HS_AccessLogFormat_Text, int sampleRate=1) {
+    if (strlen(path) >= PATH_MAX) return 0;
+    
+    FILE* file = HS__OpenAccessLogFile(path);
+    if (!file) return 0;
+    
+    HS_AccessLog* log = (HS_AccessLog*) calloc(1, sizeof(HS_AccessLog));
+    strcpy(log->path, path);
+    log->file = file;
+    log->format = format;
+    log->sampleRate = sampleRate > 1 ? sampleRate : 1;
+    log->batch = (char*) malloc(HS__AccessLogBatchSize);
+    pthread_mutex_init(&log->mutex, 0);
+    pthread_cond_init(&log->cond, 0);
+    
+    if (pthread_create(&log->thread, 0, HS__AccessLogWorker, log)) {
+        lwsl_err("HS_AccessLog | Can't start the log thread\n");
+        pthread_mutex_destroy(&log->mutex);
+        pthread_cond_destroy(&log->cond);
+        fclose(file);
+        free(log->batch);
+        free(log);
+        return 0;
+    }
+    
+    return log;
+}
 
-        // TODO: Connection: keep-alive is not allowed in http 2. I couldn't find
-        // a way to detect if the connection is using h1 or h2, so I'm removing
-        // this header from all responses.
-        // HS_AddHTTPHeader(client, WSI_TOKEN_CONNECTION, "keep-alive");
+// Makes the log thread reopen the file, once it has been moved by logrotate
+// or the like. Only sets a flag, so it can be called from a signal handler.
+void HS_ReopenAccessLog(HS_AccessLog* log) {
+    __atomic_store_n(&log->reopenRequested, 1, __ATOMIC_RELEASE);
+}
 
-        HS_MaybeAddAllowOriginHeader(client);
+// Logs the requests served by the server. Several servers (e.g. those of a
+// listener group) can share a log. Call before HS_RunForever.
+bool HS_SetAccessLog(HS_Server* server, HS_AccessLog* log) {
+    HS_AccessLogRing* ring = (HS_AccessLogRing*) calloc(1, sizeof(HS_AccessLogRing));
+    
+    pthread_mutex_lock(&log->mutex);
+    bool added = log->ringsCount < HS__AccessLogRingsCap;
+    if (added) log->rings[log->ringsCount++] = ring;
+    pthread_mutex_unlock(&log->mutex);
+    
+    if (!added) {
+        free(ring);
+        return false;
+    }
+    
+    server->accessLog = log;
+    server->accessLogRing = ring;
+    return true;
+}
 
-        if (client->contentLanguage[0]) {
-            HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_LANGUAGE, client->contentLanguage);
+// Logs what the server's ring still holds, and detaches the server
+void HS__DetachAccessLog(HS_Server* server) {
+    HS_AccessLog* log = server->accessLog;
+    HS_AccessLogRing* ring = server->accessLogRing;
+    if (!log) return;
+    
+    pthread_mutex_lock(&log->mutex);
+    HS__DrainAccessLogRing(log, ring);
+    HS__FlushAccessLog(log);
+    
+    for (int i = 0; i < log->ringsCount; ++i) {
+        if (log->rings[i] == ring) {
+            log->rings[i] = log->rings[--log->ringsCount];
+            break;
         }
-
-        HS_WriteResponse(client);
     }
+    pthread_mutex_unlock(&log->mutex);
     
-    return callbackResult;
+    free(ring);
+    server->accessLog = 0;
+    server->accessLogRing = 0;
 }
 
-bool HS_GetHeader(HS_HTTPClient* client, lws_token_indexes header, char* buffer, int bufferSize) {
-    return lws_hdr_copy(client->socket, buffer, bufferSize, header) > 0;
+// Stops the log thread and closes the file. The servers using the log must
+// have been destroyed.
+void HS_CloseAccessLog(HS_AccessLog* log) {
+    pthread_mutex_lock(&log->mutex);
+    log->stopping = true;
+    pthread_cond_signal(&log->cond);
+    pthread_mutex_unlock(&log->mutex);
+    pthread_join(log->thread, 0);
+    
+    if (log->file) fclose(log->file);
+    pthread_mutex_destroy(&log->mutex);
+    pthread_cond_destroy(&log->cond);
+    free(log->batch);
+    free(log);
 }
 
-void HS_GetPathNodes(char* path, char** nodes) {
-    // TODO: This function can crash very easily!!1
-    // We don't check if the passed buffers for each
-    // path node has sufficient space to receive the data.
-    char buffer[PATH_MAX] = {};
-    strcpy(buffer, path);
-    char* entry = strtok(buffer, "/");
+// Appends the client's request to the server's ring, once it's done (or the
+// connection is gone).
+void HS__LogRequest(HS_Server* server, HS_VHost* vhost, HS_HTTPClient* client) {
+    HS_AccessLogRing* ring = server->accessLogRing;
+    if (!ring || !client->requestTime) return;
     
-    if (entry[0] == 0) {
-        entry = strtok(0, "/");
+    lws_usec_t requestTime = client->requestTime;
+    client->requestTime = 0;
+    
+    bool failed = client->responseStatus < 200 || client->responseStatus >= 400;
+    if (!failed && server->accessLog->sampleRate > 1 && server->accessLogSampled++ % server->accessLog->sampleRate) {
+        return;
     }
     
-    int i = 0;
-    while (nodes[i]) {
-        if (!entry || !entry[0]) {
-            break;
-        }
-        
-        strcpy(nodes[i], entry);
-        entry = strtok(0, "/");
-        ++i;
+    unsigned head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == HS__AccessLogRingCap) {
+        ++ring->dropped;
+        return;
     }
+    
+    HS_AccessLogRecord* record = &ring->records[head & (HS__AccessLogRingCap-1)];
+    lws_usec_t responseTime = client->responseTime ? client->responseTime : lws_now_usecs();
+    record->time = requestTime;
+    record->serviceTime = (int) HS_Min(responseTime - requestTime, (lws_usec_t) INT_MAX);
+    record->status = client->responseStatus;
+    record->bytes = client->responseBytes;
+    record->cacheHit = client->cacheHit;
+    record->h2 = lws_get_network_wsi(client->socket) != client->socket;
+    snprintf(record->method, sizeof(record->method), "%s", client->httpMethod);
+    snprintf(record->vhost, sizeof(record->vhost), "%s", vhost->name);
+    snprintf(record->ipAddress, sizeof(record->ipAddress), "%s", client->ipAddress);
+    snprintf(record->uri, sizeof(record->uri), "%s", client->requestURI ? client->requestURI : "");
+    
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    ++ring->logged;
 }
 
-JS_JSON* HS_GetGatedArea(JS_JSON* gkConfig, const char* areaId) {
-    JS_Iterator it = JS_ForEach(JS_Get(gkConfig, "gated-areas"));
+// Per-IP limits
+//---------------
+bool HS__ParseIPAddress(const char* text, unsigned char* address) {
+    memset(address, 0, 16);
+    if (inet_pton(AF_INET6, text, address) == 1) return true;
     
-    while (JS_Next(&it)) {
-        JS_JSON* j = JS_Unwrap(it);
-        if (strcmp(JS_GetString(j, "id"), areaId)==0) {
-            return j;
-        }
+    address[10] = address[11] = 0xff;
+    return inet_pton(AF_INET, text, address + 12) == 1;
+}
+
+bool HS__IsLoopbackAddress(const unsigned char* address) {
+    static const unsigned char loopback6[16] = {0,0,0,0, 0,0,0,0, 0,0,0,0, 0,0,0,1};
+    return (address[10] == 0xff && address[12] == 127) || !memcmp(address, loopback6, 16);
+}
+
+bool HS__IsTrustedProxy(HS_VHost* vhost, const unsigned char* address) {
+    for (int i = 0; i < vhost->ipTrustedProxiesCount; ++i) {
+        if (!memcmp(vhost->ipTrustedProxies[i], address, 16)) return true;
     }
-    
-    return 0;
+    return false;
 }
 
-int HS_GatekeeprGetRequestHandler(HS_CallbackArgs* args) {
-    HS_HTTPClient* client = HS_GetHTTPClientData(args);
-    HS_VHost* vhost = HS_GetVHost(args);
-    JS_JSON* gkConfig = vhost->gkConfig;
+// Copies the address a trusted proxy forwarded into ipAddress. Returns false
+// when there's none.
+bool HS__GetForwardedAddress(HS_VHost* vhost, lws* socket, char* ipAddress, int ipAddressSize) {
+    unsigned char address[16];
+    char forwarded[512];
     
-    char defaultCacheControl[] = "no-cache, no-store, must-revalidate";
+    // Entries are appended by each proxy, the ones on the left come from the client
+    if (lws_hdr_copy(socket, forwarded, sizeof(forwarded), WSI_TOKEN_X_FORWARDED_FOR) > 0) {
+        for (int end = strlen(forwarded); end > 0;) {
+            int start = end;
+            while (start > 0 && forwarded[start-1] != ',') --start;
+            
+            char* entry = forwarded + start;
+            forwarded[end] = 0;
+            while (*entry == ' ') ++entry;
+            for (char* c = forwarded + end; c > entry && c[-1] == ' ';) *--c = 0;
+            
+            if (!HS__ParseIPAddress(entry, address)) break;
+            if (!HS__IsTrustedProxy(vhost, address)) {
+                snprintf(ipAddress, ipAddressSize, "%s", entry);
+                return true;
+            }
+            end = start - 1;
+        }
+    }
     
-    int result = 0;
+    char realIP[64];
+    if (lws_hdr_copy(socket, realIP, sizeof(realIP), WSI_TOKEN_HTTP_X_REAL_IP) > 0 && HS__ParseIPAddress(realIP, address)) {
+        snprintf(ipAddress, ipAddressSize, "%s", realIP);
+        return true;
+    }
     
-    char urlPrefix[1024] = {};
-    char gatedAreaId[256] = {};
-    char* nodes[] = {urlPrefix, gatedAreaId, 0};
+    return false;
+}
+
+// Copies the client's address into ipAddress: the peer's, or the one a
+// trusted proxy forwarded. Returns whether the peer is a trusted proxy.
+bool HS__GetClientAddress(HS_VHost* vhost, lws* socket, char* ipAddress, int ipAddressSize) {
+    lws_get_peer_simple(socket, ipAddress, ipAddressSize);
     
-    HS_GetPathNodes(client->uri, nodes);
+    unsigned char address[16];
+    bool proxied = vhost->unixSocketPath[0] || (HS__ParseIPAddress(ipAddress, address) && HS__IsTrustedProxy(vhost, address));
     
-    if (strcmp(urlPrefix, "gk")==0 && gatedAreaId[0]) {
-        JS_JSON* jArea = HS_GetGatedArea(gkConfig, gatedAreaId);
-        
-        if (jArea) {
-            JS_JSON* jConfig = JS_Create();
-            JS_Set(jConfig, "server", vhost->host);
-            JS_Set(jConfig, "googleClientId", JS_GetString(gkConfig, "google-client-id"));
-            JS_Set(jConfig, "gatedArea", JS_Copy(jArea));
-            
-            char config[HS_KILO_BYTES(2)] = {};
-            JS_DumpCompact(jConfig, config, sizeof(config));
-            
-            char tmplPath[PATH_MAX] = {};
-            sprintf(tmplPath, "%s/gatekeepr/gatekeepr.html", vhost->servedFilesRootDir);
-            FILE* tmplFile = fopen(tmplPath, "r");
-            
-            if (tmplFile) {
-                int tmplFileSize = HS_GetFileSize(tmplFile);
-                char* tmpl = (char*) calloc(1, tmplFileSize);
-                fread(tmpl, tmplFileSize, 1, tmplFile);
-                fclose(tmplFile);
-                
-                HS_InitResponseBuffer(client, tmplFileSize + HS_KILO_BYTES(2));
-                
-                HS_Replacement reps[] = {
-                    {"<!--TITLE GOES HERE-->", JS_GetString(jArea, "name")},
-                    {"/*GATEKEEPR CONFIG GOES HERE*/", config},
-                    {"LOGO PATH GOES HERE", JS_Get(jArea, "image") ? JS_GetString(jArea, "image") : ""},
-                    {"AREA ID GOES HERE", gatedAreaId},
-                    {"HOME PATH GOES HERE", JS_Get(jArea, "home") ? JS_GetString(jArea, "home") : ""},
-                    {"TERMS URL GOES HERE", JS_Get(jArea, "terms") ? JS_GetString(jArea, "terms") : ""},
-                    {"-v0000.00.00.00.00.00", vhost->cacheBustVersion},
-                    {}
-                };
-                
-                client->fileSize = HS_Replace(client->fileContent, tmpl, tmplFileSize, reps);
-                
-                HS_AddHTTPHeaderStatus(client, 200);
-                HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_LENGTH, client->fileSize);
-                HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CONTENT_TYPE, "text/html");
-                HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_CACHE_CONTROL, defaultCacheControl);
-                HS_WriteResponse(client);
-                
-                free(tmpl);
-            } else {
-                // TODO: gatekeepr.html not found!
-            }
-            
-            JS_Free(jConfig);
-        } else {
-            HS_AddHTTPHeaderStatus(client, 404);
-            HS_WriteResponse(client);
+    if (proxied && !HS__GetForwardedAddress(vhost, socket, ipAddress, ipAddressSize)) {
+        if (vhost->ipLimits && !vhost->ipForwardedMissingWarned) {
+            lwsl_warn("IPLimits | VHost=%s | A proxy's request has neither X-Forwarded-For nor X-Real-IP, so it's limited as the proxy's\n", vhost->name);
+            vhost->ipForwardedMissingWarned = true;
         }
-    } else {
-        HS_AddHTTPHeaderStatus(client, 404);
-        HS_WriteResponse(client);
+        if (vhost->unixSocketPath[0]) ipAddress[0] = 0; // not an address, so not limited
     }
-    
-    return result;
+    return proxied;
 }
 
-JS_JSON* HS_GetGatedAreaFromURI(JS_JSON* gkConfig, char* uri) {
-    JS_Iterator it = JS_ForEach(JS_Get(gkConfig, "gated-areas"));
+HS_IPLimit* HS__FindIPLimit(HS_VHost* vhost, const char* ipAddress, bool insert) {
+    unsigned char address[16];
+    if (!vhost->ipLimits || !HS__ParseIPAddress(ipAddress, address)) return 0;
     
-    while (JS_Next(&it)) {
-        JS_JSON* j = JS_Unwrap(it);
-        if (HS_StartsWith(uri, JS_GetString(j, "prefix"))) {
-            return j;
+    if (vhost->ipLimitsExemptLoopback && HS__IsLoopbackAddress(address)) return 0;
+    
+    uint32_t hash = HS__HashRulePattern((const char*) address, sizeof(address)) | 1;
+    
+    for (int i = 0; i < HS__IPLimitsCap; ++i) {
+        HS_IPLimit* limit = &vhost->ipLimits[(hash + i) & (HS__IPLimitsCap-1)];
+        
+        if (!limit->hash) {
+            // Keep the load factor at 3/4; a full table lets new addresses through
+            if (!insert || vhost->ipLimitsCount >= HS__IPLimitsCap/4*3) {
+                return 0;
+            }
+            
+            limit->hash = hash;
+            memcpy(limit->address, address, sizeof(address));
+            limit->requestTokens = vhost->ipMaxRequestsPerSecond;
+            limit->upgradeTokens = vhost->ipMaxUpgradesPerMinute;
+            limit->lastRefill = lws_now_usecs();
+            ++vhost->ipLimitsCount;
+            return limit;
+        }
+        
+        if (limit->hash == hash && !memcmp(limit->address, address, sizeof(address))) {
+            return limit;
         }
     }
     
     return 0;
 }
 
-int HS_HandleGetRequestToGatedArea(HS_CallbackArgs* args) {
-    HS_HTTPClient* client = HS_GetHTTPClientData(args);
-    HS_VHost* vhost = HS_GetVHost(args);
+// Takes a request (or upgrade) token. Returns false when there is none left.
+bool HS__TakeIPToken(HS_VHost* vhost, const char* ipAddress, bool upgrade) {
+    int rate = upgrade ? vhost->ipMaxUpgradesPerMinute : vhost->ipMaxRequestsPerSecond;
+    if (!rate) return true;
     
-    int result = 0;
+    HS_IPLimit* limit = HS__FindIPLimit(vhost, ipAddress, true);
+    if (!limit) return true;
     
-    JS_JSON* jArea = HS_GetGatedAreaFromURI(vhost->gkConfig, client->uri);
+    lws_usec_t now = lws_now_usecs();
+    float seconds = (now - limit->lastRefill)/1000000.0f;
+    limit->lastRefill = now;
+    limit->lastSeen = time(0);
     
-    char* gatedAreaId = JS_GetString(jArea, "id");
-    char sessionCookie[512] = {};
-    char cookieName[256] = {};
-    sprintf(cookieName, "gatekeepr_%s", gatedAreaId);
+    limit->requestTokens += seconds*vhost->ipMaxRequestsPerSecond;
+    if (limit->requestTokens > vhost->ipMaxRequestsPerSecond) limit->requestTokens = vhost->ipMaxRequestsPerSecond;
+    limit->upgradeTokens += seconds*vhost->ipMaxUpgradesPerMinute/60.0f;
+    if (limit->upgradeTokens > vhost->ipMaxUpgradesPerMinute) limit->upgradeTokens = vhost->ipMaxUpgradesPerMinute;
     
-    if (HS_GetCookieValue(client->socket, cookieName, sessionCookie, sizeof(sessionCookie))) {
-        // Cleanup database
-        time_t now = time(0);
-        SQ_DeleteRows(vhost->gkdb, "sessions", "%lld >= expirationDate OR (%lld-lastUseDate) >= 3600", now, now);
-        
-        if (SQ_GetAggregateFunctionResultInt(vhost->gkdb, "SELECT COUNT(*) FROM sessions JOIN users ON sessions.userId=users.id WHERE gatedArea='%s' AND users.id || '.' || sessions.id = '%s'", gatedAreaId, sessionCookie)) {
-            // Authentication successful
-            SQ_ExecuteCommand(vhost->gkdb, "UPDATE sessions SET lastUseDate=%lld WHERE '%s' LIKE '%%' || id", now, sessionCookie);
-            return HS_GetFileByURI(args);
-        }
-    }
+    float& tokens = upgrade ? limit->upgradeTokens : limit->requestTokens;
+    if (tokens < 1) return false;
     
-    // Authentication needed. Redirect to gatekeepr
-    //-----------------------------------------------
-    sprintf(sessionCookie, "%s=; Expires=Thu, 01 Jan 1970 00:00:01 GMT; Path=/;", cookieName);
+    tokens -= 1;
+    return true;
+}
 
-    char redirParam[HS_KILO_BYTES(2)] = {};
-    if (!HS_GetQueryStringValue(client, "redirect", redirParam, sizeof(redirParam))) {
-        lws_urlencode(redirParam, client->uri, sizeof(redirParam));
+// Releases the count of a network connection
+void HS__RemoveIPConnection(HS_Server* httpServer, int fd) {
+    if (fd < 0 || fd >= httpServer->ipConnectionsCap || !httpServer->ipConnections[fd].vhost) return;
+    
+    HS_IPConnection* connection = &httpServer->ipConnections[fd];
+    HS_IPLimit* limit = HS__FindIPLimit(connection->vhost, connection->ipAddress, false);
+    if (limit && limit->connections > 0) --limit->connections;
+    connection->vhost = 0;
+}
+
+// lws resets the descriptor of a connection before LWS_CALLBACK_WSI_DESTROY: a
+// counted one is kept (plus one) in the opaque user data of its network wsi.
+void HS__TagIPConnection(HS_Server* httpServer, lws* socket) {
+    int fd = lws_get_socket_fd(socket);
+    if (fd >= 0 && fd < httpServer->ipConnectionsCap && httpServer->ipConnections[fd].vhost) {
+        lws_set_opaque_user_data(socket, (void*) (intptr_t) (fd + 1));
     }
+}
 
-    char redirURL[HS_KILO_BYTES(2)] = {};
-    int _ = snprintf(redirURL, sizeof(redirURL), "https://%s/gk/%s?redirect=%s", vhost->host, JS_GetString(jArea, "id"), redirParam);
+void HS__ReleaseIPConnection(HS_Server* httpServer, lws* socket) {
+    if (lws_get_network_wsi(socket) != socket) return; // h2 streams share their connection's
     
-    HS_AddHTTPHeaderStatus(client, 302);
-    HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_LOCATION, redirURL);
-    HS_AddHTTPHeader(client, WSI_TOKEN_HTTP_SET_COOKIE, sessionCookie);
-    HS_WriteResponse(client);
-    
-    return result;
+    int fd = (int) (intptr_t) lws_get_opaque_user_data(socket) - 1;
+    HS__RemoveIPConnection(httpServer, fd);
 }
 
-int HS_GetFileByURIOrAuthenticate(HS_CallbackArgs* args) {
-    HS_HTTPClient* client = HS_GetHTTPClientData(args);
-    HS_VHost* vhost = HS_GetVHost(args);
+// Counts a network connection against its peer's address, unless the peer is a
+// trusted proxy. Returns false when the address already has all its
+// connections.
+bool HS__AddIPConnection(HS_Server* httpServer, HS_VHost* vhost, lws_filter_network_conn_args* filter) {
+    int fd = filter->accept_fd;
+    if (fd < 0) return true;
     
-    char cookie[HS_KILO_BYTES(4)] = {};
-    HS_GetHeader(client, WSI_TOKEN_HTTP_COOKIE, cookie, sizeof(cookie));
+    // A descriptor still counted belonged to a connection that was never adopted
+    HS__RemoveIPConnection(httpServer, fd);
+    if (!vhost->ipMaxConnections) return true;
     
-    if (HS_StartsWith(client->uri, "/gk/")) {
-        return HS_GatekeeprGetRequestHandler(args);
+    char ipAddress[48] = {};
+    if (filter->cli_addr.ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((sockaddr_in*) &filter->cli_addr)->sin_addr, ipAddress, sizeof(ipAddress));
+    } else if (filter->cli_addr.ss_family == AF_INET6) {
+        inet_ntop(AF_INET6, &((sockaddr_in6*) &filter->cli_addr)->sin6_addr, ipAddress, sizeof(ipAddress));
     }
     
-    if (HS_GetGatedAreaFromURI(vhost->gkConfig, client->uri)) {
-        return HS_HandleGetRequestToGatedArea(args);
+    unsigned char address[16];
+    if (!HS__ParseIPAddress(ipAddress, address) || HS__IsTrustedProxy(vhost, address)) return true;
+    
+    HS_IPLimit* limit = HS__FindIPLimit(vhost, ipAddress, true);
+    if (!limit) return true;
+    
+    limit->lastSeen = time(0);
+    if (limit->connections >= vhost->ipMaxConnections) return false;
+    
+    if (fd >= httpServer->ipConnectionsCap) {
+        int cap = fd + 1024; // and the next descriptors
+        httpServer->ipConnections = (HS_IPConnection*) realloc(httpServer->ipConnections, cap*sizeof(HS_IPConnection));
+        memset(httpServer->ipConnections + httpServer->ipConnectionsCap, 0, (cap - httpServer->ipConnectionsCap)*sizeof(HS_IPConnection));
+        httpServer->ipConnectionsCap = cap;
     }
     
-    return HS_GetFileByURI(args);
+    ++limit->connections;
+    httpServer->ipConnections[fd].vhost = vhost;
+    strcpy(httpServer->ipConnections[fd].ipAddress, ipAddress);
+    return true;
 }
-  
+
+// Rebuilds the table without the addresses that have been idle for a while
+void HS__ExpireIPLimits(HS_Server* server, void* userData) {
+    HS_VHost* vhost = (HS_VHost*) userData;
+    HS_IPLimit* previous = vhost->ipLimits;
+    time_t now = time(0);
+    
+    vhost->ipLimits = (HS_IPLimit*) calloc(1, HS__IPLimitsCap*sizeof(HS_IPLimit));
+    vhost->ipLimitsCount = 0;
+    
+    for (int i = 0; i < HS__IPLimitsCap; ++i) {
+        HS_IPLimit* limit = &previous[i];
+        if (!limit->hash || (!limit->connections && now - limit->lastSeen >= HS__IPLimitsIdleTimeout)) continue;
+        
+        for (int j = 0; j < HS__IPLimitsCap; ++j) {
+            HS_IPLimit* slot = &vhost->ipLimits[(limit->hash + j) & (HS__IPLimitsCap-1)];
+            if (!slot->hash) {
+                *slot = *limit;
+                ++vhost->ipLimitsCount;
+                break;
+            }
+        }
+    }
+    
+    free(previous);
+}
+
 int HS_HTTPCallback(lws* socket, lws_callback_reasons reason, void* userData, void* in, size_t len) {
     HS_CallbackArgs args = {};
     args.socket = socket;
@@ -2090,6 +7153,8 @@ int HS_HTTPCallback(lws* socket, lws_callback_reasons reason, void* userData, vo
 
     switch (reason) {
       case LWS_CALLBACK_HTTP: {
+        HS__LogRequest(HS_GetServer(&args), server, client); // the previous request of the connection
+        
 #if 0
         printf("Loaded Files: (%d)\n", server->loadedFilesCount);
         for (int i = 0; i < server->loadedFilesCount; ++i) {
@@ -2097,37 +7162,57 @@ int HS_HTTPCallback(lws* socket, lws_callback_reasons reason, void* userData, vo
         }
 #endif
 
-        char uri[HS__URICap] = {};
-        if (len >= sizeof(uri)) {
+        if (len >= HS__URICap) {
             callbackResult = -1;
             break;
         }
         
+        // A previous request on this connection may still hold its arena
+        HS_Arena arena = client->arena;
+        if (arena.block) HS__ResetArena(&arena);
+        else HS__AcquireArena(server, &arena);
+        
+        char ipAddress[sizeof(client->ipAddress)];
+        memcpy(ipAddress, client->ipAddress, sizeof(ipAddress));
+        bool ipProxied = client->ipProxied;
+        
         *client = {};
+        memcpy(client->ipAddress, ipAddress, sizeof(ipAddress));
+        client->ipProxied = ipProxied;
         client->socket = socket;
         client->id = server->nextHTTPClientId++;
+        client->arena = arena;
+        client->uri = HS_ArenaAlloc(&client->arena, HS__URICap);
+        client->filePath = HS_ArenaAlloc(&client->arena, HS__FilePathCap);
+        client->headerBuffer = HS_ArenaAlloc(&client->arena, LWS_PRE + HS__HeaderBufferSize);
+        client->uri[0] = 0;
+        client->filePath[0] = 0;
             
         // Init header buffer
         client->headerBegin = client->headerBuffer + LWS_PRE;
-        client->headerEnd = client->headerBuffer + sizeof(client->headerBuffer) - LWS_PRE - 1;
+        client->headerEnd = client->headerBuffer + HS__HeaderBufferSize - 1;
         client->headerAt = client->headerBegin;
-    
-        HS_GetIpv4(&args, client->ipAddress);
         
-        char contentLength[64] = {};
+        bool logged = HS_GetServer(&args)->accessLogRing != 0;
+        if (logged) client->requestTime = lws_now_usecs();
+        
+        // lws only allocates the client on the first request of a connection.
+        // A proxy's connection carries the requests of many clients.
+        if ((server->ipLimits || logged) && (!client->ipAddress[0] || client->ipProxied)) {
+            client->ipProxied = HS__GetClientAddress(server, socket, client->ipAddress, sizeof(client->ipAddress));
+        }
+        
+        if (!HS__TakeIPToken(server, client->ipAddress, false)) {
+            ++server->metrics.ipLimitedRequests;
+            HS_CloseConnection(client, 429);
+            break;
+        }
         
         // Read headers
         //--------------
-        lws_hdr_copy(socket, client->host, sizeof(client->host), WSI_TOKEN_HOST);
-        lws_hdr_copy(socket, client->referer, sizeof(client->referer), WSI_TOKEN_HTTP_REFERER);
-        lws_hdr_copy(socket, client->acceptLanguage, sizeof(client->acceptLanguage), WSI_TOKEN_HTTP_ACCEPT_LANGUAGE);
-        lws_hdr_copy(socket, client->userAgent, sizeof(client->userAgent), WSI_TOKEN_HTTP_USER_AGENT);
-        lws_hdr_copy(socket, client->origin, sizeof(client->origin), WSI_TOKEN_ORIGIN);
-        lws_hdr_copy(socket, contentLength, sizeof(contentLength), WSI_TOKEN_HTTP_CONTENT_LENGTH);
-        lws_hdr_copy(socket, client->contentType, sizeof(client->contentType), WSI_TOKEN_HTTP_CONTENT_TYPE);
-        
-        if (!client->host[0]) {
-            strcpy(client->host, server->hostName);
+        char contentLength[64] = "";
+        if (lws_hdr_total_length(socket, WSI_TOKEN_HTTP_CONTENT_LENGTH)) {
+            lws_hdr_copy(socket, contentLength, sizeof(contentLength), WSI_TOKEN_HTTP_CONTENT_LENGTH);
         }
         
         if (contentLength[0]) {
@@ -2148,11 +7233,16 @@ int HS_HTTPCallback(lws* socket, lws_callback_reasons reason, void* userData, vo
             strcpy(client->httpMethod, "OTHER");
         }
         
-        sprintf(uri, "%.*s", (int)len, (char*)in);
-        strcpy(client->uri, uri);
+        memcpy(client->uri, in, len);
+        client->uri[len] = 0;
         client->uriSize = strlen(client->uri);
-
-        lwsl_debug("HTTPMethod=%s | URI=%s\n", client->httpMethod, uri);
+        
+        if (logged) {
+            client->requestURI = HS_ArenaAlloc(&client->arena, HS__AccessLogURICap);
+            if (client->requestURI) snprintf(client->requestURI, HS__AccessLogURICap, "%s", client->uri);
+        }
+        
+        lwsl_debug("HTTPMethod=%s | URI=%s\n", client->httpMethod, client->uri);
 
         // Plugins
         //---------
@@ -2214,7 +7304,7 @@ int HS_HTTPCallback(lws* socket, lws_callback_reasons reason, void* userData, vo
             if (strcmp(client->httpMethod, "POST")==0 && server->httpPostHandler) {
                 if (server->postEndpointsSize) {
                     for (int i = 0; i < server->postEndpointsSize; ++i) {
-                        if (HS_StartsWith(uri, server->postEndpoints[i])) {
+                        if (HS_StartsWith(client->uri, server->postEndpoints[i])) {
                             validEndpoint = true;
                             break;
                         }
@@ -2235,7 +7325,7 @@ int HS_HTTPCallback(lws* socket, lws_callback_reasons reason, void* userData, vo
             } else if (strcmp(client->httpMethod, "DELETE")==0 && server->httpDeleteHandler) {
                 if (server->deleteEndpointsSize) {
                     for (int i = 0; i < server->deleteEndpointsSize; ++i) {
-                        if (HS_StartsWith(uri, server->deleteEndpoints[i])) {
+                        if (HS_StartsWith(client->uri, server->deleteEndpoints[i])) {
                             validEndpoint = true;
                             break;
                         }
@@ -2283,42 +7373,21 @@ int HS_HTTPCallback(lws* socket, lws_callback_reasons reason, void* userData, vo
             break;
         }
         
-        if (client->closeConnection) {
+        if (client->gkLookupJob) {
+            // The session cookie was looked up by the I/O pool
+            if (!client->gkLookupJob->pending) HS__ReplayGatedRequest(&args, client);
+        } else if (client->pathResolveJob) {
+            // The path was resolved by the I/O pool
+            if (!client->pathResolveJob->pending) HS__ReplayGetRequest(&args, client);
+        } else if (client->pendingStatus) {
+            // The file was loaded by the I/O pool
+            http_status status = client->pendingStatus;
+            client->pendingStatus = (http_status) 0;
+            HS__WriteFileResponse(client, status, client->mimeType, client->pendingCacheControl, 0);
+        } else if (client->closeConnection) {
             lws_return_http_status(socket, client->closeStatus, 0);
-        } else if (client->fileBuffer) {
-            int remaining = client->fileSize - client->at;
-
-            if (client->at == 0) {
-                lwsl_debug("HS_HTTPCallback | VHost=%s | Reason=%s | Size=%d | WSI=%p\n", server->name, HS_ToString(reason), client->fileSize, socket);
-            }
-
-            if (remaining) {
-                int amount = HS_Min(remaining, server->h2MaxFrameSize);
-                bool finalWrite = client->at + amount >= client->fileSize;
-                lws_write_protocol writeProtocol = finalWrite ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP;
-                memcpy(server->frameStart, ((uint8_t*) client->fileContent) + client->at, amount);
-                lws_write(socket, (uint8_t*) server->frameStart, amount, writeProtocol);
-                
-                client->at += amount;
-                
-                if (finalWrite) {
-                    lwsl_debug("WriteFinished | VHost=%s | WSI=%p\n", server->name, socket);
-                    client->closeStatus = (http_status) 0;
-                    callbackResult = -1;
-                } else {
-                    lws_set_timeout(socket, PENDING_TIMEOUT_HTTP_CONTENT, 20);
-                    lws_callback_on_writable(socket);
-                }
-            } else {
-                lws_write(socket, (uint8_t*) server->frameStart, 0, LWS_WRITE_HTTP_FINAL);
-                client->closeStatus = (http_status) 0;
-                callbackResult = -1;
-                
-                if (!client->fileEntry) {
-                    free(client->fileBuffer);
-                    client->fileBuffer = 0;
-                }
-            }
+        } else if (client->fileContent || client->streamFile) {
+            callbackResult = HS__WriteBodyChunk(server, client);
         } else if (client->closeStatus) {
             lws_write(socket, (uint8_t*) server->frameStart, 0, LWS_WRITE_HTTP_FINAL);
             client->closeStatus = (http_status) 0;
@@ -2382,51 +7451,150 @@ int HS_HTTPCallback(lws* socket, lws_callback_reasons reason, void* userData, vo
         }
       } break;
       
+      case LWS_CALLBACK_FILTER_NETWORK_CONNECTION: {
+        // On the listening socket, before the connection is adopted
+        if (server->ipLimits && !HS__AddIPConnection(HS_GetServer(&args), server, (lws_filter_network_conn_args*) userData)) {
+            ++server->metrics.ipRefusedConnections;
+            callbackResult = 1;
+        }
+      } break;
+      
+      case LWS_CALLBACK_SERVER_NEW_CLIENT_INSTANTIATED: {
+        HS__TagIPConnection(HS_GetServer(&args), socket);
+      } break;
+      case LWS_CALLBACK_WSI_DESTROY: {
+        HS__ReleaseIPConnection(HS_GetServer(&args), socket);
+      } break;
+      
+      case LWS_CALLBACK_HTTP_CONFIRM_UPGRADE: {
+        char ipAddress[48] = {};
+        if (server->ipLimits) HS__GetClientAddress(server, socket, ipAddress, sizeof(ipAddress));
+        
+        if (!HS__TakeIPToken(server, ipAddress, true)) {
+            ++server->metrics.ipLimitedUpgrades;
+            lws_return_http_status(socket, 429, 0);
+            callbackResult = 1;
+        }
+      } break;
+      
       //case LWS_CALLBACK_WSI_DESTROY: {
       case LWS_CALLBACK_HTTP_DROP_PROTOCOL: {
         if (client) {
-            if (client->fileEntry) {
-                --client->fileEntry->clientsReading;
-            } else if (client->fileBuffer) {
-                free(client->fileBuffer);
+            HS__LogRequest(HS_GetServer(&args), server, client);
+            
+            if (client->fileLoadJob) {
+                client->fileLoadJob->client = 0; // Freed when it's done
+                client->fileLoadJob = 0;
             }
+            HS__ReleasePathResolve(client);
+            HS__ReleaseGKLookup(client);
+            
+            HS__ReleaseResponseBody(client);
+            HS__ReleaseArena(server, &client->arena);
+            client->uri = 0;
+            client->requestURI = 0;
+            client->filePath = 0;
+            client->headerBuffer = 0;
             
             if (client->sessionData) {
                 free(client->sessionData);
+                client->sessionData = 0;
             }
             
             if (client->receivedBuffer) {
                 free(client->receivedBuffer);
+                client->receivedBuffer = 0;
             }
         }
       } break;
       
+      case LWS_CALLBACK_OPENSSL_LOAD_EXTRA_SERVER_VERIFY_CERTS: {
+        HS__ConfigureTLS(server, (SSL_CTX*) userData);
+      } break;
+      
+      case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+        HS__FinishIOJobs(HS_GetServer(&args));
+        HS__ScheduleTimerService(HS_GetServer(&args)); // A timer may have been added from another thread
+      } break;
+      
       case LWS_CALLBACK_PROTOCOL_INIT: {
-        HS_RmDir("%s/.cache-bust", server->servedFilesRootDir);
-        HS_RmDir("%s/.ssi-parsed", server->servedFilesRootDir);
-
-        for (int i = 0; i < server->rootDirMapSize; ++i) {
-            const char* path = server->rootDirMap[i].path;
-            HS_RmDir("%s/.cache-bust", path);
-            HS_RmDir("%s/.ssi-parsed", path);
-        }
-        
         server->h2MaxFrameSize = HS_GetH2FrameMaxSize(server);
         
+        if (server->ipMaxConnections || server->ipMaxRequestsPerSecond || server->ipMaxUpgradesPerMinute) {
+            server->ipLimits = (HS_IPLimit*) calloc(1, HS__IPLimitsCap*sizeof(HS_IPLimit));
+            HS_AddTimer(HS_GetServer(&args), HS__IPLimitsExpirePeriod, HS__IPLimitsExpirePeriod, HS__ExpireIPLimits, server);
+            
+            // Only a local proxy can reach a loopback interface
+            const char* iface = server->unixSocketPath[0] ? 0 : server->lwsContextInfo.iface;
+            unsigned char address[16];
+            bool loopbackOnly = iface && (!strcmp(iface, "lo") || !strcmp(iface, "localhost") ||
+                                          (HS__ParseIPAddress(iface, address) && HS__IsLoopbackAddress(address)));
+            if (loopbackOnly && !server->ipTrustedProxiesCount) {
+                lwsl_warn("IPLimits | VHost=%s | Listening on %s only: all clients share the proxy's address%s. List it in ip-limits/trusted-proxies\n",
+                          server->name, iface, server->ipLimitsExemptLoopback ? ", which is exempt" : "");
+            }
+        }
+        
         if (!server->disableFileCache) {
             server->loadedFiles = (HS_FileMapEntry*) calloc(1, HS__FileMapCap*sizeof(HS_FileMapEntry));
+            
+            if (server->pathCacheTTL >= 0) {
+                if (!server->pathCacheTTL) server->pathCacheTTL = 2;
+                server->pathCache = (HS_PathCacheEntry*) calloc(1, HS__PathCacheCap*sizeof(HS_PathCacheEntry));
+                server->langCache = (HS_LangCacheEntry*) calloc(1, HS__LangCacheCap*sizeof(HS_LangCacheEntry));
+            }
         }
         
         server->frameBuffer = (char*) calloc(1, LWS_PRE + server->h2MaxFrameSize);
         server->frameStart = server->frameBuffer + LWS_PRE;
         
-        HS_Date dateNow = HS_GetDateNow();
-        sprintf(server->cacheBustVersion, "-v%d.%02d.%02d.%02d.%02d.%02d", dateNow.year, dateNow.month, dateNow.day, dateNow.hour, dateNow.minute, dateNow.second);
+        HS__SetCacheBustVersion(server);
+        HS_CompileVHostRules(server);
+        
+        if (server->warmFileCache && server->loadedFiles) {
+            HS_AddTimer(HS_GetServer(&args), 0, 0, HS__WarmFileCache, server);
+        }
       } break;
       
       case LWS_CALLBACK_PROTOCOL_DESTROY: {
+        while (server->freeArenaBlocks) {
+            char* block = server->freeArenaBlocks;
+            server->freeArenaBlocks = *(char**) block;
+            free(block);
+        }
+        
+        for (int i = 0; i < server->loadedFilesCount; ++i) {
+            HS__FreeFileEntry(&server->loadedFiles[i]);
+        }
         if (server->loadedFiles) free(server->loadedFiles);
+        if (server->ipLimits) free(server->ipLimits);
+        
+        if (server->pathCache) {
+            for (int i = 0; i < HS__PathCacheCap; ++i) {
+                if (server->pathCache[i].uri) free(server->pathCache[i].uri);
+                if (server->pathCache[i].realPath) free(server->pathCache[i].realPath);
+            }
+            free(server->pathCache);
+        }
+        if (server->langCache) {
+            for (int i = 0; i < HS__LangCacheCap; ++i) {
+                if (server->langCache[i].key) free(server->langCache[i].key);
+            }
+            free(server->langCache);
+        }
         if (server->frameBuffer) free(server->frameBuffer);
+        HS_DestroyTemplate(server->gkTemplate);
+        HS__FreeGatedAreas(server);
+        if (server->gkSessions) {
+            HS__FlushGKSessions(server);
+            free(server->gkSessions);
+            server->gkSessions = 0;
+        }
+        if (server->gkDenyList) free(server->gkDenyList);
+        if (server->gkDenied) free(server->gkDenied);
+        server->gkDenyList = 0;
+        server->gkDenied = 0;
+        server->gkDeniedCount = 0;
       } break;
       
       default: break;
@@ -2453,6 +7621,7 @@ struct HS_Request {
     char* body;
     int bodyCap;
     int bodySize;
+    int bodySent;
     
     // This `type` is for user convenience, so that they can
     // easily identify the request type using enums or something,
@@ -2467,14 +7636,24 @@ struct HS_Request {
     int headerSectionSize;
     
     char* responseBuffer;
+    int responseBufferCap;
     int responseContentLength;
     int responseSize;
+    int responseSizeCap;
+    bool responseTruncated; // the body went over responseSizeCap, the rest was dropped
     int responseStatus;
     char contentType[256];
     
+    // When set, it's called with each part of the response body in args->in
+    // and args->len as it arrives, and the body isn't buffered.
+    HS_CallbackFunc responseBodyHandler;
+    
+    bool newConnection; // false when the request went over a pooled connection
+    
     bool delayBodyFree;
     
     int connectionFlags;
+    int keepWarmSecs;
     lws_context* lwsContext;
     lws_vhost* vhost;
     char localProtocolName[256];
@@ -2577,6 +7756,11 @@ HS_Request* HS_SendRequest(HS_Request* request) {
     lws_client_connect_info connectInfo = {};
     connectInfo.context = request->lwsContext;
     connectInfo.ssl_connection = request->connectionFlags;
+    if (!request->protocolName[0]) {
+        // Queue on a live connection to the same endpoint when there is one
+        connectInfo.ssl_connection |= LCCSCF_PIPELINE;
+        connectInfo.keep_warm_secs = request->keepWarmSecs;
+    }
     connectInfo.address = request->hostName;
     connectInfo.port = request->port ? request->port : 443;
     connectInfo.host = request->hostName;
@@ -2602,11 +7786,15 @@ HS_Request* HS_SendRequest(HS_Request* request) {
 HS_Request* HS_InitRequest(HS_Server* server, int bodyCap) {
     HS_Request* request = (HS_Request*) calloc(1, sizeof(HS_Request));
     
+    HS_VHost* requesterVHost = HS_GetVHost(server, "hs-requester-vhost");
+    
     request->lwsContext = server->lwsContext;
     request->connectionFlags = server->defaultConnectionFlags;
+    request->keepWarmSecs = requesterVHost->requestKeepWarmSecs;
+    request->responseSizeCap = HS__ResponseSizeCap;
     request->bodyCap = bodyCap;
     if (bodyCap) request->body = (char*) calloc(1, bodyCap);
-    request->vhost = HS_GetVHost(server, "hs-requester-vhost")->lwsVHost;
+    request->vhost = requesterVHost->lwsVHost;
     strcpy(request->localProtocolName, "requester");
     
     return request;
@@ -2639,7 +7827,66 @@ HS_Request* HS_SendUpgradeRequest(HS_Server* server, const char* hostName, int p
     return request;
 }
 
-#define HS_AppendToBody(request, fmt, ...) (request)->bodySize += sprintf((request)->body+(request)->bodySize, fmt, __VA_ARGS__)
+#define HS_AppendToBody(request, fmt, ...) (request)->bodySize += sprintf((request)->body+(request)->bodySize, fmt, __VA_ARGS__)
+
+void HS__CountRequest(HS_VHost* vhost, HS_Request* request) {
+    int port = request->port ? request->port : 443;
+    HS_RequestHostMetrics* host = 0;
+    
+    for (int i = 0; i < vhost->requestHostsCount; ++i) {
+        if (vhost->requestHosts[i].port == port && strcmp(vhost->requestHosts[i].hostName, request->hostName)==0) {
+            host = &vhost->requestHosts[i];
+            break;
+        }
+    }
+    
+    if (!host) {
+        if (vhost->requestHostsCount == HS__RequestHostsCap) return;
+        host = &vhost->requestHosts[vhost->requestHostsCount++];
+        strcpy(host->hostName, request->hostName);
+        host->port = port;
+    }
+    
+    ++host->requests;
+    if (!request->newConnection) ++host->reused;
+}
+
+// Adds the request's header section ("Name: value\r\n" lines) with lws, which
+// encodes them for h2 streams.
+bool HS__AppendRequestHeaders(lws* socket, HS_Request* request, unsigned char** p, unsigned char* end) {
+    char* line = request->headerSection;
+    char* sectionEnd = request->headerSection + request->headerSectionSize;
+    
+    while (line < sectionEnd) {
+        char* lineEnd = (char*) memchr(line, '\n', sectionEnd - line);
+        if (!lineEnd) lineEnd = sectionEnd;
+        
+        char* colon = (char*) memchr(line, ':', lineEnd - line);
+        if (colon) {
+            char name[256];
+            int nameSize = colon - line;
+            if (nameSize + 2 > (int) sizeof(name)) return false;
+            
+            // h2 header names are lowercase
+            for (int i = 0; i < nameSize; ++i) name[i] = tolower(line[i]);
+            name[nameSize] = ':';
+            name[nameSize+1] = 0;
+            
+            char* value = colon + 1;
+            while (value < lineEnd && *value == ' ') ++value;
+            int valueSize = lineEnd - value;
+            while (valueSize && (value[valueSize-1] == '\r' || value[valueSize-1] == ' ')) --valueSize;
+            
+            if (lws_add_http_header_by_name(socket, (unsigned char*) name, (unsigned char*) value, valueSize, p, end)) {
+                return false;
+            }
+        }
+        
+        line = lineEnd + 1;
+    }
+    
+    return true;
+}
 
 int HS_RequesterCallback(lws* socket, lws_callback_reasons reason, void* userData, void* in, size_t len) {
     HS_CallbackArgs args = {};
@@ -2667,8 +7914,12 @@ int HS_RequesterCallback(lws* socket, lws_callback_reasons reason, void* userDat
     }
 
     switch (reason) {
+      case LWS_CALLBACK_CONNECTING: {
+        if (request) request->newConnection = true;
+      } break;
+      
       case LWS_CALLBACK_COMPLETED_CLIENT_HTTP: {
-        request->responseBuffer[request->responseSize] = 0;
+        if (request->responseBuffer) request->responseBuffer[request->responseSize] = 0;
         request->responseStatus = lws_http_client_http_response(socket);
         
         lws_hdr_copy(socket, request->contentType, sizeof(request->contentType), WSI_TOKEN_HTTP_CONTENT_TYPE);
@@ -2682,9 +7933,10 @@ int HS_RequesterCallback(lws* socket, lws_callback_reasons reason, void* userDat
       } break;
       
       case LWS_CALLBACK_CLIENT_APPEND_HANDSHAKE_HEADER: {
-        if (request->headerSectionSize) {
-            strncpy(*((char**) in), request->headerSection, request->headerSectionSize);
-            *(char**)in += request->headerSectionSize;
+        unsigned char** p = (unsigned char**) in;
+        if (request->headerSectionSize && !HS__AppendRequestHeaders(socket, request, p, *p + len)) {
+            callbackResult = -1;
+            break;
         }
         
         if (request->body) lws_client_http_body_pending(socket, 1);
@@ -2693,8 +7945,25 @@ int HS_RequesterCallback(lws* socket, lws_callback_reasons reason, void* userDat
       
       case LWS_CALLBACK_CLIENT_HTTP_WRITEABLE: {
         if (request->body) {
-            // TODO: Send body in chunks
-            lws_write(socket, (unsigned char*) request->body, request->bodySize, LWS_WRITE_HTTP);
+            // The body goes out a chunk per writeable callback, each copied
+            // after the LWS_PRE bytes lws needs in front of it
+            char buffer[LWS_PRE + HS__RequestBodyChunkSize];
+            int chunkSize = request->bodySize - request->bodySent;
+            if (chunkSize > HS__RequestBodyChunkSize) chunkSize = HS__RequestBodyChunkSize;
+            bool last = request->bodySent + chunkSize == request->bodySize;
+            
+            memcpy(buffer + LWS_PRE, request->body + request->bodySent, chunkSize);
+            if (lws_write(socket, (unsigned char*) buffer + LWS_PRE, chunkSize, last ? LWS_WRITE_HTTP_FINAL : LWS_WRITE_HTTP) != chunkSize) {
+                callbackResult = -1;
+                break;
+            }
+            request->bodySent += chunkSize;
+            
+            if (!last) {
+                lws_callback_on_writable(socket);
+                break;
+            }
+            
             lws_client_http_body_pending(socket, 0);
             
             if (!request->delayBodyFree) {
@@ -2717,20 +7986,39 @@ int HS_RequesterCallback(lws* socket, lws_callback_reasons reason, void* userDat
         lws_hdr_copy(socket, contentLengthString, sizeof(contentLengthString), WSI_TOKEN_HTTP_CONTENT_LENGTH);
         
         request->responseContentLength = atoi(contentLengthString);
+        HS__CountRequest(server, request);
         
-        if (request->responseContentLength > 0) {
-            if (request->responseContentLength >= HS_MEGA_BYTES(64)) {
-                callbackResult = -1;
-                //request->result = HTTPSPostResult_BufferTooSmall;
-            } else {
-                request->responseBuffer = (char*) calloc(1, request->responseContentLength+1);
-            }
-        } else {
-            request->responseBuffer = (char*) calloc(1, HS_KILO_BYTES(512));
+        if (!request->responseBodyHandler) {
+            // Without a Content-Length (chunked) the buffer grows as needed
+            request->responseBufferCap = request->responseContentLength > 0 && request->responseContentLength < request->responseSizeCap ? request->responseContentLength+1 : HS_KILO_BYTES(16);
+            request->responseBuffer = (char*) calloc(1, request->responseBufferCap);
         }
       } break;
       
       case LWS_CALLBACK_RECEIVE_CLIENT_HTTP_READ: {
+        if (request->responseTruncated) {
+            break;
+        }
+        
+        // Past the cap the body is still read, but dropped: closing instead
+        // would fail the requests queued behind this one on the connection.
+        if (request->responseSize + (int) len >= request->responseSizeCap) {
+            request->responseTruncated = true;
+            len = request->responseSizeCap - 1 - request->responseSize;
+            args.len = len;
+        }
+        
+        if (request->responseBodyHandler) {
+            request->responseSize += len;
+            request->responseBodyHandler(&args);
+            break;
+        }
+        
+        if (request->responseSize + (int) len >= request->responseBufferCap) {
+            while (request->responseSize + (int) len >= request->responseBufferCap) request->responseBufferCap *= 2;
+            request->responseBuffer = (char*) realloc(request->responseBuffer, request->responseBufferCap);
+        }
+        
         memcpy(&request->responseBuffer[request->responseSize], in, len);
         request->responseSize += len;
       } break;
@@ -2772,7 +8060,7 @@ int HS_RequesterCallback(lws* socket, lws_callback_reasons reason, void* userDat
       default: break;
     }
     
-    return 0;
+    return callbackResult;
 }
 
 bool HS_InitServer(HS_Server* server, bool disableHTTP2=false) {
@@ -2782,6 +8070,7 @@ bool HS_InitServer(HS_Server* server, bool disableHTTP2=false) {
     server->lwsContextInfo.alpn = disableHTTP2 ? "h1" : 0;
     server->lwsContextInfo.pt_serv_buf_size = HS_MEGA_BYTES(16);
     server->lwsContext = lws_create_context(&server->lwsContextInfo);
+    HS__InitTimers(server);
     return server->lwsContext;
 }
 
@@ -2867,10 +8156,17 @@ bool HS_AddRequesterVHost(HS_Server* server, const char* clientSSLCAPath) {
     v->lwsProtocolsCount = 0;
     v->lwsContextInfo.port = CONTEXT_PORT_NO_LISTEN;
     v->lwsContextInfo.client_ssl_ca_filepath = clientSSLCAPath;
+    v->requestKeepWarmSecs = HS__RequestKeepWarmSecs;
     HS__AddProtocol(server, "hs-requester-vhost", "requester", HS_RequesterCallback, 0);
     return true;
 }
 
+// Sets how long idle outgoing connections are kept open for reuse
+void HS_SetRequestKeepAlive(HS_Server* server, int seconds) {
+    HS_VHost* v = HS_GetVHost(server, "hs-requester-vhost");
+    v->requestKeepWarmSecs = seconds;
+}
+
 void HS_AddCertToTrustStore(HS_Server* server, const char* cert) {
     HS_VHost* v = HS_GetVHost(server, "hs-requester-vhost");
     v->certTrustStore[v->certTrustStoreCount++] = cert;
@@ -2936,6 +8232,68 @@ void HS_SetCertificate(HS_Server* server, const char* vhostName, const char* ssl
     v->lwsContextInfo.ssl_private_key_filepath = v->sslPrivateKeyPath;
 }
 
+// Serves an ECDSA certificate to the clients that support it, next to the RSA
+// one, or alone. ECDSA handshakes are smaller and cheaper for the server.
+void HS_SetECDSACertificate(HS_Server* server, const char* vhostName, const char* sslPublicKeyPath, const char* sslPrivateKeyPath) {
+    HS_VHost* v = HS_GetVHost(server, vhostName);
+    strcpy(v->sslECDSAPublicKeyPath, sslPublicKeyPath);
+    strcpy(v->sslECDSAPrivateKeyPath, sslPrivateKeyPath);
+}
+
+// Sessions are resumable for timeoutSecs. A negative size disables the cache:
+// sessions are then only resumed from tickets.
+void HS_SetTLSSessionCache(HS_Server* server, const char* vhostName, int size, int timeoutSecs) {
+    HS_VHost* v = HS_GetVHost(server, vhostName);
+    v->tlsSessionCacheSize = size;
+    v->tlsSessionTimeout = timeoutSecs;
+}
+
+void HS_SetTLSSessionTickets(HS_Server* server, const char* vhostName, bool enabled, int keyRotationSecs) {
+    HS_VHost* v = HS_GetVHost(server, vhostName);
+    v->tlsDisableTickets = !enabled;
+    v->tlsTicketKeyRotation = keyRotationSecs;
+}
+
+// Sets the ticket keys instead of generating and rotating them, so that
+// instances given the same keys resume each other's sessions. hexKey is 160
+// hex digits: the key's name (16 bytes), AES key (32) and HMAC key (32). The
+// first key added encrypts new tickets. Returns false if malformed, or if the
+// vhost already has HS__TLSTicketKeysCap keys.
+bool HS_AddTLSTicketKey(HS_Server* server, const char* vhostName, const char* hexKey) {
+    HS_VHost* v = HS_GetVHost(server, vhostName);
+    if (v->tlsTicketKeysCount == HS__TLSTicketKeysCap || strlen(hexKey) != 2*sizeof(HS_TLSTicketKey)) return false;
+    
+    unsigned char* key = (unsigned char*) &v->tlsTicketKeys[v->tlsTicketKeysCount];
+    for (int i = 0; i < (int) sizeof(HS_TLSTicketKey); ++i) {
+        int hi = HS__HexValue(hexKey[2*i]);
+        int lo = HS__HexValue(hexKey[2*i+1]);
+        if (hi < 0 || lo < 0) {
+            OPENSSL_cleanse(key, sizeof(HS_TLSTicketKey));
+            return false;
+        }
+        key[i] = hi << 4 | lo;
+    }
+    
+    ++v->tlsTicketKeysCount;
+    return true;
+}
+
+// Resumes the vhost's TLS sessions from `store`, which servers serving the
+// same vhost share (listener groups do it for their servers). Call before
+// HS_RunForever.
+void HS_SetTLSSessionStore(HS_Server* server, const char* vhostName, HS_TLSSessionStore* store) {
+    HS_VHost* v = HS_GetVHost(server, vhostName);
+    v->tlsStore = store;
+}
+
+// TLS1_2_VERSION or TLS1_3_VERSION. The cipher lists must outlive HS_RunForever.
+void HS_SetTLSProtocol(HS_Server* server, const char* vhostName, int minVersion, const char* cipherList=0, const char* tls13CipherSuites=0) {
+    HS_VHost* v = HS_GetVHost(server, vhostName);
+    v->tlsMinVersion = minVersion;
+    if (cipherList) v->lwsContextInfo.ssl_cipher_list = cipherList;
+    if (tls13CipherSuites) v->lwsContextInfo.tls1_3_plus_cipher_list = tls13CipherSuites;
+}
+
 void HS_SetLogLevel(int level) {
     // LLL_ERR | LLL_WARN | LLL_NOTICE | LLL_INFO | LLL_DEBUG;
     lws_set_log_level(level, 0);
@@ -2950,8 +8308,21 @@ bool HS_InitVHosts(HS_Server* server) {
     bool result = true;
     for (int i = 0; i < server->vhostsCount; ++i) {
         HS_VHost& v = server->vhosts[i];
+        
+        // With only an ECDSA certificate, lws loads it as the main one
+        if (!v.lwsContextInfo.ssl_cert_filepath && v.sslECDSAPublicKeyPath[0]) {
+            v.lwsContextInfo.ssl_cert_filepath = v.sslECDSAPublicKeyPath;
+            v.lwsContextInfo.ssl_private_key_filepath = v.sslECDSAPrivateKeyPath;
+        }
+        
         v.lwsVHost = lws_create_vhost(server->lwsContext, &v.lwsContextInfo);
         result = v.lwsVHost ? result : false;
+        
+#ifndef _WIN32
+        if (v.lwsVHost && v.unixSocketMode && v.unixSocketPath[0] != '@' && chmod(v.unixSocketPath, v.unixSocketMode)) {
+            lwsl_err("VHost=%s | Failed to set mode %o on %s: %s\n", v.name, v.unixSocketMode, v.unixSocketPath, strerror(errno));
+        }
+#endif
     }
     return result;
 }
@@ -2966,12 +8337,315 @@ void HS_EnableFileCache(HS_Server* server, const char* vhostName) {
     v->disableFileCache = false;
 }
 
+// Caches files only while the file watcher covers every served dir of the
+// vhost (Linux), for when a stale file mustn't be served, e.g. while editing
+// them. Otherwise the cache is disabled.
+void HS_RequireFileWatcher(HS_Server* server, const char* vhostName) {
+    HS_VHost* v = HS_GetVHost(server, vhostName);
+    v->fileCacheNeedsWatcher = true;
+}
+
+// Cache files as read-only mappings instead of heap copies. Mappings are
+// shared by every vhost that has this enabled, so a file served by more than
+// one vhost is kept in memory once (in the OS page cache).
+void HS_EnableMappedFileCache(HS_Server* server, const char* vhostName) {
+    HS_VHost* v = HS_GetVHost(server, vhostName);
+    v->mappedFileCache = true;
+}
+
+// Don't send Cache-Control headers, so browsers always revalidate. Useful in
+// development, where files change while the server runs.
+void HS_DisableCacheControl(HS_Server* server, const char* vhostName) {
+    HS_VHost* v = HS_GetVHost(server, vhostName);
+    v->disableCacheControl = true;
+}
+
+// Fills the vhost's file cache with its served files (see HS__WarmFileCache).
+// Before the server runs, this just schedules the warm-up for when the vhost
+// starts; after that, it must be called from the service thread.
+void HS_WarmCache(HS_Server* server, const char* vhostName) {
+    HS_VHost* v = HS_GetVHost(server, vhostName);
+    
+    if (v->loadedFiles) {
+        HS__WarmFileCache(server, v);
+    } else {
+        v->warmFileCache = true;
+    }
+}
+
+// File watcher
+//--------------
+// On Linux, the served directories of every caching vhost are watched with
+// inotify, and changes invalidate the cache entries built from the changed
+// files, so the cache stays fresh without restarting the server.
+
+bool HS__IsServedPath(HS_VHost* vhost, const char* path) {
+    if (HS__IsPathUnder(path, vhost->servedFilesRootDir)) return true;
+    
+    for (int i = 0; i < vhost->rootDirMap.rulesCount; ++i) {
+        if (HS__IsPathUnder(path, vhost->rootDirMap.rules[i].value)) return true;
+    }
+    
+    return false;
+}
+
+// Bumps the cache bust version and drops the cached files that embed it,
+// since any change to the served files can make them outdated.
+void HS__ResetCacheBustedFiles(HS_VHost* vhost) {
+    HS__SetCacheBustVersion(vhost);
+    
+    for (int i = 0; i < vhost->loadedFilesCount; ++i) {
+        HS_FileMapEntry* entry = &vhost->loadedFiles[i];
+        if (entry->fileBuffer && !entry->stale && entry->cacheBusted) {
+            HS_InvalidateFileEntry(entry);
+        }
+    }
+}
+
+// Invalidates the cache entries read from `path` (a file, or a directory and
+// everything under it), or that include it by SSI, in every vhost that serves
+// it. A null `path` means everything changed. Vhosts whose cache busted files
+// must be regenerated are flagged in `resetCacheBusting`.
+void HS_InvalidateServedPath(HS_Server* server, const char* path, bool* resetCacheBusting) {
+    for (int v = 0; v < server->vhostsCount; ++v) {
+        HS_VHost* vhost = &server->vhosts[v];
+        if (!vhost->loadedFiles || (path && !HS__IsServedPath(vhost, path))) continue;
+        
+        ++vhost->pathCacheGeneration;
+        
+        if (vhost->gkTemplate && (!path || HS__IsPathUnder(vhost->gkTemplate->path, path))) {
+            HS_DestroyTemplate(vhost->gkTemplate);
+            vhost->gkTemplate = 0;
+        }
+        
+        for (int i = 0; i < vhost->loadedFilesCount; ++i) {
+            HS_FileMapEntry* entry = &vhost->loadedFiles[i];
+            if (entry->fileBuffer && !entry->stale && (!path || HS__IsPathUnder(entry->sourcePath, path) || HS__IncludesPath(entry->includes, path))) {
+                HS_InvalidateFileEntry(entry);
+            }
+        }
+        
+        if (vhost->cacheBust.rulesCount) resetCacheBusting[v] = true;
+    }
+}
+
+// Serves the vhost without counting on the file watcher, which doesn't cover
+// all of its served dirs: resolved paths expire after pathCacheTTL again, and
+// vhosts that need the watcher stop caching files.
+void HS__StopCountingOnWatcher(HS_VHost* vhost, const char* reason) {
+    if (!vhost->watcherFailed) {
+        lwsl_warn("FileWatcher | VHost=%s | %s: %s\n", vhost->name, reason,
+                  vhost->fileCacheNeedsWatcher ? "not caching files" : "resolved paths now expire, changed files may be served stale");
+    }
+    vhost->watcherFailed = true;
+    vhost->pathCacheWatched = false;
+    ++vhost->pathCacheGeneration; // Entries cached while watched don't expire
+    
+    if (vhost->fileCacheNeedsWatcher && !vhost->disableFileCache) {
+        vhost->disableFileCache = true;
+        for (int i = 0; i < vhost->loadedFilesCount; ++i) {
+            HS_FileMapEntry* entry = &vhost->loadedFiles[i];
+            if (entry->fileBuffer && !entry->stale) HS_InvalidateFileEntry(entry);
+        }
+    }
+}
+
+#ifdef __linux__
+// Watches dirPath and the directories under it. Returns false if some of them
+// couldn't be watched, and describes the first failure in `failure`.
+bool HS__WatchDirTree(HS_Server* server, const char* dirPath, char* failure, int failureSize) {
+    if (HS__IsDerivedFilesPath(dirPath)) return true;
+    
+    int wd = inotify_add_watch(server->fileWatcherFd, dirPath, IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+    if (wd < 0) {
+        // ENOSPC: past fs.inotify.max_user_watches. Gone or not a dir are fine.
+        if (errno == ENOENT || errno == ENOTDIR) return true;
+        if (!failure[0]) snprintf(failure, failureSize, "Can't watch %s (%s)", dirPath, strerror(errno));
+        return false;
+    }
+    
+    HS_WatchedDir* freeSlot = 0;
+    
+    for (int i = 0; i < server->watchedDirsCount; ++i) {
+        HS_WatchedDir* watched = &server->watchedDirs[i];
+        if (watched->wd == wd) return true; // Already watching it (e.g. through a symlink)
+        if (watched->wd < 0 && !freeSlot) freeSlot = watched;
+    }
+    
+    if (!freeSlot) {
+        if (server->watchedDirsCount == HS__WatchedDirsCap) {
+            if (!failure[0]) snprintf(failure, failureSize, "Too many directories (%d), not watching %s", HS__WatchedDirsCap, dirPath);
+            inotify_rm_watch(server->fileWatcherFd, wd);
+            return false;
+        }
+        freeSlot = &server->watchedDirs[server->watchedDirsCount++];
+    }
+    
+    freeSlot->wd = wd;
+    snprintf(freeSlot->path, HS__FilePathCap, "%s", dirPath);
+    
+    DIR* dir = opendir(dirPath);
+    if (!dir) return true;
+    
+    bool watched = true;
+    while (dirent* child = readdir(dir)) {
+        if (strcmp(child->d_name, ".")==0 || strcmp(child->d_name, "..")==0) continue;
+        
+        char childPath[HS__FilePathCap];
+        snprintf(childPath, sizeof(childPath), "%s/%s", dirPath, child->d_name);
+        
+        if (child->d_type == DT_DIR || (child->d_type == DT_UNKNOWN && HS_IsDirectory(childPath))) {
+            watched = HS__WatchDirTree(server, childPath, failure, failureSize) && watched;
+        }
+    }
+    
+    closedir(dir);
+    return watched;
+}
+
+// A served dir that doesn't exist yet can't be watched: its creation would go
+// unnoticed
+bool HS__WatchRootDir(HS_Server* server, const char* dirPath, char* failure, int failureSize) {
+    if (HS_IsDirectory(dirPath)) return HS__WatchDirTree(server, dirPath, failure, failureSize);
+    
+    if (!failure[0]) snprintf(failure, failureSize, "Can't watch %s (not a directory)", dirPath);
+    return false;
+}
+
+int HS_FileWatcherCallback(lws* socket, lws_callback_reasons reason, void* userData, void* in, size_t len) {
+    if (reason != LWS_CALLBACK_RAW_RX_FILE) return 0;
+    
+    HS_Server* server = (HS_Server*) lws_context_user(lws_get_context(socket));
+    bool resetCacheBusting[HS__VHostsArrayCap] = {};
+    
+    alignas(inotify_event) char buffer[HS_KILO_BYTES(16)];
+    int size = 0;
+    
+    while ((size = read(server->fileWatcherFd, buffer, sizeof(buffer))) > 0) {
+        for (char* at = buffer; at < buffer + size;) {
+            inotify_event* event = (inotify_event*) at;
+            at += sizeof(inotify_event) + event->len;
+            
+            if (event->mask & IN_Q_OVERFLOW) {
+                // Lost track of what changed
+                HS_InvalidateServedPath(server, 0, resetCacheBusting);
+                continue;
+            }
+            
+            HS_WatchedDir* watched = 0;
+            for (int i = 0; i < server->watchedDirsCount && !watched; ++i) {
+                if (server->watchedDirs[i].wd == event->wd) watched = &server->watchedDirs[i];
+            }
+            if (!watched) continue;
+            
+            if (event->mask & IN_IGNORED) {
+                // Directory was removed
+                watched->wd = -1;
+                continue;
+            }
+            
+            char path[HS__FilePathCap];
+            if (snprintf(path, sizeof(path), "%s/%s", watched->path, event->len ? event->name : "") >= (int) sizeof(path)) {
+                // Can't be named: invalidate everything under its directory instead
+                lwsl_warn("FileWatcher | Path too long under %s\n", watched->path);
+                HS_InvalidateServedPath(server, watched->path, resetCacheBusting);
+                continue;
+            }
+            if (HS__IsDerivedFilesPath(path)) continue;
+            
+            char failure[HS__FilePathCap + 64] = {};
+            if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)) && !HS__WatchDirTree(server, path, failure, sizeof(failure))) {
+                for (int v = 0; v < server->vhostsCount; ++v) {
+                    HS_VHost* vhost = &server->vhosts[v];
+                    if (vhost->pathCacheWatched && HS__IsServedPath(vhost, path)) HS__StopCountingOnWatcher(vhost, failure);
+                }
+            }
+            
+            if (server->verbosity) printf("FileWatcher | Changed=%s\n", path);
+            HS_InvalidateServedPath(server, path, resetCacheBusting);
+        }
+    }
+    
+    for (int v = 0; v < server->vhostsCount; ++v) {
+        if (resetCacheBusting[v]) HS__ResetCacheBustedFiles(&server->vhosts[v]);
+    }
+    
+    return 0;
+}
+#endif
+
+// Sets up the inotify watches and the vhost whose protocol receives their
+// events. Must run before the vhosts are created.
+void HS__InitFileWatcher(HS_Server* server) {
+    int vhostsCount = server->vhostsCount;
+    
+    for (int v = 0; v < vhostsCount; ++v) {
+        HS_VHost* vhost = &server->vhosts[v];
+        if (vhost->disableFileCache || (!vhost->servedFilesRootDir[0] && !vhost->rootDirMap.rulesCount)) continue;
+        
+#ifdef __linux__
+        if (!server->watchedDirs) {
+            server->fileWatcherFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+            if (server->fileWatcherFd < 0) {
+                char failure[64];
+                snprintf(failure, sizeof(failure), "inotify_init1 failed (%s)", strerror(errno));
+                HS__StopCountingOnWatcher(vhost, failure);
+                continue;
+            }
+            
+            server->watchedDirs = (HS_WatchedDir*) calloc(1, HS__WatchedDirsCap*sizeof(HS_WatchedDir));
+            
+            HS_AddVHost(server, "hs-file-watcher-vhost");
+            HS_VHost* watcherVHost = HS_GetVHost(server, "hs-file-watcher-vhost");
+            watcherVHost->lwsProtocolsCount = 0;
+            watcherVHost->lwsContextInfo.port = CONTEXT_PORT_NO_LISTEN;
+            HS__AddProtocol(server, "hs-file-watcher-vhost", "file-watcher", HS_FileWatcherCallback, 0);
+        }
+        
+        char failure[HS__FilePathCap + 64] = {};
+        bool watched = !vhost->servedFilesRootDir[0] || HS__WatchRootDir(server, vhost->servedFilesRootDir, failure, sizeof(failure));
+        
+        for (int i = 0; i < vhost->rootDirMap.rulesCount; ++i) {
+            const char* rootDir = vhost->rootDirMap.rules[i].value;
+            if (rootDir[0]) watched = HS__WatchRootDir(server, rootDir, failure, sizeof(failure)) && watched;
+        }
+        
+        if (watched) {
+            vhost->pathCacheWatched = true;
+        } else {
+            HS__StopCountingOnWatcher(vhost, failure);
+        }
+#else
+        if (vhost->fileCacheNeedsWatcher) vhost->disableFileCache = true;
+#endif
+    }
+}
+
+void HS__StartFileWatcher(HS_Server* server) {
+#ifdef __linux__
+    if (!server->watchedDirs) return;
+    
+    lws_sock_file_fd_type fd = {};
+    fd.filefd = server->fileWatcherFd;
+    
+    HS_VHost* watcherVHost = HS_GetVHost(server, "hs-file-watcher-vhost");
+    if (!lws_adopt_descriptor_vhost(watcherVHost->lwsVHost, LWS_ADOPT_RAW_FILE_DESC, fd, "file-watcher", 0)) {
+        for (int v = 0; v < server->vhostsCount; ++v) {
+            if (server->vhosts[v].pathCacheWatched) HS__StopCountingOnWatcher(&server->vhosts[v], "Failed to adopt the inotify descriptor");
+        }
+    }
+#endif
+}
+
 bool HS_RunForever(HS_Server* server, bool disableHTTP2=false) {
     if (!server->lwsContext) HS_InitServer(server, disableHTTP2);
+    HS__InitFileWatcher(server);
     HS_InitVHosts(server);
-    HS_InitPeriodicTasks(server);
+    HS__StartFileWatcher(server);
+    HS__StartIOPool(server);
+    HS__StartTimers(server);
     
-    server->isRunning = true;
+    server->isRunning = !server->stopRequested;
     int serviceReturn = 0;
     
     while (serviceReturn >= 0 && server->isRunning) {
@@ -2984,12 +8658,115 @@ bool HS_RunForever(HS_Server* server, bool disableHTTP2=false) {
 }
 
 void HS_Stop(HS_Server* server) {
+    server->stopRequested = true;
     server->isRunning = false;
     lws_cancel_service(server->lwsContext);
 }
 
 void HS_Destroy(HS_Server* server) {
+    HS__StopIOPool(server);
     lws_context_destroy(server->lwsContext);
+    HS__FinishIOJobs(server); // Clients are gone: this just frees the jobs
+    HS__DetachAccessLog(server);
+    
+    for (int i = 0; i < server->vhostsCount; ++i) {
+        HS_VHost* vhost = &server->vhosts[i];
+        for (int j = 0; j < vhost->servedArchivesCount; ++j) {
+            HS__FreeServedArchive(&vhost->servedArchives[j]);
+        }
+        if (vhost->tlsOwnsStore) HS_DestroyTLSSessionStore(vhost->tlsStore);
+    }
+    
+    if (server->fileMappings) free(server->fileMappings);
+    if (server->watchedDirs) free(server->watchedDirs);
+    if (server->ipConnections) free(server->ipConnections);
+    HS__DestroyTimers(server);
+    
+    // lws doesn't remove the socket files it created
+    for (int i = 0; i < server->vhostsCount; ++i) {
+        HS_VHost* vhost = &server->vhosts[i];
+        if (vhost->lwsVHost && vhost->unixSocketPath[0] && vhost->unixSocketPath[0] != '@') {
+            unlink(vhost->unixSocketPath);
+        }
+    }
+}
+
+// Listener groups
+//-----------------
+// Serves a vhost from several servers, each with its own lws context and
+// service thread, all listening on the same port with SO_REUSEPORT: the kernel
+// spreads the connections over them, so the vhost scales across cores without
+// sharing a thread with other vhosts. The setup function creates each server
+// like a standalone one, and must call HS_ShareVHostPort. Serving files with
+// the mapped file cache lets the servers share the OS page cache instead of
+// each holding copies of the files. The TLS sessions of each vhost are shared
+// by the servers, since a client may reconnect to any of them.
+#define HS__ListenersCap 32
+
+typedef void (*HS_ListenerSetup)(HS_Server* server, int index, void* userData);
+
+struct HS_ListenerGroup {
+    HS_Server* servers[HS__ListenersCap];
+    pthread_t  threads[HS__ListenersCap];
+    int        count;
+    
+    HS_TLSSessionStore* tlsStores[HS__VHostsArrayCap]; // by vhost index, the same in every server
+};
+
+// Lets servers in other threads or processes listen on the vhost's port too.
+// Connections are only spread over them on Linux.
+void HS_ShareVHostPort(HS_Server* server, const char* vhostName) {
+    HS_VHost* v = HS_GetVHost(server, vhostName);
+    v->lwsContextInfo.options |= LWS_SERVER_OPTION_ALLOW_LISTEN_SHARE;
+}
+
+void* HS__RunListener(void* data) {
+    HS_RunForever((HS_Server*) data, true);
+    return 0;
+}
+
+HS_ListenerGroup* HS_StartListenerGroup(int count, HS_ListenerSetup setup, void* userData=0) {
+    HS_ListenerGroup* group = (HS_ListenerGroup*) calloc(1, sizeof(HS_ListenerGroup));
+    if (count > HS__ListenersCap) count = HS__ListenersCap;
+    
+    for (int i = 0; i < count; ++i) {
+        HS_Server* server = (HS_Server*) calloc(1, sizeof(HS_Server));
+        setup(server, i, userData);
+        
+        for (int v = 0; v < server->vhostsCount; ++v) {
+            if (!server->vhosts[v].lwsContextInfo.ssl_cert_filepath || server->vhosts[v].tlsStore) continue;
+            if (!group->tlsStores[v]) group->tlsStores[v] = HS_CreateTLSSessionStore();
+            server->vhosts[v].tlsStore = group->tlsStores[v];
+        }
+        
+        if (pthread_create(&group->threads[group->count], 0, HS__RunListener, server)) {
+            lwsl_err("Listeners | Failed to start listener %d\n", i);
+            HS_Destroy(server);
+            free(server);
+            break;
+        }
+        
+        group->servers[group->count++] = server;
+    }
+    
+    return group;
+}
+
+void HS_StopListenerGroup(HS_ListenerGroup* group) {
+    for (int i = 0; i < group->count; ++i) {
+        HS_Stop(group->servers[i]);
+    }
+    
+    for (int i = 0; i < group->count; ++i) {
+        pthread_join(group->threads[i], 0);
+        HS_Destroy(group->servers[i]);
+        free(group->servers[i]);
+    }
+    
+    for (int v = 0; v < HS__VHostsArrayCap; ++v) {
+        if (group->tlsStores[v]) HS_DestroyTLSSessionStore(group->tlsStores[v]);
+    }
+    free(group);
 }
 
 void HS_AddRedirToHTTPSVHost(HS_Server* server, const char* vhostName, const char* fromHostname, int fromPort, const char* toHostname, int toPort) {
@@ -3168,13 +8945,16 @@ bool HS_ReceiveMessageFragment(HS_CallbackArgs* args, char** receivedBuffer, int
 
 void HS_AddServedFilesDir(HS_Server* server, const char* vhostName, const char* uriPrefix, const char* path) {
     HS_VHost* vhost = HS_GetVHost(server, vhostName);
-    HS_RootDirMapEntry& entry = vhost->rootDirMap[vhost->rootDirMapSize++];
-    strcpy(entry.uriPrefix, uriPrefix);
-    HS_RealPath(path, entry.path);
-
-    if (!HS_EndsWith(entry.uriPrefix, "/")) {
-        strcat(entry.uriPrefix, "/");
-    }
+    
+    char prefix[HS__URICap] = {};
+    int uriPrefixSize = strlen(uriPrefix);
+    snprintf(prefix, sizeof(prefix), uriPrefixSize && uriPrefix[uriPrefixSize-1] == '/' ? "%s*" : "%s/*", uriPrefix);
+    
+    char realPath[HS__FilePathCap] = {};
+    HS_RealPath(path, realPath);
+    
+    vhost->rootDirMap.lastMatchWins = true;
+    HS_AddRule(&vhost->rootDirMap, prefix, realPath);
 }
 
 bool HS_InitFileServer(HS_Server* server, const char* vhostName, const char* configFilePath) {
@@ -3184,17 +8964,43 @@ bool HS_InitFileServer(HS_Server* server, const char* vhostName, const char* con
     JS_Reader jreader[] = {
         {"hostname", JS_Type_String, vhost->hostName},
         {"port", JS_Type_Integer, &vhost->port},
+        {"unix-socket", JS_Type_String},
+        {"unix-socket-mode", JS_Type_String},
+        {"unix-socket-owner", JS_Type_String},
         {"served-files-dir", JS_Type_String, servedFilesRootDir},
         {"served-files-dir-map", JS_Type_Dict},
         {"error-404-file", JS_Type_String, vhost->error404File},
         {"ssl-public-key-path", JS_Type_String, vhost->sslPublicKeyPath},
         {"ssl-private-key-path", JS_Type_String, vhost->sslPrivateKeyPath},
         {"ssl-ca-bundle-path", JS_Type_String, vhost->sslCABundlePath},
+        {"ssl-ecdsa-public-key-path", JS_Type_String, vhost->sslECDSAPublicKeyPath},
+        {"ssl-ecdsa-private-key-path", JS_Type_String, vhost->sslECDSAPrivateKeyPath},
+        {"ip-limits", JS_Type_Dict},
+        {"ip-limits/connections", JS_Type_Integer, &vhost->ipMaxConnections},
+        {"ip-limits/requests-per-second", JS_Type_Integer, &vhost->ipMaxRequestsPerSecond},
+        {"ip-limits/upgrades-per-minute", JS_Type_Integer, &vhost->ipMaxUpgradesPerMinute},
+        {"ip-limits/exempt-loopback", JS_Type_Boolean, &vhost->ipLimitsExemptLoopback},
+        {"ip-limits/trusted-proxies", JS_Type_Array},
+        {"tls", JS_Type_Dict},
+        {"tls/session-cache-size", JS_Type_Integer, &vhost->tlsSessionCacheSize},
+        {"tls/session-timeout", JS_Type_Integer, &vhost->tlsSessionTimeout},
+        {"tls/ticket-key-rotation", JS_Type_Integer, &vhost->tlsTicketKeyRotation},
+        {"tls/disable-session-tickets", JS_Type_Boolean, &vhost->tlsDisableTickets},
+        {"tls/min-version", JS_Type_String},
+        {"tls/cipher-list", JS_Type_String},
+        {"tls/tls13-ciphersuites", JS_Type_String},
+        {"tls/ticket-keys", JS_Type_Array},
         {"mem-cache-max-size-mb", JS_Type_Integer, &vhost->memCacheMaxSizeMB},
+        {"mmap-file-cache", JS_Type_Boolean, &vhost->mappedFileCache},
+        {"persist-transformed-files", JS_Type_Boolean, &vhost->persistTransformedFiles},
+        {"path-cache-ttl", JS_Type_Integer, &vhost->pathCacheTTL},
+        {"warm-cache", JS_Type_Boolean, &vhost->warmFileCache},
         {"default-content-language", JS_Type_String, &vhost->defaultContentLanguage},
         {"allowed-origins", JS_Type_Dict},
         {"gatekeepr", JS_Type_Dict},
         {"gatekeepr/database", JS_Type_String, &vhost->gkDatabasePath},
+        {"gatekeepr/token-keys", JS_Type_Array},
+        {"gatekeepr/deny-list", JS_Type_String, &vhost->gkDenyListPath},
         {}
     };
     
@@ -3205,11 +9011,53 @@ bool HS_InitFileServer(HS_Server* server, const char* vhostName, const char* con
     if (result) {
         HS_SetVHostHostName(server, vhostName, vhost->hostName);
         HS_SetVHostPort(server, vhostName, vhost->port);
+        
+        JS_JSON* jSocket = JS_Get(jConfig, "unix-socket");
+        if (jSocket) {
+            JS_JSON* jMode = JS_Get(jConfig, "unix-socket-mode");
+            JS_JSON* jOwner = JS_Get(jConfig, "unix-socket-owner");
+            
+            // The mode is octal, like chmod's: "0660"
+            int mode = jMode ? (int) strtol(jMode->string, 0, 8) : 0;
+            result = HS_SetVHostUnixSocket(server, vhostName, jSocket->string, mode, jOwner ? jOwner->string : 0);
+        }
 
         if (vhost->sslPublicKeyPath[0]) vhost->lwsContextInfo.ssl_cert_filepath = vhost->sslPublicKeyPath;
         if (vhost->sslPrivateKeyPath[0]) vhost->lwsContextInfo.ssl_private_key_filepath = vhost->sslPrivateKeyPath;
         if (vhost->sslCABundlePath[0]) vhost->lwsContextInfo.ssl_ca_filepath = vhost->sslCABundlePath;
         
+        // The strings stay in jConfig, which lives as long as the vhost
+        JS_JSON* jTLS = JS_Get(jConfig, "tls");
+        if (jTLS) {
+            JS_JSON* j = JS_Get(jTLS, "min-version");
+            if (j) {
+                if      (!strcmp(j->string, "1.2")) vhost->tlsMinVersion = TLS1_2_VERSION;
+                else if (!strcmp(j->string, "1.3")) vhost->tlsMinVersion = TLS1_3_VERSION;
+                else lwsl_warn("TLS | VHost=%s | Unknown min-version %s\n", vhostName, j->string);
+            }
+            
+            j = JS_Get(jTLS, "cipher-list");
+            if (j) vhost->lwsContextInfo.ssl_cipher_list = j->string;
+            
+            j = JS_Get(jTLS, "tls13-ciphersuites");
+            if (j) vhost->lwsContextInfo.tls1_3_plus_cipher_list = j->string;
+            
+            JS_Iterator it = JS_ForEach(JS_Get(jTLS, "ticket-keys"));
+            while (JS_Next(&it)) {
+                JS_JSON* jKey = JS_Unwrap(it);
+                if (jKey->type != JS_Type_String || !HS_AddTLSTicketKey(server, vhostName, jKey->string)) {
+                    lwsl_warn("TLS | VHost=%s | Ignoring a ticket key: expected at most %d strings of %d hex digits\n", vhostName, HS__TLSTicketKeysCap, (int) (2*sizeof(HS_TLSTicketKey)));
+                }
+            }
+        }
+        
+        JS_JSON* jLimits = JS_Get(jConfig, "ip-limits");
+        JS_Iterator it = JS_ForEach(jLimits ? JS_Get(jLimits, "trusted-proxies") : 0);
+        while (JS_Next(&it)) {
+            JS_JSON* jProxy = JS_Unwrap(it);
+            if (jProxy->type == JS_Type_String) HS_AddIPTrustedProxy(server, vhostName, jProxy->string);
+        }
+        
         HS_RealPath(servedFilesRootDir, vhost->servedFilesRootDir);
         
         JS_JSON* j = JS_Get(jConfig, "uri-map");
@@ -3222,19 +9070,14 @@ bool HS_InitFileServer(HS_Server* server, const char* vhostName, const char* con
         j = JS_Get(jConfig, "cache-control-map");
         if (j) {
             for (int i = 0; i < j->size; ++i) {
-                HS_CacheControlMapEntry& entry = vhost->cacheControlMap[vhost->cacheControlMapSize++];
-                strcpy(entry.uri, j->pairs[i].key);
-                entry.uriSize = strlen(entry.uri);
-                strcpy(entry.cacheString, j->pairs[i].value->string);
+                HS_PushCacheControlMapping(server, vhostName, j->pairs[i].key, j->pairs[i].value->string);
             }
         }
         
         j = JS_Get(jConfig, "redirect-map");
         if (j) {
             for (int i = 0; i < j->size; ++i) {
-                HS_RedirectMapEntry& entry = vhost->redirectMap[vhost->redirectMapSize++];
-                strcpy(entry.uri, j->pairs[i].key);
-                strcpy(entry.destination, j->pairs[i].value->string);
+                HS_PushRedirectMapping(server, vhostName, j->pairs[i].key, j->pairs[i].value->string);
             }
         }
 
@@ -3248,16 +9091,14 @@ bool HS_InitFileServer(HS_Server* server, const char* vhostName, const char* con
         j = JS_Get(jConfig, "cache-bust");
         if (j) {
             for (int i = 0; i < j->size; ++i) {
-                char* entry = vhost->cacheBust[vhost->cacheBustSize++];
-                strcpy(entry, j->array[i]->string);
+                HS_PushCacheBust(server, vhostName, j->array[i]->string);
             }
         }
         
         j = JS_Get(jConfig, "needs-ssi-parsing");
         if (j) {
             for (int i = 0; i < j->size; ++i) {
-                char* entry = vhost->needsSSIParsing[vhost->needsSSIParsingSize++];
-                strcpy(entry, j->array[i]->string);
+                HS_PushSSITarget(server, vhostName, j->array[i]->string);
             }
         }
         
@@ -3277,11 +9118,41 @@ bool HS_InitFileServer(HS_Server* server, const char* vhostName, const char* con
                 strcpy(vhost->gkDatabasePath, "gatekeepr.db");
             }
             
+            vhost->gkTokenKeysCount = 0;
+            JS_Iterator it = JS_ForEach(JS_Get(j, "token-keys"));
+            while (JS_Next(&it) && vhost->gkTokenKeysCount < HS__GKTokenKeysCap) {
+                HS_GKTokenKey& key = vhost->gkTokenKeys[vhost->gkTokenKeysCount];
+                char* id = JS_GetString(JS_Unwrap(it), "id");
+                char* secret = JS_GetString(JS_Unwrap(it), "secret");
+                
+                if (!id || !secret || !id[0] || strchr(id, '.') || strlen(id) >= sizeof(key.id) || !secret[0] || strlen(secret) >= sizeof(key.secret)) {
+                    lwsl_err("gatekeepr: invalid token key %d\n", it.index);
+                    continue;
+                }
+                strcpy(key.id, id);
+                strcpy(key.secret, secret);
+                ++vhost->gkTokenKeysCount;
+            }
+            
             if (HS_IsFileReadable(vhost->gkDatabasePath)) {
                 vhost->gkdb = SQ_OpenDB(vhost->gkDatabasePath);
+                pthread_mutex_init(&vhost->gkdbMutex, 0);
+            }
+            
+            if (vhost->gkdb && !vhost->gkSessions) {
+                vhost->gkSessions = (HS_GKSession*) calloc(1, HS__GKSessionsCap*sizeof(HS_GKSession));
+                vhost->gkLookupsLeft = HS__GKLookupsPerSyncCap;
+                HS__SubmitGKSync(server, vhost);
+            }
+            HS__RefreshGKDenyList(vhost);
+            
+            if (!server->gatekeeprTaskScheduled && (vhost->gkSessions || vhost->gkDenyListPath[0])) {
+                HS_SchedulePeriodicTask(server, HS__GatekeeprTask, HS__GKSyncPeriod);
+                server->gatekeeprTaskScheduled = true;
             }
             
             vhost->gkConfig = j;
+            HS__CompileGatedAreas(vhost);
         }
     
         if (vhost->port == 443) {
@@ -14,6 +14,7 @@ struct SG_SignalHandler {
     int signal;
     SG_SignalHandlerFunction function;
     void* data;
+    void (*previous)(int); // restored by SG_UnregisterHandler
 };
 
 SG_SignalHandler SG_SignalHandlers[32] = {};
@@ -43,14 +44,29 @@ void SG_RegisterHandler(int sig, SG_SignalHandlerFunction function, void* data)
     if (sig == SIGINT) {
         SetConsoleCtrlHandler(WindowsCtrlHandler, TRUE);
     } else {
-        signal(sig, SG_SignalReceiver);
+        SG_SignalHandlers[sig].previous = signal(sig, SG_SignalReceiver);
     }
 }
 
+void SG_UnregisterHandler(int sig) {
+    if (sig == SIGINT) {
+        SetConsoleCtrlHandler(WindowsCtrlHandler, FALSE);
+    } else {
+        signal(sig, SG_SignalHandlers[sig].previous == SIG_ERR ? SIG_DFL : SG_SignalHandlers[sig].previous);
+    }
+    SG_SignalHandlers[sig] = {};
+}
+
 #else
 void SG_RegisterHandler(int sig, SG_SignalHandlerFunction function, void* data) {
     SG_SignalHandlers[sig] = {sig, function, data};
-    signal(sig, SG_SignalReceiver);
+    SG_SignalHandlers[sig].previous = signal(sig, SG_SignalReceiver);
+}
+
+// Puts back the disposition the signal had before SG_RegisterHandler
+void SG_UnregisterHandler(int sig) {
+    signal(sig, SG_SignalHandlers[sig].previous == SIG_ERR ? SIG_DFL : SG_SignalHandlers[sig].previous);
+    SG_SignalHandlers[sig] = {};
 }
 #endif
 
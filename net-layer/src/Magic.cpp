@@ -48,7 +48,8 @@ enum MG_NetEventType {
     MG_NetEventType_NewClient,
     MG_NetEventType_ClientLeft,
     MG_NetEventType_NewPayload,
-    MG_NetEventType_ServerLoopInterrupted
+    MG_NetEventType_ServerLoopInterrupted,
+    MG_NetEventType_TimerFired // clientId is the tag given to MG_AddTimer
 };
 
 struct MG_NetEvent {
@@ -70,10 +71,19 @@ struct MG_AppEvent {
     int payloadSize;
 };
 
+// NOTE: URI mappings are pushed by the app layer, but the routing rules are
+// compiled and used by the net layer thread, so updates are queued for it.
+struct MG_URIMappingUpdate {
+    bool clear;
+    char uri[PATH_MAX];
+    char filePath[PATH_MAX];
+};
+
 struct MG_Global {
     pthread_t threadId;
     int ipcPort;
     char magicPackageRootPath[PATH_MAX];
+    char servedArchivePath[PATH_MAX];
 
 #ifdef _WIN32
     SOCKET fdSocket;
@@ -84,12 +94,19 @@ struct MG_Global {
     char projectPath[PATH_MAX];
     char appHostName[PATH_MAX];
     int appPort;
+    char appUnixSocketPath[PATH_MAX]; // listened on instead of appPort when set
+    int appUnixSocketMode;
+    char accessLogPath[PATH_MAX]; // no access log when empty
+    int accessLogFormat;
+    int accessLogSampleRate;
     char docsPath[PATH_MAX];
     int  docsPathSize;
     bool verbose;
     bool devMode;
 
     HS_Server hserver;
+    HS_ListenerGroup* companionListeners; // when the companion vhost has its own threads
+    HS_AccessLog* accessLog;
 
     size_t appStateSize;
     void (*appInit)();
@@ -102,6 +119,9 @@ struct MG_Global {
     pthread_mutex_t netEventsMutex;
     pthread_mutex_t appEventsMutex;
 
+    MG_URIMappingUpdate* uriMappingUpdates;
+    pthread_mutex_t uriMappingUpdatesMutex;
+
     MG_Client** clients;
     int nextClientId;
 };
@@ -260,6 +280,36 @@ MG_API int MG_ProcessIncomingMessage(HS_CallbackArgs* args) {
     return 0;
 }
 
+MG_API void MG_PushURIMappingUpdate(MG_URIMappingUpdate update) {
+    pthread_mutex_lock(&g.uriMappingUpdatesMutex);
+    arradd(g.uriMappingUpdates, update);
+    pthread_mutex_unlock(&g.uriMappingUpdatesMutex);
+
+    if (g.hserver.lwsContext) {
+        lws_cancel_service(g.hserver.lwsContext);
+    }
+}
+
+// Runs on the net layer thread
+MG_API void MG_ApplyURIMappingUpdates() {
+    pthread_mutex_lock(&g.uriMappingUpdatesMutex);
+
+    for (int i = 0; i < arrcount(g.uriMappingUpdates); ++i) {
+        MG_URIMappingUpdate& update = g.uriMappingUpdates[i];
+        if (update.clear) {
+            HS_ClearURIMapping(&g.hserver, "magic-app");
+        } else {
+            HS_PushURIMapping(&g.hserver, "magic-app", update.uri, update.filePath);
+        }
+    }
+    if (arrcount(g.uriMappingUpdates)) {
+        HS_CompileURIMapping(&g.hserver, "magic-app");
+    }
+
+    arrclear(g.uriMappingUpdates);
+    pthread_mutex_unlock(&g.uriMappingUpdatesMutex);
+}
+
 MG_API int HS_CALLBACK(handleEvent, args) {
     HS_VHost* vhost = HS_GetVHost(args->socket);
     MG_Client* wcClient = HS_GetClientData(MG_Client, args);
@@ -297,6 +347,12 @@ MG_API int HS_CALLBACK(handleEvent, args) {
             lws_sock_file_fd_type fd = {.sockfd=g.fdSocket};
 #endif
             lws* wsi = lws_adopt_descriptor_vhost(vhost->lwsVHost, LWS_ADOPT_SOCKET, fd, "ws", 0);
+
+            MG_ApplyURIMappingUpdates();
+        } break;
+
+        case LWS_CALLBACK_EVENT_WAIT_CANCELLED: {
+            MG_ApplyURIMappingUpdates();
         } break;
 
         case LWS_CALLBACK_CLOSED: {
@@ -349,15 +405,52 @@ MG_API int HS_CALLBACK(handleEvent, args) {
 }
 
 MG_API void MG_PushURIMapping(const char* uri, int uriSize, const char* filePath, int filePathSize) {
-    char uriBuf[PATH_MAX] = {};
-    char filePathBuf[PATH_MAX] = {};
-    strncpy(uriBuf, uri, uriSize);
-    strncpy(filePathBuf, filePath, filePathSize);
-    HS_PushURIMapping(&g.hserver, "magic-app", uriBuf, filePathBuf);
+    MG_URIMappingUpdate update = {};
+    strncpy(update.uri, uri, MIN(uriSize, PATH_MAX-1));
+    strncpy(update.filePath, filePath, MIN(filePathSize, PATH_MAX-1));
+    MG_PushURIMappingUpdate(update);
 }
 
 MG_API void MG_ClearURIMapping() {
-    HS_ClearURIMapping(&g.hserver, "magic-app");
+    MG_URIMappingUpdate update = {};
+    update.clear = true;
+    MG_PushURIMappingUpdate(update);
+}
+
+// Page templates
+//----------------
+// Used by the app layer to generate the pages' HTML: a template is compiled
+// once and rendered for each page.
+
+MG_API HS_Template* MG_LoadTemplate(const char* path, const char** placeholders, int placeholdersCount) {
+    return HS_LoadTemplate(path, placeholders, placeholdersCount);
+}
+
+MG_API bool MG_RenderTemplateToFile(HS_Template* tmpl, const char** values, const char* outputPath) {
+    FILE* file = fopen(outputPath, "wb");
+    if (!file) return false;
+    
+    int size = HS_RenderTemplate(tmpl, values, 0);
+    char* output = (char*) malloc(size + 1);
+    HS_RenderTemplate(tmpl, values, output);
+    
+    bool written = fwrite(output, 1, size, file) == (size_t) size;
+    fclose(file);
+    free(output);
+    return written;
+}
+
+MG_API void MG_DestroyTemplate(HS_Template* tmpl) {
+    HS_DestroyTemplate(tmpl);
+}
+
+// Signs a gatekeepr token for a user of the companion vhost's gated area, e.g.
+// when the app logs the user in itself. Returns its size, or 0 when the vhost
+// has no token keys. The keys are only read after the vhost is initialized.
+MG_API int MG_CreateGatekeeprToken(const char* gatedArea, const char* userId, long long expires, char* output, int outputSize) {
+    HS_Server* server = g.companionListeners && g.companionListeners->count ? g.companionListeners->servers[0] : &g.hserver;
+    HS_VHost* vhost = HS_GetVHost(server, "magic-companion");
+    return vhost ? HS_CreateGatekeeprToken(vhost, gatedArea, userId, expires, output, outputSize) : 0;
 }
 
 MG_API void MG_SetStateSize(size_t size) {
@@ -376,6 +469,11 @@ MG_API void MG_HandleSigInt(void* data) {
     LU_Log(LU_Debug, "ServerLoopInterrupted");
 }
 
+// Lets logrotate move the access log: SIGHUP reopens it
+MG_API void MG_HandleSigHup(void* data) {
+    if (g.accessLog) HS_ReopenAccessLog(g.accessLog);
+}
+
 MG_API void MG_StartIPC(void) {
 #ifdef _WIN32
     static int wsa_initialized = 0;
@@ -408,6 +506,44 @@ MG_API void MG_StartIPC(void) {
 #endif
 }
 
+// "listener-threads" in companion-host.json moves the companion vhost off the
+// app's service thread, onto that many threads sharing its port. 0 keeps it
+// on the app's thread. Each thread has its own file cache; with
+// "mmap-file-cache" they share the files through the OS page cache instead.
+int MG__CompanionListeners() {
+    JS_JSON* jConfig = JS_ParseFile(".Magic/companion-host.json");
+    if (!jConfig) return 0;
+    
+    JS_JSON* j = JS_Get(jConfig, "listener-threads");
+    int result = j && j->type == JS_Type_Number ? (int) j->number : 0;
+    JS_Free(jConfig);
+    
+#ifndef __linux__
+    // Without SO_REUSEPORT, one listener would get all the connections
+    if (result > 1) result = 1;
+#endif
+    return result;
+}
+
+void MG__SetupCompanionListener(HS_Server* server, int index, void* userData) {
+    *server = HS_CreateServer(0, !HS_IsDirectory(".Magic/certs"));
+    HS_InitServer(server, true);
+    HS_AddVHost(server, "magic-companion");
+    HS_SetLWSVHostConfig(server, "magic-companion", pt_serv_buf_size, HS_KILO_BYTES(12));
+    HS_SetLWSProtocolConfig(server, "magic-companion", "HTTP", rx_buffer_size, HS_KILO_BYTES(12));
+    HS_InitFileServer(server, "magic-companion", ".Magic/companion-host.json");
+    HS_ShareVHostPort(server, "magic-companion");
+    
+    if (g.accessLog) {
+        HS_SetAccessLog(server, g.accessLog);
+    }
+    
+    if (g.verbose) {
+        HS_SetVHostVerbosity(server, "magic-companion", 1);
+        HS_SchedulePeriodicTask(server, HS_PrintMetrics, 60000);
+    }
+}
+
 MG_API void* MG_RunServer(void*) {
     if (g.verbose) {
         HS_SetLogLevel(LLL_ERR | LLL_WARN | LLL_NOTICE | LLL_INFO | LLL_DEBUG);
@@ -431,12 +567,18 @@ MG_API void* MG_RunServer(void*) {
     HS_SetHTTPGetHandler(&g.hserver, "magic-app", HS_GetFileByURI);
     HS_SetVHostHostName(&g.hserver, "magic-app", g.appHostName);
     HS_SetVHostPort(&g.hserver, "magic-app", g.appPort);
+    if (g.appUnixSocketPath[0]) {
+        HS_SetVHostUnixSocket(&g.hserver, "magic-app", g.appUnixSocketPath, g.appUnixSocketMode);
+    }
     HS_AddProtocol(&g.hserver, "magic-app", "ws", handleEvent, MG_Client);
     HS_PushCacheBust(&g.hserver, "magic-app", "*.html");
     HS_PushCacheControlMapping(&g.hserver, "magic-app", "*.html", "no-cache, no-store, must-revalidate");
     HS_PushCacheControlMapping(&g.hserver, "magic-app", "/*", "max-age=2592000");
     if (!disableSSL) {
         HS_SetCertificate(&g.hserver, "magic-app", ".Magic/certs/certificate.crt", ".Magic/certs/private.key");
+        if (HS_IsRegularFile(".Magic/certs/ecdsa-certificate.crt")) {
+            HS_SetECDSACertificate(&g.hserver, "magic-app", ".Magic/certs/ecdsa-certificate.crt", ".Magic/certs/ecdsa-private.key");
+        }
     }
 
     char tempBuffer[2*PATH_MAX];
@@ -448,37 +590,100 @@ MG_API void* MG_RunServer(void*) {
     snprintf(tempBuffer, sizeof(tempBuffer), "%s/%s", g.magicPackageRootPath, "served-files");
     HS_AddServedFilesDir(&g.hserver, "magic-app", "/Magic.jl", tempBuffer);
 
+    // Magic's own files are served from the archive packed at build time. In
+    // dev mode they are served from the package dir, where they are edited.
+    if (!g.devMode && HS_IsRegularFile(g.servedArchivePath)) {
+        HS_AddServedArchive(&g.hserver, "magic-app", "/Magic.jl", g.servedArchivePath);
+    }
+
     if (g.verbose) {
         HS_SetVHostVerbosity(&g.hserver, "magic-app", 1);
     }
 
     if (g.devMode) {
+#ifdef __linux__
+        // Served files are watched, so the cache stays fresh. If they can't
+        // all be watched, they aren't cached.
+        HS_DisableCacheControl(&g.hserver, "magic-app");
+        HS_RequireFileWatcher(&g.hserver, "magic-app");
+#else
         HS_DisableFileCache(&g.hserver, "magic-app");
+#endif
     }
 
     if (g.docsPath) {
         HS_AddServedFilesDir(&g.hserver, "magic-app", "/docs", g.docsPath);
     }
 
-    if (HS_IsRegularFile(".Magic/companion-host.json")) {
+    if (!g.devMode) {
+        HS_WarmCache(&g.hserver, "magic-app");
+
+        // Generous enough for browsers; a local reverse proxy has to do its own limiting
+        HS_SetIPLimits(&g.hserver, "magic-app", 256, 200, 60, true);
+    }
+
+    if (g.accessLogPath[0]) {
+        g.accessLog = HS_OpenAccessLog(g.accessLogPath, (HS_AccessLogFormat) g.accessLogFormat, g.accessLogSampleRate);
+        if (g.accessLog) HS_SetAccessLog(&g.hserver, g.accessLog);
+    }
+
+    int companionListeners = MG__CompanionListeners();
+    if (companionListeners > 0) {
+        g.companionListeners = HS_StartListenerGroup(companionListeners, MG__SetupCompanionListener);
+    } else if (HS_IsRegularFile(".Magic/companion-host.json")) {
         HS_AddVHost(&g.hserver, "magic-companion");
         HS_SetLWSVHostConfig(&g.hserver, "magic-companion", pt_serv_buf_size, HS_KILO_BYTES(12));
         HS_SetLWSProtocolConfig(&g.hserver, "magic-companion", "HTTP", rx_buffer_size, HS_KILO_BYTES(12));
         HS_InitFileServer(&g.hserver, "magic-companion", ".Magic/companion-host.json");
+        if (HS_GetVHost(&g.hserver, "magic-companion")->mappedFileCache) {
+            // Share mapped files with the companion vhost
+            HS_EnableMappedFileCache(&g.hserver, "magic-app");
+        }
         if (g.verbose) {
             HS_SetVHostVerbosity(&g.hserver, "magic-companion", 1);
         }
     }
 
+    if (g.verbose) {
+        HS_SchedulePeriodicTask(&g.hserver, HS_PrintMetrics, 60000);
+    }
+
     SG_RegisterHandler(SIGINT, MG_HandleSigInt, 0);
+#ifndef _WIN32
+    if (g.accessLog) SG_RegisterHandler(SIGHUP, MG_HandleSigHup, 0);
+#endif
 
     MG_StartIPC();
 
     HS_RunForever(&g.hserver, true);
+    if (g.companionListeners) {
+        HS_StopListenerGroup(g.companionListeners);
+    }
     HS_Destroy(&g.hserver);
+    if (g.accessLog) {
+#ifndef _WIN32
+        SG_UnregisterHandler(SIGHUP);
+#endif
+        HS_CloseAccessLog(g.accessLog);
+        g.accessLog = 0;
+    }
     return 0;
 }
 
+// Called before MG_InitNetLayer
+MG_API void MG_SetUnixSocket(const char* path, int pathSize, int mode) {
+    strncpy(g.appUnixSocketPath, path, pathSize < (int) sizeof(g.appUnixSocketPath) ? pathSize : sizeof(g.appUnixSocketPath) - 1);
+    g.appUnixSocketMode = mode;
+}
+
+// Called before MG_InitNetLayer. format is an HS_AccessLogFormat; 1 in
+// sampleRate successful requests is logged.
+MG_API void MG_SetAccessLog(const char* path, int pathSize, int format, int sampleRate) {
+    strncpy(g.accessLogPath, path, pathSize < (int) sizeof(g.accessLogPath) ? pathSize : sizeof(g.accessLogPath) - 1);
+    g.accessLogFormat = format;
+    g.accessLogSampleRate = sampleRate;
+}
+
 MG_API void MG_InitNetLayer(
     const char* hostName,
     int hostNameSize,
@@ -488,6 +693,8 @@ MG_API void MG_InitNetLayer(
     int ipcPort,
     const char* magicPackageRootPath,
     int magicPackageRootPathSize,
+    const char* servedArchivePath,
+    int servedArchivePathSize,
     bool verbose,
     bool devMode
 ) {
@@ -509,14 +716,32 @@ MG_API void MG_InitNetLayer(
     g.ipcPort = ipcPort;
 
     strncpy(g.magicPackageRootPath, magicPackageRootPath, magicPackageRootPathSize);
+    strncpy(g.servedArchivePath, servedArchivePath, servedArchivePathSize);
     getcwd(g.projectPath, sizeof(g.projectPath));
 
     pthread_mutex_init(&g.netEventsMutex, 0);
     pthread_mutex_init(&g.appEventsMutex, 0);
+    pthread_mutex_init(&g.uriMappingUpdatesMutex, 0);
+
+    g.uriMappingUpdates = arralloc(MG_URIMappingUpdate, 16);
 
     int result = pthread_create(&g.threadId, 0, MG_RunServer, 0);
 }
 
+void MG__TimerFired(HS_Server* server, void* userData) {
+    MG_PushNetEvent(MG_CreateNetEvent(MG_NetEventType_TimerFired, (int) (intptr_t) userData, 0, 0));
+    MG_WakeUpAppLayer();
+}
+
+// The app layer runs the timer's function when it gets the TimerFired event
+MG_API HS_TimerId MG_AddTimer(int64_t delayMs, int64_t periodMs, int tag) {
+    return HS_AddTimer(&g.hserver, delayMs, periodMs, MG__TimerFired, (void*) (intptr_t) tag);
+}
+
+MG_API bool MG_CancelTimer(HS_TimerId id) {
+    return HS_CancelTimer(&g.hserver, id);
+}
+
 MG_API bool MG_ServerIsRunning() {
     return g.hserver.isRunning;
 }
@@ -0,0 +1,12 @@
+// Packs a directory of static files into a served archive (see
+// HS_AddServedArchive). The build scripts use it for Magic's served-files.
+#include "DD_HTTPS.h"
+
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <served-files-dir> <archive-path>\n", argv[0]);
+        return 1;
+    }
+    
+    return HS_PackServedFiles(argv[1], argv[2]) ? 0 : 1;
+}
@@ -0,0 +1,72 @@
+// Access log: requests are written by the log thread, and SIGHUP reopens the
+// file once logrotate has moved it.
+#include "test.h"
+#include "../src/DD_SignalUtils.h"
+
+char TS_Dir[HS__FilePathCap];
+
+void TS_HandleSigHup(void* data) {
+    HS_ReopenAccessLog((HS_AccessLog*) data);
+}
+
+// Waits (up to 2 s) for the log at TS_Dir/name to hold `count` lines; returns its content.
+const char* TS_ReadLog(const char* name, int count) {
+    static char content[HS_KILO_BYTES(4)];
+    char path[HS__FilePathCap];
+    snprintf(path, sizeof(path), "%s/%s", TS_Dir, name);
+
+    for (int i = 0; i < 200; ++i) {
+        content[0] = 0;
+        FILE* file = fopen(path, "rb");
+        if (file) {
+            content[fread(content, 1, sizeof(content)-1, file)] = 0;
+            fclose(file);
+        }
+
+        int lines = 0;
+        for (const char* c = content; *c; ++c) lines += *c == '\n';
+        if (lines >= count) break;
+        usleep(10000);
+    }
+    return content;
+}
+
+int main() {
+    TS_MakeTempDir(TS_Dir, sizeof(TS_Dir));
+    TS_WriteFile(TS_Dir, "page.html", "<p>page</p>");
+
+    char path[HS__FilePathCap];
+    snprintf(path, sizeof(path), "%s/access.log", TS_Dir);
+    HS_AccessLog* log = HS_OpenAccessLog(path);
+    TS_Check(log != 0);
+
+    TS_Server ts = {};
+    TS_Check(TS_StartFileServer(&ts, TS_Dir, 8396, "", log));
+
+    TS_CheckInt(TS_Get(ts.port, "/page.html").status, 200);
+    TS_Check(strstr(TS_ReadLog("access.log", 1), " files \"GET /page.html\" 200 11 ") != 0);
+
+    // Moved away, the file keeps getting the lines until SIGHUP
+    char rotatedPath[HS__FilePathCap];
+    snprintf(rotatedPath, sizeof(rotatedPath), "%s/access.log.1", TS_Dir);
+    rename(path, rotatedPath);
+
+    signal(SIGHUP, SIG_IGN);
+    SG_RegisterHandler(SIGHUP, TS_HandleSigHup, log);
+    TS_CheckInt(TS_Get(ts.port, "/missing.html").status, 404);
+    TS_Check(strstr(TS_ReadLog("access.log.1", 2), "\"GET /missing.html\" 404 ") != 0);
+
+    raise(SIGHUP);
+    TS_CheckInt(TS_Get(ts.port, "/page.html").status, 200);
+    const char* content = TS_ReadLog("access.log", 1);
+    TS_Check(strstr(content, "\"GET /page.html\" 200 ") != 0 && !strstr(content, "missing"));
+
+    // The previous disposition is back once unregistered
+    SG_UnregisterHandler(SIGHUP);
+    TS_Check(signal(SIGHUP, SIG_DFL) == SIG_IGN);
+
+    TS_StopServer(&ts);
+    HS_CloseAccessLog(log);
+    TS_RemoveDir(TS_Dir);
+    return TS_Finish("access_log");
+}
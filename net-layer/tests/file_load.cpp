@@ -0,0 +1,157 @@
+// Loading served files on the I/O pool: the errors a load can hit once the
+// path was resolved, reads of mapped bodies, and the responses served from the
+// loaded content, with or without the file watcher.
+#include "test.h"
+
+HS__FileLoadJob* TS_LoadFile(const char* filePath, bool cacheable=true) {
+    HS__FileLoadJob* job = (HS__FileLoadJob*) calloc(1, sizeof(HS__FileLoadJob));
+    snprintf(job->filePath, sizeof(job->filePath), "%s", filePath);
+    job->cacheable = cacheable;
+    HS__LoadFile(&job->ioJob);
+    return job;
+}
+
+HS__FileLoadJob* TS_LoadTransformedFile(const char* rootDir, const char* sourcePath) {
+    HS__FileLoadJob* job = (HS__FileLoadJob*) calloc(1, sizeof(HS__FileLoadJob));
+    snprintf(job->rootDir, sizeof(job->rootDir), "%s", rootDir);
+    snprintf(job->sourcePath, sizeof(job->sourcePath), "%s", sourcePath);
+    snprintf(job->filePath, sizeof(job->filePath), "%s/.ssi-parsed/page.html", rootDir);
+    job->parseSSI = true;
+    job->cacheable = true;
+    HS__LoadFile(&job->ioJob);
+    return job;
+}
+
+void TS_FreeJob(HS__FileLoadJob* job) {
+    if (job->fileBuffer) free(job->fileBuffer);
+    if (job->includes) free(job->includes);
+    if (job->streamFile) fclose(job->streamFile);
+    free(job);
+}
+
+int main() {
+    char dir[HS__FilePathCap];
+    char path[HS__FilePathCap];
+    TS_MakeTempDir(dir, sizeof(dir));
+    TS_WriteFile(dir, "page.html", "<p>page</p>");
+
+    // Loaded
+    snprintf(path, sizeof(path), "%s/page.html", dir);
+    HS__FileLoadJob* job = TS_LoadFile(path);
+    TS_CheckInt(job->errorStatus, 0);
+    TS_Check(job->fileBuffer && job->fileSize == 11 && memcmp(job->fileBuffer + LWS_PRE, "<p>page</p>", 11)==0);
+    TS_FreeJob(job);
+
+    // Streamed when not cacheable
+    job = TS_LoadFile(path, false);
+    TS_CheckInt(job->errorStatus, 0);
+    TS_Check(job->streamFile && job->streamSize == 11 && !job->fileBuffer);
+    TS_FreeJob(job);
+
+    // Removed since it was resolved
+    snprintf(path, sizeof(path), "%s/gone.html", dir);
+    job = TS_LoadFile(path);
+    TS_CheckInt(job->errorStatus, HTTP_STATUS_NOT_FOUND);
+    TS_Check(!job->fileBuffer && !job->streamFile);
+    TS_FreeJob(job);
+
+    // A directory on the way was replaced by a file
+    snprintf(path, sizeof(path), "%s/page.html/x.html", dir);
+    job = TS_LoadFile(path, false);
+    TS_CheckInt(job->errorStatus, HTTP_STATUS_NOT_FOUND);
+    TS_FreeJob(job);
+
+    // Other errors are the server's
+    int size = snprintf(path, sizeof(path), "%s/", dir);
+    memset(path + size, 'x', NAME_MAX+1);
+    path[size + NAME_MAX+1] = 0;
+    job = TS_LoadFile(path);
+    TS_CheckInt(job->errorStatus, HTTP_STATUS_INTERNAL_SERVER_ERROR);
+    TS_FreeJob(job);
+
+    // Transformed files whose source is gone
+    snprintf(path, sizeof(path), "%s/gone.html", dir);
+    job = TS_LoadTransformedFile(dir, path);
+    TS_CheckInt(job->errorStatus, HTTP_STATUS_NOT_FOUND);
+    TS_FreeJob(job);
+
+    snprintf(path, sizeof(path), "%s/page.html", dir);
+    job = TS_LoadTransformedFile(dir, path);
+    TS_CheckInt(job->errorStatus, 0);
+    TS_Check(job->fileBuffer != 0);
+    TS_FreeJob(job);
+
+    // Served: from memory, mapped (files of HS__FileMappingMinSize or more) and missing
+    static char large[HS__FileMappingMinSize + 1];
+    memset(large, 'm', sizeof(large)-1);
+    TS_WriteFile(dir, "large.txt", large);
+
+    // Frames of mapped bodies are read from the file, which can shrink meanwhile
+    HS__FileReadJob* readJob = (HS__FileReadJob*) calloc(1, sizeof(HS__FileReadJob) + LWS_PRE + 64);
+    readJob->buffer = (char*) (readJob + 1);
+    snprintf(path, sizeof(path), "%s/large.txt", dir);
+    readJob->fd = open(path, O_RDONLY);
+    readJob->offset = 64;
+    readJob->amount = 64;
+    HS__ReadFileChunk(&readJob->ioJob);
+    TS_Check(!readJob->failed && readJob->buffer[LWS_PRE] == 'm' && readJob->buffer[LWS_PRE + 63] == 'm');
+
+    TS_Check(truncate(path, 100) == 0);
+    HS__ReadFileChunk(&readJob->ioJob);
+    TS_Check(readJob->failed && readJob->truncated);
+    HS__FreeFileReadJob(readJob);
+    TS_WriteFile(dir, "large.txt", large);
+
+    TS_Server ts = {};
+    TS_Check(TS_StartFileServer(&ts, dir, 8391, "\"mmap-file-cache\": true"));
+
+    for (int i = 0; i < 2; ++i) {
+        TS_Response response = TS_Get(ts.port, "/page.html");
+        TS_CheckInt(response.status, 200);
+        TS_CheckStr(response.body, "<p>page</p>");
+
+        response = TS_Get(ts.port, "/large.txt");
+        TS_CheckInt(response.status, 200);
+        TS_CheckInt(response.bodySize, (int) sizeof(large)-1);
+        TS_Check(response.body[0] == 'm' && response.body[sizeof(large)-2] == 'm');
+
+        response = TS_Get(ts.port, "/gone.html");
+        TS_CheckInt(response.status, 404);
+    }
+
+    // Paths are resolved on the I/O pool, then the request is served again
+    snprintf(path, sizeof(path), "%s/docs", dir);
+    mkdir(path, 0755);
+    TS_WriteFile(path, "index.html", "<p>docs</p>");
+    usleep(200000); // for the file watcher
+
+    for (int i = 0; i < 2; ++i) {
+        TS_Response response = TS_Get(ts.port, "/docs/");
+        TS_CheckInt(response.status, 200);
+        TS_CheckStr(response.body, "<p>docs</p>");
+
+        response = TS_Get(ts.port, "/docs/missing.html");
+        TS_CheckInt(response.status, 404);
+    }
+
+    TS_StopServer(&ts);
+
+    // Served dirs that can't be watched: resolved paths expire again
+    char config[HS_KILO_BYTES(1)];
+    snprintf(config, sizeof(config), "\"served-files-dir-map\": {\"/odd/\": \"%s/page.html\"}", dir);
+    TS_Check(TS_StartFileServer(&ts, dir, 8397, config));
+    HS_VHost* vhost = HS_GetVHost(&ts.server, "files");
+    TS_Check(!vhost->pathCacheWatched && vhost->watcherFailed && !vhost->disableFileCache);
+    TS_CheckStr(TS_Get(ts.port, "/page.html").body, "<p>page</p>");
+    TS_StopServer(&ts);
+
+    // And files aren't cached by the vhosts that require the watcher
+    static HS_VHost unwatched = {};
+    unwatched.pathCacheWatched = true;
+    unwatched.fileCacheNeedsWatcher = true;
+    HS__StopCountingOnWatcher(&unwatched, "Can't watch");
+    TS_Check(!unwatched.pathCacheWatched && unwatched.disableFileCache);
+
+    TS_RemoveDir(dir);
+    return TS_Finish("file_load");
+}
@@ -0,0 +1,203 @@
+// Gated areas with gatekeepr sessions: sessions validated from the vhost's
+// table, which I/O jobs sync and look up, cookies the database doesn't know,
+// logouts, and signed tokens issued for database sessions and denied at logout.
+#include "test.h"
+
+char TS_Dir[HS__FilePathCap];
+char TS_DatabasePath[HS__FilePathCap];
+
+sqlite3* TS_CreateDatabase() {
+    snprintf(TS_DatabasePath, sizeof(TS_DatabasePath), "%s/gatekeepr.db", TS_Dir);
+    sqlite3* db = SQ_OpenDB(TS_DatabasePath);
+    SQ_ExecuteCommand(db, "CREATE TABLE users (id TEXT PRIMARY KEY)");
+    SQ_ExecuteCommand(db, "CREATE TABLE sessions (id TEXT PRIMARY KEY, userId TEXT, gatedArea TEXT, expirationDate INTEGER, lastUseDate INTEGER)");
+    SQ_ExecuteCommand(db, "INSERT INTO users VALUES ('u1')");
+    return db;
+}
+
+void TS_AddSession(sqlite3* db, const char* sessionId, const char* gatedArea) {
+    long long now = time(0);
+    SQ_ExecuteCommand(db, "INSERT INTO sessions VALUES ('%s', 'u1', '%s', %lld, %lld)", sessionId, gatedArea, now + 3600, now);
+}
+
+// Without an I/O pool, jobs run right away
+HS_Server TS_IOServer = {};
+
+void TS_SyncGKSessions(HS_VHost* vhost) {
+    HS__SubmitGKSync(&TS_IOServer, vhost);
+}
+
+void TS_LookUpGKSession(HS_VHost* vhost, const char* gatedArea, const char* cookie) {
+    HS_SubmitIOJob(&TS_IOServer, &HS__NewGKSessionJob(vhost, gatedArea, cookie, HS__LookUpGKSession, HS__FinishGKLookup)->ioJob);
+}
+
+int main() {
+    TS_MakeTempDir(TS_Dir, sizeof(TS_Dir));
+    sqlite3* db = TS_CreateDatabase();
+    TS_AddSession(db, "s1", "team");
+
+    // Validated from the table
+    static HS_VHost vhost = {};
+    vhost.gkdb = SQ_OpenDB(TS_DatabasePath);
+    pthread_mutex_init(&vhost.gkdbMutex, 0);
+    vhost.gkSessions = (HS_GKSession*) calloc(HS__GKSessionsCap, sizeof(HS_GKSession));
+    TS_SyncGKSessions(&vhost);
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.s1"), HS_GKSessionState_Valid);
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "other", "u1.s1"), HS_GKSessionState_Unknown);
+    TS_LookUpGKSession(&vhost, "other", "u1.s1");
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "other", "u1.s1"), HS_GKSessionState_Invalid);
+
+    // A fresh login is looked up once
+    TS_AddSession(db, "s2", "team");
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.s2"), HS_GKSessionState_Unknown);
+    TS_LookUpGKSession(&vhost, "team", "u1.s2");
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.s2"), HS_GKSessionState_Valid);
+    TS_Check(HS__FindGKSession(&vhost, "u1.s2", "team", false) != 0);
+
+    // Unknown cookies are remembered as expired until the next sync
+    int lookupsLeft = vhost.gkLookupsLeft;
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.forged"), HS_GKSessionState_Unknown);
+    TS_LookUpGKSession(&vhost, "team", "u1.forged");
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.forged"), HS_GKSessionState_Invalid);
+    TS_CheckInt(vhost.gkLookupsLeft, lookupsLeft - 1);
+
+    // Past the lookups budget, unknown cookies are rejected without a lookup
+    TS_AddSession(db, "s3", "team");
+    vhost.gkLookupsLeft = 0;
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.s3"), HS_GKSessionState_Invalid);
+    TS_SyncGKSessions(&vhost);
+    TS_CheckInt(vhost.gkLookupsLeft, HS__GKLookupsPerSyncCap);
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.s3"), HS_GKSessionState_Valid);
+
+    // Last uses are written back by the sync
+    SQ_ExecuteCommand(db, "UPDATE sessions SET lastUseDate=%lld WHERE id='s1'", (long long) time(0) - 60);
+    TS_SyncGKSessions(&vhost);
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.s1"), HS_GKSessionState_Valid);
+    TS_SyncGKSessions(&vhost);
+    TS_Check(SQ_GetAggregateFunctionResultInt(db, "SELECT lastUseDate FROM sessions WHERE id='s1'") >= time(0) - 1);
+
+    // Ending a session rejects it right away, and the sync deletes it
+    HS_EndGatekeeprSession(&TS_IOServer, &vhost, "team", "u1.s3");
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.s3"), HS_GKSessionState_Invalid);
+    TS_SyncGKSessions(&vhost);
+    TS_CheckInt(SQ_GetAggregateFunctionResultInt(db, "SELECT COUNT(*) FROM sessions WHERE id='s3'"), 0);
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.s3"), HS_GKSessionState_Unknown);
+    TS_LookUpGKSession(&vhost, "team", "u1.s3");
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.s3"), HS_GKSessionState_Invalid);
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.s1"), HS_GKSessionState_Valid);
+
+    // Sessions ended while a sync runs stay ended in the new table
+    HS__GKSyncJob* syncJob = HS__NewGKSyncJob(&vhost);
+    HS__SyncGKSessions(&syncJob->ioJob);
+    HS_EndGatekeeprSession(&TS_IOServer, &vhost, "team", "u1.s2");
+    HS__FinishGKSync(&syncJob->ioJob);
+    TS_CheckInt(HS__ValidateGKSession(&vhost, "team", "u1.s2"), HS_GKSessionState_Invalid);
+    TS_SyncGKSessions(&vhost);
+    TS_CheckInt(SQ_GetAggregateFunctionResultInt(db, "SELECT COUNT(*) FROM sessions WHERE id='s2'"), 0);
+
+    free(vhost.gkSessions);
+    SQ_CloseDB(vhost.gkdb);
+
+    // Served: redirected to the login page without a session, logged out
+    char path[HS__FilePathCap];
+    snprintf(path, sizeof(path), "%s/team", TS_Dir);
+    mkdir(path, 0755);
+    TS_WriteFile(path, "page.html", "<p>team</p>");
+
+    char config[HS_KILO_BYTES(1)];
+    snprintf(config, sizeof(config), "\"gatekeepr\": {\"database\": \"%s\", \"gated-areas\": [{\"id\": \"team\", \"prefix\": \"/team/\", \"home\": \"/home.html\"}]}", TS_DatabasePath);
+
+    TS_Server ts = {};
+    TS_Check(TS_StartFileServer(&ts, TS_Dir, 8392, config));
+
+    char value[256];
+    TS_Response response = TS_Get(ts.port, "/team/page.html");
+    TS_CheckInt(response.status, 302);
+    TS_CheckStr(TS_GetHeader(&response, "location", value, sizeof(value)), "https://localhost:8392/gk/team?redirect=%2Fteam%2Fpage%2Ehtml");
+
+    // Unless the login page's URL, which carries the URI, doesn't fit
+    char longURI[1024] = "/team/";
+    memset(longURI + 6, '~', sizeof(longURI)-7);
+    response = TS_Get(ts.port, longURI);
+    TS_CheckInt(response.status, 414);
+
+    response = TS_Get(ts.port, "/team/page.html", "Cookie: gatekeepr_team=u1.s1\r\n");
+    TS_CheckInt(response.status, 200);
+    TS_CheckStr(response.body, "<p>team</p>");
+
+    response = TS_Get(ts.port, "/team/page.html", "Cookie: gatekeepr_team=u1.forged\r\n");
+    TS_CheckInt(response.status, 302);
+
+    // A fresh login waits for its lookup
+    TS_AddSession(db, "s5", "team");
+    response = TS_Get(ts.port, "/team/page.html", "Cookie: gatekeepr_team=u1.s5\r\n");
+    TS_CheckInt(response.status, 200);
+    TS_CheckStr(response.body, "<p>team</p>");
+
+    response = TS_Get(ts.port, "/gk/team/logout", "Cookie: gatekeepr_team=u1.s1\r\n");
+    TS_CheckInt(response.status, 302);
+    TS_CheckStr(TS_GetHeader(&response, "location", value, sizeof(value)), "/home.html");
+    TS_Check(TS_GetHeader(&response, "set-cookie", value, sizeof(value)) && HS_StartsWith(value, "gatekeepr_team=;"));
+
+    response = TS_Get(ts.port, "/team/page.html", "Cookie: gatekeepr_team=u1.s1\r\n");
+    TS_CheckInt(response.status, 302);
+
+    response = TS_Get(ts.port, "/gk/nowhere/logout");
+    TS_CheckInt(response.status, 404);
+
+    TS_StopServer(&ts);
+
+    // With token keys, a database session is exchanged for a token on first use
+    char denyListPath[HS__FilePathCap];
+    snprintf(denyListPath, sizeof(denyListPath), "%s/deny-list.txt", TS_Dir);
+    snprintf(config, sizeof(config), "\"gatekeepr\": {\"database\": \"%s\", \"deny-list\": \"%s\", \"token-keys\": [{\"id\": \"k1\", \"secret\": \"s3cret\"}], "
+             "\"gated-areas\": [{\"id\": \"team\", \"prefix\": \"/team/\"}]}", TS_DatabasePath, denyListPath);
+    TS_AddSession(db, "s4", "team");
+    TS_Check(TS_StartFileServer(&ts, TS_Dir, 8393, config));
+
+    response = TS_Get(ts.port, "/team/page.html", "Cookie: gatekeepr_team=u1.s4\r\n");
+    TS_CheckInt(response.status, 302);
+    TS_CheckStr(TS_GetHeader(&response, "location", value, sizeof(value)), "/team/page.html");
+    TS_Check(TS_GetHeader(&response, "set-cookie", value, sizeof(value)) && HS_StartsWith(value, "gatekeepr_team=k1.u1."));
+
+    char cookie[512];
+    snprintf(cookie, sizeof(cookie), "Cookie: %.*s\r\n", (int) strcspn(value, ";"), value);
+    response = TS_Get(ts.port, "/team/page.html", cookie);
+    TS_CheckInt(response.status, 200);
+    TS_CheckStr(response.body, "<p>team</p>");
+
+    // Logging out denies the token, here and in the deny list file
+    response = TS_Get(ts.port, "/gk/team/logout", cookie);
+    TS_CheckInt(response.status, 302);
+    response = TS_Get(ts.port, "/team/page.html", cookie);
+    TS_CheckInt(response.status, 302);
+    TS_Check(TS_GetHeader(&response, "location", value, sizeof(value)) && HS_StartsWith(value, "https://"));
+
+    char denyList[256] = {};
+    FILE* file = fopen(denyListPath, "rb");
+    TS_Check(file && fread(denyList, 1, sizeof(denyList)-1, file) == 2*HS__GKSignatureSize + 1);
+    if (file) fclose(file);
+    denyList[2*HS__GKSignatureSize] = 0;
+    cookie[strcspn(cookie, "\r")] = 0;
+    TS_Check(denyList[0] && HS_EndsWith(cookie, denyList));
+
+    // Accepted without the database by instances sharing the keys, only for its area
+    HS_VHost* tokenVHost = HS_GetVHost(&ts.server, "files");
+    char token[256];
+    TS_Check(HS_CreateGatekeeprToken(tokenVHost, "team", "u2", time(0) + 60, token, sizeof(token)) > 0);
+    TS_Check(HS__ValidateGKToken(tokenVHost, "team", token));
+    TS_Check(!HS__ValidateGKToken(tokenVHost, "other", token));
+    TS_Check(HS_CreateGatekeeprToken(tokenVHost, "team", "u2", time(0) - 1, token, sizeof(token)) > 0);
+    TS_Check(!HS__ValidateGKToken(tokenVHost, "team", token));
+
+    response = TS_Get(ts.port, "/team/page.html", "Cookie: gatekeepr_team=k1.u1.99999999999.0000000000000000000000000000000000000000000000000000000000000000\r\n");
+    TS_CheckInt(response.status, 302);
+    TS_Check(TS_GetHeader(&response, "location", value, sizeof(value)) && HS_StartsWith(value, "https://"));
+
+    // The exchanged session is deleted, by the changes written back on shutdown at the latest
+    TS_StopServer(&ts);
+    TS_CheckInt(SQ_GetAggregateFunctionResultInt(db, "SELECT COUNT(*) FROM sessions WHERE id='s4'"), 0);
+    SQ_CloseDB(db);
+    TS_RemoveDir(TS_Dir);
+    return TS_Finish("gatekeepr");
+}
@@ -0,0 +1,84 @@
+// Per-IP limits: requests and connections limited by the peer's address, or
+// behind a trusted proxy by the address it forwards.
+#include "test.h"
+
+// Connections are counted until the server sees them closed: each request
+// waits for the previous connection to be gone first.
+int TS_Status(int port, const char* extraHeaders="") {
+    usleep(50000);
+    return TS_Get(port, "/page.html", extraHeaders).status;
+}
+
+// Opens a connection whose request stays in flight: its response is too large
+// for the socket buffers, and isn't read.
+int TS_OpenConnection(int port, const char* extraHeaders) {
+    int fd = TS_Connect(port);
+    int bufferSize = HS_KILO_BYTES(4);
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize));
+
+    char request[HS_KILO_BYTES(1)];
+    snprintf(request, sizeof(request), "GET /large.txt HTTP/1.1\r\nHost: localhost\r\n%s\r\n", extraHeaders);
+    send(fd, request, strlen(request), MSG_NOSIGNAL);
+    usleep(100000);
+    return fd;
+}
+
+int main() {
+    char dir[HS__FilePathCap];
+    TS_MakeTempDir(dir, sizeof(dir));
+    TS_WriteFile(dir, "page.html", "<p>page</p>");
+
+    static char large[HS_MEGA_BYTES(8)];
+    memset(large, 'l', sizeof(large)-1);
+    TS_WriteFile(dir, "large.txt", large);
+
+    // Without trusted proxies, forwarded addresses are ignored
+    TS_Server ts = {};
+    TS_Check(TS_StartFileServer(&ts, dir, 8394, "\"ip-limits\": {\"requests-per-second\": 2, \"connections\": 1}"));
+
+    TS_CheckInt(TS_Status(ts.port, "X-Forwarded-For: 1.1.1.1\r\n"), 200);
+    TS_CheckInt(TS_Status(ts.port, "X-Forwarded-For: 2.2.2.2\r\n"), 200);
+    TS_CheckInt(TS_Status(ts.port, "X-Forwarded-For: 3.3.3.3\r\n"), 429);
+    TS_CheckInt(ts.server.vhosts[0].metrics.ipLimitedRequests, 1);
+
+    // Connections are counted per address, and closed without a response once
+    // over the limit, whether the connection counted is busy or idle
+    usleep(1000000); // for the tokens to come back
+    int fd = TS_OpenConnection(ts.port, "");
+    TS_CheckInt(TS_Status(ts.port), 0);
+    TS_CheckInt(ts.server.vhosts[0].metrics.ipRefusedConnections, 1);
+    close(fd);
+
+    fd = TS_Connect(ts.port);
+    usleep(100000);
+    TS_CheckInt(TS_Status(ts.port), 0);
+    TS_CheckInt(ts.server.vhosts[0].metrics.ipRefusedConnections, 2);
+
+    // And released once closed
+    close(fd);
+    TS_CheckInt(TS_Status(ts.port), 200);
+    TS_StopServer(&ts);
+
+    // Behind a trusted proxy, by the last address that isn't the proxy's
+    TS_Check(TS_StartFileServer(&ts, dir, 8395, "\"ip-limits\": {\"requests-per-second\": 2, \"connections\": 1, \"trusted-proxies\": [\"127.0.0.1\", \"10.0.0.1\"]}"));
+
+    TS_CheckInt(TS_Status(ts.port, "X-Forwarded-For: 9.9.9.9, 1.1.1.1\r\n"), 200);
+    TS_CheckInt(TS_Status(ts.port, "X-Forwarded-For: 8.8.8.8, 1.1.1.1, 10.0.0.1\r\n"), 200);
+    TS_CheckInt(TS_Status(ts.port, "X-Forwarded-For: 1.1.1.1\r\n"), 429);
+    TS_CheckInt(TS_Status(ts.port, "X-Forwarded-For: 1.1.1.1, 2.2.2.2\r\n"), 200);
+    TS_CheckInt(TS_Status(ts.port, "X-Real-IP: 3.3.3.3\r\n"), 200);
+    TS_CheckInt(TS_Status(ts.port, "X-Real-IP: 3.3.3.3\r\n"), 200);
+    TS_CheckInt(TS_Status(ts.port, "X-Real-IP: 7.7.7.7\r\n"), 200);
+    TS_CheckInt(TS_Status(ts.port, "X-Real-IP: 3.3.3.3\r\n"), 429);
+
+    // The proxy's connections aren't counted against anyone
+    fd = TS_OpenConnection(ts.port, "X-Forwarded-For: 4.4.4.4\r\n");
+    TS_CheckInt(TS_Status(ts.port, "X-Forwarded-For: 4.4.4.4\r\n"), 200);
+    TS_CheckInt(TS_Status(ts.port, "X-Forwarded-For: 5.5.5.5\r\n"), 200);
+    TS_CheckInt(ts.server.vhosts[0].metrics.ipRefusedConnections, 0);
+    close(fd);
+
+    TS_StopServer(&ts);
+    TS_RemoveDir(dir);
+    return TS_Finish("ip_limits");
+}
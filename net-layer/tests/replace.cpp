@@ -0,0 +1,38 @@
+// Multi-pattern replacement: the list form of HS_Replace writes only what fits
+// its output buffer, and refuses more patterns than a template can hold.
+#include "test.h"
+
+int main() {
+    char input[] = "<a>$name</a><b>$title, $name</b>";
+    HS_Replacement reps[] = {
+        {"$name", "Ada"},
+        {"$title", "Countess"},
+        {0, 0},
+    };
+
+    char output[64];
+    TS_CheckInt(HS_Replace(output, sizeof(output), input, strlen(input), reps), 30);
+    TS_CheckStr(output, "<a>Ada</a><b>Countess, Ada</b>");
+
+    // Too small: the needed size is returned and nothing is written
+    memset(output, 'x', sizeof(output));
+    TS_CheckInt(HS_Replace(output, 30, input, strlen(input), reps), 30);
+    TS_Check(output[0] == 'x' && output[29] == 'x');
+    TS_CheckInt(HS_Replace(output, 31, input, strlen(input), reps), 30);
+    TS_CheckInt((int) strlen(output), 30);
+
+    // Too many patterns
+    static char names[HS__TemplatePlaceholdersCap+1][8];
+    static HS_Replacement manyReps[HS__TemplatePlaceholdersCap+2];
+    for (int i = 0; i <= HS__TemplatePlaceholdersCap; ++i) {
+        snprintf(names[i], sizeof(names[i]), "$%d", i);
+        manyReps[i] = {names[i], ""};
+    }
+    TS_CheckInt(HS_Replace(output, sizeof(output), input, strlen(input), manyReps), -1);
+
+    manyReps[HS__TemplatePlaceholdersCap] = {0, 0};
+    TS_CheckInt(HS_Replace(output, sizeof(output), input, strlen(input), manyReps), (int) strlen(input));
+    TS_CheckStr(output, input);
+
+    return TS_Finish("replace");
+}
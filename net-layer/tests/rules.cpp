@@ -0,0 +1,74 @@
+// URI rules: the first rule added that matches wins (the last one for
+// lastMatchWins lists), whether or not the list is compiled.
+#include "test.h"
+
+const char* TS_MatchedValue(HS_RuleList* list, const char* uri) {
+    HS_Rule* rule = HS_MatchRule(list, uri);
+    return rule ? rule->value : "none";
+}
+
+void TS_CheckFirstMatch(HS_RuleList* list) {
+    TS_CheckStr(TS_MatchedValue(list, "/docs/index.html"), "docs prefix");
+    TS_CheckStr(TS_MatchedValue(list, "/docs/a.css"), "docs prefix");
+    TS_CheckStr(TS_MatchedValue(list, "/index.html"), "exact index");
+    TS_CheckStr(TS_MatchedValue(list, "/about.html"), "html suffix");
+    TS_CheckStr(TS_MatchedValue(list, "/a/b.css"), "catch-all");
+    TS_CheckStr(TS_MatchedValue(list, "/"), "catch-all");
+}
+
+int main() {
+    HS_RuleList list = {};
+    HS_AddRule(&list, "/docs/*", "docs prefix");
+    HS_AddRule(&list, "/index.html", "exact index");
+    HS_AddRule(&list, "*.html", "html suffix");
+    HS_AddRule(&list, "/docs/index.html", "shadowed exact");
+    HS_AddRule(&list, "/*", "catch-all");
+
+    // Not compiled yet: scanned in order
+    TS_Check(!list.compiled);
+    TS_CheckFirstMatch(&list);
+    TS_Check(!list.compiled); // matching never compiles
+
+    HS_CompileRules(&list);
+    TS_Check(list.compiled);
+    TS_CheckFirstMatch(&list);
+
+    // Changes are only picked up by the compiled form once recompiled
+    HS_ClearRules(&list);
+    HS_AddRule(&list, "*.css", "css");
+    TS_CheckStr(TS_MatchedValue(&list, "/a/b.css"), "css");
+    TS_CheckStr(TS_MatchedValue(&list, "/index.html"), "none");
+    HS_CompileRules(&list);
+    TS_CheckStr(TS_MatchedValue(&list, "/a/b.css"), "css");
+    TS_CheckStr(TS_MatchedValue(&list, "/index.html"), "none");
+
+    // Last match wins, e.g. served dirs added after the root dir
+    HS_RuleList dirs = {};
+    dirs.lastMatchWins = true;
+    HS_AddRule(&dirs, "/*", "root");
+    HS_AddRule(&dirs, "/static/*", "static");
+    for (int compiled = 0; compiled < 2; ++compiled) {
+        if (compiled) HS_CompileRules(&dirs);
+        TS_CheckStr(TS_MatchedValue(&dirs, "/static/app.js"), "static");
+        TS_CheckStr(TS_MatchedValue(&dirs, "/app.js"), "root");
+    }
+
+    // Exact-only lists don't treat '*' as a wildcard
+    HS_RuleList redirects = {};
+    redirects.exactOnly = true;
+    HS_AddRule(&redirects, "/old*", "literal");
+    for (int compiled = 0; compiled < 2; ++compiled) {
+        if (compiled) HS_CompileRules(&redirects);
+        TS_CheckStr(TS_MatchedValue(&redirects, "/old*"), "literal");
+        TS_CheckStr(TS_MatchedValue(&redirects, "/older"), "none");
+    }
+
+    // A vhost's lists are compiled when it starts
+    static HS_VHost vhost = {};
+    HS_AddRule(&vhost.uriMap, "/home", "/index.html");
+    HS_AddRule(&vhost.cacheControlMap, "*.html", "no-cache");
+    HS_CompileVHostRules(&vhost);
+    TS_Check(vhost.uriMap.compiled && vhost.cacheControlMap.compiled && vhost.rootDirMap.compiled);
+
+    return TS_Finish("rules");
+}
@@ -0,0 +1,127 @@
+// Server side includes: nested and cyclic includes, the files a page depends
+// on, and outputs that end right at the parser's buffer capacity (build with
+// TEST_FLAGS=-fsanitize=address to catch writes past it).
+#include "test.h"
+
+char TS_Dir[HS__FilePathCap];
+
+// Parses the file at TS_Dir/name; returns the output, to be freed with free(result - LWS_PRE).
+char* TS_ParseSSI(const char* name, int* size, char** includes=0) {
+    char path[HS__FilePathCap];
+    snprintf(path, sizeof(path), "%s/%s", TS_Dir, name);
+
+    FILE* file = fopen(path, "rb");
+    int fileSize = HS_GetFileSize(file);
+    char* content = (char*) calloc(1, fileSize+1);
+    fread(content, fileSize, 1, file);
+    fclose(file);
+
+    char* parsed = HS_DoSSI(content, fileSize, TS_Dir, size, path, includes);
+    free(content);
+    return parsed + LWS_PRE;
+}
+
+bool TS_Includes(const char* includes, const char* name) {
+    char path[HS__FilePathCap];
+    snprintf(path, sizeof(path), "%s/%s", TS_Dir, name);
+    return HS__IncludesPath(includes, path);
+}
+
+// A page whose output is exactly `outputSize` bytes: an include of a file
+// filling the rest. HS_DoSSI's buffer starts at the page's size + 4 KB.
+void TS_CheckOutputSize(int outputSize) {
+    const char page[] = "<p><!--#include virtual=\"/fill.txt\"--></p>";
+    int fillSize = outputSize - 7;
+
+    char* fill = (char*) malloc(fillSize+1);
+    memset(fill, 'f', fillSize);
+    fill[fillSize] = 0;
+    TS_WriteFile(TS_Dir, "fill.txt", fill);
+    TS_WriteFile(TS_Dir, "sized.html", page);
+
+    int size = 0;
+    char* parsed = TS_ParseSSI("sized.html", &size);
+    TS_CheckInt(size, outputSize);
+    TS_Check(memcmp(parsed, "<p>", 3)==0 && memcmp(parsed + 3, fill, fillSize)==0 && memcmp(parsed + size-4, "</p>", 4)==0);
+    TS_CheckInt(parsed[size], 0);
+
+    free(parsed - LWS_PRE);
+    free(fill);
+}
+
+int main() {
+    TS_MakeTempDir(TS_Dir, sizeof(TS_Dir));
+
+    char path[HS__FilePathCap];
+    snprintf(path, sizeof(path), "%s/parts", TS_Dir);
+    mkdir(path, 0755);
+
+    // Nested: virtual paths from the root, file paths from the including file
+    TS_WriteFile(TS_Dir, "page.html", "A<!--#include virtual=\"/parts/b.html\"-->D");
+    TS_WriteFile(path, "b.html", "B<!--#include file=\"c.html\"-->");
+    TS_WriteFile(path, "c.html", "C");
+
+    int size = 0;
+    char* includes = 0;
+    char* parsed = TS_ParseSSI("page.html", &size, &includes);
+    TS_CheckStr(parsed, "ABCD");
+    TS_Check(TS_Includes(includes, "parts/b.html"));
+    TS_Check(TS_Includes(includes, "parts/c.html"));
+    TS_Check(!TS_Includes(includes, "page.html"));
+    free(parsed - LWS_PRE);
+    free(includes);
+
+    // Cycles are cut where they close; the files are still dependencies
+    TS_WriteFile(TS_Dir, "x.html", "x<!--#include virtual=\"/y.html\"-->");
+    TS_WriteFile(TS_Dir, "y.html", "y<!--#include virtual=\"/x.html\"-->");
+    TS_WriteFile(TS_Dir, "self.html", "s<!--#include file=\"self.html\"-->s");
+
+    parsed = TS_ParseSSI("x.html", &size, &includes);
+    TS_CheckStr(parsed, "xy");
+    TS_Check(TS_Includes(includes, "y.html"));
+    TS_Check(TS_Includes(includes, "x.html"));
+    free(parsed - LWS_PRE);
+    free(includes);
+
+    parsed = TS_ParseSSI("self.html", &size);
+    TS_CheckStr(parsed, "ss");
+    free(parsed - LWS_PRE);
+
+    // Missing includes are dropped, but tracked in case they are created
+    TS_WriteFile(TS_Dir, "missing.html", "m<!--#include virtual=\"/later.html\"-->m");
+    parsed = TS_ParseSSI("missing.html", &size, &includes);
+    TS_CheckStr(parsed, "mm");
+    TS_Check(TS_Includes(includes, "later.html"));
+    free(parsed - LWS_PRE);
+    free(includes);
+
+    // Includes out of the root and malformed directives are left alone
+    char outside[HS__FilePathCap];
+    char odd[3*HS__FilePathCap];
+    snprintf(outside, sizeof(outside), "%s-outside.txt", TS_Dir);
+    TS_WriteFile("/", outside + 1, "secret");
+    snprintf(odd, sizeof(odd), "<!--#include virtual=\"/../%s\"--><!--#include nothing-->", strrchr(outside, '/') + 1);
+    TS_WriteFile(TS_Dir, "odd.html", odd);
+    parsed = TS_ParseSSI("odd.html", &size);
+    TS_CheckStr(parsed, odd);
+    free(parsed - LWS_PRE);
+    unlink(outside);
+
+    // Outputs around the initial capacity, and around its double
+    int capacity = (int) strlen("<p><!--#include virtual=\"/fill.txt\"--></p>") + HS_KILO_BYTES(4);
+    for (int delta = -1; delta <= 1; ++delta) {
+        TS_CheckOutputSize(capacity + delta);
+        TS_CheckOutputSize(2*capacity + delta);
+    }
+
+    // With cache busting on top, which writes its own terminating 0
+    TS_WriteFile(TS_Dir, "bust.html", "<a href=\"/app-v0000.00.00.00.00.00.js\"><!--#include virtual=\"/fill.txt\"-->");
+    char* fileBuffer = HS__LoadTransformedFile("-v2024.01.02.03.04.05", TS_Dir, (snprintf(path, sizeof(path), "%s/bust.html", TS_Dir), path), true, true, &size, &includes);
+    TS_Check(fileBuffer && strstr(fileBuffer + LWS_PRE, "/app-v2024.01.02.03.04.05.js"));
+    TS_CheckInt(fileBuffer[LWS_PRE + size], 0);
+    free(fileBuffer);
+    free(includes);
+
+    TS_RemoveDir(TS_Dir);
+    return TS_Finish("ssi");
+}
@@ -0,0 +1,221 @@
+// Minimal support for the net layer tests. Every tests/*.cpp is a program
+// that runs its checks and returns the number of failures; run-tests.sh
+// builds and runs them all.
+#include "../src/DD_HTTPS.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+int TS_Failures = 0;
+
+#define TS_Check(condition) TS__Check((condition), #condition, __FILE__, __LINE__)
+#define TS_CheckInt(actual, expected) TS__CheckInt((actual), (expected), #actual, __FILE__, __LINE__)
+#define TS_CheckStr(actual, expected) TS__CheckStr((actual), (expected), #actual, __FILE__, __LINE__)
+
+bool TS__Check(bool passed, const char* expression, const char* file, int line) {
+    if (!passed) {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expression);
+        ++TS_Failures;
+    }
+    return passed;
+}
+
+bool TS__CheckInt(long long actual, long long expected, const char* expression, const char* file, int line) {
+    if (actual != expected) {
+        fprintf(stderr, "%s:%d: %s is %lld, expected %lld\n", file, line, expression, actual, expected);
+        ++TS_Failures;
+    }
+    return actual == expected;
+}
+
+bool TS__CheckStr(const char* actual, const char* expected, const char* expression, const char* file, int line) {
+    bool passed = actual && strcmp(actual, expected)==0;
+    if (!passed) {
+        fprintf(stderr, "%s:%d: %s is \"%s\", expected \"%s\"\n", file, line, expression, actual ? actual : "(null)", expected);
+        ++TS_Failures;
+    }
+    return passed;
+}
+
+int TS_Finish(const char* testName) {
+    printf("%s: %s\n", testName, TS_Failures ? "FAILED" : "passed");
+    return TS_Failures;
+}
+
+// Files
+//-------
+// Tests serve files from a fresh directory under /tmp.
+
+void TS_MakeTempDir(char* path, int pathSize) {
+    snprintf(path, pathSize, "/tmp/hs-test-XXXXXX");
+    if (!mkdtemp(path)) {
+        perror("mkdtemp");
+        exit(1);
+    }
+}
+
+void TS_WriteFile(const char* dir, const char* name, const char* content) {
+    char path[HS__FilePathCap];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+    FILE* file = fopen(path, "wb");
+    fwrite(content, 1, strlen(content), file);
+    fclose(file);
+}
+
+void TS_RemoveDir(const char* dir) {
+    char command[HS__FilePathCap + 16];
+    snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+    if (system(command) != 0) fprintf(stderr, "Couldn't remove %s\n", dir);
+}
+
+// Servers
+//---------
+// The server runs HS_RunForever on its own thread, as in a listener group.
+
+struct TS_Server {
+    HS_Server server;
+    pthread_t thread;
+    int port;
+};
+
+void* TS__RunServer(void* data) {
+    HS_RunForever(&((TS_Server*) data)->server, true);
+    return 0;
+}
+
+int TS_Connect(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (connect(fd, (sockaddr*) &address, sizeof(address)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Starts the server (already set up with its vhosts) and waits until it accepts connections.
+bool TS_StartServer(TS_Server* ts, int port) {
+    HS_SetLogLevel(LLL_ERR | LLL_WARN);
+    ts->port = port;
+    pthread_create(&ts->thread, 0, TS__RunServer, ts);
+
+    for (int i = 0; i < 200; ++i) {
+        int fd = TS_Connect(port);
+        if (fd >= 0) {
+            close(fd);
+            return true;
+        }
+        usleep(10000);
+    }
+    return false;
+}
+
+// Starts a file server vhost ("files") serving rootDir on port. config holds
+// extra members of its config file, e.g. "\"mmap-file-cache\": true". Its
+// requests are logged to accessLog, if any.
+bool TS_StartFileServer(TS_Server* ts, const char* rootDir, int port, const char* config="", HS_AccessLog* accessLog=0) {
+    char configPath[] = "/tmp/hs-test-config-XXXXXX";
+    int fd = mkstemp(configPath);
+    if (fd < 0) return false;
+
+    FILE* file = fdopen(fd, "w");
+    fprintf(file, "{\"hostname\": \"localhost\", \"port\": %d, \"served-files-dir\": \"%s\"%s%s}", port, rootDir, config[0] ? ", " : "", config);
+    fclose(file);
+
+    HS_SetLogLevel(LLL_ERR | LLL_WARN);
+    ts->server = HS_CreateServer(0, true);
+    HS_InitServer(&ts->server, true);
+    HS_AddVHost(&ts->server, "files");
+    bool initialized = HS_InitFileServer(&ts->server, "files", configPath);
+    unlink(configPath);
+    if (accessLog) HS_SetAccessLog(&ts->server, accessLog);
+
+    return initialized && TS_StartServer(ts, port);
+}
+
+void TS_StopServer(TS_Server* ts) {
+    HS_Stop(&ts->server);
+    pthread_join(ts->thread, 0);
+    HS_Destroy(&ts->server);
+}
+
+// HTTP
+//------
+
+struct TS_Response {
+    int  status; // 0 if the connection was closed without a response
+    char headers[HS_KILO_BYTES(4)];
+    char body[HS_KILO_BYTES(128)];
+    int  bodySize;
+};
+
+// Sends a raw request on fd and reads the response, up to its Content-Length
+// or until the connection closes.
+void TS_Exchange(int fd, const char* request, TS_Response* response) {
+    *response = {};
+    if (send(fd, request, strlen(request), MSG_NOSIGNAL) < 0) return;
+
+    timeval timeout = {5, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    static char buffer[HS_KILO_BYTES(144)];
+    int size = 0;
+    char* body = 0;
+    int contentLength = -1;
+
+    for (int n; size < (int) sizeof(buffer)-1 && (n = recv(fd, buffer + size, sizeof(buffer)-1 - size, 0)) > 0;) {
+        size += n;
+        buffer[size] = 0;
+
+        if (!body && (body = strstr(buffer, "\r\n\r\n"))) {
+            char* header = strcasestr(buffer, "\r\ncontent-length:");
+            if (header && header < body) contentLength = atoi(header + 17);
+        }
+        if (body && contentLength >= 0 && size - (body+4 - buffer) >= contentLength) break;
+    }
+    buffer[size] = 0;
+
+    body = strstr(buffer, "\r\n\r\n");
+    if (!body || sscanf(buffer, "HTTP/1.%*d %d", &response->status) != 1) return;
+
+    snprintf(response->headers, sizeof(response->headers), "%.*s", (int) (body - buffer), buffer);
+    body += 4;
+    response->bodySize = HS_Min(size - (int) (body - buffer), (int) sizeof(response->body)-1);
+    memcpy(response->body, body, response->bodySize);
+    response->body[response->bodySize] = 0;
+}
+
+TS_Response TS_Get(int port, const char* uri, const char* extraHeaders="") {
+    TS_Response response = {};
+    int fd = TS_Connect(port);
+    if (fd < 0) return response;
+
+    char request[HS_KILO_BYTES(4)];
+    snprintf(request, sizeof(request), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n%s\r\n", uri, extraHeaders);
+    TS_Exchange(fd, request, &response);
+    close(fd);
+    return response;
+}
+
+// Returns the value of a response header (case-insensitive name), or 0.
+const char* TS_GetHeader(TS_Response* response, const char* name, char* value, int valueSize) {
+    int nameSize = strlen(name);
+
+    for (char* line = strstr(response->headers, "\r\n"); line; line = strstr(line, "\r\n")) {
+        line += 2;
+        if (strncasecmp(line, name, nameSize)==0 && line[nameSize] == ':') {
+            char* start = line + nameSize + 1;
+            while (*start == ' ') ++start;
+            char* end = strstr(start, "\r\n");
+            snprintf(value, valueSize, "%.*s", end ? (int) (end - start) : (int) strlen(start), start);
+            return value;
+        }
+    }
+    return 0;
+}
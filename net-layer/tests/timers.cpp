@@ -0,0 +1,124 @@
+// Timers: the wheel is driven tick by tick, without a service thread, to check
+// when timers fire around the level boundaries, and how they're cancelled.
+#include "test.h"
+
+HS_Server TS_TimerServer = {};
+char TS_Fired[64]; // tags of the timers run, in order
+int TS_FiredCount;
+HS_TimerId TS_CancelledId; // by TS_Cancel
+
+void TS_Record(HS_Server* server, void* userData) {
+    TS_Fired[TS_FiredCount++] = (char) (intptr_t) userData;
+    TS_Fired[TS_FiredCount] = 0;
+}
+
+void TS_Cancel(HS_Server* server, void* userData) {
+    TS_Record(server, userData);
+    TS_Check(HS_CancelTimer(server, TS_CancelledId));
+}
+
+// Returns the tags of the timers run up to tick `now`
+const char* TS_RunTimers(uint64_t now) {
+    TS_FiredCount = 0;
+    TS_Fired[0] = 0;
+    HS__RunTimers(&TS_TimerServer, now);
+    return TS_Fired;
+}
+
+uint64_t TS_Expires(HS_TimerId id) {
+    return HS__GetTimer(&TS_TimerServer.timerWheel, (int) (id & 0xffffffff) - 1)->expires;
+}
+
+// Timers are added at the clock's tick: once the wheel ran ahead of it, it
+// starts over.
+void TS_ResetTimers() {
+    HS__DestroyTimers(&TS_TimerServer);
+}
+
+HS_TimerId TS_AddTimer(uint64_t delayMs, uint64_t periodMs, char tag, HS_TimerFunc func=TS_Record) {
+    return HS_AddTimer(&TS_TimerServer, delayMs, periodMs, func, (void*) (intptr_t) tag);
+}
+
+int main() {
+    HS_TimerWheel* wheel = &TS_TimerServer.timerWheel;
+
+    // One-shot timers fire in order, at their tick, whichever level holds them:
+    // 63 ms is the last slot of level 0, 64 ms the first of level 1, and
+    // 4096 ms the first of level 2.
+    HS_TimerId t4096 = TS_AddTimer(4096, 0, 'd');
+    HS_TimerId t64 = TS_AddTimer(64, 0, 'c');
+    HS_TimerId t63 = TS_AddTimer(63, 0, 'b');
+    HS_TimerId t1 = TS_AddTimer(1, 0, 'a');
+    TS_Check(t4096 && t64 && t63 && t1);
+    TS_Check(HS__GetTimer(wheel, (int) (t4096 & 0xffffffff) - 1)->level == 2);
+    TS_CheckInt(wheel->timersCount, 4);
+
+    TS_CheckStr(TS_RunTimers(TS_Expires(t1)), "a");
+    TS_CheckStr(TS_RunTimers(TS_Expires(t63) - 1), "");
+    TS_CheckStr(TS_RunTimers(TS_Expires(t63)), "b");
+    TS_CheckStr(TS_RunTimers(TS_Expires(t64) - 1), "");
+    TS_CheckStr(TS_RunTimers(TS_Expires(t64)), "c");
+    TS_CheckStr(TS_RunTimers(TS_Expires(t4096) - 1), "");
+    TS_CheckStr(TS_RunTimers(TS_Expires(t4096)), "d");
+    TS_CheckInt(wheel->timersCount, 0);
+
+    // Fired one-shot timers can't be cancelled anymore
+    TS_Check(!HS_CancelTimer(&TS_TimerServer, t1));
+    TS_ResetTimers();
+
+    // Periodic timers fire every period, skipping the runs they missed
+    HS_TimerId periodic = TS_AddTimer(63, 64, 'p');
+    uint64_t tick = TS_Expires(periodic);
+    TS_CheckStr(TS_RunTimers(tick), "p");
+    TS_CheckStr(TS_RunTimers(tick + 63), "");
+    TS_CheckStr(TS_RunTimers(tick + 64), "p");
+    TS_CheckStr(TS_RunTimers(tick + 128), "p");
+    TS_CheckStr(TS_RunTimers(tick + 5000), "p");
+    TS_CheckInt((int) (TS_Expires(periodic) - tick), 5001);
+    TS_CheckStr(TS_RunTimers(tick + 5001), "p");
+
+    // Cancelled before firing
+    TS_Check(HS_CancelTimer(&TS_TimerServer, periodic));
+    TS_Check(!HS_CancelTimer(&TS_TimerServer, periodic));
+    HS_TimerId cancelled = TS_AddTimer(4096, 0, 'x');
+    TS_Check(HS_CancelTimer(&TS_TimerServer, cancelled));
+    TS_CheckStr(TS_RunTimers(tick + 20000), "");
+    TS_CheckInt(wheel->timersCount, 0);
+    TS_ResetTimers();
+
+    // Cancelled while firing, by a timer that fired on the same tick
+    HS_TimerId canceller = TS_AddTimer(100, 0, 'a', TS_Cancel);
+    TS_CancelledId = TS_AddTimer(100, 0, 'b');
+    TS_CheckInt((int) TS_Expires(TS_CancelledId), (int) TS_Expires(canceller));
+    TS_CheckStr(TS_RunTimers(TS_Expires(canceller)), "a");
+    TS_Check(!HS_CancelTimer(&TS_TimerServer, TS_CancelledId));
+    TS_ResetTimers();
+
+    // A periodic timer cancelling itself isn't scheduled again
+    TS_CancelledId = TS_AddTimer(10, 10, 's', TS_Cancel);
+    tick = TS_Expires(TS_CancelledId);
+    TS_CheckStr(TS_RunTimers(tick), "s");
+    TS_CheckStr(TS_RunTimers(tick + 100), "");
+    TS_CheckInt(wheel->timersCount, 0);
+    TS_ResetTimers();
+
+    // Ids of freed timers are stale once their slot is reused
+    HS_TimerId stale = TS_AddTimer(10, 0, 'x');
+    TS_Check(HS_CancelTimer(&TS_TimerServer, stale));
+    HS_TimerId reused = TS_AddTimer(10, 0, 'r');
+    TS_CheckInt((int) (reused & 0xffffffff), (int) (stale & 0xffffffff));
+    TS_Check(reused != stale);
+    TS_Check(!HS_CancelTimer(&TS_TimerServer, stale));
+    TS_CheckStr(TS_RunTimers(TS_Expires(reused)), "r");
+
+    // Also when the timer fired instead
+    stale = reused;
+    reused = TS_AddTimer(10, 0, 'r');
+    TS_CheckInt((int) (reused & 0xffffffff), (int) (stale & 0xffffffff));
+    TS_Check(!HS_CancelTimer(&TS_TimerServer, stale));
+    TS_Check(HS_CancelTimer(&TS_TimerServer, reused));
+    TS_CheckInt(wheel->timersCount, 0);
+
+    HS__DestroyTimers(&TS_TimerServer);
+    return TS_Finish("timers");
+}
@@ -19,7 +19,7 @@ get_session_data, get_default_value, set_default_value,
 is_app_first_pass, is_page_first_pass, is_session_first_pass, gen_resource_path,
 fragment, @fragment, get_url_path, is_on_page, get_current_page, add_page,
 add_css_rule, add_font, begin_page_config, end_page_config, set_title,
-set_description
+set_description, schedule_timer, cancel_timer
 
 using ArgParse
 using Libdl
@@ -176,6 +176,7 @@ const NetEventType_NewClient  = Cint(1)
 const NetEventType_ClientLeft = Cint(2)
 const NetEventType_NewPayload = Cint(3)
 const NetEventType_ServerLoopInterrupted = Cint(4)
+const NetEventType_TimerFired = Cint(5)
 
 @with_kw mutable struct NetEvent
     ev_type::NetEventType = NetEventType_None
@@ -236,6 +237,9 @@ end
     verbose::Bool = false
     dev_mode::Bool = false
     ipc_connection::Union{TCPSocket, Nothing} = nothing
+    timers::Dict{Cint, Tuple{UInt64, Function, Bool}} = Dict{Cint, Tuple{UInt64, Function, Bool}}() # tag => (id, f, one_shot)
+    timers_lock::ReentrantLock = ReentrantLock()
+    next_timer_tag::Cint = 0
 end
 
 g = Global()
@@ -1748,36 +1752,32 @@ function handle_client_left(client_id::Cint)::Nothing
 end
 
 function create_page_html(page::PageConfig, output_path::String)::Nothing
-    template = read(joinpath(@__DIR__, "../served-files/MagicPageTemplate.html"), String)
-
     title = length(page.title) > 0 ? page.title : g.base_page_config.title
     description = length(page.description) > 0 ? page.description : g.base_page_config.description
 
-    page_html = replace(
-        template,
+    render_template(
+        joinpath(@__DIR__, "../served-files/MagicPageTemplate.html"),
+        output_path,
         "<title>Magic App</title>" => "<title>$(title)</title>",
         "<meta property=\"og:description\" content=\"Web app made with Magic.jl\">" => "<meta property=\"og:description\" content=\"$(description)\">",
         "<!-- MAGIC PAGE STYLE -->" => "<style>$(page.style)</style>"
     )
 
-    write(output_path, page_html)
     page.file_path = output_path
     return nothing
 end
 
 function create_404_html(output_path::String)::Nothing
-    template = read(joinpath(@__DIR__, "../served-files/Magic404Template.html"), String)
-
     title = g.base_page_config.title
     description = g.base_page_config.description
 
-    page_html = replace(
-        template,
+    render_template(
+        joinpath(@__DIR__, "../served-files/Magic404Template.html"),
+        output_path,
         "<title>Magic App</title>" => "<title>$(title)</title>",
         "<meta property=\"og:description\" content=\"Web app made with Magic.jl\">" => "<meta property=\"og:description\" content=\"$(description)\">",
     )
 
-    write(output_path, page_html)
     return nothing
 end
 
@@ -2044,6 +2044,33 @@ function clear_uri_mapping()::Nothing
     return nothing
 end
 
+# Templates are compiled by the net layer once per file and set of placeholders,
+# and compiled again when the file's modification time changes
+const compiled_templates = Dict{Tuple{String, Vector{String}}, Tuple{Float64, Ptr{Cvoid}}}()
+
+function render_template(template_path::String, output_path::String, replacements::Pair{String, String}...)::Nothing
+    placeholders = String[first(r) for r in replacements]
+    values = String[last(r) for r in replacements]
+    key = (template_path, placeholders)
+    modified = mtime(template_path)
+
+    compiled_modified, tmpl = get(compiled_templates, key, (0.0, C_NULL))
+    if tmpl == C_NULL || compiled_modified != modified
+        tmpl == C_NULL || ccall((:MG_DestroyTemplate, MAGIC_SO), Cvoid, (Ptr{Cvoid},), tmpl)
+        tmpl = GC.@preserve placeholders ccall((:MG_LoadTemplate, MAGIC_SO), Ptr{Cvoid}, (Cstring, Ptr{Ptr{UInt8}}, Cint), template_path, pointer.(placeholders), Cint(length(placeholders)))
+        compiled_templates[key] = (modified, tmpl)
+    end
+
+    if tmpl == C_NULL
+        delete!(compiled_templates, key)
+        error("Failed to load template $(template_path)")
+    end
+
+    written = GC.@preserve values ccall((:MG_RenderTemplateToFile, MAGIC_SO), Bool, (Ptr{Cvoid}, Ptr{Ptr{UInt8}}, Cstring), tmpl, pointer.(values), output_path)
+    written || error("Failed to write $(output_path)")
+    return nothing
+end
+
 # NOTE: functions to open browser. Copied from LiveServer.jl
 #-------------------------------------------------------------
 function detectwsl()
@@ -2102,6 +2129,11 @@ function start_app(
     script_path::String="app.jl";
     host_name::String="localhost",
     port::Int=3443,
+    unix_socket::Union{String, Nothing}=nothing,
+    unix_socket_mode::Integer=0o660,
+    access_log::Union{String, Nothing}=nothing,
+    access_log_format::Symbol=:text,
+    access_log_sample_rate::Int=1,
     docs_path::Union{String, Nothing}=nothing,
     verbose::Bool=false,
     dev_mode::Bool=false
@@ -2190,7 +2222,15 @@ function start_app(
         docs_path = realpath(docs_path)
     end
 
-    init_net_layer(host_name, port, docs_path, Int(ipc_port), joinpath(@__DIR__, ".."), g.verbose, g.dev_mode)
+    if unix_socket !== nothing
+        set_unix_socket(unix_socket, unix_socket_mode)
+    end
+
+    if access_log !== nothing
+        set_access_log(access_log, access_log_format, access_log_sample_rate)
+    end
+
+    init_net_layer(host_name, port, docs_path, Int(ipc_port), joinpath(@__DIR__, ".."), joinpath(dirname(MAGIC_SO), "served-files.pack"), g.verbose, g.dev_mode)
 
     g.ipc_connection = accept(ipc_server)
     @info "NetLayerStarted\nNow serving at http://$(host_name):$(port)"
@@ -2294,6 +2334,8 @@ function start_app(
                     else
                         @error "Unknown payload type '$(payload["type"])'"
                     end
+                elseif ev.data.ev_type == NetEventType_TimerFired
+                    run_timer(ev.data.client_id)
                 elseif ev.data.ev_type == NetEventType_ServerLoopInterrupted
                     @info "NetEventType_ServerLoopInterrupted"
                     close(g.ipc_connection)
@@ -2358,12 +2400,26 @@ function destroy_net_event(ev::NetEvent)::Nothing
     ccall((:MG_DestroyNetEvent, MAGIC_SO), Cvoid, (NetEvent,), ev)
 end
 
-function init_net_layer(host_name::String, port::Int, docs_path::String, ipc_port::Int, package_root_dir::String, verbose::Bool, dev_mode::Bool)
+function set_unix_socket(path::String, mode::Integer)::Nothing
+    ccall((:MG_SetUnixSocket, MAGIC_SO), Cvoid, (Cstring, Cint, Cint), path, Cint(sizeof(path)), Cint(mode))
+    return nothing
+end
+
+# format is :text or :json (JSON lines). 1 in sample_rate successful requests is logged.
+function set_access_log(path::String, format::Symbol, sample_rate::Int)::Nothing
+    if !(format in (:text, :json))
+        throw(ArgumentError("access log format must be :text or :json, got :$(format)"))
+    end
+    ccall((:MG_SetAccessLog, MAGIC_SO), Cvoid, (Cstring, Cint, Cint, Cint), path, Cint(sizeof(path)), Cint(format === :json ? 1 : 0), Cint(sample_rate))
+    return nothing
+end
+
+function init_net_layer(host_name::String, port::Int, docs_path::String, ipc_port::Int, package_root_dir::String, served_archive_path::String, verbose::Bool, dev_mode::Bool)
     ccall(
         (:MG_InitNetLayer, MAGIC_SO),
         Cvoid,
-        (Cstring, Cint, Cint, Cstring, Cint, Cint, Cstring, Cint, Cint, Cint),
-        host_name, Cint(sizeof(host_name)), port, docs_path, Cint(sizeof(docs_path)), Cint(ipc_port), package_root_dir, Cint(sizeof(package_root_dir)), Cint(verbose), Cint(dev_mode)
+        (Cstring, Cint, Cint, Cstring, Cint, Cint, Cstring, Cint, Cstring, Cint, Cint, Cint),
+        host_name, Cint(sizeof(host_name)), port, docs_path, Cint(sizeof(docs_path)), Cint(ipc_port), package_root_dir, Cint(sizeof(package_root_dir)), served_archive_path, Cint(sizeof(served_archive_path)), Cint(verbose), Cint(dev_mode)
     )
 end
 
@@ -2379,6 +2435,54 @@ function stop_server()
     return ccall((:MG_StopServer, MAGIC_SO), Cvoid, ())
 end
 
+# Runs `f()` on the app loop after `delay_ms`, then every `period_ms` if it is
+# not 0. Returns a tag for `cancel_timer`.
+function schedule_timer(f::Function, delay_ms::Integer; period_ms::Integer=0)::Cint
+    lock(g.timers_lock) do
+        tag = g.next_timer_tag += Cint(1)
+        id = ccall((:MG_AddTimer, MAGIC_SO), UInt64, (Int64, Int64, Cint), delay_ms, period_ms, tag)
+        if id == 0
+            error("Could not add the timer")
+        end
+
+        g.timers[tag] = (id, f, period_ms == 0)
+        return tag
+    end
+end
+
+function cancel_timer(tag::Integer)::Bool
+    lock(g.timers_lock) do
+        timer = pop!(g.timers, Cint(tag), nothing)
+        if timer === nothing
+            return false
+        end
+
+        # NOTE: A fired event may still be queued; it is ignored once the tag is gone.
+        ccall((:MG_CancelTimer, MAGIC_SO), Bool, (UInt64,), timer[1])
+        return true
+    end
+end
+
+function run_timer(tag::Cint)::Nothing
+    timer = lock(g.timers_lock) do
+        timer = get(g.timers, tag, nothing)
+        if timer !== nothing && timer[3]
+            delete!(g.timers, tag)
+        end
+        timer
+    end
+
+    if timer !== nothing
+        try
+            timer[2]()
+        catch e
+            @error "Timer $(tag) failed" exception=(e, catch_backtrace())
+        end
+    end
+
+    return nothing
+end
+
 #---------------------------------
 
 function __init__()
@@ -2409,6 +2513,31 @@ function main(_args::Vector{String} #= not used =#)
             arg_type = Int
             default = 3443
 
+        "--unix-socket", "-u"
+            help = "Unix domain socket path to listen on instead of the port, e.g. behind a reverse proxy"
+            arg_type = String
+            default = nothing
+
+        "--unix-socket-mode"
+            help = "Permissions of the Unix domain socket, in octal"
+            arg_type = String
+            default = "660"
+
+        "--access-log"
+            help = "File to log requests to; SIGHUP reopens it"
+            arg_type = String
+            default = nothing
+
+        "--access-log-format"
+            help = "Access log format: text or json (JSON lines)"
+            arg_type = String
+            default = "text"
+
+        "--access-log-sample-rate"
+            help = "Log 1 in N successful requests (failed ones are always logged)"
+            arg_type = Int
+            default = 1
+
         "--docs_path", "-d"
             help = "Path to built Magic.jl documentation to be served"
             arg_type = String
@@ -2422,7 +2551,7 @@ function main(_args::Vector{String} #= not used =#)
     parsed = parse_args(cli)
 
     if parsed["script"] != nothing
-        start_app(parsed["script"]; host_name=parsed["hostname"], port=parsed["port"], docs_path=parsed["docs_path"], dev_mode=parsed["dev"])
+        start_app(parsed["script"]; host_name=parsed["hostname"], port=parsed["port"], unix_socket=parsed["unix-socket"], unix_socket_mode=parse(Int, parsed["unix-socket-mode"]; base=8), access_log=parsed["access-log"], access_log_format=Symbol(parsed["access-log-format"]), access_log_sample_rate=parsed["access-log-sample-rate"], docs_path=parsed["docs_path"], dev_mode=parsed["dev"])
     end
 end
 